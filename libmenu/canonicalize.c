@@ -37,6 +37,104 @@
 #define MAXSYMLINKS sysconf(_SC_SYMLOOP_MAX)
 #endif
 
+/* What we know about the paths we resolved, so that the common prefixes
+ * (/etc/xdg/menus, /usr/share/applications, ...) are only stat()ed once,
+ * and the directories that don't exist (~/.config/menus, the KDE legacy
+ * dirs, ...) are not probed again and again.
+ *
+ * Any event of the menu monitors clears the directories, as a reload only
+ * ever follows such an event. The missing paths are only forgotten when a
+ * monitor reports something created at, above or below them. The trees
+ * watch all the paths they looked for, but only for as long as they live:
+ * the whole cache is cleared with the last menu tree. */
+typedef enum {
+	PATH_STATE_UNKNOWN = 0,
+	PATH_STATE_DIRECTORY,
+	PATH_STATE_MISSING
+} PathState;
+
+static GHashTable* path_cache = NULL;
+static GMutex path_cache_lock;
+
+static PathState path_cache_lookup(const char* path)
+{
+	PathState retval = PATH_STATE_UNKNOWN;
+
+	g_mutex_lock(&path_cache_lock);
+
+	if (path_cache != NULL)
+	{
+		retval = GPOINTER_TO_INT(g_hash_table_lookup(path_cache, path));
+	}
+
+	g_mutex_unlock(&path_cache_lock);
+
+	return retval;
+}
+
+static void path_cache_insert(const char* path, PathState state)
+{
+	g_mutex_lock(&path_cache_lock);
+
+	if (path_cache == NULL)
+	{
+		path_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	g_hash_table_replace(path_cache, g_strdup(path), GINT_TO_POINTER(state));
+
+	g_mutex_unlock(&path_cache_lock);
+}
+
+/* Whether @path is @prefix or a file below it */
+static gboolean path_has_prefix(const char* path, const char* prefix)
+{
+	size_t len = strlen(prefix);
+
+	return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == G_DIR_SEPARATOR);
+}
+
+void menu_canonicalize_file_changed(const char* path, gboolean created)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+
+	g_mutex_lock(&path_cache_lock);
+
+	if (path_cache != NULL)
+	{
+		g_hash_table_iter_init(&iter, path_cache);
+
+		while (g_hash_table_iter_next(&iter, &key, &value))
+		{
+			if (GPOINTER_TO_INT(value) == PATH_STATE_DIRECTORY)
+			{
+				g_hash_table_iter_remove(&iter);
+			}
+			else if (created && path != NULL && (path_has_prefix(path, key) || path_has_prefix(key, path)))
+			{
+				g_hash_table_iter_remove(&iter);
+			}
+		}
+	}
+
+	g_mutex_unlock(&path_cache_lock);
+}
+
+void menu_canonicalize_clear_cache(void)
+{
+	g_mutex_lock(&path_cache_lock);
+
+	if (path_cache != NULL)
+	{
+		g_hash_table_destroy(path_cache);
+		path_cache = NULL;
+	}
+
+	g_mutex_unlock(&path_cache_lock);
+}
+
 /* Return the canonical absolute name of file NAME.  A canonical name
    does not contain any `.', `..' components nor any repeated path
    separators ('/') or symlinks.  All path components must exist.  If
@@ -203,11 +301,36 @@ static char* menu_realpath(const char* name, char* resolved)
 			dest = dest + (end - start);
 			*dest = '\0';
 
+			switch (path_cache_lookup(rpath))
+			{
+				case PATH_STATE_DIRECTORY:
+					continue;
+
+				case PATH_STATE_MISSING:
+					errno = ENOENT;
+					goto error;
+
+				default:
+					break;
+			}
+
 			if (stat(rpath, &st) < 0)
 			{
+				if (errno == ENOENT)
+				{
+					path_cache_insert(rpath, PATH_STATE_MISSING);
+				}
+
 				goto error;
 			}
 
+			/* Only directories: the last component is usually the file
+			 * whose existence the caller wants to know about. */
+			if (S_ISDIR(st.st_mode))
+			{
+				path_cache_insert(rpath, PATH_STATE_DIRECTORY);
+			}
+
 			if (S_ISLNK(st.st_mode))
 			{
 				char* buf = alloca(path_max);
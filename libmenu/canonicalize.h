@@ -31,6 +31,14 @@ extern "C" {
 
 char* menu_canonicalize_file_name(const char* name, gboolean allow_missing_basename);
 
+/* Called by the menu monitors for every event, so that the paths known to
+ * exist or to be missing are checked again, see canonicalize.c */
+void menu_canonicalize_file_changed(const char* path, gboolean created);
+
+/* Called when the last menu tree is gone, and with it the monitors that kept
+ * the paths up to date */
+void menu_canonicalize_clear_cache(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,9 +49,15 @@ struct DesktopEntry {
 	char* exec;
 	gboolean terminal;
 
+	/* the snapshot the strings point into, for an entry read from one:
+	 * they aren't freed then */
+	GMappedFile* mapped;
+
 	guint type: 2;
 	guint flags: 4;
-	guint refcount: 24;
+
+	/* entries are shared between trees, which can be built in a thread */
+	volatile gint refcount;
 };
 
 struct DesktopEntrySet {
@@ -353,6 +359,18 @@ DesktopEntry* desktop_entry_reload(DesktopEntry* entry)
   g_free (entry->categories);
   entry->categories = NULL;
 
+  if (entry->mapped != NULL)
+    {
+      entry->path     = g_strdup (entry->path);
+      entry->basename = g_strdup (entry->basename);
+
+      entry->name = entry->generic_name = entry->full_name = NULL;
+      entry->comment = entry->icon = entry->exec = NULL;
+
+      g_mapped_file_unref (entry->mapped);
+      entry->mapped = NULL;
+    }
+
   g_free (entry->name);
   entry->name = NULL;
 
@@ -382,7 +400,7 @@ DesktopEntry* desktop_entry_ref(DesktopEntry* entry)
   g_return_val_if_fail (entry != NULL, NULL);
   g_return_val_if_fail (entry->refcount > 0, NULL);
 
-  entry->refcount += 1;
+  g_atomic_int_inc (&entry->refcount);
 
   return entry;
 }
@@ -433,12 +451,18 @@ void desktop_entry_unref(DesktopEntry* entry)
   g_return_if_fail (entry != NULL);
   g_return_if_fail (entry->refcount > 0);
 
-  entry->refcount -= 1;
-  if (entry->refcount == 0)
+  if (g_atomic_int_dec_and_test (&entry->refcount))
     {
       g_free (entry->categories);
       entry->categories = NULL;
 
+      if (entry->mapped != NULL)
+        {
+          g_mapped_file_unref (entry->mapped);
+          g_free (entry);
+          return;
+        }
+
       g_free (entry->name);
       entry->name = NULL;
 
@@ -546,7 +570,6 @@ gboolean desktop_entry_has_categories(DesktopEntry* entry)
 gboolean desktop_entry_has_category(DesktopEntry* entry, const char* category)
 {
   GQuark quark;
-  int    i;
 
   if (entry->categories == NULL)
     return FALSE;
@@ -554,9 +577,19 @@ gboolean desktop_entry_has_category(DesktopEntry* entry, const char* category)
   if (!(quark = g_quark_try_string (category)))
     return FALSE;
 
+  return desktop_entry_has_category_quark (entry, quark);
+}
+
+gboolean desktop_entry_has_category_quark(DesktopEntry* entry, GQuark category)
+{
+  int i;
+
+  if (entry->categories == NULL)
+    return FALSE;
+
   for (i = 0; entry->categories[i]; i++)
     {
-      if (quark == entry->categories[i])
+      if (category == entry->categories[i])
         return TRUE;
     }
 
@@ -592,6 +625,60 @@ void desktop_entry_add_legacy_category(DesktopEntry* entry)
   entry->categories = categories;
 }
 
+void desktop_entry_write(DesktopEntry* entry, GString* out)
+{
+	menu_write_uint32(out, entry->type);
+	menu_write_mapped_string(out, entry->path);
+	menu_write_mapped_string(out, entry->basename);
+	menu_write_mapped_string(out, entry->name);
+	menu_write_mapped_string(out, entry->generic_name);
+	menu_write_mapped_string(out, entry->full_name);
+	menu_write_mapped_string(out, entry->comment);
+	menu_write_mapped_string(out, entry->icon);
+	menu_write_mapped_string(out, entry->exec);
+	menu_write_uint32(out, entry->terminal != FALSE);
+	menu_write_uint32(out, entry->flags);
+}
+
+DesktopEntry* desktop_entry_read(GMappedFile* mapped, const char** data, const char* end)
+{
+	DesktopEntry* retval;
+	guint32 type;
+	guint32 terminal;
+	guint32 flags;
+
+	retval = g_new0(DesktopEntry, 1);
+	retval->refcount = 1;
+	retval->mapped = g_mapped_file_ref(mapped);
+
+	if (!menu_read_uint32(data, end, &type) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->path) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->basename) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->name) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->generic_name) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->full_name) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->comment) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->icon) ||
+	    !menu_read_mapped_string(data, end, (const char**) &retval->exec) ||
+	    !menu_read_uint32(data, end, &terminal) ||
+	    !menu_read_uint32(data, end, &flags) ||
+	    (type != DESKTOP_ENTRY_DESKTOP && type != DESKTOP_ENTRY_DIRECTORY) ||
+	    flags > 0xf ||
+	    retval->path == NULL ||
+	    retval->basename == NULL ||
+	    retval->name == NULL)
+	{
+		desktop_entry_unref(retval);
+		return NULL;
+	}
+
+	retval->type = type;
+	retval->terminal = terminal != 0;
+	retval->flags = flags;
+
+	return retval;
+}
+
 /*
  * Entry sets
  */
@@ -60,9 +60,15 @@ gboolean desktop_entry_get_tryexec_failed(DesktopEntry* entry);
 
 gboolean desktop_entry_has_categories(DesktopEntry* entry);
 gboolean desktop_entry_has_category(DesktopEntry* entry, const char* category);
+gboolean desktop_entry_has_category_quark(DesktopEntry* entry, GQuark category);
 
 void desktop_entry_add_legacy_category(DesktopEntry* src);
 
+/* Only what the menu tree getters need is written: not the categories. The
+ * entries read use the strings of the mapping in place, and keep it alive. */
+void desktop_entry_write(DesktopEntry* entry, GString* out);
+DesktopEntry* desktop_entry_read(GMappedFile* mapped, const char** data, const char* end);
+
 
 typedef struct DesktopEntrySet DesktopEntrySet;
 
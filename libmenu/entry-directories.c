@@ -45,6 +45,8 @@ struct EntryDirectory {
 struct EntryDirectoryList {
 	int refcount;
 	int length;
+	guint hash;
+	guint interned: 1;
 	GList* dirs;
 };
 
@@ -62,8 +64,22 @@ struct CachedDir {
 	guint deleted: 1;
 
 	guint references: 28;
+
+	/* the stat of the directory and of all its entry files, valid or not,
+	 * from before they were read, for the snapshots */
+	gint64 mtime;
+	gint64 size;
+	gint64 inode;
+	GSList* files;
 };
 
+typedef struct {
+	char* basename;
+	gint64 mtime;
+	gint64 size;
+	gint64 inode;
+} CachedDirFile;
+
 struct CachedDirMonitor {
 	EntryDirectory* ed;
 	EntryDirectoryChangedFunc callback;
@@ -92,6 +108,12 @@ static CachedDir* cached_dir_new(const char *name)
 	return dir;
 }
 
+static void cached_dir_file_free(CachedDirFile* file)
+{
+  g_free (file->basename);
+  g_free (file);
+}
+
 static void cached_dir_free(CachedDir* dir)
 {
   if (dir->dir_monitor)
@@ -113,6 +135,12 @@ static void cached_dir_free(CachedDir* dir)
   g_slist_free (dir->entries);
   dir->entries = NULL;
 
+  g_slist_foreach (dir->files,
+                   (GFunc) cached_dir_file_free,
+                   NULL);
+  g_slist_free (dir->files);
+  dir->files = NULL;
+
   g_slist_foreach (dir->subdirs,
                    (GFunc) cached_dir_free,
                    NULL);
@@ -227,10 +255,55 @@ static CachedDir* cached_dir_lookup(const char* canonical)
   return dir;
 }
 
+static void cached_dir_stat_file(CachedDir* dir, const char* basename, const char* path)
+{
+  CachedDirFile *file;
+  GSList        *tmp;
+
+  file = NULL;
+  for (tmp = dir->files; tmp != NULL; tmp = tmp->next)
+    {
+      if (strcmp (((CachedDirFile *) tmp->data)->basename, basename) == 0)
+        {
+          file = tmp->data;
+          break;
+        }
+    }
+
+  if (file == NULL)
+    {
+      file = g_new (CachedDirFile, 1);
+      file->basename = g_strdup (basename);
+      dir->files = g_slist_prepend (dir->files, file);
+    }
+
+  menu_stat_file (path, &file->mtime, &file->size, &file->inode);
+}
+
+static void cached_dir_forget_file(CachedDir* dir, const char* basename)
+{
+  GSList *tmp;
+
+  for (tmp = dir->files; tmp != NULL; tmp = tmp->next)
+    {
+      CachedDirFile *file = tmp->data;
+
+      if (strcmp (file->basename, basename) == 0)
+        {
+          cached_dir_file_free (file);
+          dir->files = g_slist_delete_link (dir->files, tmp);
+          return;
+        }
+    }
+}
+
 static gboolean cached_dir_add_entry(CachedDir* dir, const char* basename, const char* path)
 {
   DesktopEntry *entry;
 
+  /* before reading: a change made while reading is then noticed */
+  cached_dir_stat_file (dir, basename, path);
+
   entry = desktop_entry_new (path);
   if (entry == NULL)
     return FALSE;
@@ -240,7 +313,9 @@ static gboolean cached_dir_add_entry(CachedDir* dir, const char* basename, const
   return TRUE;
 }
 
-static gboolean cached_dir_update_entry(CachedDir* dir, const char* basename, const char* path)
+/* *entries_changed is set if the entry was added or removed, rather than
+ * reloaded in place */
+static gboolean cached_dir_update_entry(CachedDir* dir, const char* basename, const char* path, gboolean* entries_changed)
 {
   GSList *tmp;
 
@@ -249,9 +324,12 @@ static gboolean cached_dir_update_entry(CachedDir* dir, const char* basename, co
     {
       if (strcmp (desktop_entry_get_basename (tmp->data), basename) == 0)
         {
+          cached_dir_stat_file (dir, basename, path);
+
           if (!desktop_entry_reload (tmp->data))
 	    {
 	      dir->entries = g_slist_delete_link (dir->entries, tmp);
+	      *entries_changed = TRUE;
 	    }
 
           return TRUE;
@@ -260,6 +338,8 @@ static gboolean cached_dir_update_entry(CachedDir* dir, const char* basename, co
       tmp = tmp->next;
     }
 
+  *entries_changed = TRUE;
+
   return cached_dir_add_entry (dir, basename, path);
 }
 
@@ -267,6 +347,8 @@ static gboolean cached_dir_remove_entry(CachedDir* dir, const char* basename)
 {
   GSList *tmp;
 
+  cached_dir_forget_file (dir, basename);
+
   tmp = dir->entries;
   while (tmp != NULL)
     {
@@ -357,6 +439,7 @@ static void cached_dir_invoke_monitors(CachedDir* dir)
 static void handle_cached_dir_changed (MenuMonitor* monitor, MenuMonitorEvent event, const char* path, CachedDir* dir)
 {
   gboolean  handled = FALSE;
+  gboolean  entries_changed = FALSE;
   char     *basename;
   char     *dirname;
 
@@ -371,6 +454,9 @@ static void handle_cached_dir_changed (MenuMonitor* monitor, MenuMonitorEvent ev
 
   dir = cached_dir_lookup (dirname);
 
+  if (dir->have_read_entries)
+    menu_stat_file (dirname, &dir->mtime, &dir->size, &dir->inode);
+
   if (g_str_has_suffix (basename, ".desktop") ||
       g_str_has_suffix (basename, ".directory"))
     {
@@ -378,7 +464,7 @@ static void handle_cached_dir_changed (MenuMonitor* monitor, MenuMonitorEvent ev
         {
         case MENU_MONITOR_EVENT_CREATED:
         case MENU_MONITOR_EVENT_CHANGED:
-          handled = cached_dir_update_entry (dir, basename, path);
+          handled = cached_dir_update_entry (dir, basename, path, &entries_changed);
           break;
 
         case MENU_MONITOR_EVENT_DELETED:
@@ -416,8 +502,10 @@ static void handle_cached_dir_changed (MenuMonitor* monitor, MenuMonitorEvent ev
 
   if (handled)
     {
-      /* CHANGED events don't change the set of desktop entries */
-      if (event == MENU_MONITOR_EVENT_CREATED || event == MENU_MONITOR_EVENT_DELETED)
+      /* CHANGED events don't change the set of desktop entries, unless the
+       * file became a valid entry or stopped being one */
+      if (event == MENU_MONITOR_EVENT_CREATED || event == MENU_MONITOR_EVENT_DELETED ||
+          entries_changed)
         {
           _entry_directory_list_empty_desktop_cache ();
         }
@@ -452,6 +540,9 @@ static gboolean cached_dir_load_entries_recursive(CachedDir* dir, const char* di
   menu_verbose ("Attempting to read entries from %s (full path %s)\n",
                 dir->name, dirname);
 
+  /* before reading: a change made while reading is then noticed */
+  menu_stat_file (dirname, &dir->mtime, &dir->size, &dir->inode);
+
   dp = opendir (dirname);
   if (dp == NULL)
     {
@@ -602,8 +693,38 @@ static void cached_dir_remove_reference(CachedDir* dir)
  * Entry directories
  */
 
+/* The entry directories alive, each of them once: loading the same path
+ * again gives the same EntryDirectory, so that the lists of the menus can
+ * be compared by pointers */
+static GHashTable* entry_directories = NULL;
+
+static guint entry_directory_hash(gconstpointer key)
+{
+	const EntryDirectory* ed = key;
+	guint hash;
+
+	hash = g_direct_hash(ed->dir) ^ (ed->entry_type << 1 | ed->is_legacy);
+
+	if (ed->legacy_prefix != NULL)
+		hash ^= g_str_hash(ed->legacy_prefix);
+
+	return hash;
+}
+
+static gboolean entry_directory_equal(gconstpointer a, gconstpointer b)
+{
+	const EntryDirectory* ed_a = a;
+	const EntryDirectory* ed_b = b;
+
+	return ed_a->dir == ed_b->dir &&
+	       ed_a->entry_type == ed_b->entry_type &&
+	       ed_a->is_legacy == ed_b->is_legacy &&
+	       g_strcmp0(ed_a->legacy_prefix, ed_b->legacy_prefix) == 0;
+}
+
 static EntryDirectory* entry_directory_new_full(DesktopEntryType entry_type, const char* path, gboolean is_legacy, const char* legacy_prefix)
 {
+  EntryDirectory  key;
   EntryDirectory *ed;
   char           *canonical;
 
@@ -619,10 +740,30 @@ static EntryDirectory* entry_directory_new_full(DesktopEntryType entry_type, con
       return NULL;
     }
 
+  if (entry_directories == NULL)
+    entry_directories = g_hash_table_new (entry_directory_hash,
+                                          entry_directory_equal);
+
+  key.dir           = cached_dir_lookup (canonical);
+  key.legacy_prefix = (char *) legacy_prefix;
+  key.entry_type    = entry_type;
+  key.is_legacy     = is_legacy != FALSE;
+  g_assert (key.dir != NULL);
+
+  ed = g_hash_table_lookup (entry_directories, &key);
+  if (ed != NULL)
+    {
+      ed->refcount++;
+      cached_dir_load_entries_recursive (ed->dir, canonical);
+
+      g_free (canonical);
+
+      return ed;
+    }
+
   ed = g_new0 (EntryDirectory, 1);
 
-  ed->dir = cached_dir_lookup (canonical);
-  g_assert (ed->dir != NULL);
+  ed->dir = key.dir;
 
   cached_dir_add_reference (ed->dir);
   cached_dir_load_entries_recursive (ed->dir, canonical);
@@ -632,6 +773,8 @@ static EntryDirectory* entry_directory_new_full(DesktopEntryType entry_type, con
   ed->is_legacy     = is_legacy != FALSE;
   ed->refcount      = 1;
 
+  g_hash_table_add (entry_directories, ed);
+
   g_free (canonical);
 
   return ed;
@@ -664,6 +807,8 @@ void entry_directory_unref(EntryDirectory* ed)
 
   if (--ed->refcount == 0)
     {
+      g_hash_table_remove (entry_directories, ed);
+
       cached_dir_remove_reference (ed->dir);
 
       ed->dir        = NULL;
@@ -886,6 +1031,19 @@ void entry_directory_get_flat_contents(EntryDirectory* ed, DesktopEntrySet* desk
  * Entry directory lists
  */
 
+/* The interned lists, see entry_directory_list_intern() */
+static GHashTable* entry_directory_lists = NULL;
+
+static guint entry_directory_list_hash(gconstpointer key)
+{
+	return ((const EntryDirectoryList*) key)->hash;
+}
+
+static gboolean entry_directory_list_equal(gconstpointer a, gconstpointer b)
+{
+	return _entry_directory_list_compare(a, b);
+}
+
 EntryDirectoryList* entry_directory_list_new(void)
 {
   EntryDirectoryList *list;
@@ -917,6 +1075,9 @@ void entry_directory_list_unref(EntryDirectoryList* list)
   list->refcount -= 1;
   if (list->refcount == 0)
     {
+      if (list->interned)
+        g_hash_table_remove (entry_directory_lists, list);
+
       g_list_foreach (list->dirs, (GFunc) entry_directory_unref, NULL);
       g_list_free (list->dirs);
       list->dirs = NULL;
@@ -927,11 +1088,46 @@ void entry_directory_list_unref(EntryDirectoryList* list)
 
 void entry_directory_list_prepend(EntryDirectoryList* list, EntryDirectory* ed)
 {
+  g_return_if_fail (!list->interned);
+
   list->length += 1;
   list->dirs = g_list_prepend (list->dirs,
                                entry_directory_ref (ed));
 }
 
+EntryDirectoryList* entry_directory_list_intern(EntryDirectoryList* list)
+{
+  EntryDirectoryList *interned;
+  GList              *tmp;
+
+  g_return_val_if_fail (list != NULL, NULL);
+
+  if (list->interned)
+    return list;
+
+  if (entry_directory_lists == NULL)
+    entry_directory_lists = g_hash_table_new (entry_directory_list_hash,
+                                              entry_directory_list_equal);
+
+  list->hash = 0;
+  for (tmp = list->dirs; tmp != NULL; tmp = tmp->next)
+    list->hash = list->hash * 31 + g_direct_hash (tmp->data);
+
+  interned = g_hash_table_lookup (entry_directory_lists, list);
+  if (interned != NULL)
+    {
+      entry_directory_list_ref (interned);
+      entry_directory_list_unref (list);
+
+      return interned;
+    }
+
+  list->interned = TRUE;
+  g_hash_table_add (entry_directory_lists, list);
+
+  return list;
+}
+
 int entry_directory_list_get_length(EntryDirectoryList* list)
 {
   return list->length;
@@ -942,6 +1138,8 @@ void entry_directory_list_append_list(EntryDirectoryList* list, EntryDirectoryLi
   GList *tmp;
   GList *new_dirs = NULL;
 
+  g_return_if_fail (!list->interned);
+
   if (to_append->length == 0)
     return;
 
@@ -976,6 +1174,75 @@ DesktopEntry* entry_directory_list_get_directory(EntryDirectoryList *list, const
   return retval;
 }
 
+static void cached_dir_append_path(CachedDir* dir, GString* path)
+{
+	/* the root of the cache is "/" */
+	if (dir->parent == NULL)
+		return;
+
+	cached_dir_append_path(dir->parent, path);
+
+	g_string_append_c(path, G_DIR_SEPARATOR);
+	g_string_append(path, dir->name);
+}
+
+static void cached_dir_foreach_input(CachedDir* dir, GString* path, EntryDirectoryInputFunc func, gpointer user_data)
+{
+	GSList* tmp;
+	gsize path_len;
+
+	if (dir->deleted || !dir->have_read_entries)
+		return;
+
+	func(path->len > 0 ? path->str : G_DIR_SEPARATOR_S, dir->mtime, dir->size, dir->inode, user_data);
+
+	path_len = path->len;
+
+	for (tmp = dir->files; tmp != NULL; tmp = tmp->next)
+	{
+		CachedDirFile* file = tmp->data;
+
+		g_string_append_c(path, G_DIR_SEPARATOR);
+		g_string_append(path, file->basename);
+
+		func(path->str, file->mtime, file->size, file->inode, user_data);
+
+		g_string_truncate(path, path_len);
+	}
+
+	for (tmp = dir->subdirs; tmp != NULL; tmp = tmp->next)
+	{
+		CachedDir* subdir = tmp->data;
+
+		g_string_append_c(path, G_DIR_SEPARATOR);
+		g_string_append(path, subdir->name);
+
+		cached_dir_foreach_input(subdir, path, func, user_data);
+
+		g_string_truncate(path, path_len);
+	}
+}
+
+void entry_directory_list_foreach_input(EntryDirectoryList* list, EntryDirectoryInputFunc func, gpointer user_data)
+{
+	GString* path;
+	GList* tmp;
+
+	path = g_string_new(NULL);
+
+	for (tmp = list->dirs; tmp != NULL; tmp = tmp->next)
+	{
+		EntryDirectory* ed = tmp->data;
+
+		cached_dir_append_path(ed->dir, path);
+		cached_dir_foreach_input(ed->dir, path, func, user_data);
+
+		g_string_truncate(path, 0);
+	}
+
+	g_string_free(path, TRUE);
+}
+
 gboolean _entry_directory_list_compare(const EntryDirectoryList* a, const EntryDirectoryList* b)
 {
   GList *al, *bl;
@@ -986,6 +1253,13 @@ gboolean _entry_directory_list_compare(const EntryDirectoryList* a, const EntryD
   if ((a == NULL || b == NULL))
     return FALSE;
 
+  if (a == b)
+    return TRUE;
+
+  /* there is only one interned list with these dirs */
+  if (a->interned && b->interned)
+    return FALSE;
+
   if (a->length != b->length)
     return FALSE;
 
@@ -52,11 +52,22 @@ gboolean _entry_directory_list_compare(const EntryDirectoryList* a, const EntryD
 void entry_directory_list_prepend(EntryDirectoryList* list, EntryDirectory* ed);
 void entry_directory_list_append_list(EntryDirectoryList* list, EntryDirectoryList* to_append);
 
+/* Takes the reference to @list, and returns a reference to the one list
+ * with the same directories; it must not be changed from then on */
+EntryDirectoryList* entry_directory_list_intern(EntryDirectoryList* list);
+
 void entry_directory_list_add_monitors(EntryDirectoryList* list, EntryDirectoryChangedFunc callback, gpointer user_data);
 void entry_directory_list_remove_monitors(EntryDirectoryList* list, EntryDirectoryChangedFunc callback, gpointer user_data);
 
 DesktopEntry* entry_directory_list_get_directory (EntryDirectoryList* list, const char* relative_path);
 
+typedef void (*EntryDirectoryInputFunc) (const char* path, gint64 mtime, gint64 size, gint64 inode, gpointer user_data);
+
+/* Calls func for each directory that was read, including subdirectories, and
+ * for each of their entry files, valid or not, with the menu_stat_file() of
+ * before they were read */
+void entry_directory_list_foreach_input(EntryDirectoryList* list, EntryDirectoryInputFunc func, gpointer user_data);
+
 DesktopEntrySet* _entry_directory_list_get_all_desktops(EntryDirectoryList* list);
 void _entry_directory_list_empty_desktop_cache(void);
 
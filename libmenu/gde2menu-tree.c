@@ -23,6 +23,12 @@
 
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
 
 #include "menu-layout.h"
 #include "menu-monitor.h"
@@ -35,6 +41,10 @@
  * too.
  */
 
+typedef struct Gde2MenuTreeArena Gde2MenuTreeArena;
+typedef struct Gde2MenuTreeSharedLayout Gde2MenuTreeSharedLayout;
+typedef struct Gde2MenuTreeRuleMemo Gde2MenuTreeRuleMemo;
+
 typedef enum
 {
   GDE2MENU_TREE_ABSOLUTE = 0,
@@ -55,9 +65,18 @@ struct Gde2MenuTree
 
   GSList *menu_file_monitors;
 
+  /* layout is owned by shared_layout, which all the trees built from the
+   * same menu file use, whatever their flags */
+  Gde2MenuTreeSharedLayout *shared_layout;
   MenuLayoutNode *layout;
   Gde2MenuTreeDirectory *root;
 
+  /* where the items are allocated while the tree is being built */
+  Gde2MenuTreeArena *arena;
+
+  /* what the rules of the menus match, while the tree is being built */
+  Gde2MenuTreeRuleMemo *rule_memo;
+
   GSList *monitors;
 
   gpointer       user_data;
@@ -68,10 +87,32 @@ struct Gde2MenuTree
 
 typedef struct
 {
+  Gde2MenuTree           *tree;
   Gde2MenuTreeChangedFunc callback;
   gpointer             user_data;
+  gint                 refcount;
 } Gde2MenuTreeMonitor;
 
+/*
+ * All the items of a build are allocated from one arena. Each item holds a
+ * reference on it, so the memory is released with a few frees once the last
+ * item is gone, including items still referenced by users after the tree has
+ * been rebuilt.
+ */
+#define GDE2MENU_TREE_ARENA_BLOCK_SIZE 16384
+
+struct Gde2MenuTreeArena
+{
+  GSList *blocks;
+  char   *next;
+  gsize   left;
+
+  /* the snapshot the strings of the items point into, if read from one */
+  GMappedFile *mapped;
+
+  gint refcount;
+};
+
 struct Gde2MenuTreeItem
 {
   Gde2MenuTreeItemType type;
@@ -81,7 +122,9 @@ struct Gde2MenuTreeItem
   gpointer       user_data;
   GDestroyNotify dnotify;
 
-  guint refcount;
+  Gde2MenuTreeArena *arena;
+
+  gint refcount;
 };
 
 struct Gde2MenuTreeDirectory
@@ -97,7 +140,16 @@ struct Gde2MenuTreeDirectory
 	MenuLayoutValues  default_layout_values;
 	GSList           *default_layout_info;
 	GSList           *layout_info;
-	GSList           *contents;
+
+	/* items are collected in pending_contents while the layout is processed,
+	 * and then moved to an array of the exact size */
+	GPtrArray         *pending_contents;
+	Gde2MenuTreeItem **contents;
+	guint              n_contents;
+
+	/* spans of contents that were filled by a sorted <Merge>; this is what
+	 * gets re-sorted when the sort key changes */
+	GSList *sort_runs;
 
 	guint only_unallocated : 1;
 	guint is_root : 1;
@@ -107,6 +159,10 @@ struct Gde2MenuTreeDirectory
 
 	/* 16 bits should be more than enough; G_MAXUINT16 means no inline header */
 	guint will_inline_header : 16;
+
+	/* how many items the directory has once preprocessed, counting the
+	 * ones of the subdirs with an inline header; only valid then */
+	guint n_layout_items;
 };
 
 typedef struct
@@ -116,6 +172,21 @@ typedef struct
   Gde2MenuTree *tree;
 } Gde2MenuTreeDirectoryRoot;
 
+typedef struct
+{
+  guint start;
+  guint length;
+} Gde2MenuTreeSortRun;
+
+typedef struct
+{
+  Gde2MenuTreeDirectory *directory;
+  gpointer            unused;
+  guint               position;
+} Gde2MenuTreeRealIter;
+
+G_STATIC_ASSERT (sizeof (Gde2MenuTreeRealIter) <= sizeof (Gde2MenuTreeIter));
+
 struct Gde2MenuTreeEntry
 {
   Gde2MenuTreeItem item;
@@ -137,6 +208,9 @@ struct Gde2MenuTreeHeader
   Gde2MenuTreeItem item;
 
   Gde2MenuTreeDirectory *directory;
+
+  /* number of items inlined right after the header */
+  guint n_inlined;
 };
 
 struct Gde2MenuTreeAlias
@@ -153,13 +227,20 @@ static Gde2MenuTree *gde2menu_tree_new                 (Gde2MenuTreeType    type
 						  Gde2MenuTreeFlags   flags);
 static void      gde2menu_tree_load_layout          (Gde2MenuTree       *tree);
 static void      gde2menu_tree_force_reload         (Gde2MenuTree       *tree);
+static void      gde2menu_tree_release_layout       (Gde2MenuTree       *tree,
+						     gboolean            invalidate);
 static void      gde2menu_tree_build_from_layout    (Gde2MenuTree       *tree);
+static void      gde2menu_tree_ensure_root          (Gde2MenuTree       *tree);
 static void      gde2menu_tree_force_rebuild        (Gde2MenuTree       *tree);
+static void      gde2menu_tree_resort               (Gde2MenuTree       *tree);
 static void      gde2menu_tree_resolve_files        (Gde2MenuTree       *tree,
 						  GHashTable      *loaded_menu_files,
 						  MenuLayoutNode  *layout);
 static void      gde2menu_tree_force_recanonicalize (Gde2MenuTree       *tree);
 static void      gde2menu_tree_invoke_monitors      (Gde2MenuTree       *tree);
+static void      gde2menu_tree_monitor_remove       (Gde2MenuTreeMonitor *monitor);
+static void      parsed_menu_files_clear            (void);
+static void      parsed_menu_files_forget           (const char         *path);
 
 static void gde2menu_tree_item_unref_and_unset_parent (gpointer itemp);
 
@@ -268,7 +349,9 @@ typedef enum
   MENU_FILE_MONITOR_INVALID = 0,
   MENU_FILE_MONITOR_FILE,
   MENU_FILE_MONITOR_NONEXISTENT_FILE,
-  MENU_FILE_MONITOR_DIRECTORY
+  MENU_FILE_MONITOR_DIRECTORY,
+  MENU_FILE_MONITOR_USER_DIRECTORY,
+  MENU_FILE_MONITOR_DAEMON
 } MenuFileMonitorType;
 
 typedef struct
@@ -306,6 +389,9 @@ handle_menu_file_changed (MenuMonitor      *monitor,
 		event == MENU_MONITOR_EVENT_CREATED ? "created" :
 		event == MENU_MONITOR_EVENT_CHANGED ? "changed" : "deleted");
 
+  if (event == MENU_MONITOR_EVENT_DELETED)
+    parsed_menu_files_forget (path);
+
   gde2menu_tree_force_recanonicalize (tree);
   gde2menu_tree_invoke_monitors (tree);
 }
@@ -324,6 +410,51 @@ handle_menu_file_directory_changed (MenuMonitor      *monitor,
 		event == MENU_MONITOR_EVENT_CREATED ? "created" :
 		event == MENU_MONITOR_EVENT_CHANGED ? "changed" : "deleted");
 
+  if (event == MENU_MONITOR_EVENT_DELETED)
+    parsed_menu_files_forget (path);
+
+  gde2menu_tree_force_recanonicalize (tree);
+  gde2menu_tree_invoke_monitors (tree);
+}
+
+/* what the menus read in the entry and menu directories */
+static gboolean
+is_menu_input_name (const char *name)
+{
+  return g_str_has_suffix (name, ".desktop") ||
+	 g_str_has_suffix (name, ".directory") ||
+	 g_str_has_suffix (name, ".menu");
+}
+
+static void
+handle_user_directory_changed (MenuMonitor      *monitor,
+			       MenuMonitorEvent  event,
+			       const char       *path,
+			       Gde2MenuTree     *tree)
+{
+  /* the tree of the daemon was used as long as there was nothing like
+   * this in the directory, see user_path_is_unused() */
+  if (event == MENU_MONITOR_EVENT_DELETED ||
+      (!is_menu_input_name (path) && !g_file_test (path, G_FILE_TEST_IS_DIR)))
+    return;
+
+  menu_verbose ("\"%s\" %s, marking tree for recanonicalization\n",
+		path,
+		event == MENU_MONITOR_EVENT_CREATED ? "created" : "changed");
+
+  gde2menu_tree_force_recanonicalize (tree);
+  gde2menu_tree_invoke_monitors (tree);
+}
+
+static void
+handle_daemon_closed (MenuMonitor      *monitor,
+		      MenuMonitorEvent  event,
+		      const char       *path,
+		      Gde2MenuTree     *tree)
+{
+  /* nothing updates the snapshot the tree was loaded from anymore */
+  menu_verbose ("The menu daemon went away, marking tree for recanonicalization\n");
+
   gde2menu_tree_force_recanonicalize (tree);
   gde2menu_tree_invoke_monitors (tree);
 }
@@ -368,6 +499,24 @@ gde2menu_tree_add_menu_file_monitor (Gde2MenuTree           *tree,
 			       tree);
       break;
 
+    case MENU_FILE_MONITOR_USER_DIRECTORY:
+      menu_verbose ("Adding a monitor for the unused user directory \"%s\"\n", path);
+
+      monitor->monitor = menu_get_directory_monitor (path);
+      menu_monitor_add_notify (monitor->monitor,
+			       (MenuMonitorNotifyFunc) handle_user_directory_changed,
+			       tree);
+      break;
+
+    case MENU_FILE_MONITOR_DAEMON:
+      menu_verbose ("Adding a monitor for the menu daemon socket \"%s\"\n", path);
+
+      monitor->monitor = menu_get_socket_monitor (path);
+      menu_monitor_add_notify (monitor->monitor,
+			       (MenuMonitorNotifyFunc) handle_daemon_closed,
+			       tree);
+      break;
+
     default:
       g_assert_not_reached ();
       break;
@@ -400,6 +549,18 @@ remove_menu_file_monitor (MenuFileMonitor *monitor,
 				  tree);
       break;
 
+    case MENU_FILE_MONITOR_USER_DIRECTORY:
+      menu_monitor_remove_notify (monitor->monitor,
+				  (MenuMonitorNotifyFunc) handle_user_directory_changed,
+				  tree);
+      break;
+
+    case MENU_FILE_MONITOR_DAEMON:
+      menu_monitor_remove_notify (monitor->monitor,
+				  (MenuMonitorNotifyFunc) handle_daemon_closed,
+				  tree);
+      break;
+
     default:
       g_assert_not_reached ();
       break;
@@ -425,4101 +586,8224 @@ gde2menu_tree_remove_menu_file_monitors (Gde2MenuTree *tree)
   tree->menu_file_monitors = NULL;
 }
 
-static Gde2MenuTree *
-gde2menu_tree_lookup_absolute (const char    *absolute,
-			    Gde2MenuTreeFlags  flags)
-{
-  Gde2MenuTree  *tree;
-  gboolean    canonical;
-  const char *canonical_path;
-  char       *freeme;
+/*
+ * The layout of a menu file, once its <MergeFile>, <MergeDir> and friends
+ * have been resolved and its <Move>s executed, doesn't depend on the flags
+ * of the tree. It is kept in gde2menu_tree_layout_cache, keyed by the
+ * canonical path of the menu file, and shared read-only between the trees.
+ *
+ * Every tree keeps its own monitors on the files that were merged, so that
+ * any change invalidates the shared layout and reloads all the trees.
+ */
 
-  menu_verbose ("Looking up absolute path in tree cache: \"%s\"\n", absolute);
+typedef struct
+{
+  MenuFileMonitorType  type;
+  char                *path;
+} MergedFile;
 
-  if ((tree = gde2menu_tree_lookup_from_cache (absolute, flags)) != NULL)
-    return tree;
+/* What the <Include> and <Exclude> rules of a <Menu> match. This doesn't
+ * depend on the flags either, so it's computed once per shared layout. */
+typedef struct
+{
+  DesktopEntrySet *entries;
+  DesktopEntrySet *allocated;
+  DesktopEntrySet *excluded;
 
-  canonical = TRUE;
-  canonical_path = freeme = menu_canonicalize_file_name (absolute, FALSE);
-  if (canonical_path == NULL)
-    {
-      menu_verbose ("Failed to canonicalize absolute menu path \"%s\": %s\n",
-                    absolute, g_strerror (errno));
-      canonical = FALSE;
-      canonical_path = absolute;
-    }
+  /* the entry ids, in the shared layout, of allocated */
+  GArray          *allocated_ids;
+} MenuMatches;
 
-  if ((tree = gde2menu_tree_lookup_from_cache (canonical_path, flags)) != NULL)
-    return tree;
+/* The <Include> and <Exclude> rules of a <Menu>, compiled to a flat array
+ * that is evaluated against one entry at a time. Each rule is followed by
+ * its children, and end is the index of the rule after them. */
+typedef enum
+{
+  MENU_RULE_INCLUDE,
+  MENU_RULE_EXCLUDE,
+  MENU_RULE_AND,
+  MENU_RULE_OR,
+  MENU_RULE_NOT,
+  MENU_RULE_ALL,
+  MENU_RULE_FILENAME,
+  MENU_RULE_CATEGORY,
+  MENU_RULE_NONE
+} MenuRuleType;
 
-  tree = gde2menu_tree_new (GDE2MENU_TREE_ABSOLUTE, canonical_path, canonical, flags);
+typedef struct
+{
+  MenuRuleType  type;
+  guint         end;
 
-  g_free (freeme);
+  union
+  {
+    const char *filename;
+    GQuark      category;
+  } u;
+} MenuRule;
 
-  return tree;
-}
+#define MENU_RULE_STATE_INCLUDED  (1 << 0)
+#define MENU_RULE_STATE_EXCLUDED  (1 << 1)
+#define MENU_RULE_STATE_ALLOCATED (1 << 2)
 
-static Gde2MenuTree *
-gde2menu_tree_lookup_basename (const char    *basename,
-			    Gde2MenuTreeFlags  flags)
+/* An entry pool, in the order the rules are evaluated in */
+typedef struct
 {
-  Gde2MenuTree *tree;
+  DesktopEntrySet *entry_pool;
+  GPtrArray       *file_ids;
+  GPtrArray       *entries;
 
-  menu_verbose ("Looking up menu file in tree cache: \"%s\"\n", basename);
+  /* GBytes of a MenuRule and its children -> a guint8 per entry */
+  GHashTable      *results;
+} MenuRulePool;
 
-  if ((tree = gde2menu_tree_lookup_from_cache (basename, flags)) != NULL)
-    return tree;
+struct Gde2MenuTreeRuleMemo
+{
+  /* DesktopEntrySet -> MenuRulePool */
+  GHashTable *pools;
 
-  return gde2menu_tree_new (GDE2MENU_TREE_BASENAME, basename, FALSE, flags);
-}
+  /* MenuLayoutNode of a <Menu> -> MenuRulePool, owned by pools */
+  GHashTable *menus;
+};
 
-static gboolean
-canonicalize_basename_with_config_dir (Gde2MenuTree   *tree,
-                                       const char *basename,
-                                       const char *config_dir)
+/* A rule to evaluate over a pool, possibly in another thread */
+typedef struct
 {
-  char *path;
+  MenuRulePool *pool;
+  GArray       *rules;
+  guint         index;
+  guint8       *results;
+} MenuRuleEvaluation;
 
-  path = g_build_filename (config_dir, "menus",  basename,  NULL);
+struct Gde2MenuTreeSharedLayout
+{
+  guint           refcount;
 
-  tree->canonical_path = menu_canonicalize_file_name (path, FALSE);
-  if (tree->canonical_path)
-    {
-      tree->canonical = TRUE;
-      gde2menu_tree_add_menu_file_monitor (tree,
-					tree->canonical_path,
-					MENU_FILE_MONITOR_FILE);
-    }
-  else
-    {
-      gde2menu_tree_add_menu_file_monitor (tree,
-					path,
-					MENU_FILE_MONITOR_NONEXISTENT_FILE);
-    }
+  char           *cache_key;
+  MenuLayoutNode *layout;
 
-  g_free (path);
+  GSList         *merged_files;
+  GSList         *inputs;
 
-  return tree->canonical;
-}
+  /* MenuLayoutNode of a <Menu> -> MenuMatches */
+  GHashTable     *matches;
+
+  /* MenuLayoutNode of a <Menu> -> GArray of MenuRule */
+  GHashTable     *rules;
+
+  /* desktop file id -> index + 1 of its bit in the allocation bits of a
+   * build, for the ids in matches */
+  GHashTable     *entry_ids;
+};
+
+static GHashTable *gde2menu_tree_layout_cache = NULL;
 
 static void
-canonicalize_basename (Gde2MenuTree  *tree,
-                       const char *basename)
+menu_matches_free (MenuMatches *matches)
 {
-  if (!canonicalize_basename_with_config_dir (tree,
-                                              basename,
-                                              g_get_user_config_dir ()))
-    {
-      const char * const *system_config_dirs;
-      int                 i;
+  desktop_entry_set_unref (matches->entries);
+  desktop_entry_set_unref (matches->allocated);
+  desktop_entry_set_unref (matches->excluded);
 
-      system_config_dirs = g_get_system_config_dirs ();
+  if (matches->allocated_ids != NULL)
+    g_array_free (matches->allocated_ids, TRUE);
 
-      i = 0;
-      while (system_config_dirs[i] != NULL)
-        {
-          if (canonicalize_basename_with_config_dir (tree,
-                                                     basename,
-                                                     system_config_dirs[i]))
-            break;
+  g_free (matches);
+}
 
-          ++i;
-        }
-    }
+static void
+handle_shared_layout_entries_changed (MenuLayoutNode           *layout,
+				      Gde2MenuTreeSharedLayout *shared)
+{
+  menu_verbose ("Entries changed, dropping the matches of layout %s\n",
+		shared->cache_key);
+
+  g_hash_table_remove_all (shared->matches);
+  g_hash_table_remove_all (shared->entry_ids);
 }
 
-static gboolean gde2menu_tree_canonicalize_path(Gde2MenuTree* tree)
+static inline char *
+get_layout_cache_key (Gde2MenuTree *tree)
 {
-	if (tree->canonical)
-		return TRUE;
+  /* the name of the root menu depends on how the tree was looked up */
+  return g_strdup_printf ("%s:%s",
+			  tree->canonical_path,
+			  tree->type == GDE2MENU_TREE_BASENAME ? tree->basename : "");
+}
 
-	g_assert(tree->canonical_path == NULL);
+static void
+gde2menu_tree_shared_layout_uncache (Gde2MenuTreeSharedLayout *shared)
+{
+  if (gde2menu_tree_layout_cache == NULL ||
+      g_hash_table_lookup (gde2menu_tree_layout_cache, shared->cache_key) != shared)
+    return;
 
-	if (tree->type == GDE2MENU_TREE_BASENAME)
-	{
-		gde2menu_tree_remove_menu_file_monitors (tree);
+  menu_verbose ("Removing menu layout from cache: %s\n", shared->cache_key);
 
-		if (strcmp(tree->basename, "gde2-applications.menu") == 0 && g_getenv("XDG_MENU_PREFIX"))
-		{
-			char* prefixed_basename;
-			prefixed_basename = g_strdup_printf("%s%s", g_getenv("XDG_MENU_PREFIX"), tree->basename);
-			canonicalize_basename(tree, prefixed_basename);
-			g_free(prefixed_basename);
-		}
+  g_hash_table_remove (gde2menu_tree_layout_cache, shared->cache_key);
 
-		if (!tree->canonical)
-			canonicalize_basename(tree, tree->basename);
+  if (g_hash_table_size (gde2menu_tree_layout_cache) == 0)
+    {
+      g_hash_table_destroy (gde2menu_tree_layout_cache);
+      gde2menu_tree_layout_cache = NULL;
+    }
+}
 
-		if (tree->canonical)
-			menu_verbose("Successfully looked up menu_file for \"%s\": %s\n", tree->basename, tree->canonical_path);
-		else
-			menu_verbose("Failed to look up menu_file for \"%s\"\n", tree->basename);
-	}
-	else /* if (tree->type == GDE2MENU_TREE_ABSOLUTE) */
-	{
-		tree->canonical_path = menu_canonicalize_file_name(tree->absolute_path, FALSE);
+static Gde2MenuTreeSharedLayout *
+gde2menu_tree_shared_layout_new (Gde2MenuTree *tree)
+{
+  Gde2MenuTreeSharedLayout *shared;
 
-		if (tree->canonical_path != NULL)
-		{
-			menu_verbose("Successfully looked up menu_file for \"%s\": %s\n", tree->absolute_path, tree->canonical_path);
+  shared = g_new0 (Gde2MenuTreeSharedLayout, 1);
 
-			/*
-			* Replace the cache entry with the canonicalized version
-			*/
-			gde2menu_tree_remove_from_cache (tree, tree->flags);
+  shared->refcount  = 1;
+  shared->cache_key = get_layout_cache_key (tree);
+  shared->matches   = g_hash_table_new_full (NULL, NULL, NULL,
+					     (GDestroyNotify) menu_matches_free);
+  shared->rules     = g_hash_table_new_full (NULL, NULL, NULL,
+					     (GDestroyNotify) g_array_unref);
+  shared->entry_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, NULL);
 
-			gde2menu_tree_remove_menu_file_monitors(tree);
-			gde2menu_tree_add_menu_file_monitor(tree, tree->canonical_path, MENU_FILE_MONITOR_FILE);
+  if (gde2menu_tree_layout_cache == NULL)
+    gde2menu_tree_layout_cache = g_hash_table_new (g_str_hash, g_str_equal);
 
-			tree->canonical = TRUE;
+  menu_verbose ("Adding menu layout to cache: %s\n", shared->cache_key);
 
-			gde2menu_tree_add_to_cache (tree, tree->flags);
-		}
-		else
-		{
-			menu_verbose("Failed to look up menu_file for \"%s\"\n", tree->absolute_path);
-		}
-	}
+  g_hash_table_replace (gde2menu_tree_layout_cache, shared->cache_key, shared);
 
-	return tree->canonical;
+  return shared;
 }
 
 static void
-gde2menu_tree_force_recanonicalize (Gde2MenuTree *tree)
+merged_files_free (GSList *merged_files)
 {
-  gde2menu_tree_remove_menu_file_monitors (tree);
+  GSList *tmp;
 
-  if (tree->canonical)
+  tmp = merged_files;
+  while (tmp != NULL)
     {
-      gde2menu_tree_force_reload (tree);
+      MergedFile *merged = tmp->data;
 
-      g_free (tree->canonical_path);
-      tree->canonical_path = NULL;
+      g_free (merged->path);
+      g_free (merged);
 
-      tree->canonical = FALSE;
+      tmp = tmp->next;
     }
+  g_slist_free (merged_files);
 }
 
-Gde2MenuTree* gde2menu_tree_lookup(const char* menu_file, Gde2MenuTreeFlags flags)
+static void layout_inputs_free (GSList *inputs);
+
+static void
+gde2menu_tree_shared_layout_unref (Gde2MenuTreeSharedLayout *shared)
 {
-  Gde2MenuTree *retval;
 
-  g_return_val_if_fail (menu_file != NULL, NULL);
+  g_assert (shared->refcount > 0);
 
-  flags &= GDE2MENU_TREE_FLAGS_MASK;
+  if (--shared->refcount > 0)
+    return;
 
-  if (g_path_is_absolute (menu_file))
-    retval = gde2menu_tree_lookup_absolute (menu_file, flags);
-  else
-    retval = gde2menu_tree_lookup_basename (menu_file, flags);
+  gde2menu_tree_shared_layout_uncache (shared);
 
-  g_assert (retval != NULL);
+  g_hash_table_destroy (shared->matches);
+  shared->matches = NULL;
 
-  return retval;
-}
+  g_hash_table_destroy (shared->rules);
+  shared->rules = NULL;
 
-static Gde2MenuTree *
-gde2menu_tree_new (Gde2MenuTreeType   type,
-		const char     *menu_file,
-		gboolean        canonical,
-		Gde2MenuTreeFlags  flags)
-{
-  Gde2MenuTree *tree;
+  g_hash_table_destroy (shared->entry_ids);
+  shared->entry_ids = NULL;
 
-  tree = g_new0 (Gde2MenuTree, 1);
+  if (shared->layout)
+    {
+      menu_layout_node_root_remove_entries_monitor (shared->layout,
+						    (MenuLayoutNodeEntriesChangedFunc) handle_shared_layout_entries_changed,
+						    shared);
+      menu_layout_node_unref (shared->layout);
+    }
+  shared->layout = NULL;
 
-  tree->type     = type;
-  tree->flags    = flags;
-  tree->refcount = 1;
+  merged_files_free (shared->merged_files);
+  shared->merged_files = NULL;
 
-  tree->sort_key = GDE2MENU_TREE_SORT_NAME;
+  layout_inputs_free (shared->inputs);
+  shared->inputs = NULL;
 
-  if (tree->type == GDE2MENU_TREE_BASENAME)
-    {
-      g_assert (canonical == FALSE);
-      tree->basename = g_strdup (menu_file);
-    }
-  else
+  g_free (shared->cache_key);
+  g_free (shared);
+}
+
+static void
+gde2menu_tree_add_merged_file_monitors (Gde2MenuTree             *tree,
+					Gde2MenuTreeSharedLayout *shared)
+{
+  GSList *tmp;
+
+  tmp = shared->merged_files;
+  while (tmp != NULL)
     {
-      tree->canonical     = canonical != FALSE;
-      tree->absolute_path = g_strdup (menu_file);
+      MergedFile *merged = tmp->data;
 
-      if (tree->canonical)
-	{
-	  tree->canonical_path = g_strdup (menu_file);
-	  gde2menu_tree_add_menu_file_monitor (tree,
-					    tree->canonical_path,
-					    MENU_FILE_MONITOR_FILE);
-	}
-      else
-	{
-	  gde2menu_tree_add_menu_file_monitor (tree,
-					    tree->absolute_path,
-					    MENU_FILE_MONITOR_NONEXISTENT_FILE);
-	}
+      gde2menu_tree_add_menu_file_monitor (tree, merged->path, merged->type);
+
+      tmp = tmp->next;
     }
+}
 
-  gde2menu_tree_add_to_cache (tree, tree->flags);
+static Gde2MenuTreeSharedLayout *
+gde2menu_tree_shared_layout_lookup (Gde2MenuTree *tree)
+{
+  Gde2MenuTreeSharedLayout *shared;
+  char                     *cache_key;
 
-  return tree;
+  if (gde2menu_tree_layout_cache == NULL)
+    return NULL;
+
+  cache_key = get_layout_cache_key (tree);
+  shared = g_hash_table_lookup (gde2menu_tree_layout_cache, cache_key);
+  g_free (cache_key);
+
+  if (shared == NULL)
+    return NULL;
+
+  menu_verbose ("Using cached menu layout: %s\n", shared->cache_key);
+
+  /* watch the files that were merged when the layout was loaded */
+  gde2menu_tree_add_merged_file_monitors (tree, shared);
+
+  shared->refcount++;
+
+  return shared;
 }
 
-Gde2MenuTree *
-gde2menu_tree_ref (Gde2MenuTree *tree)
+static void
+gde2menu_tree_add_merged_file_monitor (Gde2MenuTree        *tree,
+				       const char          *path,
+				       MenuFileMonitorType  type)
 {
-  g_return_val_if_fail (tree != NULL, NULL);
-  g_return_val_if_fail (tree->refcount > 0, NULL);
+  MergedFile *merged;
 
-  tree->refcount++;
+  g_assert (tree->shared_layout != NULL);
 
-  return tree;
+  merged = g_new (MergedFile, 1);
+  merged->type = type;
+  merged->path = g_strdup (path);
+
+  tree->shared_layout->merged_files =
+    g_slist_prepend (tree->shared_layout->merged_files, merged);
+
+  gde2menu_tree_add_menu_file_monitor (tree, path, type);
 }
 
-void
-gde2menu_tree_unref (Gde2MenuTree *tree)
+/*
+ * The shared layouts are also saved in the user cache directory, so that
+ * the next process doesn't have to parse and resolve all the .menu files
+ * again. Along with the layout, the compiled file has the merged files to
+ * monitor, and the stat of every file and directory that was read while
+ * resolving the layout: it is only used if none of them changed.
+ */
+
+#define COMPILED_LAYOUT_MAGIC "gde2-menus compiled layout 1"
+
+typedef struct
 {
-  g_return_if_fail (tree != NULL);
-  g_return_if_fail (tree->refcount >= 1);
+  char   *path;
+  gint64  mtime; /* see menu_stat_file() */
+  gint64  size;
+  gint64  inode;
+} LayoutInput;
 
-  if (--tree->refcount > 0)
-    return;
+static void
+layout_input_free (LayoutInput *input)
+{
+  g_free (input->path);
+  g_free (input);
+}
 
-  if (tree->dnotify)
-    tree->dnotify (tree->user_data);
-  tree->user_data = NULL;
-  tree->dnotify   = NULL;
+static void
+layout_inputs_free (GSList *inputs)
+{
+  g_slist_foreach (inputs, (GFunc) layout_input_free, NULL);
+  g_slist_free (inputs);
+}
 
-  gde2menu_tree_remove_from_cache (tree, tree->flags);
+static LayoutInput *
+gde2menu_tree_add_layout_input (Gde2MenuTree *tree,
+				const char   *path)
+{
+  LayoutInput *input;
 
-  gde2menu_tree_force_recanonicalize (tree);
+  g_assert (tree->shared_layout != NULL);
 
-  if (tree->basename != NULL)
-    g_free (tree->basename);
-  tree->basename = NULL;
+  input = g_new (LayoutInput, 1);
+  input->path = g_strdup (path);
+  menu_stat_file (path, &input->mtime, &input->size, &input->inode);
 
-  if (tree->absolute_path != NULL)
-    g_free (tree->absolute_path);
-  tree->absolute_path = NULL;
+  tree->shared_layout->inputs =
+    g_slist_prepend (tree->shared_layout->inputs, input);
 
-  g_slist_foreach (tree->monitors, (GFunc) g_free, NULL);
-  g_slist_free (tree->monitors);
-  tree->monitors = NULL;
+  return input;
+}
 
-  g_free (tree);
+/* mtimes can have a resolution of one second: a file changed in the same
+ * second as the stat could change again without the stat noticing */
+static gboolean
+layout_input_is_recent (LayoutInput *input,
+			gint64       now)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return input->mtime / 1000000000 >= now - 1;
+#else
+  return input->mtime >= now - 1;
+#endif
 }
 
-void
-gde2menu_tree_set_user_data (Gde2MenuTree       *tree,
-			  gpointer        user_data,
-			  GDestroyNotify  dnotify)
+/*
+ * Parsed menu files
+ *
+ * A change to one .menu file reloads the whole layout. Only that file needs
+ * to be parsed again though: the others are copied from the pristine parse
+ * kept here, and then resolved as usual. The layout can't be patched in
+ * place, since merging menus and executing moves loses track of where the
+ * nodes came from.
+ */
+
+typedef struct
 {
-  g_return_if_fail (tree != NULL);
+  MenuLayoutNode *layout;
+  gint64          mtime;
+  gint64          size;
+  gint64          inode;
+} ParsedMenuFile;
 
-  if (tree->dnotify != NULL)
-    tree->dnotify (tree->user_data);
+/* "path:non-prefixed basename" -> ParsedMenuFile */
+static GHashTable *parsed_menu_files = NULL;
 
-  tree->dnotify   = dnotify;
-  tree->user_data = user_data;
+static void
+parsed_menu_file_free (ParsedMenuFile *parsed)
+{
+  menu_layout_node_unref (parsed->layout);
+  g_free (parsed);
 }
 
-gpointer
-gde2menu_tree_get_user_data (Gde2MenuTree *tree)
+static char *
+get_parsed_menu_file_key (const char *path,
+			  const char *non_prefixed_basename)
 {
-  g_return_val_if_fail (tree != NULL, NULL);
-
-  return tree->user_data;
+  return g_strdup_printf ("%s:%s",
+			  path,
+			  non_prefixed_basename ? non_prefixed_basename : "");
 }
 
-const char *
-gde2menu_tree_get_menu_file (Gde2MenuTree *tree)
+static MenuLayoutNode *
+parsed_menu_file_lookup (const char  *key,
+			 LayoutInput *input)
 {
-  /* FIXME: this is horribly ugly. But it's done to keep the API. Would be bad
-   * to break the API only for a "const char *" => "char *" change. The other
-   * alternative is to leak the memory, which is bad too. */
-  static char *ugly_result_cache = NULL;
+  ParsedMenuFile *parsed;
 
-  g_return_val_if_fail (tree != NULL, NULL);
+  if (parsed_menu_files == NULL)
+    return NULL;
 
-  /* we need to canonicalize the path so we actually find out the real menu
-   * file that is being used -- and take into account XDG_MENU_PREFIX */
-  if (!gde2menu_tree_canonicalize_path (tree))
+  parsed = g_hash_table_lookup (parsed_menu_files, key);
+  if (parsed == NULL)
     return NULL;
 
-  if (ugly_result_cache != NULL)
+  /* the file changed or is gone: the parse will never be used again */
+  if (parsed->mtime != input->mtime ||
+      parsed->size  != input->size ||
+      parsed->inode != input->inode)
     {
-      g_free (ugly_result_cache);
-      ugly_result_cache = NULL;
+      g_hash_table_remove (parsed_menu_files, key);
+      return NULL;
     }
 
-  if (tree->type == GDE2MENU_TREE_BASENAME)
-    {
-      ugly_result_cache = g_path_get_basename (tree->canonical_path);
-      return ugly_result_cache;
-    }
-  else
-    return tree->absolute_path;
+  menu_verbose ("\"%s\" didn't change, not parsing it again\n", input->path);
+
+  return menu_layout_node_copy (parsed->layout);
 }
 
-Gde2MenuTreeDirectory *
-gde2menu_tree_get_root_directory (Gde2MenuTree *tree)
+/* takes ownership of @key */
+static void
+parsed_menu_file_store (char           *key,
+			LayoutInput    *input,
+			MenuLayoutNode *layout)
 {
-  g_return_val_if_fail (tree != NULL, NULL);
+  ParsedMenuFile *parsed;
 
-  if (!tree->root)
-    {
-      gde2menu_tree_build_from_layout (tree);
+  if (parsed_menu_files == NULL)
+    parsed_menu_files = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free,
+					       (GDestroyNotify) parsed_menu_file_free);
 
-      if (!tree->root)
-        return NULL;
+  if (layout == NULL ||
+      input->mtime < 0 ||
+      layout_input_is_recent (input, g_get_real_time () / G_USEC_PER_SEC))
+    {
+      g_hash_table_remove (parsed_menu_files, key);
+      g_free (key);
+      return;
     }
 
-  return gde2menu_tree_item_ref (tree->root);
+  parsed = g_new (ParsedMenuFile, 1);
+  parsed->layout = menu_layout_node_copy (layout);
+  parsed->mtime  = input->mtime;
+  parsed->size   = input->size;
+  parsed->inode  = input->inode;
+
+  g_hash_table_replace (parsed_menu_files, key, parsed);
 }
 
-static Gde2MenuTreeDirectory *
-find_path (Gde2MenuTreeDirectory *directory,
-	   const char         *path)
+/* Called when the last tree is gone: the files that are merged then may not be
+ * the same, and the ones that aren't would be kept forever */
+static void
+parsed_menu_files_clear (void)
 {
-  const char *name;
-  char       *slash;
-  char       *freeme;
-  GSList     *tmp;
+  if (parsed_menu_files != NULL)
+    {
+      g_hash_table_destroy (parsed_menu_files);
+      parsed_menu_files = NULL;
+    }
+}
 
-  while (path[0] == G_DIR_SEPARATOR) path++;
+/* @path was deleted, its parses are of no use anymore */
+static void
+parsed_menu_files_forget (const char *path)
+{
+  GHashTableIter iter;
+  gpointer       key;
+  size_t         len;
 
-  if (path[0] == '\0')
-    return directory;
+  if (parsed_menu_files == NULL)
+    return;
 
-  freeme = NULL;
-  slash = strchr (path, G_DIR_SEPARATOR);
-  if (slash)
+  len = strlen (path);
+
+  g_hash_table_iter_init (&iter, parsed_menu_files);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      name = freeme = g_strndup (path, slash - path);
-      path = slash + 1;
+      if (strncmp (key, path, len) == 0 && ((char *) key)[len] == ':')
+        g_hash_table_iter_remove (&iter);
     }
-  else
+}
+
+static MenuLayoutNode *
+gde2menu_tree_load_menu_file (Gde2MenuTree  *tree,
+			      const char    *path,
+			      const char    *non_prefixed_basename,
+			      GError       **error)
+{
+  LayoutInput    *input;
+  MenuLayoutNode *layout;
+  char           *key;
+
+  input = gde2menu_tree_add_layout_input (tree, path);
+  key   = get_parsed_menu_file_key (path, non_prefixed_basename);
+
+  if ((layout = parsed_menu_file_lookup (key, input)) != NULL)
     {
-      name = path;
-      path = NULL;
+      g_free (key);
+      return layout;
     }
 
-  tmp = directory->contents;
-  while (tmp != NULL)
+  layout = menu_layout_load (path, non_prefixed_basename, error);
+  parsed_menu_file_store (key, input, layout);
+
+  return layout;
+}
+
+typedef struct
+{
+  const char     *path;
+  guint           index;
+  MenuLayoutNode *layout;
+} MenuFileParse;
+
+static void
+parse_menu_file (MenuFileParse *parse,
+		 gpointer       user_data)
+{
+  parse->layout = menu_layout_load (parse->path, NULL, NULL);
+}
+
+/* Same as gde2menu_tree_load_menu_file() for all the files of a <MergeDir>:
+ * parsing doesn't touch anything shared, so the files that need it are
+ * parsed in parallel. @layouts gets the layout of each path, in order. */
+static void
+gde2menu_tree_load_menu_files (Gde2MenuTree    *tree,
+			       GPtrArray       *paths,
+			       MenuLayoutNode **layouts)
+{
+  LayoutInput   **inputs;
+  char          **keys;
+  MenuFileParse  *parses;
+  GThreadPool    *pool;
+  guint           n_parses;
+  guint           i;
+
+  inputs   = g_new (LayoutInput *, paths->len);
+  keys     = g_new (char *, paths->len);
+  parses   = g_new (MenuFileParse, paths->len);
+  n_parses = 0;
+
+  for (i = 0; i < paths->len; i++)
     {
-      Gde2MenuTreeItem *item = tmp->data;
+      inputs[i]  = gde2menu_tree_add_layout_input (tree, paths->pdata[i]);
+      keys[i]    = get_parsed_menu_file_key (paths->pdata[i], NULL);
+      layouts[i] = parsed_menu_file_lookup (keys[i], inputs[i]);
 
-      if (gde2menu_tree_item_get_type (item) != GDE2MENU_TREE_ITEM_DIRECTORY)
+      if (layouts[i] == NULL)
         {
-          tmp = tmp->next;
-          continue;
+          parses[n_parses].path   = paths->pdata[i];
+          parses[n_parses].index  = i;
+          parses[n_parses].layout = NULL;
+          n_parses++;
         }
+    }
 
-      if (!strcmp (name, GDE2MENU_TREE_DIRECTORY (item)->name))
-	{
-	  g_free (freeme);
+  pool = NULL;
+  if (n_parses > 1 && g_get_num_processors () > 1)
+    pool = g_thread_pool_new ((GFunc) parse_menu_file, NULL,
+			      MIN (n_parses, g_get_num_processors ()),
+			      FALSE, NULL);
 
-	  if (path)
-	    return find_path (GDE2MENU_TREE_DIRECTORY (item), path);
-	  else
-	    return GDE2MENU_TREE_DIRECTORY (item);
-	}
+  for (i = 0; i < n_parses; i++)
+    {
+      if (pool == NULL || !g_thread_pool_push (pool, &parses[i], NULL))
+        parse_menu_file (&parses[i], NULL);
+    }
 
-      tmp = tmp->next;
+  /* waits for all the parses to be done */
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  for (i = 0; i < n_parses; i++)
+    {
+      guint index = parses[i].index;
+
+      layouts[index] = parses[i].layout;
+      parsed_menu_file_store (keys[index], inputs[index], layouts[index]);
+      keys[index] = NULL;
     }
 
-  g_free (freeme);
+  for (i = 0; i < paths->len; i++)
+    g_free (keys[i]);
 
-  return NULL;
+  g_free (parses);
+  g_free (keys);
+  g_free (inputs);
 }
 
-Gde2MenuTreeDirectory *
-gde2menu_tree_get_directory_from_path (Gde2MenuTree  *tree,
-				    const char *path)
-{
-  Gde2MenuTreeDirectory *root;
-  Gde2MenuTreeDirectory *directory;
+/* The daemon (see below) builds its trees for any user: it uses user
+ * directories that don't exist instead of its own, and the processes that
+ * load its snapshots check theirs instead, see check_snapshot_inputs(). */
+#define DAEMON_USER_CONFIG_DIR "/nonexistent/gde2-menus/config"
+#define DAEMON_USER_DATA_DIR   "/nonexistent/gde2-menus/data"
 
-  g_return_val_if_fail (tree != NULL, NULL);
-  g_return_val_if_fail (path != NULL, NULL);
+static int daemon_lock_fd = -1;
 
-  if (path[0] != G_DIR_SEPARATOR)
-    return NULL;
+static const char *
+get_user_config_dir (void)
+{
+  return daemon_lock_fd >= 0 ? DAEMON_USER_CONFIG_DIR : g_get_user_config_dir ();
+}
 
-  if (!(root = gde2menu_tree_get_root_directory (tree)))
-    return NULL;
+static const char *
+get_user_data_dir (void)
+{
+  return daemon_lock_fd >= 0 ? DAEMON_USER_DATA_DIR : g_get_user_data_dir ();
+}
 
-  directory = find_path (root, path);
+/* where the daemon keeps its lock, socket and snapshots, for all the users */
+static const char *
+get_daemon_dir (void)
+{
+  const char *dir;
 
-  gde2menu_tree_item_unref (root);
+  dir = g_getenv ("GDE2_MENU_DAEMON_DIR");
 
-  return directory ? gde2menu_tree_item_ref (directory) : NULL;
+  return dir != NULL && dir[0] != '\0' ? dir : GDE2MENU_DAEMON_DIR;
 }
 
-Gde2MenuTreeSortKey
-gde2menu_tree_get_sort_key (Gde2MenuTree *tree)
+static char *
+get_compiled_layout_key (Gde2MenuTree *tree)
 {
-  g_return_val_if_fail (tree != NULL, GDE2MENU_TREE_SORT_NAME);
-  g_return_val_if_fail (tree->refcount > 0, GDE2MENU_TREE_SORT_NAME);
+  char *cache_key;
+  char *system_config_dirs;
+  char *system_data_dirs;
+  char *retval;
+
+  cache_key          = get_layout_cache_key (tree);
+  system_config_dirs = g_strjoinv (":", (char **) g_get_system_config_dirs ());
+  system_data_dirs   = g_strjoinv (":", (char **) g_get_system_data_dirs ());
+
+  retval = g_strdup_printf ("%s\n%s\n%s\n%s\n%s\n%s",
+			    cache_key,
+			    get_user_config_dir (),
+			    system_config_dirs,
+			    get_user_data_dir (),
+			    system_data_dirs,
+			    g_getenv ("XDG_MENU_PREFIX") ? g_getenv ("XDG_MENU_PREFIX") : "");
+
+  g_free (system_data_dirs);
+  g_free (system_config_dirs);
+  g_free (cache_key);
 
-  return tree->sort_key;
+  return retval;
 }
 
-void
-gde2menu_tree_set_sort_key (Gde2MenuTree        *tree,
-			 Gde2MenuTreeSortKey  sort_key)
+static char *
+get_compiled_layout_path (const char *key)
 {
-  g_return_if_fail (tree != NULL);
-  g_return_if_fail (tree->refcount > 0);
-  g_return_if_fail (sort_key >= GDE2MENU_TREE_SORT_FIRST);
-  g_return_if_fail (sort_key <= GDE2MENU_TREE_SORT_LAST);
+  char *checksum;
+  char *basename;
+  char *retval;
 
-  if (sort_key == tree->sort_key)
-    return;
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  basename = g_strconcat (checksum, ".layout", NULL);
 
-  tree->sort_key = sort_key;
-  gde2menu_tree_force_rebuild (tree);
-}
+  retval = g_build_filename (g_get_user_cache_dir (), "gde2-menus", basename, NULL);
 
-void
-gde2menu_tree_add_monitor (Gde2MenuTree            *tree,
-                       Gde2MenuTreeChangedFunc   callback,
-                       gpointer               user_data)
-{
-  Gde2MenuTreeMonitor *monitor;
-  GSList           *tmp;
+  g_free (basename);
+  g_free (checksum);
 
-  g_return_if_fail (tree != NULL);
-  g_return_if_fail (callback != NULL);
+  return retval;
+}
 
-  tmp = tree->monitors;
-  while (tmp != NULL)
+static void
+gde2menu_tree_shared_layout_save (Gde2MenuTreeSharedLayout *shared,
+				  const char               *key)
+{
+  GString *out;
+  GSList  *tmp;
+  GError  *error;
+  char    *path;
+  char    *dirname;
+  gint64   now;
+
+  /* don't save anything until the inputs settle down */
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  for (tmp = shared->inputs; tmp != NULL; tmp = tmp->next)
     {
-      monitor = tmp->data;
+      LayoutInput *input = tmp->data;
 
-      if (monitor->callback  == callback &&
-          monitor->user_data == user_data)
-        break;
+      if (layout_input_is_recent (input, now))
+        {
+          menu_verbose ("\"%s\" was just modified, not saving the compiled layout\n",
+                        input->path);
+          return;
+        }
+    }
 
-      tmp = tmp->next;
+  out = g_string_new (NULL);
+
+  menu_write_string (out, COMPILED_LAYOUT_MAGIC);
+  menu_write_string (out, key);
+
+  menu_write_uint32 (out, g_slist_length (shared->inputs));
+  for (tmp = shared->inputs; tmp != NULL; tmp = tmp->next)
+    {
+      LayoutInput *input = tmp->data;
+
+      menu_write_string (out, input->path);
+      menu_write_int64 (out, input->mtime);
+      menu_write_int64 (out, input->size);
+      menu_write_int64 (out, input->inode);
     }
 
-  if (tmp == NULL)
+  menu_write_uint32 (out, g_slist_length (shared->merged_files));
+  for (tmp = shared->merged_files; tmp != NULL; tmp = tmp->next)
     {
-      monitor = g_new0 (Gde2MenuTreeMonitor, 1);
+      MergedFile *merged = tmp->data;
 
-      monitor->callback  = callback;
-      monitor->user_data = user_data;
+      menu_write_uint32 (out, merged->type);
+      menu_write_string (out, merged->path);
+    }
 
-      tree->monitors = g_slist_append (tree->monitors, monitor);
+  menu_layout_write (shared->layout, out);
+
+  path    = get_compiled_layout_path (key);
+  dirname = g_path_get_dirname (path);
+
+  error = NULL;
+  if (g_mkdir_with_parents (dirname, 0700) != 0)
+    {
+      menu_verbose ("Failed to create \"%s\": %s\n",
+		    dirname, g_strerror (errno));
+    }
+  else if (!g_file_set_contents (path, out->str, out->len, &error))
+    {
+      menu_verbose ("Failed to save compiled layout: %s\n", error->message);
+      g_error_free (error);
     }
+  else
+    {
+      menu_verbose ("Saved compiled layout to \"%s\"\n", path);
+    }
+
+  g_free (dirname);
+  g_free (path);
+  g_string_free (out, TRUE);
 }
 
-void
-gde2menu_tree_remove_monitor (Gde2MenuTree            *tree,
-			   Gde2MenuTreeChangedFunc  callback,
-			   gpointer              user_data)
-{
-  GSList *tmp;
+static gboolean
+gde2menu_tree_shared_layout_load (Gde2MenuTreeSharedLayout *shared,
+				  const char               *key)
+{
+  GMappedFile *mapped;
+  const char  *data;
+  const char  *end;
+  char        *path;
+  char        *str;
+  GSList      *inputs;
+  GSList      *merged_files;
+  guint32      n;
+  gboolean     retval;
+
+  path = get_compiled_layout_path (key);
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  g_free (path);
 
-  g_return_if_fail (tree != NULL);
-  g_return_if_fail (callback != NULL);
+  if (mapped == NULL)
+    return FALSE;
 
-  tmp = tree->monitors;
-  while (tmp != NULL)
+  data = g_mapped_file_get_contents (mapped);
+  end  = data + g_mapped_file_get_length (mapped);
+
+  retval       = FALSE;
+  inputs       = NULL;
+  merged_files = NULL;
+
+  if (!menu_read_string (&data, end, &str))
+    goto out;
+  if (g_strcmp0 (str, COMPILED_LAYOUT_MAGIC) != 0)
     {
-      Gde2MenuTreeMonitor *monitor = tmp->data;
-      GSList          *next = tmp->next;
+      g_free (str);
+      goto out;
+    }
+  g_free (str);
 
-      if (monitor->callback  == callback &&
-          monitor->user_data == user_data)
+  if (!menu_read_string (&data, end, &str))
+    goto out;
+  if (g_strcmp0 (str, key) != 0)
+    {
+      g_free (str);
+      goto out;
+    }
+  g_free (str);
+
+  if (!menu_read_uint32 (&data, end, &n))
+    goto out;
+  while (n-- > 0)
+    {
+      LayoutInput *input;
+      gint64       mtime;
+      gint64       size;
+      gint64       inode;
+
+      input = g_new0 (LayoutInput, 1);
+      inputs = g_slist_prepend (inputs, input);
+
+      if (!menu_read_string (&data, end, &input->path) ||
+          !menu_read_int64 (&data, end, &input->mtime) ||
+          !menu_read_int64 (&data, end, &input->size) ||
+          !menu_read_int64 (&data, end, &input->inode) ||
+          input->path == NULL)
+        goto out;
+
+      menu_stat_file (input->path, &mtime, &size, &inode);
+      if (mtime != input->mtime || size != input->size || inode != input->inode)
         {
-          tree->monitors = g_slist_delete_link (tree->monitors, tmp);
-          g_free (monitor);
+          menu_verbose ("\"%s\" changed, not using the compiled layout\n",
+                        input->path);
+          goto out;
         }
-
-      tmp = next;
     }
-}
-
-static void
-gde2menu_tree_invoke_monitors (Gde2MenuTree *tree)
-{
-  GSList *tmp;
 
-  tmp = tree->monitors;
-  while (tmp != NULL)
+  if (!menu_read_uint32 (&data, end, &n))
+    goto out;
+  while (n-- > 0)
     {
-      Gde2MenuTreeMonitor *monitor = tmp->data;
-      GSList           *next    = tmp->next;
+      MergedFile *merged;
+      guint32     type;
 
-      monitor->callback (tree, monitor->user_data);
+      merged = g_new0 (MergedFile, 1);
+      merged_files = g_slist_prepend (merged_files, merged);
 
-      tmp = next;
-    }
-}
+      if (!menu_read_uint32 (&data, end, &type) ||
+          !menu_read_string (&data, end, &merged->path) ||
+          merged->path == NULL ||
+          type == MENU_FILE_MONITOR_INVALID ||
+          type > MENU_FILE_MONITOR_DIRECTORY)
+        goto out;
 
-Gde2MenuTreeItemType
-gde2menu_tree_item_get_type (Gde2MenuTreeItem *item)
-{
-  g_return_val_if_fail (item != NULL, 0);
+      merged->type = type;
+    }
 
-  return item->type;
-}
+  if ((shared->layout = menu_layout_read (&data, end)) == NULL)
+    goto out;
 
-Gde2MenuTreeDirectory *
-gde2menu_tree_item_get_parent (Gde2MenuTreeItem *item)
-{
-  g_return_val_if_fail (item != NULL, NULL);
+  shared->inputs       = inputs;
+  shared->merged_files = merged_files;
+  inputs       = NULL;
+  merged_files = NULL;
 
-  return item->parent ? gde2menu_tree_item_ref (item->parent) : NULL;
-}
+  retval = TRUE;
 
-static void
-gde2menu_tree_item_set_parent (Gde2MenuTreeItem      *item,
-			    Gde2MenuTreeDirectory *parent)
-{
-  g_return_if_fail (item != NULL);
+ out:
+  layout_inputs_free (inputs);
+  merged_files_free (merged_files);
+  g_mapped_file_unref (mapped);
 
-  item->parent = parent;
+  return retval;
 }
 
-GSList *
-gde2menu_tree_directory_get_contents (Gde2MenuTreeDirectory *directory)
+static Gde2MenuTree *
+gde2menu_tree_lookup_absolute (const char    *absolute,
+			    Gde2MenuTreeFlags  flags)
 {
-  GSList *retval;
-  GSList *tmp;
+  Gde2MenuTree  *tree;
+  gboolean    canonical;
+  const char *canonical_path;
+  char       *freeme;
 
-  g_return_val_if_fail (directory != NULL, NULL);
+  menu_verbose ("Looking up absolute path in tree cache: \"%s\"\n", absolute);
 
-  retval = NULL;
+  if ((tree = gde2menu_tree_lookup_from_cache (absolute, flags)) != NULL)
+    return tree;
 
-  tmp = directory->contents;
-  while (tmp != NULL)
+  canonical = TRUE;
+  canonical_path = freeme = menu_canonicalize_file_name (absolute, FALSE);
+  if (canonical_path == NULL)
     {
-      retval = g_slist_prepend (retval,
-                                gde2menu_tree_item_ref (tmp->data));
-
-      tmp = tmp->next;
+      menu_verbose ("Failed to canonicalize absolute menu path \"%s\": %s\n",
+                    absolute, g_strerror (errno));
+      canonical = FALSE;
+      canonical_path = absolute;
     }
 
-  return g_slist_reverse (retval);
-}
+  if ((tree = gde2menu_tree_lookup_from_cache (canonical_path, flags)) != NULL)
+    return tree;
 
-const char *
-gde2menu_tree_directory_get_name (Gde2MenuTreeDirectory *directory)
-{
-  g_return_val_if_fail (directory != NULL, NULL);
+  tree = gde2menu_tree_new (GDE2MENU_TREE_ABSOLUTE, canonical_path, canonical, flags);
 
-  if (!directory->directory_entry)
-    return directory->name;
+  g_free (freeme);
 
-  return desktop_entry_get_name (directory->directory_entry);
+  return tree;
 }
 
-const char *
-gde2menu_tree_directory_get_comment (Gde2MenuTreeDirectory *directory)
+static Gde2MenuTree *
+gde2menu_tree_lookup_basename (const char    *basename,
+			    Gde2MenuTreeFlags  flags)
 {
-  g_return_val_if_fail (directory != NULL, NULL);
-
-  if (!directory->directory_entry)
-    return NULL;
-
-  return desktop_entry_get_comment (directory->directory_entry);
-}
+  Gde2MenuTree *tree;
 
-const char* gde2menu_tree_directory_get_icon(Gde2MenuTreeDirectory* directory)
-{
-	g_return_val_if_fail(directory != NULL, NULL);
+  menu_verbose ("Looking up menu file in tree cache: \"%s\"\n", basename);
 
-	if (!directory->directory_entry)
-		return NULL;
+  if ((tree = gde2menu_tree_lookup_from_cache (basename, flags)) != NULL)
+    return tree;
 
-	return desktop_entry_get_icon(directory->directory_entry);
+  return gde2menu_tree_new (GDE2MENU_TREE_BASENAME, basename, FALSE, flags);
 }
 
-const char *
-gde2menu_tree_directory_get_desktop_file_path (Gde2MenuTreeDirectory *directory)
+static gboolean
+canonicalize_basename_with_config_dir (Gde2MenuTree   *tree,
+                                       const char *basename,
+                                       const char *config_dir)
 {
-  g_return_val_if_fail (directory != NULL, NULL);
+  char *path;
 
-  if (!directory->directory_entry)
-    return NULL;
+  path = g_build_filename (config_dir, "menus",  basename,  NULL);
 
-  return desktop_entry_get_path (directory->directory_entry);
-}
+  tree->canonical_path = menu_canonicalize_file_name (path, FALSE);
+  if (tree->canonical_path)
+    {
+      tree->canonical = TRUE;
+      gde2menu_tree_add_menu_file_monitor (tree,
+					tree->canonical_path,
+					MENU_FILE_MONITOR_FILE);
+    }
+  else
+    {
+      gde2menu_tree_add_menu_file_monitor (tree,
+					path,
+					MENU_FILE_MONITOR_NONEXISTENT_FILE);
+    }
 
-const char *
-gde2menu_tree_directory_get_menu_id (Gde2MenuTreeDirectory *directory)
-{
-  g_return_val_if_fail (directory != NULL, NULL);
+  g_free (path);
 
-  return directory->name;
+  return tree->canonical;
 }
 
 static void
-gde2menu_tree_directory_set_tree (Gde2MenuTreeDirectory *directory,
-			       Gde2MenuTree          *tree)
+canonicalize_basename (Gde2MenuTree  *tree,
+                       const char *basename)
 {
-  Gde2MenuTreeDirectoryRoot *root;
+  if (!canonicalize_basename_with_config_dir (tree,
+                                              basename,
+                                              get_user_config_dir ()))
+    {
+      const char * const *system_config_dirs;
+      int                 i;
 
-  g_assert (directory != NULL);
-  g_assert (directory->is_root);
+      system_config_dirs = g_get_system_config_dirs ();
 
-  root = (Gde2MenuTreeDirectoryRoot *) directory;
+      i = 0;
+      while (system_config_dirs[i] != NULL)
+        {
+          if (canonicalize_basename_with_config_dir (tree,
+                                                     basename,
+                                                     system_config_dirs[i]))
+            break;
 
-  root->tree = tree;
+          ++i;
+        }
+    }
 }
 
-Gde2MenuTree *
-gde2menu_tree_directory_get_tree (Gde2MenuTreeDirectory *directory)
+static gboolean gde2menu_tree_canonicalize_path(Gde2MenuTree* tree)
 {
-  Gde2MenuTreeDirectoryRoot *root;
-
-  g_return_val_if_fail (directory != NULL, NULL);
-
-  while (GDE2MENU_TREE_ITEM (directory)->parent != NULL)
-    directory = GDE2MENU_TREE_DIRECTORY (GDE2MENU_TREE_ITEM (directory)->parent);
+	if (tree->canonical)
+		return TRUE;
 
-  if (!directory->is_root)
-    return NULL;
+	g_assert(tree->canonical_path == NULL);
 
-  root = (Gde2MenuTreeDirectoryRoot *) directory;
+	if (tree->type == GDE2MENU_TREE_BASENAME)
+	{
+		gde2menu_tree_remove_menu_file_monitors (tree);
 
-  if (root->tree)
-    gde2menu_tree_ref (root->tree);
+		if (strcmp(tree->basename, "gde2-applications.menu") == 0 && g_getenv("XDG_MENU_PREFIX"))
+		{
+			char* prefixed_basename;
+			prefixed_basename = g_strdup_printf("%s%s", g_getenv("XDG_MENU_PREFIX"), tree->basename);
+			canonicalize_basename(tree, prefixed_basename);
+			g_free(prefixed_basename);
+		}
 
-  return root->tree;
-}
+		if (!tree->canonical)
+			canonicalize_basename(tree, tree->basename);
 
-gboolean
-gde2menu_tree_directory_get_is_nodisplay (Gde2MenuTreeDirectory *directory)
-{
-  g_return_val_if_fail (directory != NULL, FALSE);
+		if (tree->canonical)
+			menu_verbose("Successfully looked up menu_file for \"%s\": %s\n", tree->basename, tree->canonical_path);
+		else
+			menu_verbose("Failed to look up menu_file for \"%s\"\n", tree->basename);
+	}
+	else /* if (tree->type == GDE2MENU_TREE_ABSOLUTE) */
+	{
+		tree->canonical_path = menu_canonicalize_file_name(tree->absolute_path, FALSE);
 
-  return directory->is_nodisplay;
+		if (tree->canonical_path != NULL)
+		{
+			menu_verbose("Successfully looked up menu_file for \"%s\": %s\n", tree->absolute_path, tree->canonical_path);
+
+			/*
+			* Replace the cache entry with the canonicalized version
+			*/
+			gde2menu_tree_remove_from_cache (tree, tree->flags);
+
+			gde2menu_tree_remove_menu_file_monitors(tree);
+			gde2menu_tree_add_menu_file_monitor(tree, tree->canonical_path, MENU_FILE_MONITOR_FILE);
+
+			tree->canonical = TRUE;
+
+			gde2menu_tree_add_to_cache (tree, tree->flags);
+		}
+		else
+		{
+			menu_verbose("Failed to look up menu_file for \"%s\"\n", tree->absolute_path);
+		}
+	}
+
+	return tree->canonical;
 }
 
 static void
-append_directory_path (Gde2MenuTreeDirectory *directory,
-		       GString            *path)
+gde2menu_tree_force_recanonicalize (Gde2MenuTree *tree)
 {
+  gde2menu_tree_remove_menu_file_monitors (tree);
 
-  if (!directory->item.parent)
+  if (tree->canonical)
     {
-      g_string_append_c (path, G_DIR_SEPARATOR);
-      return;
-    }
+      gde2menu_tree_force_reload (tree);
 
-  append_directory_path (directory->item.parent, path);
+      g_free (tree->canonical_path);
+      tree->canonical_path = NULL;
 
-  g_string_append (path, directory->name);
-  g_string_append_c (path, G_DIR_SEPARATOR);
+      tree->canonical = FALSE;
+    }
 }
 
-char *
-gde2menu_tree_directory_make_path (Gde2MenuTreeDirectory *directory,
-				Gde2MenuTreeEntry     *entry)
+Gde2MenuTree* gde2menu_tree_lookup(const char* menu_file, Gde2MenuTreeFlags flags)
 {
-  GString *path;
+  Gde2MenuTree *retval;
 
-  g_return_val_if_fail (directory != NULL, NULL);
+  g_return_val_if_fail (menu_file != NULL, NULL);
 
-  path = g_string_new (NULL);
+  flags &= GDE2MENU_TREE_FLAGS_MASK;
 
-  append_directory_path (directory, path);
+  menu_lock ();
 
-  if (entry != NULL)
-    g_string_append (path,
-		     desktop_entry_get_basename (entry->desktop_entry));
+  if (g_path_is_absolute (menu_file))
+    retval = gde2menu_tree_lookup_absolute (menu_file, flags);
+  else
+    retval = gde2menu_tree_lookup_basename (menu_file, flags);
 
-  return g_string_free (path, FALSE);
-}
+  menu_unlock ();
 
-const char *
-gde2menu_tree_entry_get_name (Gde2MenuTreeEntry *entry)
-{
-  g_return_val_if_fail (entry != NULL, NULL);
+  g_assert (retval != NULL);
 
-  return desktop_entry_get_name (entry->desktop_entry);
+  return retval;
 }
 
-const char *
-gde2menu_tree_entry_get_generic_name (Gde2MenuTreeEntry *entry)
+static Gde2MenuTree *
+gde2menu_tree_new (Gde2MenuTreeType   type,
+		const char     *menu_file,
+		gboolean        canonical,
+		Gde2MenuTreeFlags  flags)
 {
-  g_return_val_if_fail (entry != NULL, NULL);
+  Gde2MenuTree *tree;
 
-  return desktop_entry_get_generic_name (entry->desktop_entry);
-}
+  tree = g_new0 (Gde2MenuTree, 1);
 
-const char *
-gde2menu_tree_entry_get_display_name (Gde2MenuTreeEntry *entry)
-{
-  const char *display_name;
+  tree->type     = type;
+  tree->flags    = flags;
+  tree->refcount = 1;
 
-  g_return_val_if_fail (entry != NULL, NULL);
+  tree->sort_key = GDE2MENU_TREE_SORT_NAME;
 
-  display_name = desktop_entry_get_full_name (entry->desktop_entry);
-  if (!display_name || display_name[0] == '\0')
-    display_name = desktop_entry_get_name (entry->desktop_entry);
+  if (tree->type == GDE2MENU_TREE_BASENAME)
+    {
+      g_assert (canonical == FALSE);
+      tree->basename = g_strdup (menu_file);
+    }
+  else
+    {
+      tree->canonical     = canonical != FALSE;
+      tree->absolute_path = g_strdup (menu_file);
 
-  return display_name;
-}
+      if (tree->canonical)
+	{
+	  tree->canonical_path = g_strdup (menu_file);
+	  gde2menu_tree_add_menu_file_monitor (tree,
+					    tree->canonical_path,
+					    MENU_FILE_MONITOR_FILE);
+	}
+      else
+	{
+	  gde2menu_tree_add_menu_file_monitor (tree,
+					    tree->absolute_path,
+					    MENU_FILE_MONITOR_NONEXISTENT_FILE);
+	}
+    }
 
-const char *
-gde2menu_tree_entry_get_comment (Gde2MenuTreeEntry *entry)
-{
-  g_return_val_if_fail (entry != NULL, NULL);
+  gde2menu_tree_add_to_cache (tree, tree->flags);
 
-  return desktop_entry_get_comment (entry->desktop_entry);
+  return tree;
 }
 
-const char* gde2menu_tree_entry_get_icon(Gde2MenuTreeEntry *entry)
+Gde2MenuTree *
+gde2menu_tree_ref (Gde2MenuTree *tree)
 {
-	g_return_val_if_fail (entry != NULL, NULL);
+  g_return_val_if_fail (tree != NULL, NULL);
+  g_return_val_if_fail (tree->refcount > 0, NULL);
 
-	return desktop_entry_get_icon(entry->desktop_entry);
+  menu_lock ();
+  tree->refcount++;
+  menu_unlock ();
+
+  return tree;
 }
 
-const char* gde2menu_tree_entry_get_exec(Gde2MenuTreeEntry* entry)
+void
+gde2menu_tree_unref (Gde2MenuTree *tree)
 {
-	g_return_val_if_fail(entry != NULL, NULL);
+  g_return_if_fail (tree != NULL);
+  g_return_if_fail (tree->refcount >= 1);
 
-	return desktop_entry_get_exec(entry->desktop_entry);
-}
+  menu_lock ();
 
-gboolean gde2menu_tree_entry_get_launch_in_terminal(Gde2MenuTreeEntry* entry)
-{
-  g_return_val_if_fail(entry != NULL, FALSE);
+  if (--tree->refcount > 0)
+    {
+      menu_unlock ();
+      return;
+    }
 
-  return desktop_entry_get_launch_in_terminal(entry->desktop_entry);
-}
+  if (tree->dnotify)
+    tree->dnotify (tree->user_data);
+  tree->user_data = NULL;
+  tree->dnotify   = NULL;
 
-const char* gde2menu_tree_entry_get_desktop_file_path(Gde2MenuTreeEntry* entry)
-{
-	g_return_val_if_fail(entry != NULL, NULL);
+  gde2menu_tree_remove_from_cache (tree, tree->flags);
 
-	return desktop_entry_get_path(entry->desktop_entry);
-}
+  /* nothing watches the files anymore */
+  if (gde2menu_tree_cache == NULL)
+    {
+      menu_canonicalize_clear_cache ();
+      parsed_menu_files_clear ();
+    }
 
-const char* gde2menu_tree_entry_get_desktop_file_id(Gde2MenuTreeEntry* entry)
-{
-	g_return_val_if_fail(entry != NULL, NULL);
+  /* the layout may still be used by trees with other flags */
+  gde2menu_tree_release_layout (tree, FALSE);
+  gde2menu_tree_force_recanonicalize (tree);
 
-	return entry->desktop_file_id;
-}
+  if (tree->basename != NULL)
+    g_free (tree->basename);
+  tree->basename = NULL;
 
-gboolean gde2menu_tree_entry_get_is_excluded(Gde2MenuTreeEntry* entry)
-{
-	g_return_val_if_fail(entry != NULL, FALSE);
+  if (tree->absolute_path != NULL)
+    g_free (tree->absolute_path);
+  tree->absolute_path = NULL;
 
-	return entry->is_excluded;
-}
+  g_slist_foreach (tree->monitors, (GFunc) gde2menu_tree_monitor_remove, NULL);
+  g_slist_free (tree->monitors);
+  tree->monitors = NULL;
 
-gboolean gde2menu_tree_entry_get_is_nodisplay(Gde2MenuTreeEntry* entry)
-{
-	g_return_val_if_fail(entry != NULL, FALSE);
+  g_free (tree);
 
-	return entry->is_nodisplay;
+  menu_unlock ();
 }
 
-Gde2MenuTreeDirectory* gde2menu_tree_header_get_directory(Gde2MenuTreeHeader* header)
+void
+gde2menu_tree_set_user_data (Gde2MenuTree       *tree,
+			  gpointer        user_data,
+			  GDestroyNotify  dnotify)
 {
-	g_return_val_if_fail (header != NULL, NULL);
+  g_return_if_fail (tree != NULL);
 
-	return gde2menu_tree_item_ref(header->directory);
+  if (tree->dnotify != NULL)
+    tree->dnotify (tree->user_data);
+
+  tree->dnotify   = dnotify;
+  tree->user_data = user_data;
 }
 
-Gde2MenuTreeDirectory* gde2menu_tree_alias_get_directory(Gde2MenuTreeAlias* alias)
+gpointer
+gde2menu_tree_get_user_data (Gde2MenuTree *tree)
 {
-	g_return_val_if_fail (alias != NULL, NULL);
+  g_return_val_if_fail (tree != NULL, NULL);
 
-	return gde2menu_tree_item_ref(alias->directory);
+  return tree->user_data;
 }
 
-Gde2MenuTreeItem *
-gde2menu_tree_alias_get_item (Gde2MenuTreeAlias *alias)
+const char *
+gde2menu_tree_get_menu_file (Gde2MenuTree *tree)
 {
-  g_return_val_if_fail (alias != NULL, NULL);
+  /* FIXME: this is horribly ugly. But it's done to keep the API. Would be bad
+   * to break the API only for a "const char *" => "char *" change. The other
+   * alternative is to leak the memory, which is bad too. */
+  static char *ugly_result_cache = NULL;
+  const char  *retval;
 
-  return gde2menu_tree_item_ref (alias->aliased_item);
-}
+  g_return_val_if_fail (tree != NULL, NULL);
 
-static Gde2MenuTreeDirectory *
-gde2menu_tree_directory_new (Gde2MenuTreeDirectory *parent,
-			  const char         *name,
-			  gboolean            is_root)
-{
-  Gde2MenuTreeDirectory *retval;
+  menu_lock ();
 
-  if (!is_root)
+  /* we need to canonicalize the path so we actually find out the real menu
+   * file that is being used -- and take into account XDG_MENU_PREFIX */
+  if (!gde2menu_tree_canonicalize_path (tree))
     {
-      retval = g_new0 (Gde2MenuTreeDirectory, 1);
+      menu_unlock ();
+      return NULL;
     }
-  else
-    {
-      Gde2MenuTreeDirectoryRoot *root;
-
-      root = g_new0 (Gde2MenuTreeDirectoryRoot, 1);
 
-      retval = GDE2MENU_TREE_DIRECTORY (root);
+  if (ugly_result_cache != NULL)
+    {
+      g_free (ugly_result_cache);
+      ugly_result_cache = NULL;
+    }
 
-      retval->is_root = TRUE;
+  if (tree->type == GDE2MENU_TREE_BASENAME)
+    {
+      ugly_result_cache = g_path_get_basename (tree->canonical_path);
+      retval = ugly_result_cache;
     }
+  else
+    retval = tree->absolute_path;
 
+  menu_unlock ();
 
-  retval->item.type     = GDE2MENU_TREE_ITEM_DIRECTORY;
-  retval->item.parent   = parent;
-  retval->item.refcount = 1;
+  return retval;
+}
 
-  retval->name                = g_strdup (name);
-  retval->directory_entry     = NULL;
-  retval->entries             = NULL;
-  retval->subdirs             = NULL;
-  retval->default_layout_info = NULL;
-  retval->layout_info         = NULL;
-  retval->contents            = NULL;
-  retval->only_unallocated    = FALSE;
-  retval->is_nodisplay        = FALSE;
-  retval->layout_pending_separator = FALSE;
-  retval->preprocessed        = FALSE;
-  retval->will_inline_header  = G_MAXUINT16;
+Gde2MenuTreeDirectory *
+gde2menu_tree_get_root_directory (Gde2MenuTree *tree)
+{
+  Gde2MenuTreeDirectory *retval;
 
-  retval->default_layout_values.mask          = MENU_LAYOUT_VALUES_NONE;
-  retval->default_layout_values.show_empty    = FALSE;
-  retval->default_layout_values.inline_menus  = FALSE;
-  retval->default_layout_values.inline_limit  = 4;
-  retval->default_layout_values.inline_header = FALSE;
-  retval->default_layout_values.inline_alias  = FALSE;
+  g_return_val_if_fail (tree != NULL, NULL);
+
+  /* this blocks while the tree is being built in a thread */
+  menu_lock ();
+
+  gde2menu_tree_ensure_root (tree);
+
+  retval = tree->root ? gde2menu_tree_item_ref (tree->root) : NULL;
+
+  menu_unlock ();
 
   return retval;
 }
 
 static void
-gde2menu_tree_directory_finalize (Gde2MenuTreeDirectory *directory)
+load_in_thread (GTask        *task,
+		gpointer      source_object,
+		Gde2MenuTree *tree,
+		GCancellable *cancellable)
 {
-  g_assert (directory->item.refcount == 0);
+  Gde2MenuTreeDirectory *root;
 
-  g_slist_foreach (directory->contents,
-		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
-		   NULL);
-  g_slist_free (directory->contents);
-  directory->contents = NULL;
+  if (g_task_return_error_if_cancelled (task))
+    return;
 
-  g_slist_foreach (directory->default_layout_info,
-		   (GFunc) menu_layout_node_unref,
-		   NULL);
-  g_slist_free (directory->default_layout_info);
-  directory->default_layout_info = NULL;
+  menu_lock ();
 
-  g_slist_foreach (directory->layout_info,
-		   (GFunc) menu_layout_node_unref,
-		   NULL);
-  g_slist_free (directory->layout_info);
-  directory->layout_info = NULL;
+  /* the files read are monitored from the caller's context, not this
+   * thread's */
+  menu_monitor_begin_deferred (g_task_get_context (task));
 
-  g_slist_foreach (directory->subdirs,
-		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
-		   NULL);
-  g_slist_free (directory->subdirs);
-  directory->subdirs = NULL;
+  gde2menu_tree_ensure_root (tree);
 
-  g_slist_foreach (directory->entries,
-		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
-		   NULL);
-  g_slist_free (directory->entries);
-  directory->entries = NULL;
+  menu_monitor_end_deferred ();
 
-  if (directory->directory_entry)
-    desktop_entry_unref (directory->directory_entry);
-  directory->directory_entry = NULL;
+  root = tree->root ? gde2menu_tree_item_ref (tree->root) : NULL;
 
-  g_free (directory->name);
-  directory->name = NULL;
+  menu_unlock ();
+
+  g_task_return_pointer (task, root, (GDestroyNotify) gde2menu_tree_item_unref);
 }
 
-static Gde2MenuTreeSeparator *
-gde2menu_tree_separator_new (Gde2MenuTreeDirectory *parent)
+void
+gde2menu_tree_load_async (Gde2MenuTree        *tree,
+			  GCancellable        *cancellable,
+			  GAsyncReadyCallback  callback,
+			  gpointer             user_data)
 {
-  Gde2MenuTreeSeparator *retval;
+  GTask *task;
 
-  retval = g_new0 (Gde2MenuTreeSeparator, 1);
+  g_return_if_fail (tree != NULL);
+  g_return_if_fail (tree->refcount > 0);
 
-  retval->item.type     = GDE2MENU_TREE_ITEM_SEPARATOR;
-  retval->item.parent   = parent;
-  retval->item.refcount = 1;
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, gde2menu_tree_load_async);
+  g_task_set_task_data (task,
+			gde2menu_tree_ref (tree),
+			(GDestroyNotify) gde2menu_tree_unref);
 
-  return retval;
+  g_task_run_in_thread (task, (GTaskThreadFunc) load_in_thread);
+  g_object_unref (task);
 }
 
-static Gde2MenuTreeHeader *
-gde2menu_tree_header_new (Gde2MenuTreeDirectory *parent,
-		       Gde2MenuTreeDirectory *directory)
+Gde2MenuTreeDirectory *
+gde2menu_tree_load_finish (Gde2MenuTree  *tree,
+			   GAsyncResult  *result,
+			   GError       **error)
 {
-  Gde2MenuTreeHeader *retval;
+  g_return_val_if_fail (tree != NULL, NULL);
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  g_return_val_if_fail (g_task_get_task_data (G_TASK (result)) == tree, NULL);
 
-  retval = g_new0 (Gde2MenuTreeHeader, 1);
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
 
-  retval->item.type     = GDE2MENU_TREE_ITEM_HEADER;
-  retval->item.parent   = parent;
-  retval->item.refcount = 1;
+static Gde2MenuTreeDirectory *
+find_path (Gde2MenuTreeDirectory *directory,
+	   const char         *path)
+{
+  const char *name;
+  char       *slash;
+  char       *freeme;
+  guint       i;
 
-  retval->directory = gde2menu_tree_item_ref (directory);
+  while (path[0] == G_DIR_SEPARATOR) path++;
 
-  gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (retval->directory), NULL);
+  if (path[0] == '\0')
+    return directory;
 
-  return retval;
-}
+  freeme = NULL;
+  slash = strchr (path, G_DIR_SEPARATOR);
+  if (slash)
+    {
+      name = freeme = g_strndup (path, slash - path);
+      path = slash + 1;
+    }
+  else
+    {
+      name = path;
+      path = NULL;
+    }
 
-static void
-gde2menu_tree_header_finalize (Gde2MenuTreeHeader *header)
-{
-  g_assert (header->item.refcount == 0);
+  for (i = 0; i < directory->n_contents; i++)
+    {
+      Gde2MenuTreeItem *item = directory->contents[i];
 
-  if (header->directory != NULL)
-    gde2menu_tree_item_unref (header->directory);
-  header->directory = NULL;
+      if (gde2menu_tree_item_get_type (item) != GDE2MENU_TREE_ITEM_DIRECTORY)
+        continue;
+
+      if (!strcmp (name, GDE2MENU_TREE_DIRECTORY (item)->name))
+	{
+	  g_free (freeme);
+
+	  if (path)
+	    return find_path (GDE2MENU_TREE_DIRECTORY (item), path);
+	  else
+	    return GDE2MENU_TREE_DIRECTORY (item);
+	}
+    }
+
+  g_free (freeme);
+
+  return NULL;
 }
 
-static Gde2MenuTreeAlias *
-gde2menu_tree_alias_new (Gde2MenuTreeDirectory *parent,
-		      Gde2MenuTreeDirectory *directory,
-		      Gde2MenuTreeItem      *item)
+Gde2MenuTreeDirectory *
+gde2menu_tree_get_directory_from_path (Gde2MenuTree  *tree,
+				    const char *path)
 {
-  Gde2MenuTreeAlias *retval;
+  Gde2MenuTreeDirectory *root;
+  Gde2MenuTreeDirectory *directory;
 
-  retval = g_new0 (Gde2MenuTreeAlias, 1);
+  g_return_val_if_fail (tree != NULL, NULL);
+  g_return_val_if_fail (path != NULL, NULL);
 
-  retval->item.type     = GDE2MENU_TREE_ITEM_ALIAS;
-  retval->item.parent   = parent;
-  retval->item.refcount = 1;
+  if (path[0] != G_DIR_SEPARATOR)
+    return NULL;
 
-  retval->directory    = gde2menu_tree_item_ref (directory);
-  if (item->type != GDE2MENU_TREE_ITEM_ALIAS)
-    retval->aliased_item = gde2menu_tree_item_ref (item);
-  else
-    retval->aliased_item = gde2menu_tree_item_ref (gde2menu_tree_alias_get_item (GDE2MENU_TREE_ALIAS (item)));
+  if (!(root = gde2menu_tree_get_root_directory (tree)))
+    return NULL;
 
-  gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (retval->directory), NULL);
-  gde2menu_tree_item_set_parent (retval->aliased_item, NULL);
+  directory = find_path (root, path);
+  if (directory != NULL)
+    gde2menu_tree_item_ref (directory);
 
-  return retval;
+  gde2menu_tree_item_unref (root);
+
+  return directory;
 }
 
-static void
-gde2menu_tree_alias_finalize (Gde2MenuTreeAlias *alias)
+Gde2MenuTreeSortKey
+gde2menu_tree_get_sort_key (Gde2MenuTree *tree)
 {
-  g_assert (alias->item.refcount == 0);
-
-  if (alias->directory != NULL)
-    gde2menu_tree_item_unref (alias->directory);
-  alias->directory = NULL;
+  g_return_val_if_fail (tree != NULL, GDE2MENU_TREE_SORT_NAME);
+  g_return_val_if_fail (tree->refcount > 0, GDE2MENU_TREE_SORT_NAME);
 
-  if (alias->aliased_item != NULL)
-    gde2menu_tree_item_unref (alias->aliased_item);
-  alias->aliased_item = NULL;
+  return tree->sort_key;
 }
 
-static Gde2MenuTreeEntry *
-gde2menu_tree_entry_new (Gde2MenuTreeDirectory *parent,
-		      DesktopEntry       *desktop_entry,
-		      const char         *desktop_file_id,
-		      gboolean            is_excluded,
-                      gboolean            is_nodisplay)
+void
+gde2menu_tree_set_sort_key (Gde2MenuTree        *tree,
+			 Gde2MenuTreeSortKey  sort_key)
 {
-  Gde2MenuTreeEntry *retval;
+  g_return_if_fail (tree != NULL);
+  g_return_if_fail (tree->refcount > 0);
+  g_return_if_fail (sort_key >= GDE2MENU_TREE_SORT_FIRST);
+  g_return_if_fail (sort_key <= GDE2MENU_TREE_SORT_LAST);
 
-  retval = g_new0 (Gde2MenuTreeEntry, 1);
+  if (sort_key == tree->sort_key)
+    return;
 
-  retval->item.type     = GDE2MENU_TREE_ITEM_ENTRY;
-  retval->item.parent   = parent;
-  retval->item.refcount = 1;
+  menu_lock ();
 
-  retval->desktop_entry   = desktop_entry_ref (desktop_entry);
-  retval->desktop_file_id = g_strdup (desktop_file_id);
-  retval->is_excluded     = is_excluded != FALSE;
-  retval->is_nodisplay    = is_nodisplay != FALSE;
+  tree->sort_key = sort_key;
 
-  return retval;
+  /* only the order of the items depends on the sort key, so there's no need
+   * to rebuild the tree if it's already there */
+  gde2menu_tree_resort (tree);
+
+  menu_unlock ();
 }
 
 static void
-gde2menu_tree_entry_finalize (Gde2MenuTreeEntry *entry)
+gde2menu_tree_monitor_ref (Gde2MenuTreeMonitor *monitor)
 {
-  g_assert (entry->item.refcount == 0);
-
-  g_free (entry->desktop_file_id);
-  entry->desktop_file_id = NULL;
-
-  if (entry->desktop_entry)
-    desktop_entry_unref (entry->desktop_entry);
-  entry->desktop_entry = NULL;
+  g_atomic_int_inc (&monitor->refcount);
 }
 
-static int
-gde2menu_tree_entry_compare_by_id (Gde2MenuTreeItem *a,
-				Gde2MenuTreeItem *b)
+static void
+gde2menu_tree_monitor_unref (Gde2MenuTreeMonitor *monitor)
 {
-  if (a->type == GDE2MENU_TREE_ITEM_ALIAS)
-    a = GDE2MENU_TREE_ALIAS (a)->aliased_item;
-
-  if (b->type == GDE2MENU_TREE_ITEM_ALIAS)
-    b = GDE2MENU_TREE_ALIAS (b)->aliased_item;
-
-  return strcmp (GDE2MENU_TREE_ENTRY (a)->desktop_file_id,
-                 GDE2MENU_TREE_ENTRY (b)->desktop_file_id);
+  if (g_atomic_int_dec_and_test (&monitor->refcount))
+    g_free (monitor);
 }
 
-gpointer gde2menu_tree_item_ref(gpointer itemp)
+static void
+gde2menu_tree_monitor_remove (Gde2MenuTreeMonitor *monitor)
 {
-	Gde2MenuTreeItem* item = (Gde2MenuTreeItem*) itemp;
-
-	g_return_val_if_fail(item != NULL, NULL);
-	g_return_val_if_fail(item->refcount > 0, NULL);
-
-	item->refcount++;
+  monitor->callback  = NULL;
+  monitor->user_data = NULL;
 
-	return item;
+  gde2menu_tree_monitor_unref (monitor);
 }
 
 void
-gde2menu_tree_item_unref (gpointer itemp)
+gde2menu_tree_add_monitor (Gde2MenuTree            *tree,
+                       Gde2MenuTreeChangedFunc   callback,
+                       gpointer               user_data)
 {
-  Gde2MenuTreeItem *item;
+  Gde2MenuTreeMonitor *monitor;
+  GSList           *tmp;
 
-  item = (Gde2MenuTreeItem *) itemp;
+  g_return_if_fail (tree != NULL);
+  g_return_if_fail (callback != NULL);
 
-  g_return_if_fail (item != NULL);
-  g_return_if_fail (item->refcount > 0);
+  menu_lock ();
 
-  if (--item->refcount == 0)
+  tmp = tree->monitors;
+  while (tmp != NULL)
     {
-      switch (item->type)
-	{
-	case GDE2MENU_TREE_ITEM_DIRECTORY:
-	  gde2menu_tree_directory_finalize (GDE2MENU_TREE_DIRECTORY (item));
-	  break;
-
-	case GDE2MENU_TREE_ITEM_ENTRY:
-	  gde2menu_tree_entry_finalize (GDE2MENU_TREE_ENTRY (item));
-	  break;
+      monitor = tmp->data;
 
-	case GDE2MENU_TREE_ITEM_SEPARATOR:
-	  break;
+      if (monitor->callback  == callback &&
+          monitor->user_data == user_data)
+        break;
 
-	case GDE2MENU_TREE_ITEM_HEADER:
-	  gde2menu_tree_header_finalize (GDE2MENU_TREE_HEADER (item));
-	  break;
+      tmp = tmp->next;
+    }
 
-	case GDE2MENU_TREE_ITEM_ALIAS:
-	  gde2menu_tree_alias_finalize (GDE2MENU_TREE_ALIAS (item));
-	  break;
+  if (tmp == NULL)
+    {
+      monitor = g_new0 (Gde2MenuTreeMonitor, 1);
 
-	default:
-	  g_assert_not_reached ();
-	  break;
-	}
+      monitor->tree      = tree;
+      monitor->callback  = callback;
+      monitor->user_data = user_data;
+      monitor->refcount  = 1;
 
-      if (item->dnotify)
-	item->dnotify (item->user_data);
-      item->user_data = NULL;
-      item->dnotify   = NULL;
+      tree->monitors = g_slist_append (tree->monitors, monitor);
+    }
 
-      item->parent = NULL;
+  menu_unlock ();
+}
+
+void
+gde2menu_tree_remove_monitor (Gde2MenuTree            *tree,
+			   Gde2MenuTreeChangedFunc  callback,
+			   gpointer              user_data)
+{
+  GSList *tmp;
+
+  g_return_if_fail (tree != NULL);
+  g_return_if_fail (callback != NULL);
+
+  menu_lock ();
+
+  tmp = tree->monitors;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeMonitor *monitor = tmp->data;
+      GSList          *next = tmp->next;
+
+      if (monitor->callback  == callback &&
+          monitor->user_data == user_data)
+        {
+          tree->monitors = g_slist_delete_link (tree->monitors, tmp);
+          gde2menu_tree_monitor_remove (monitor);
+        }
 
-      g_free (item);
+      tmp = next;
     }
+
+  menu_unlock ();
 }
 
-static void
-gde2menu_tree_item_unref_and_unset_parent (gpointer itemp)
+static gboolean
+invoke_monitors_in_idle (GSList *monitors)
 {
-  Gde2MenuTreeItem *item;
+  GSList *tmp;
 
-  item = (Gde2MenuTreeItem *) itemp;
+  tmp = monitors;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeMonitor *monitor = tmp->data;
 
-  g_return_if_fail (item != NULL);
+      /* unless it's been removed by a previous callback */
+      if (monitor->callback != NULL)
+        monitor->callback (monitor->tree, monitor->user_data);
 
-  gde2menu_tree_item_set_parent (item, NULL);
-  gde2menu_tree_item_unref (item);
+      gde2menu_tree_monitor_unref (monitor);
+
+      tmp = tmp->next;
+    }
+
+  g_slist_free (monitors);
+
+  return FALSE;
 }
 
-void
-gde2menu_tree_item_set_user_data (Gde2MenuTreeItem  *item,
-			       gpointer        user_data,
-			       GDestroyNotify  dnotify)
+static void
+gde2menu_tree_invoke_monitors (Gde2MenuTree *tree)
 {
-  g_return_if_fail (item != NULL);
+  GSList  *monitors;
+  GSource *current;
+  GSource *source;
 
-  if (item->dnotify != NULL)
-    item->dnotify (item->user_data);
+  /* this is called with the lock held while handling the file monitor
+   * events: the callbacks are run once it's dropped, on the same context */
+  monitors = g_slist_copy (tree->monitors);
+  if (monitors == NULL)
+    return;
 
-  item->dnotify   = dnotify;
-  item->user_data = user_data;
+  g_slist_foreach (monitors, (GFunc) gde2menu_tree_monitor_ref, NULL);
+
+  current = g_main_current_source ();
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source,
+                         (GSourceFunc) invoke_monitors_in_idle,
+                         monitors,
+                         NULL);
+  g_source_attach (source, current ? g_source_get_context (current) : NULL);
+  g_source_unref (source);
 }
 
-gpointer
-gde2menu_tree_item_get_user_data (Gde2MenuTreeItem *item)
+Gde2MenuTreeItemType
+gde2menu_tree_item_get_type (Gde2MenuTreeItem *item)
+{
+  g_return_val_if_fail (item != NULL, 0);
+
+  return item->type;
+}
+
+Gde2MenuTreeDirectory *
+gde2menu_tree_item_get_parent (Gde2MenuTreeItem *item)
 {
   g_return_val_if_fail (item != NULL, NULL);
 
-  return item->user_data;
+  return item->parent ? gde2menu_tree_item_ref (item->parent) : NULL;
 }
 
-static inline const char *
-gde2menu_tree_item_compare_get_name_helper (Gde2MenuTreeItem    *item,
-					 Gde2MenuTreeSortKey  sort_key)
+static void
+gde2menu_tree_item_set_parent (Gde2MenuTreeItem      *item,
+			    Gde2MenuTreeDirectory *parent)
 {
-  const char *name;
+  g_return_if_fail (item != NULL);
 
-  name = NULL;
+  item->parent = parent;
+}
 
-  switch (item->type)
-    {
-    case GDE2MENU_TREE_ITEM_DIRECTORY:
-      if (GDE2MENU_TREE_DIRECTORY (item)->directory_entry)
-	name = desktop_entry_get_name (GDE2MENU_TREE_DIRECTORY (item)->directory_entry);
-      else
-	name = GDE2MENU_TREE_DIRECTORY (item)->name;
-      break;
+GSList *
+gde2menu_tree_directory_get_contents (Gde2MenuTreeDirectory *directory)
+{
+  GSList *retval;
+  guint   i;
 
-    case GDE2MENU_TREE_ITEM_ENTRY:
-      switch (sort_key)
-	{
-	case GDE2MENU_TREE_SORT_NAME:
-	  name = desktop_entry_get_name (GDE2MENU_TREE_ENTRY (item)->desktop_entry);
-	  break;
-	case GDE2MENU_TREE_SORT_DISPLAY_NAME:
-	  name = gde2menu_tree_entry_get_display_name (GDE2MENU_TREE_ENTRY (item));
-	  break;
-	default:
-	  g_assert_not_reached ();
-	  break;
-	}
-      break;
+  g_return_val_if_fail (directory != NULL, NULL);
 
-    case GDE2MENU_TREE_ITEM_ALIAS:
-      {
-        Gde2MenuTreeItem *dir;
-        dir = GDE2MENU_TREE_ITEM (GDE2MENU_TREE_ALIAS (item)->directory);
-        name = gde2menu_tree_item_compare_get_name_helper (dir, sort_key);
-      }
-      break;
+  retval = NULL;
 
-    case GDE2MENU_TREE_ITEM_SEPARATOR:
-    case GDE2MENU_TREE_ITEM_HEADER:
-    default:
-      g_assert_not_reached ();
-      break;
+  i = directory->n_contents;
+  while (i > 0)
+    {
+      i--;
+      retval = g_slist_prepend (retval,
+                                gde2menu_tree_item_ref (directory->contents[i]));
     }
 
-  return name;
+  return retval;
 }
 
-static int
-gde2menu_tree_item_compare (Gde2MenuTreeItem *a,
-			 Gde2MenuTreeItem *b,
-			 gpointer       sort_key_p)
+void
+gde2menu_tree_directory_iter_init (Gde2MenuTreeIter      *iter,
+				   Gde2MenuTreeDirectory *directory)
 {
-  const char       *name_a;
-  const char       *name_b;
-  Gde2MenuTreeSortKey  sort_key;
+  Gde2MenuTreeRealIter *real_iter = (Gde2MenuTreeRealIter *) iter;
 
-  sort_key = GPOINTER_TO_INT (sort_key_p);
+  g_return_if_fail (iter != NULL);
+  g_return_if_fail (directory != NULL);
 
-  name_a = gde2menu_tree_item_compare_get_name_helper (a, sort_key);
-  name_b = gde2menu_tree_item_compare_get_name_helper (b, sort_key);
+  real_iter->directory = directory;
+  real_iter->unused    = NULL;
+  real_iter->position  = 0;
+}
 
-  return g_utf8_collate (name_a, name_b);
+Gde2MenuTreeItem *
+gde2menu_tree_directory_iter_next (Gde2MenuTreeIter *iter)
+{
+  Gde2MenuTreeRealIter *real_iter = (Gde2MenuTreeRealIter *) iter;
+
+  g_return_val_if_fail (iter != NULL, NULL);
+
+  if (real_iter->position >= real_iter->directory->n_contents)
+    return NULL;
+
+  return real_iter->directory->contents[real_iter->position++];
 }
 
-static MenuLayoutNode *
-find_menu_child (MenuLayoutNode *layout)
+const char *
+gde2menu_tree_directory_get_name (Gde2MenuTreeDirectory *directory)
 {
-  MenuLayoutNode *child;
+  g_return_val_if_fail (directory != NULL, NULL);
 
-  child = menu_layout_node_get_children (layout);
-  while (child && menu_layout_node_get_type (child) != MENU_LAYOUT_NODE_MENU)
-    child = menu_layout_node_get_next (child);
+  if (!directory->directory_entry)
+    return directory->name;
 
-  return child;
+  return desktop_entry_get_name (directory->directory_entry);
 }
 
-static void
-merge_resolved_children (Gde2MenuTree      *tree,
-			 GHashTable     *loaded_menu_files,
-                         MenuLayoutNode *where,
-                         MenuLayoutNode *from)
+const char *
+gde2menu_tree_directory_get_comment (Gde2MenuTreeDirectory *directory)
 {
-  MenuLayoutNode *insert_after;
-  MenuLayoutNode *menu_child;
-  MenuLayoutNode *from_child;
+  g_return_val_if_fail (directory != NULL, NULL);
 
-  gde2menu_tree_resolve_files (tree, loaded_menu_files, from);
+  if (!directory->directory_entry)
+    return NULL;
 
-  insert_after = where;
-  g_assert (menu_layout_node_get_type (insert_after) != MENU_LAYOUT_NODE_ROOT);
-  g_assert (menu_layout_node_get_parent (insert_after) != NULL);
+  return desktop_entry_get_comment (directory->directory_entry);
+}
 
-  /* skip root node */
-  menu_child = find_menu_child (from);
-  g_assert (menu_child != NULL);
-  g_assert (menu_layout_node_get_type (menu_child) == MENU_LAYOUT_NODE_MENU);
+const char* gde2menu_tree_directory_get_icon(Gde2MenuTreeDirectory* directory)
+{
+	g_return_val_if_fail(directory != NULL, NULL);
 
-  /* merge children of toplevel <Menu> */
-  from_child = menu_layout_node_get_children (menu_child);
-  while (from_child != NULL)
-    {
-      MenuLayoutNode *next;
+	if (!directory->directory_entry)
+		return NULL;
 
-      next = menu_layout_node_get_next (from_child);
+	return desktop_entry_get_icon(directory->directory_entry);
+}
 
-      menu_verbose ("Merging ");
-      menu_debug_print_layout (from_child, FALSE);
-      menu_verbose (" after ");
-      menu_debug_print_layout (insert_after, FALSE);
+const char *
+gde2menu_tree_directory_get_desktop_file_path (Gde2MenuTreeDirectory *directory)
+{
+  g_return_val_if_fail (directory != NULL, NULL);
 
-      switch (menu_layout_node_get_type (from_child))
-        {
-        case MENU_LAYOUT_NODE_NAME:
-          menu_layout_node_unlink (from_child); /* delete this */
-          break;
+  if (!directory->directory_entry)
+    return NULL;
 
-        default:
-          menu_layout_node_steal (from_child);
-          menu_layout_node_insert_after (insert_after, from_child);
-          menu_layout_node_unref (from_child);
+  return desktop_entry_get_path (directory->directory_entry);
+}
 
-          insert_after = from_child;
-          break;
-        }
+const char *
+gde2menu_tree_directory_get_menu_id (Gde2MenuTreeDirectory *directory)
+{
+  g_return_val_if_fail (directory != NULL, NULL);
 
-      from_child = next;
-    }
+  return directory->name;
 }
 
-static gboolean
-load_merge_file (Gde2MenuTree      *tree,
-		 GHashTable     *loaded_menu_files,
-                 const char     *filename,
-                 gboolean        is_canonical,
-		 gboolean        add_monitor,
-                 MenuLayoutNode *where)
+static void
+gde2menu_tree_directory_set_tree (Gde2MenuTreeDirectory *directory,
+			       Gde2MenuTree          *tree)
 {
-  MenuLayoutNode *to_merge;
-  const char     *canonical;
-  char           *freeme;
-  gboolean        retval;
-
-  freeme = NULL;
-  retval = FALSE;
-
-  if (!is_canonical)
-    {
-      canonical = freeme = menu_canonicalize_file_name (filename, FALSE);
-      if (canonical == NULL)
-        {
-	  if (add_monitor)
-	    gde2menu_tree_add_menu_file_monitor (tree,
-					     filename,
-					     MENU_FILE_MONITOR_NONEXISTENT_FILE);
-
-          menu_verbose ("Failed to canonicalize merge file path \"%s\": %s\n",
-                        filename, g_strerror (errno));
-	  goto out;
-        }
-    }
-  else
-    {
-      canonical = filename;
-    }
-
-  if (g_hash_table_lookup (loaded_menu_files, canonical) != NULL)
-    {
-      g_warning ("Not loading \"%s\": recursive loop detected in .menu files",
-		 canonical);
-      retval = TRUE;
-      goto out;
-    }
+  Gde2MenuTreeDirectoryRoot *root;
 
-  menu_verbose ("Merging file \"%s\"\n", canonical);
+  g_assert (directory != NULL);
+  g_assert (directory->is_root);
 
-  to_merge = menu_layout_load (canonical, NULL, NULL);
-  if (to_merge == NULL)
-    {
-      menu_verbose ("No menu for file \"%s\" found when merging\n",
-                    canonical);
-      goto out;
-    }
+  root = (Gde2MenuTreeDirectoryRoot *) directory;
 
-  retval = TRUE;
+  root->tree = tree;
+}
 
-  g_hash_table_insert (loaded_menu_files, (char *) canonical, GUINT_TO_POINTER (TRUE));
+Gde2MenuTree *
+gde2menu_tree_directory_get_tree (Gde2MenuTreeDirectory *directory)
+{
+  Gde2MenuTreeDirectoryRoot *root;
 
-  if (add_monitor)
-    gde2menu_tree_add_menu_file_monitor (tree,
-				      canonical,
-				      MENU_FILE_MONITOR_FILE);
+  g_return_val_if_fail (directory != NULL, NULL);
 
-  merge_resolved_children (tree, loaded_menu_files, where, to_merge);
+  while (GDE2MENU_TREE_ITEM (directory)->parent != NULL)
+    directory = GDE2MENU_TREE_DIRECTORY (GDE2MENU_TREE_ITEM (directory)->parent);
 
-  g_hash_table_remove (loaded_menu_files, canonical);
+  if (!directory->is_root)
+    return NULL;
 
-  menu_layout_node_unref (to_merge);
+  root = (Gde2MenuTreeDirectoryRoot *) directory;
 
- out:
-  if (freeme)
-    g_free (freeme);
+  if (root->tree)
+    gde2menu_tree_ref (root->tree);
 
-  return retval;
+  return root->tree;
 }
 
-static gboolean
-load_merge_file_with_config_dir (Gde2MenuTree      *tree,
-				 GHashTable     *loaded_menu_files,
-				 const char     *menu_file,
-				 const char     *config_dir,
-				 MenuLayoutNode *where)
+gboolean
+gde2menu_tree_directory_get_is_nodisplay (Gde2MenuTreeDirectory *directory)
 {
-  char     *merge_file;
-  gboolean  loaded;
+  g_return_val_if_fail (directory != NULL, FALSE);
 
-  loaded = FALSE;
+  return directory->is_nodisplay;
+}
 
-  merge_file = g_build_filename (config_dir, "menus", menu_file, NULL);
+static void
+append_directory_path (Gde2MenuTreeDirectory *directory,
+		       GString            *path)
+{
 
-  if (load_merge_file (tree, loaded_menu_files, merge_file, FALSE, TRUE, where))
-    loaded = TRUE;
+  if (!directory->item.parent)
+    {
+      g_string_append_c (path, G_DIR_SEPARATOR);
+      return;
+    }
 
-  g_free (merge_file);
+  append_directory_path (directory->item.parent, path);
 
-  return loaded;
+  g_string_append (path, directory->name);
+  g_string_append_c (path, G_DIR_SEPARATOR);
 }
 
-static gboolean
-compare_basedir_to_config_dir (const char *canonical_basedir,
-			       const char *config_dir)
+char *
+gde2menu_tree_directory_make_path (Gde2MenuTreeDirectory *directory,
+				Gde2MenuTreeEntry     *entry)
 {
-  char     *dirname;
-  char     *canonical_menus_dir;
-  gboolean  retval;
-
-  menu_verbose ("Checking to see if basedir '%s' is in '%s'\n",
-		canonical_basedir, config_dir);
+  GString *path;
 
-  dirname = g_build_filename (config_dir, "menus", NULL);
+  g_return_val_if_fail (directory != NULL, NULL);
 
-  retval = FALSE;
+  path = g_string_new (NULL);
 
-  canonical_menus_dir = menu_canonicalize_file_name (dirname, FALSE);
-  if (canonical_menus_dir != NULL &&
-      strcmp (canonical_basedir, canonical_menus_dir) == 0)
-    {
-      retval = TRUE;
-    }
+  append_directory_path (directory, path);
 
-  g_free (canonical_menus_dir);
-  g_free (dirname);
+  if (entry != NULL)
+    g_string_append (path,
+		     desktop_entry_get_basename (entry->desktop_entry));
 
-  return retval;
+  return g_string_free (path, FALSE);
 }
 
-static gboolean
-load_parent_merge_file_from_basename (Gde2MenuTree      *tree,
-                                      GHashTable     *loaded_menu_files,
-			              MenuLayoutNode *layout,
-                                      const char     *menu_file,
-                                      const char     *canonical_basedir)
+const char *
+gde2menu_tree_entry_get_name (Gde2MenuTreeEntry *entry)
 {
-  gboolean            found_basedir;
-  const char * const *system_config_dirs;
-  int                 i;
+  g_return_val_if_fail (entry != NULL, NULL);
 
-  /* We're not interested in menu files that are in directories which are not a
-   * parent of the base directory of this menu file */
-  found_basedir = compare_basedir_to_config_dir (canonical_basedir,
-						 g_get_user_config_dir ());
+  return desktop_entry_get_name (entry->desktop_entry);
+}
 
-  system_config_dirs = g_get_system_config_dirs ();
+const char *
+gde2menu_tree_entry_get_generic_name (Gde2MenuTreeEntry *entry)
+{
+  g_return_val_if_fail (entry != NULL, NULL);
 
-  i = 0;
-  while (system_config_dirs[i] != NULL)
-    {
-      if (!found_basedir)
-	{
-	  found_basedir = compare_basedir_to_config_dir (canonical_basedir,
-							 system_config_dirs[i]);
-	}
-      else
-	{
-	  menu_verbose ("Looking for parent menu file '%s' in '%s'\n",
-			menu_file, system_config_dirs[i]);
+  return desktop_entry_get_generic_name (entry->desktop_entry);
+}
 
-	  if (load_merge_file_with_config_dir (tree,
-					       loaded_menu_files,
-					       menu_file,
-					       system_config_dirs[i],
-					       layout))
-	    {
-	      break;
-	    }
-	}
+const char *
+gde2menu_tree_entry_get_display_name (Gde2MenuTreeEntry *entry)
+{
+  const char *display_name;
 
-      ++i;
-    }
+  g_return_val_if_fail (entry != NULL, NULL);
 
-  return system_config_dirs[i] != NULL;
+  display_name = desktop_entry_get_full_name (entry->desktop_entry);
+  if (!display_name || display_name[0] == '\0')
+    display_name = desktop_entry_get_name (entry->desktop_entry);
+
+  return display_name;
 }
 
-static gboolean load_parent_merge_file(Gde2MenuTree* tree, GHashTable* loaded_menu_files, MenuLayoutNode* layout)
+const char *
+gde2menu_tree_entry_get_comment (Gde2MenuTreeEntry *entry)
 {
-	MenuLayoutNode* root;
-	const char* basedir;
-	const char* menu_name;
-	char* canonical_basedir;
-	char* menu_file;
-	gboolean found;
+  g_return_val_if_fail (entry != NULL, NULL);
 
-	root = menu_layout_node_get_root(layout);
+  return desktop_entry_get_comment (entry->desktop_entry);
+}
 
-	basedir   = menu_layout_node_root_get_basedir(root);
-	menu_name = menu_layout_node_root_get_name(root);
+const char* gde2menu_tree_entry_get_icon(Gde2MenuTreeEntry *entry)
+{
+	g_return_val_if_fail (entry != NULL, NULL);
 
-	canonical_basedir = menu_canonicalize_file_name(basedir, FALSE);
+	return desktop_entry_get_icon(entry->desktop_entry);
+}
 
-	if (canonical_basedir == NULL)
-	{
-		menu_verbose("Menu basedir '%s' no longer exists, not merging parent\n", basedir);
-		return FALSE;
-	}
+const char* gde2menu_tree_entry_get_exec(Gde2MenuTreeEntry* entry)
+{
+	g_return_val_if_fail(entry != NULL, NULL);
 
-	found = FALSE;
-	menu_file = g_strconcat(menu_name, ".menu", NULL);
+	return desktop_entry_get_exec(entry->desktop_entry);
+}
 
-	if (strcmp(menu_file, "gde2-applications.menu") == 0 && g_getenv("XDG_MENU_PREFIX"))
-	{
-		char* prefixed_basename;
-		prefixed_basename = g_strdup_printf("%s%s", g_getenv("XDG_MENU_PREFIX"), menu_file);
-		found = load_parent_merge_file_from_basename(tree, loaded_menu_files, layout, prefixed_basename, canonical_basedir);
-		g_free(prefixed_basename);
-	}
+gboolean gde2menu_tree_entry_get_launch_in_terminal(Gde2MenuTreeEntry* entry)
+{
+  g_return_val_if_fail(entry != NULL, FALSE);
 
-	if (!found)
-	{
-		found = load_parent_merge_file_from_basename(tree, loaded_menu_files, layout, menu_file, canonical_basedir);
-	}
+  return desktop_entry_get_launch_in_terminal(entry->desktop_entry);
+}
 
-	g_free(menu_file);
-	g_free(canonical_basedir);
+const char* gde2menu_tree_entry_get_desktop_file_path(Gde2MenuTreeEntry* entry)
+{
+	g_return_val_if_fail(entry != NULL, NULL);
 
-	return found;
+	return desktop_entry_get_path(entry->desktop_entry);
 }
 
-static void
-load_merge_dir (Gde2MenuTree      *tree,
-		GHashTable     *loaded_menu_files,
-                const char     *dirname,
-                MenuLayoutNode *where)
+const char* gde2menu_tree_entry_get_desktop_file_id(Gde2MenuTreeEntry* entry)
 {
-  GDir       *dir;
-  const char *menu_file;
+	g_return_val_if_fail(entry != NULL, NULL);
 
-  menu_verbose ("Loading merge dir \"%s\"\n", dirname);
+	return entry->desktop_file_id;
+}
 
-  gde2menu_tree_add_menu_file_monitor (tree,
-				    dirname,
-				    MENU_FILE_MONITOR_DIRECTORY);
+gboolean gde2menu_tree_entry_get_is_excluded(Gde2MenuTreeEntry* entry)
+{
+	g_return_val_if_fail(entry != NULL, FALSE);
 
-  if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
-    return;
-
-  while ((menu_file = g_dir_read_name (dir)))
-    {
-      if (g_str_has_suffix (menu_file, ".menu"))
-        {
-          char *full_path;
+	return entry->is_excluded;
+}
 
-          full_path = g_build_filename (dirname, menu_file, NULL);
+gboolean gde2menu_tree_entry_get_is_nodisplay(Gde2MenuTreeEntry* entry)
+{
+	g_return_val_if_fail(entry != NULL, FALSE);
 
-          load_merge_file (tree, loaded_menu_files, full_path, TRUE, FALSE, where);
+	return entry->is_nodisplay;
+}
 
-          g_free (full_path);
-        }
-    }
+Gde2MenuTreeDirectory* gde2menu_tree_header_get_directory(Gde2MenuTreeHeader* header)
+{
+	g_return_val_if_fail (header != NULL, NULL);
 
-  g_dir_close (dir);
+	return gde2menu_tree_item_ref(header->directory);
 }
 
-static void
-load_merge_dir_with_config_dir (Gde2MenuTree      *tree,
-				GHashTable     *loaded_menu_files,
-                                const char     *config_dir,
-                                const char     *dirname,
-                                MenuLayoutNode *where)
+Gde2MenuTreeDirectory* gde2menu_tree_alias_get_directory(Gde2MenuTreeAlias* alias)
 {
-  char *path;
+	g_return_val_if_fail (alias != NULL, NULL);
 
-  path = g_build_filename (config_dir, "menus", dirname, NULL);
+	return gde2menu_tree_item_ref(alias->directory);
+}
 
-  load_merge_dir (tree, loaded_menu_files, path, where);
+Gde2MenuTreeItem *
+gde2menu_tree_alias_get_item (Gde2MenuTreeAlias *alias)
+{
+  g_return_val_if_fail (alias != NULL, NULL);
 
-  g_free (path);
+  return gde2menu_tree_item_ref (alias->aliased_item);
 }
 
-static void
-resolve_merge_file (Gde2MenuTree      *tree,
-		    GHashTable     *loaded_menu_files,
-                    MenuLayoutNode *layout)
+static Gde2MenuTreeArena *
+gde2menu_tree_arena_new (void)
 {
-  char *filename;
-
-  if (menu_layout_node_merge_file_get_type (layout) == MENU_MERGE_FILE_TYPE_PARENT)
-    {
-      if (load_parent_merge_file (tree, loaded_menu_files, layout))
-        return;
-    }
+  Gde2MenuTreeArena *arena;
 
-  filename = menu_layout_node_get_content_as_path (layout);
-  if (filename == NULL)
-    {
-      menu_verbose ("didn't get node content as a path, not merging file\n");
-    }
-  else
-    {
-      load_merge_file (tree, loaded_menu_files, filename, FALSE, TRUE, layout);
+  arena = g_new0 (Gde2MenuTreeArena, 1);
 
-      g_free (filename);
-    }
+  arena->blocks   = NULL;
+  arena->next     = NULL;
+  arena->left     = 0;
+  arena->refcount = 1;
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+  return arena;
 }
 
-static void
-resolve_merge_dir (Gde2MenuTree      *tree,
-		   GHashTable     *loaded_menu_files,
-                   MenuLayoutNode *layout)
+static Gde2MenuTreeArena *
+gde2menu_tree_arena_ref (Gde2MenuTreeArena *arena)
 {
-  char *path;
-
-  path = menu_layout_node_get_content_as_path (layout);
-  if (path == NULL)
-    {
-      menu_verbose ("didn't get layout node content as a path, not merging dir\n");
-    }
-  else
-    {
-      load_merge_dir (tree, loaded_menu_files, path, layout);
+  g_assert (arena->refcount > 0);
 
-      g_free (path);
-    }
+  g_atomic_int_inc (&arena->refcount);
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+  return arena;
 }
 
-static MenuLayoutNode *
-add_app_dir (Gde2MenuTree      *tree,
-             MenuLayoutNode *before,
-             const char     *data_dir)
+static void
+gde2menu_tree_arena_unref (Gde2MenuTreeArena *arena)
 {
-  MenuLayoutNode *tmp;
-  char           *dirname;
+  g_assert (arena->refcount > 0);
 
-  tmp = menu_layout_node_new (MENU_LAYOUT_NODE_APP_DIR);
-  dirname = g_build_filename (data_dir, "applications", NULL);
-  menu_layout_node_set_content (tmp, dirname);
-  menu_layout_node_insert_before (before, tmp);
-  menu_layout_node_unref (before);
+  if (g_atomic_int_dec_and_test (&arena->refcount))
+    {
+      menu_verbose ("Releasing arena with %u blocks\n",
+		    g_slist_length (arena->blocks));
 
-  menu_verbose ("Adding <AppDir>%s</AppDir> in <DefaultAppDirs/>\n",
-                dirname);
+      g_slist_foreach (arena->blocks, (GFunc) g_free, NULL);
+      g_slist_free (arena->blocks);
+      arena->blocks = NULL;
 
-  g_free (dirname);
+      if (arena->mapped != NULL)
+	g_mapped_file_unref (arena->mapped);
+      arena->mapped = NULL;
 
-  return tmp;
+      g_free (arena);
+    }
 }
 
-static void
-resolve_default_app_dirs (Gde2MenuTree      *tree,
-                          MenuLayoutNode *layout)
+/* memory is zeroed, like with g_new0() */
+static gpointer
+gde2menu_tree_arena_alloc (Gde2MenuTreeArena *arena,
+			   gsize              size)
 {
-  MenuLayoutNode     *before;
-  const char * const *system_data_dirs;
-  int                 i;
+  gpointer retval;
 
-  system_data_dirs = g_get_system_data_dirs ();
-
-  before = add_app_dir (tree,
-			menu_layout_node_ref (layout),
-			g_get_user_data_dir ());
+  size = (size + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
 
-  i = 0;
-  while (system_data_dirs[i] != NULL)
+  if (size > arena->left)
     {
-      before = add_app_dir (tree, before, system_data_dirs[i]);
+      /* don't waste the end of the current block for a big allocation */
+      if (size > GDE2MENU_TREE_ARENA_BLOCK_SIZE / 4)
+	{
+	  retval = g_malloc0 (size);
+	  arena->blocks = g_slist_prepend (arena->blocks, retval);
 
-      ++i;
+	  return retval;
+	}
+
+      arena->next = g_malloc0 (GDE2MENU_TREE_ARENA_BLOCK_SIZE);
+      arena->left = GDE2MENU_TREE_ARENA_BLOCK_SIZE;
+      arena->blocks = g_slist_prepend (arena->blocks, arena->next);
     }
 
-  menu_layout_node_unref (before);
+  retval = arena->next;
+  arena->next += size;
+  arena->left -= size;
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+  return retval;
 }
 
-static MenuLayoutNode* add_directory_dir(Gde2MenuTree* tree, MenuLayoutNode* before, const char* data_dir)
+static char *
+gde2menu_tree_arena_strdup (Gde2MenuTreeArena *arena,
+			    const char        *str)
 {
-	MenuLayoutNode* tmp;
-	char* dirname;
+  char  *retval;
+  gsize  len;
 
-	tmp = menu_layout_node_new(MENU_LAYOUT_NODE_DIRECTORY_DIR);
-	dirname = g_build_filename(data_dir, "desktop-directories", NULL);
-	menu_layout_node_set_content(tmp, dirname);
-	menu_layout_node_insert_before(before, tmp);
-	menu_layout_node_unref(before);
+  if (str == NULL)
+    return NULL;
 
-	menu_verbose("Adding <DirectoryDir>%s</DirectoryDir> in <DefaultDirectoryDirs/>\n", dirname);
+  /* the strings of a snapshot are used in place */
+  if (arena->mapped != NULL &&
+      str >= g_mapped_file_get_contents (arena->mapped) &&
+      str < g_mapped_file_get_contents (arena->mapped) + g_mapped_file_get_length (arena->mapped))
+    return (char *) str;
 
-	g_free(dirname);
+  len = strlen (str) + 1;
+  retval = gde2menu_tree_arena_alloc (arena, len);
+  memcpy (retval, str, len);
 
-	return tmp;
+  return retval;
 }
 
-static void
-resolve_default_directory_dirs (Gde2MenuTree      *tree,
-                                MenuLayoutNode *layout)
+static gpointer
+gde2menu_tree_item_alloc (Gde2MenuTreeArena *arena,
+			  gsize              size)
 {
-  MenuLayoutNode     *before;
-  const char * const *system_data_dirs;
-  int                 i;
-
-  system_data_dirs = g_get_system_data_dirs ();
-
-  before = add_directory_dir (tree,
-			      menu_layout_node_ref (layout),
-			      g_get_user_data_dir ());
-
-  i = 0;
-  while (system_data_dirs[i] != NULL)
-    {
-		/* Parche para tomar las carpetas /gde2/ */
-		char* path = g_build_filename(system_data_dirs[i], "gde2", NULL);
-		before = add_directory_dir(tree, before, path);
-		g_free(path);
-		/* /fin parche */
-      before = add_directory_dir (tree, before, system_data_dirs[i]);
-
-      ++i;
-    }
+  Gde2MenuTreeItem *item;
 
-  menu_layout_node_unref (before);
+  item = gde2menu_tree_arena_alloc (arena, size);
+  item->arena = gde2menu_tree_arena_ref (arena);
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+  return item;
 }
 
-static void
-resolve_default_merge_dirs (Gde2MenuTree      *tree,
-			    GHashTable     *loaded_menu_files,
-                            MenuLayoutNode *layout)
+static Gde2MenuTreeDirectory *
+gde2menu_tree_directory_new (Gde2MenuTreeArena     *arena,
+			  Gde2MenuTreeDirectory *parent,
+			  const char         *name,
+			  gboolean            is_root)
 {
-  MenuLayoutNode     *root;
-  const char         *menu_name;
-  char               *merge_name;
-  const char * const *system_config_dirs;
-  int                 i;
+  Gde2MenuTreeDirectory *retval;
 
-  root = menu_layout_node_get_root (layout);
-  menu_name = menu_layout_node_root_get_name (root);
+  if (!is_root)
+    {
+      retval = gde2menu_tree_item_alloc (arena, sizeof (Gde2MenuTreeDirectory));
+    }
+  else
+    {
+      Gde2MenuTreeDirectoryRoot *root;
 
-  merge_name = g_strconcat (menu_name, "-merged", NULL);
+      root = gde2menu_tree_item_alloc (arena, sizeof (Gde2MenuTreeDirectoryRoot));
 
-  system_config_dirs = g_get_system_config_dirs ();
+      retval = GDE2MENU_TREE_DIRECTORY (root);
 
-  /* Merge in reverse order */
-  i = 0;
-  while (system_config_dirs[i] != NULL) i++;
-  while (i > 0)
-    {
-      i--;
-      load_merge_dir_with_config_dir (tree,
-				      loaded_menu_files,
-                                      system_config_dirs[i],
-                                      merge_name,
-                                      layout);
+      retval->is_root = TRUE;
     }
 
-  load_merge_dir_with_config_dir (tree,
-				  loaded_menu_files,
-                                  g_get_user_config_dir (),
-                                  merge_name,
-                                  layout);
 
-  g_free (merge_name);
+  retval->item.type     = GDE2MENU_TREE_ITEM_DIRECTORY;
+  retval->item.parent   = parent;
+  retval->item.refcount = 1;
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+  retval->name                = gde2menu_tree_arena_strdup (arena, name);
+  retval->directory_entry     = NULL;
+  retval->entries             = NULL;
+  retval->subdirs             = NULL;
+  retval->default_layout_info = NULL;
+  retval->layout_info         = NULL;
+  retval->pending_contents    = NULL;
+  retval->contents            = NULL;
+  retval->n_contents          = 0;
+  retval->sort_runs           = NULL;
+  retval->only_unallocated    = FALSE;
+  retval->is_nodisplay        = FALSE;
+  retval->layout_pending_separator = FALSE;
+  retval->preprocessed        = FALSE;
+  retval->will_inline_header  = G_MAXUINT16;
+
+  retval->default_layout_values.mask          = MENU_LAYOUT_VALUES_NONE;
+  retval->default_layout_values.show_empty    = FALSE;
+  retval->default_layout_values.inline_menus  = FALSE;
+  retval->default_layout_values.inline_limit  = 4;
+  retval->default_layout_values.inline_header = FALSE;
+  retval->default_layout_values.inline_alias  = FALSE;
+
+  return retval;
 }
 
 static void
-add_filename_include (const char     *desktop_file_id,
-                      DesktopEntry   *entry,
-                      MenuLayoutNode *include)
+gde2menu_tree_directory_free_contents (Gde2MenuTreeDirectory *directory)
 {
-  if (!desktop_entry_has_categories (entry))
-    {
-      MenuLayoutNode *node;
+  guint i;
 
-      node = menu_layout_node_new (MENU_LAYOUT_NODE_FILENAME);
-      menu_layout_node_set_content (node, desktop_file_id);
-
-      menu_layout_node_append_child (include, node);
-      menu_layout_node_unref (node);
+  if (directory->pending_contents != NULL)
+    {
+      g_ptr_array_foreach (directory->pending_contents,
+			   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
+			   NULL);
+      g_ptr_array_free (directory->pending_contents, TRUE);
+      directory->pending_contents = NULL;
     }
+
+  for (i = 0; i < directory->n_contents; i++)
+    gde2menu_tree_item_unref_and_unset_parent (directory->contents[i]);
+  g_free (directory->contents);
+  directory->contents = NULL;
+  directory->n_contents = 0;
 }
 
 static void
-is_dot_directory (const char   *basename,
-		  DesktopEntry *entry,
-		  gboolean     *has_dot_directory)
+gde2menu_tree_directory_finalize (Gde2MenuTreeDirectory *directory)
 {
-  if (!strcmp (basename, ".directory"))
-    *has_dot_directory = TRUE;
-}
+  g_assert (directory->item.refcount == 0);
 
-static gboolean
-add_menu_for_legacy_dir (MenuLayoutNode *parent,
-                         const char     *legacy_dir,
-                	 const char     *relative_path,
-                         const char     *legacy_prefix,
-                         const char     *menu_name)
-{
-  EntryDirectory  *ed;
-  DesktopEntrySet *desktop_entries;
-  DesktopEntrySet *directory_entries;
-  GSList          *subdirs;
-  gboolean         menu_added;
-  gboolean         has_dot_directory;
+  gde2menu_tree_directory_free_contents (directory);
 
-  ed = entry_directory_new_legacy (DESKTOP_ENTRY_INVALID, legacy_dir, legacy_prefix);
-  if (!ed)
-    return FALSE;
+  g_slist_foreach (directory->sort_runs, (GFunc) g_free, NULL);
+  g_slist_free (directory->sort_runs);
+  directory->sort_runs = NULL;
 
-  subdirs = NULL;
-  desktop_entries   = desktop_entry_set_new ();
-  directory_entries = desktop_entry_set_new ();
+  g_slist_foreach (directory->default_layout_info,
+		   (GFunc) menu_layout_node_unref,
+		   NULL);
+  g_slist_free (directory->default_layout_info);
+  directory->default_layout_info = NULL;
 
-  entry_directory_get_flat_contents (ed,
-                                     desktop_entries,
-                                     directory_entries,
-                                     &subdirs);
-  entry_directory_unref (ed);
+  g_slist_foreach (directory->layout_info,
+		   (GFunc) menu_layout_node_unref,
+		   NULL);
+  g_slist_free (directory->layout_info);
+  directory->layout_info = NULL;
 
-  has_dot_directory = FALSE;
-  desktop_entry_set_foreach (directory_entries,
-			     (DesktopEntrySetForeachFunc) is_dot_directory,
-			     &has_dot_directory);
-  desktop_entry_set_unref (directory_entries);
+  g_slist_foreach (directory->subdirs,
+		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
+		   NULL);
+  g_slist_free (directory->subdirs);
+  directory->subdirs = NULL;
 
-  menu_added = FALSE;
-  if (desktop_entry_set_get_count (desktop_entries) > 0 || subdirs)
-    {
-      MenuLayoutNode *menu;
-      MenuLayoutNode *node;
-      GString        *subdir_path;
-      GString        *subdir_relative;
-      GSList         *tmp;
-      int             legacy_dir_len;
-      int             relative_path_len;
+  g_slist_foreach (directory->entries,
+		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
+		   NULL);
+  g_slist_free (directory->entries);
+  directory->entries = NULL;
 
-      menu = menu_layout_node_new (MENU_LAYOUT_NODE_MENU);
-      menu_layout_node_append_child (parent, menu);
+  if (directory->directory_entry)
+    desktop_entry_unref (directory->directory_entry);
+  directory->directory_entry = NULL;
 
-      menu_added = TRUE;
+  /* the name is in the arena */
+  directory->name = NULL;
+}
 
-      g_assert (menu_name != NULL);
+static Gde2MenuTreeSeparator *
+gde2menu_tree_separator_new (Gde2MenuTreeDirectory *parent)
+{
+  Gde2MenuTreeSeparator *retval;
 
-      node = menu_layout_node_new (MENU_LAYOUT_NODE_NAME);
-      menu_layout_node_set_content (node, menu_name);
-      menu_layout_node_append_child (menu, node);
-      menu_layout_node_unref (node);
+  retval = gde2menu_tree_item_alloc (parent->item.arena,
+                                     sizeof (Gde2MenuTreeSeparator));
 
-      if (has_dot_directory)
-	{
-	  node = menu_layout_node_new (MENU_LAYOUT_NODE_DIRECTORY);
-	  if (relative_path != NULL)
-	    {
-	      char *directory_entry_path;
+  retval->item.type     = GDE2MENU_TREE_ITEM_SEPARATOR;
+  retval->item.parent   = parent;
+  retval->item.refcount = 1;
 
-	      directory_entry_path = g_strdup_printf ("%s/.directory", relative_path);
-	      menu_layout_node_set_content (node, directory_entry_path);
-	      g_free (directory_entry_path);
-	    }
-	  else
-	    {
-	      menu_layout_node_set_content (node, ".directory");
-	    }
-	  menu_layout_node_append_child (menu, node);
-	  menu_layout_node_unref (node);
-	}
+  return retval;
+}
 
-      if (desktop_entry_set_get_count (desktop_entries) > 0)
-	{
-	  MenuLayoutNode *include;
+static Gde2MenuTreeHeader *
+gde2menu_tree_header_new (Gde2MenuTreeDirectory *parent,
+		       Gde2MenuTreeDirectory *directory)
+{
+  Gde2MenuTreeHeader *retval;
 
-	  include = menu_layout_node_new (MENU_LAYOUT_NODE_INCLUDE);
-	  menu_layout_node_append_child (menu, include);
+  retval = gde2menu_tree_item_alloc (parent->item.arena,
+                                     sizeof (Gde2MenuTreeHeader));
 
-	  desktop_entry_set_foreach (desktop_entries,
-				     (DesktopEntrySetForeachFunc) add_filename_include,
-				     include);
+  retval->item.type     = GDE2MENU_TREE_ITEM_HEADER;
+  retval->item.parent   = parent;
+  retval->item.refcount = 1;
 
-	  menu_layout_node_unref (include);
-	}
+  retval->directory = gde2menu_tree_item_ref (directory);
+  retval->n_inlined = 0;
 
-      subdir_path = g_string_new (legacy_dir);
-      legacy_dir_len = strlen (legacy_dir);
+  gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (retval->directory), NULL);
 
-      subdir_relative = g_string_new (relative_path);
-      relative_path_len = relative_path ? strlen (relative_path) : 0;
+  return retval;
+}
 
-      tmp = subdirs;
-      while (tmp != NULL)
-        {
-          const char *subdir = tmp->data;
+static void
+gde2menu_tree_header_finalize (Gde2MenuTreeHeader *header)
+{
+  g_assert (header->item.refcount == 0);
 
-          g_string_append_c (subdir_path, G_DIR_SEPARATOR);
-          g_string_append (subdir_path, subdir);
+  if (header->directory != NULL)
+    gde2menu_tree_item_unref (header->directory);
+  header->directory = NULL;
+}
 
-	  if (relative_path_len)
-	    {
-	      g_string_append_c (subdir_relative, G_DIR_SEPARATOR);
-	    }
-          g_string_append (subdir_relative, subdir);
+static Gde2MenuTreeAlias *
+gde2menu_tree_alias_new (Gde2MenuTreeDirectory *parent,
+		      Gde2MenuTreeDirectory *directory,
+		      Gde2MenuTreeItem      *item)
+{
+  Gde2MenuTreeAlias *retval;
 
-          add_menu_for_legacy_dir (menu,
-                                   subdir_path->str,
-				   subdir_relative->str,
-                                   legacy_prefix,
-                                   subdir);
+  retval = gde2menu_tree_item_alloc (parent->item.arena,
+                                     sizeof (Gde2MenuTreeAlias));
 
-          g_string_truncate (subdir_relative, relative_path_len);
-          g_string_truncate (subdir_path, legacy_dir_len);
+  retval->item.type     = GDE2MENU_TREE_ITEM_ALIAS;
+  retval->item.parent   = parent;
+  retval->item.refcount = 1;
 
-          tmp = tmp->next;
-        }
+  retval->directory    = gde2menu_tree_item_ref (directory);
+  if (item->type != GDE2MENU_TREE_ITEM_ALIAS)
+    retval->aliased_item = gde2menu_tree_item_ref (item);
+  else
+    retval->aliased_item = gde2menu_tree_item_ref (GDE2MENU_TREE_ALIAS (item)->aliased_item);
 
-      g_string_free (subdir_path, TRUE);
-      g_string_free (subdir_relative, TRUE);
+  gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (retval->directory), NULL);
+  gde2menu_tree_item_set_parent (retval->aliased_item, NULL);
 
-      menu_layout_node_unref (menu);
-    }
+  return retval;
+}
 
-  desktop_entry_set_unref (desktop_entries);
+static void
+gde2menu_tree_alias_finalize (Gde2MenuTreeAlias *alias)
+{
+  g_assert (alias->item.refcount == 0);
 
-  g_slist_foreach (subdirs, (GFunc) g_free, NULL);
-  g_slist_free (subdirs);
+  if (alias->directory != NULL)
+    gde2menu_tree_item_unref (alias->directory);
+  alias->directory = NULL;
 
-  return menu_added;
+  if (alias->aliased_item != NULL)
+    gde2menu_tree_item_unref (alias->aliased_item);
+  alias->aliased_item = NULL;
 }
 
-static void
-resolve_legacy_dir (Gde2MenuTree      *tree,
-		    GHashTable     *loaded_menu_files,
-                    MenuLayoutNode *legacy)
+static Gde2MenuTreeEntry *
+gde2menu_tree_entry_new (Gde2MenuTreeDirectory *parent,
+		      DesktopEntry       *desktop_entry,
+		      const char         *desktop_file_id,
+		      gboolean            is_excluded,
+                      gboolean            is_nodisplay)
 {
-  MenuLayoutNode *to_merge;
-  MenuLayoutNode *menu;
+  Gde2MenuTreeEntry *retval;
 
-  to_merge = menu_layout_node_new (MENU_LAYOUT_NODE_ROOT);
+  retval = gde2menu_tree_item_alloc (parent->item.arena,
+                                     sizeof (Gde2MenuTreeEntry));
 
-  menu = menu_layout_node_get_parent (legacy);
-  g_assert (menu_layout_node_get_type (menu) == MENU_LAYOUT_NODE_MENU);
+  retval->item.type     = GDE2MENU_TREE_ITEM_ENTRY;
+  retval->item.parent   = parent;
+  retval->item.refcount = 1;
 
-  if (add_menu_for_legacy_dir (to_merge,
-                               menu_layout_node_get_content (legacy),
-			       NULL,
-                               menu_layout_node_legacy_dir_get_prefix (legacy),
-                               menu_layout_node_menu_get_name (menu)))
-    {
-      merge_resolved_children (tree, loaded_menu_files, legacy, to_merge);
-    }
+  retval->desktop_entry   = desktop_entry_ref (desktop_entry);
+  retval->desktop_file_id = gde2menu_tree_arena_strdup (parent->item.arena,
+                                                        desktop_file_id);
+  retval->is_excluded     = is_excluded != FALSE;
+  retval->is_nodisplay    = is_nodisplay != FALSE;
 
-  menu_layout_node_unref (to_merge);
+  return retval;
 }
 
-static MenuLayoutNode *
-add_legacy_dir (Gde2MenuTree      *tree,
-		GHashTable     *loaded_menu_files,
-                MenuLayoutNode *before,
-                const char     *data_dir)
+static void
+gde2menu_tree_entry_finalize (Gde2MenuTreeEntry *entry)
 {
-  MenuLayoutNode *legacy;
-  char           *dirname;
-
-  dirname = g_build_filename (data_dir, "applnk", NULL);
+  g_assert (entry->item.refcount == 0);
 
-  legacy = menu_layout_node_new (MENU_LAYOUT_NODE_LEGACY_DIR);
-  menu_layout_node_set_content (legacy, dirname);
-  menu_layout_node_legacy_dir_set_prefix (legacy, "kde");
-  menu_layout_node_insert_before (before, legacy);
-  menu_layout_node_unref (before);
+  /* the desktop file id is in the arena */
+  entry->desktop_file_id = NULL;
 
-  menu_verbose ("Adding <LegacyDir>%s</LegacyDir> in <KDELegacyDirs/>\n",
-                dirname);
+  if (entry->desktop_entry)
+    desktop_entry_unref (entry->desktop_entry);
+  entry->desktop_entry = NULL;
+}
 
-  resolve_legacy_dir (tree, loaded_menu_files, legacy);
+static int
+gde2menu_tree_entry_compare_by_id (Gde2MenuTreeItem *a,
+				Gde2MenuTreeItem *b)
+{
+  if (a->type == GDE2MENU_TREE_ITEM_ALIAS)
+    a = GDE2MENU_TREE_ALIAS (a)->aliased_item;
 
-  g_free (dirname);
+  if (b->type == GDE2MENU_TREE_ITEM_ALIAS)
+    b = GDE2MENU_TREE_ALIAS (b)->aliased_item;
 
-  return legacy;
+  return strcmp (GDE2MENU_TREE_ENTRY (a)->desktop_file_id,
+                 GDE2MENU_TREE_ENTRY (b)->desktop_file_id);
 }
 
-static void
-resolve_kde_legacy_dirs (Gde2MenuTree      *tree,
-			 GHashTable     *loaded_menu_files,
-                         MenuLayoutNode *layout)
+gpointer gde2menu_tree_item_ref(gpointer itemp)
 {
-  MenuLayoutNode     *before;
-  const char * const *system_data_dirs;
-  int                 i;
-
-  system_data_dirs = g_get_system_data_dirs ();
+	Gde2MenuTreeItem* item = (Gde2MenuTreeItem*) itemp;
 
-  before = add_legacy_dir (tree,
-			   loaded_menu_files,
-			   menu_layout_node_ref (layout),
-			   g_get_user_data_dir ());
-
-  i = 0;
-  while (system_data_dirs[i] != NULL)
-    {
-      before = add_legacy_dir (tree, loaded_menu_files, before, system_data_dirs[i]);
-
-      ++i;
-    }
+	g_return_val_if_fail(item != NULL, NULL);
+	g_return_val_if_fail(item->refcount > 0, NULL);
 
-  menu_layout_node_unref (before);
+	g_atomic_int_inc(&item->refcount);
 
-  /* remove the now-replaced node */
-  menu_layout_node_unlink (layout);
+	return item;
 }
 
-static void
-gde2menu_tree_resolve_files (Gde2MenuTree      *tree,
-			  GHashTable     *loaded_menu_files,
-			  MenuLayoutNode *layout)
+void
+gde2menu_tree_item_unref (gpointer itemp)
 {
-  MenuLayoutNode *child;
-
-  menu_verbose ("Resolving files in: ");
-  menu_debug_print_layout (layout, TRUE);
+  Gde2MenuTreeItem *item;
 
-  switch (menu_layout_node_get_type (layout))
-    {
-    case MENU_LAYOUT_NODE_MERGE_FILE:
-      resolve_merge_file (tree, loaded_menu_files, layout);
-      break;
+  item = (Gde2MenuTreeItem *) itemp;
 
-    case MENU_LAYOUT_NODE_MERGE_DIR:
-      resolve_merge_dir (tree, loaded_menu_files, layout);
-      break;
+  g_return_if_fail (item != NULL);
+  g_return_if_fail (item->refcount > 0);
 
-    case MENU_LAYOUT_NODE_DEFAULT_APP_DIRS:
-      resolve_default_app_dirs (tree, layout);
-      break;
+  if (g_atomic_int_dec_and_test (&item->refcount))
+    {
+      switch (item->type)
+	{
+	case GDE2MENU_TREE_ITEM_DIRECTORY:
+	  gde2menu_tree_directory_finalize (GDE2MENU_TREE_DIRECTORY (item));
+	  break;
 
-    case MENU_LAYOUT_NODE_DEFAULT_DIRECTORY_DIRS:
-      resolve_default_directory_dirs (tree, layout);
-      break;
+	case GDE2MENU_TREE_ITEM_ENTRY:
+	  gde2menu_tree_entry_finalize (GDE2MENU_TREE_ENTRY (item));
+	  break;
 
-    case MENU_LAYOUT_NODE_DEFAULT_MERGE_DIRS:
-      resolve_default_merge_dirs (tree, loaded_menu_files, layout);
-      break;
+	case GDE2MENU_TREE_ITEM_SEPARATOR:
+	  break;
 
-    case MENU_LAYOUT_NODE_LEGACY_DIR:
-      resolve_legacy_dir (tree, loaded_menu_files, layout);
-      break;
+	case GDE2MENU_TREE_ITEM_HEADER:
+	  gde2menu_tree_header_finalize (GDE2MENU_TREE_HEADER (item));
+	  break;
 
-    case MENU_LAYOUT_NODE_KDE_LEGACY_DIRS:
-      resolve_kde_legacy_dirs (tree, loaded_menu_files, layout);
-      break;
+	case GDE2MENU_TREE_ITEM_ALIAS:
+	  gde2menu_tree_alias_finalize (GDE2MENU_TREE_ALIAS (item));
+	  break;
 
-    case MENU_LAYOUT_NODE_PASSTHROUGH:
-      /* Just get rid of these, we don't need the memory usage */
-      menu_layout_node_unlink (layout);
-      break;
+	default:
+	  g_assert_not_reached ();
+	  break;
+	}
 
-    default:
-      /* Recurse */
-      child = menu_layout_node_get_children (layout);
-      while (child != NULL)
-        {
-          MenuLayoutNode *next = menu_layout_node_get_next (child);
+      if (item->dnotify)
+	item->dnotify (item->user_data);
+      item->user_data = NULL;
+      item->dnotify   = NULL;
 
-          gde2menu_tree_resolve_files (tree, loaded_menu_files, child);
+      item->parent = NULL;
 
-          child = next;
-        }
-      break;
+      gde2menu_tree_arena_unref (item->arena);
     }
 }
 
 static void
-move_children (MenuLayoutNode *from,
-               MenuLayoutNode *to)
+gde2menu_tree_item_unref_and_unset_parent (gpointer itemp)
 {
-  MenuLayoutNode *from_child;
-  MenuLayoutNode *insert_before;
-
-  insert_before = menu_layout_node_get_children (to);
-  from_child    = menu_layout_node_get_children (from);
+  Gde2MenuTreeItem *item;
 
-  while (from_child != NULL)
-    {
-      MenuLayoutNode *next;
+  item = (Gde2MenuTreeItem *) itemp;
 
-      next = menu_layout_node_get_next (from_child);
+  g_return_if_fail (item != NULL);
 
-      menu_layout_node_steal (from_child);
+  gde2menu_tree_item_set_parent (item, NULL);
+  gde2menu_tree_item_unref (item);
+}
 
-      if (menu_layout_node_get_type (from_child) == MENU_LAYOUT_NODE_NAME)
-        {
-          ; /* just drop the Name in the old <Menu> */
-        }
-      else if (insert_before)
-        {
-          menu_layout_node_insert_before (insert_before, from_child);
-          g_assert (menu_layout_node_get_next (from_child) == insert_before);
-        }
-      else
-        {
-          menu_layout_node_append_child (to, from_child);
-        }
+void
+gde2menu_tree_item_set_user_data (Gde2MenuTreeItem  *item,
+			       gpointer        user_data,
+			       GDestroyNotify  dnotify)
+{
+  g_return_if_fail (item != NULL);
 
-      menu_layout_node_unref (from_child);
+  if (item->dnotify != NULL)
+    item->dnotify (item->user_data);
 
-      from_child = next;
-    }
+  item->dnotify   = dnotify;
+  item->user_data = user_data;
 }
 
-static int
-null_safe_strcmp (const char *a,
-                  const char *b)
+gpointer
+gde2menu_tree_item_get_user_data (Gde2MenuTreeItem *item)
 {
-  if (a == NULL && b == NULL)
-    return 0;
-  else if (a == NULL)
-    return -1;
-  else if (b == NULL)
-    return 1;
-  else
-    return strcmp (a, b);
+  g_return_val_if_fail (item != NULL, NULL);
+
+  return item->user_data;
 }
 
-static int
-node_compare_func (const void *a,
-                   const void *b)
+static inline const char *
+gde2menu_tree_item_compare_get_name_helper (Gde2MenuTreeItem    *item,
+					 Gde2MenuTreeSortKey  sort_key)
 {
-  MenuLayoutNode *node_a = (MenuLayoutNode*) a;
-  MenuLayoutNode *node_b = (MenuLayoutNode*) b;
-  MenuLayoutNodeType t_a = menu_layout_node_get_type (node_a);
-  MenuLayoutNodeType t_b = menu_layout_node_get_type (node_b);
+  const char *name;
 
-  if (t_a < t_b)
-    return -1;
-  else if (t_a > t_b)
-    return 1;
-  else
+  name = NULL;
+
+  switch (item->type)
     {
-      const char *c_a = menu_layout_node_get_content (node_a);
-      const char *c_b = menu_layout_node_get_content (node_b);
+    case GDE2MENU_TREE_ITEM_DIRECTORY:
+      if (GDE2MENU_TREE_DIRECTORY (item)->directory_entry)
+	name = desktop_entry_get_name (GDE2MENU_TREE_DIRECTORY (item)->directory_entry);
+      else
+	name = GDE2MENU_TREE_DIRECTORY (item)->name;
+      break;
+
+    case GDE2MENU_TREE_ITEM_ENTRY:
+      switch (sort_key)
+	{
+	case GDE2MENU_TREE_SORT_NAME:
+	  name = desktop_entry_get_name (GDE2MENU_TREE_ENTRY (item)->desktop_entry);
+	  break;
+	case GDE2MENU_TREE_SORT_DISPLAY_NAME:
+	  name = gde2menu_tree_entry_get_display_name (GDE2MENU_TREE_ENTRY (item));
+	  break;
+	default:
+	  g_assert_not_reached ();
+	  break;
+	}
+      break;
+
+    case GDE2MENU_TREE_ITEM_ALIAS:
+      {
+        Gde2MenuTreeItem *dir;
+        dir = GDE2MENU_TREE_ITEM (GDE2MENU_TREE_ALIAS (item)->directory);
+        name = gde2menu_tree_item_compare_get_name_helper (dir, sort_key);
+      }
+      break;
 
-      return null_safe_strcmp (c_a, c_b);
+    case GDE2MENU_TREE_ITEM_SEPARATOR:
+    case GDE2MENU_TREE_ITEM_HEADER:
+    default:
+      g_assert_not_reached ();
+      break;
     }
+
+  return name;
 }
 
 static int
-node_menu_compare_func (const void *a,
-                        const void *b)
+gde2menu_tree_item_compare (Gde2MenuTreeItem *a,
+			 Gde2MenuTreeItem *b,
+			 gpointer       sort_key_p)
 {
-  MenuLayoutNode *node_a = (MenuLayoutNode*) a;
-  MenuLayoutNode *node_b = (MenuLayoutNode*) b;
-  MenuLayoutNode *parent_a = menu_layout_node_get_parent (node_a);
-  MenuLayoutNode *parent_b = menu_layout_node_get_parent (node_b);
+  const char       *name_a;
+  const char       *name_b;
+  Gde2MenuTreeSortKey  sort_key;
 
-  if (parent_a < parent_b)
-    return -1;
-  else if (parent_a > parent_b)
-    return 1;
-  else
-    return null_safe_strcmp (menu_layout_node_menu_get_name (node_a),
-                             menu_layout_node_menu_get_name (node_b));
+  sort_key = GPOINTER_TO_INT (sort_key_p);
+
+  name_a = gde2menu_tree_item_compare_get_name_helper (a, sort_key);
+  name_b = gde2menu_tree_item_compare_get_name_helper (b, sort_key);
+
+  return g_utf8_collate (name_a, name_b);
 }
 
-static void
-gde2menu_tree_strip_duplicate_children (Gde2MenuTree      *tree,
-				     MenuLayoutNode *layout)
+static MenuLayoutNode *
+find_menu_child (MenuLayoutNode *layout)
 {
   MenuLayoutNode *child;
-  GSList         *simple_nodes;
-  GSList         *menu_layout_nodes;
-  GSList         *prev;
-  GSList         *tmp;
-
-  /* to strip dups, we find all the child nodes where
-   * we want to kill dups, sort them,
-   * then nuke the adjacent nodes that are equal
-   */
-
-  simple_nodes = NULL;
-  menu_layout_nodes = NULL;
 
   child = menu_layout_node_get_children (layout);
-  while (child != NULL)
-    {
-      switch (menu_layout_node_get_type (child))
-        {
-          /* These are dups if their content is the same */
-        case MENU_LAYOUT_NODE_APP_DIR:
-        case MENU_LAYOUT_NODE_DIRECTORY_DIR:
-        case MENU_LAYOUT_NODE_DIRECTORY:
-          simple_nodes = g_slist_prepend (simple_nodes, child);
-          break;
+  while (child && menu_layout_node_get_type (child) != MENU_LAYOUT_NODE_MENU)
+    child = menu_layout_node_get_next (child);
 
-          /* These have to be merged in a more complicated way,
-           * and then recursed
-           */
-        case MENU_LAYOUT_NODE_MENU:
-          menu_layout_nodes = g_slist_prepend (menu_layout_nodes, child);
-          break;
+  return child;
+}
 
-        default:
-          break;
-        }
+static void
+merge_resolved_children (Gde2MenuTree      *tree,
+			 GHashTable     *loaded_menu_files,
+                         MenuLayoutNode *where,
+                         MenuLayoutNode *from)
+{
+  MenuLayoutNode *insert_after;
+  MenuLayoutNode *menu_child;
+  MenuLayoutNode *from_child;
 
-      child = menu_layout_node_get_next (child);
-    }
+  gde2menu_tree_resolve_files (tree, loaded_menu_files, from);
 
-  /* Note that the lists are all backward. So we want to keep
-   * the items that are earlier in the list, because they were
-   * later in the file
-   */
+  insert_after = where;
+  g_assert (menu_layout_node_get_type (insert_after) != MENU_LAYOUT_NODE_ROOT);
+  g_assert (menu_layout_node_get_parent (insert_after) != NULL);
 
-  /* stable sort the simple nodes */
-  simple_nodes = g_slist_sort (simple_nodes,
-                               node_compare_func);
+  /* skip root node */
+  menu_child = find_menu_child (from);
+  g_assert (menu_child != NULL);
+  g_assert (menu_layout_node_get_type (menu_child) == MENU_LAYOUT_NODE_MENU);
 
-  prev = NULL;
-  tmp = simple_nodes;
-  while (tmp != NULL)
+  /* merge children of toplevel <Menu> */
+  from_child = menu_layout_node_get_children (menu_child);
+  while (from_child != NULL)
     {
-      GSList *next = tmp->next;
-
-      if (prev)
-        {
-          MenuLayoutNode *p = prev->data;
-          MenuLayoutNode *n = tmp->data;
-
-          if (node_compare_func (p, n) == 0)
-            {
-              /* nuke it! */
-              menu_layout_node_unlink (n);
-	      simple_nodes = g_slist_delete_link (simple_nodes, tmp);
-	      tmp = prev;
-            }
-        }
-
-      prev = tmp;
-      tmp = next;
-    }
-
-  g_slist_free (simple_nodes);
-  simple_nodes = NULL;
+      MenuLayoutNode *next;
 
-  /* stable sort the menu nodes (the sort includes the
-   * parents of the nodes in the comparison). Remember
-   * the list is backward.
-   */
-  menu_layout_nodes = g_slist_sort (menu_layout_nodes,
-				    node_menu_compare_func);
+      next = menu_layout_node_get_next (from_child);
 
-  prev = NULL;
-  tmp = menu_layout_nodes;
-  while (tmp != NULL)
-    {
-      GSList *next = tmp->next;
+      menu_verbose ("Merging ");
+      menu_debug_print_layout (from_child, FALSE);
+      menu_verbose (" after ");
+      menu_debug_print_layout (insert_after, FALSE);
 
-      if (prev)
+      switch (menu_layout_node_get_type (from_child))
         {
-          MenuLayoutNode *p = prev->data;
-          MenuLayoutNode *n = tmp->data;
-
-          if (node_menu_compare_func (p, n) == 0)
-            {
-              /* Move children of first menu to the start of second
-               * menu and nuke the first menu
-               */
-              move_children (n, p);
-              menu_layout_node_unlink (n);
-	      menu_layout_nodes = g_slist_delete_link (menu_layout_nodes, tmp);
-	      tmp = prev;
-            }
-        }
-
-      prev = tmp;
-      tmp = next;
-    }
+        case MENU_LAYOUT_NODE_NAME:
+          menu_layout_node_unlink (from_child); /* delete this */
+          break;
 
-  g_slist_free (menu_layout_nodes);
-  menu_layout_nodes = NULL;
+        default:
+          menu_layout_node_steal (from_child);
+          menu_layout_node_insert_after (insert_after, from_child);
+          menu_layout_node_unref (from_child);
 
-  /* Recursively clean up all children */
-  child = menu_layout_node_get_children (layout);
-  while (child != NULL)
-    {
-      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
-        gde2menu_tree_strip_duplicate_children (tree, child);
+          insert_after = from_child;
+          break;
+        }
 
-      child = menu_layout_node_get_next (child);
+      from_child = next;
     }
 }
 
-static MenuLayoutNode *
-find_submenu (MenuLayoutNode *layout,
-              const char     *path,
-              gboolean        create_if_not_found)
+/* takes ownership of @to_merge */
+static gboolean
+merge_menu_file (Gde2MenuTree   *tree,
+		 GHashTable     *loaded_menu_files,
+		 const char     *canonical,
+		 MenuLayoutNode *to_merge,
+		 gboolean        add_monitor,
+		 MenuLayoutNode *where)
 {
-  MenuLayoutNode *child;
-  const char     *slash;
-  const char     *next_path;
-  char           *name;
-
-  menu_verbose (" (splitting \"%s\")\n", path);
-
-  if (path[0] == '\0' || path[0] == G_DIR_SEPARATOR)
-    return NULL;
-
-  slash = strchr (path, G_DIR_SEPARATOR);
-  if (slash != NULL)
-    {
-      name = g_strndup (path, slash - path);
-      next_path = slash + 1;
-      if (*next_path == '\0')
-        next_path = NULL;
-    }
-  else
+  if (g_hash_table_lookup (loaded_menu_files, canonical) != NULL)
     {
-      name = g_strdup (path);
-      next_path = NULL;
+      g_warning ("Not loading \"%s\": recursive loop detected in .menu files",
+		 canonical);
+      if (to_merge)
+        menu_layout_node_unref (to_merge);
+      return TRUE;
     }
 
-  child = menu_layout_node_get_children (layout);
-  while (child != NULL)
-    {
-      switch (menu_layout_node_get_type (child))
-        {
-        case MENU_LAYOUT_NODE_MENU:
-          {
-            if (strcmp (name, menu_layout_node_menu_get_name (child)) == 0)
-              {
-                menu_verbose ("MenuNode %p found for path component \"%s\"\n",
-                              child, name);
-
-                g_free (name);
-
-                if (!next_path)
-                  {
-                    menu_verbose (" Found menu node %p parent is %p\n",
-                                  child, layout);
-                    return child;
-                  }
-
-                return find_submenu (child, next_path, create_if_not_found);
-              }
-          }
-          break;
-
-        default:
-          break;
-        }
-
-      child = menu_layout_node_get_next (child);
-    }
+  menu_verbose ("Merging file \"%s\"\n", canonical);
 
-  if (create_if_not_found)
+  if (to_merge == NULL)
     {
-      MenuLayoutNode *name_node;
+      menu_verbose ("No menu for file \"%s\" found when merging\n",
+                    canonical);
+      return FALSE;
+    }
 
-      child = menu_layout_node_new (MENU_LAYOUT_NODE_MENU);
-      menu_layout_node_append_child (layout, child);
+  g_hash_table_insert (loaded_menu_files, (char *) canonical, GUINT_TO_POINTER (TRUE));
 
-      name_node = menu_layout_node_new (MENU_LAYOUT_NODE_NAME);
-      menu_layout_node_set_content (name_node, name);
-      menu_layout_node_append_child (child, name_node);
-      menu_layout_node_unref (name_node);
+  if (add_monitor)
+    gde2menu_tree_add_merged_file_monitor (tree,
+					   canonical,
+					   MENU_FILE_MONITOR_FILE);
 
-      menu_verbose (" Created menu node %p parent is %p\n",
-                    child, layout);
+  merge_resolved_children (tree, loaded_menu_files, where, to_merge);
 
-      menu_layout_node_unref (child);
-      g_free (name);
+  g_hash_table_remove (loaded_menu_files, canonical);
 
-      if (!next_path)
-        return child;
+  menu_layout_node_unref (to_merge);
 
-      return find_submenu (child, next_path, create_if_not_found);
-    }
-  else
-    {
-      g_free (name);
-      return NULL;
-    }
+  return TRUE;
 }
 
-/* To call this you first have to strip duplicate children once,
- * otherwise when you move a menu Foo to Bar then you may only
- * move one of Foo, not all the merged Foo.
- */
-static void
-gde2menu_tree_execute_moves (Gde2MenuTree      *tree,
-			  MenuLayoutNode *layout,
-			  gboolean       *need_remove_dups_p)
+static gboolean
+load_merge_file (Gde2MenuTree      *tree,
+		 GHashTable     *loaded_menu_files,
+                 const char     *filename,
+		 gboolean        add_monitor,
+                 MenuLayoutNode *where)
 {
-  MenuLayoutNode *child;
-  gboolean        need_remove_dups;
-  GSList         *move_nodes;
-  GSList         *tmp;
-
-  need_remove_dups = FALSE;
-
-  move_nodes = NULL;
+  MenuLayoutNode *to_merge;
+  char           *canonical;
+  gboolean        retval;
 
-  child = menu_layout_node_get_children (layout);
-  while (child != NULL)
+  canonical = menu_canonicalize_file_name (filename, FALSE);
+  if (canonical == NULL)
     {
-      switch (menu_layout_node_get_type (child))
-        {
-        case MENU_LAYOUT_NODE_MENU:
-          /* Recurse - we recurse first and process the current node
-           * second, as the spec dictates.
-           */
-          gde2menu_tree_execute_moves (tree, child, &need_remove_dups);
-          break;
-
-        case MENU_LAYOUT_NODE_MOVE:
-          move_nodes = g_slist_prepend (move_nodes, child);
-          break;
-
-        default:
-          break;
-        }
-
-      child = menu_layout_node_get_next (child);
+      gde2menu_tree_add_layout_input (tree, filename);
+      if (add_monitor)
+	gde2menu_tree_add_merged_file_monitor (tree,
+					       filename,
+					       MENU_FILE_MONITOR_NONEXISTENT_FILE);
+
+      menu_verbose ("Failed to canonicalize merge file path \"%s\": %s\n",
+                    filename, g_strerror (errno));
+      return FALSE;
     }
 
-  /* We need to execute the move operations in the order that they appear */
-  move_nodes = g_slist_reverse (move_nodes);
-
-  tmp = move_nodes;
-  while (tmp != NULL)
-    {
-      MenuLayoutNode *move_node = tmp->data;
-      MenuLayoutNode *old_node;
-      GSList         *next = tmp->next;
-      const char     *old;
-      const char     *new;
-
-      old = menu_layout_node_move_get_old (move_node);
-      new = menu_layout_node_move_get_new (move_node);
-      g_assert (old != NULL && new != NULL);
-
-      menu_verbose ("executing <Move> old = \"%s\" new = \"%s\"\n",
-                    old, new);
+  /* don't bother parsing a file that would only be a loop */
+  to_merge = NULL;
+  if (g_hash_table_lookup (loaded_menu_files, canonical) == NULL)
+    to_merge = gde2menu_tree_load_menu_file (tree, canonical, NULL, NULL);
 
-      old_node = find_submenu (layout, old, FALSE);
-      if (old_node != NULL)
-        {
-          MenuLayoutNode *new_node;
+  retval = merge_menu_file (tree, loaded_menu_files, canonical, to_merge, add_monitor, where);
 
-          /* here we can create duplicates anywhere below the
-           * node
-           */
-          need_remove_dups = TRUE;
+  g_free (canonical);
 
-          /* look up new node creating it and its parents if
-           * required
-           */
-          new_node = find_submenu (layout, new, TRUE);
-          g_assert (new_node != NULL);
+  return retval;
+}
 
-          move_children (old_node, new_node);
+static gboolean
+load_merge_file_with_config_dir (Gde2MenuTree      *tree,
+				 GHashTable     *loaded_menu_files,
+				 const char     *menu_file,
+				 const char     *config_dir,
+				 MenuLayoutNode *where)
+{
+  char     *merge_file;
+  gboolean  loaded;
 
-          menu_layout_node_unlink (old_node);
-        }
+  loaded = FALSE;
 
-      menu_layout_node_unlink (move_node);
+  merge_file = g_build_filename (config_dir, "menus", menu_file, NULL);
 
-      tmp = next;
-    }
+  if (load_merge_file (tree, loaded_menu_files, merge_file, TRUE, where))
+    loaded = TRUE;
 
-  g_slist_free (move_nodes);
+  g_free (merge_file);
 
-  /* This oddness is to ensure we only remove dups once,
-   * at the root, instead of recursing the tree over
-   * and over.
-   */
-  if (need_remove_dups_p)
-    *need_remove_dups_p = need_remove_dups;
-  else if (need_remove_dups)
-    gde2menu_tree_strip_duplicate_children (tree, layout);
+  return loaded;
 }
 
-static void
-gde2menu_tree_load_layout (Gde2MenuTree *tree)
+static gboolean
+compare_basedir_to_config_dir (const char *canonical_basedir,
+			       const char *config_dir)
 {
-  GHashTable *loaded_menu_files;
-  GError     *error;
+  char     *dirname;
+  char     *canonical_menus_dir;
+  gboolean  retval;
 
-  if (tree->layout)
-    return;
+  menu_verbose ("Checking to see if basedir '%s' is in '%s'\n",
+		canonical_basedir, config_dir);
 
-  if (!gde2menu_tree_canonicalize_path (tree))
-    return;
+  dirname = g_build_filename (config_dir, "menus", NULL);
 
-  menu_verbose ("Loading menu layout from \"%s\"\n",
-                tree->canonical_path);
+  retval = FALSE;
 
-  error = NULL;
-  tree->layout = menu_layout_load (tree->canonical_path,
-                                   tree->type == GDE2MENU_TREE_BASENAME ?
-                                        tree->basename : NULL,
-                                   &error);
-  if (tree->layout == NULL)
-    {
-      g_warning ("Error loading menu layout from \"%s\": %s",
-                 tree->canonical_path, error->message);
-      g_error_free (error);
-      return;
+  canonical_menus_dir = menu_canonicalize_file_name (dirname, FALSE);
+  if (canonical_menus_dir != NULL &&
+      strcmp (canonical_basedir, canonical_menus_dir) == 0)
+    {
+      retval = TRUE;
     }
 
-  loaded_menu_files = g_hash_table_new (g_str_hash, g_str_equal);
-  g_hash_table_insert (loaded_menu_files, tree->canonical_path, GUINT_TO_POINTER (TRUE));
-  gde2menu_tree_resolve_files (tree, loaded_menu_files, tree->layout);
-  g_hash_table_destroy (loaded_menu_files);
+  g_free (canonical_menus_dir);
+  g_free (dirname);
 
-  gde2menu_tree_strip_duplicate_children (tree, tree->layout);
-  gde2menu_tree_execute_moves (tree, tree->layout, NULL);
+  return retval;
 }
 
-static void
-gde2menu_tree_force_reload (Gde2MenuTree *tree)
+static gboolean
+load_parent_merge_file_from_basename (Gde2MenuTree      *tree,
+                                      GHashTable     *loaded_menu_files,
+			              MenuLayoutNode *layout,
+                                      const char     *menu_file,
+                                      const char     *canonical_basedir)
 {
-  gde2menu_tree_force_rebuild (tree);
+  gboolean            found_basedir;
+  const char * const *system_config_dirs;
+  int                 i;
 
-  if (tree->layout)
-    menu_layout_node_unref (tree->layout);
-  tree->layout = NULL;
-}
+  /* We're not interested in menu files that are in directories which are not a
+   * parent of the base directory of this menu file */
+  found_basedir = compare_basedir_to_config_dir (canonical_basedir,
+						 get_user_config_dir ());
 
-typedef struct
-{
-  DesktopEntrySet *set;
-  const char      *category;
-} GetByCategoryForeachData;
+  system_config_dirs = g_get_system_config_dirs ();
 
-static void
-get_by_category_foreach (const char               *file_id,
-			 DesktopEntry             *entry,
-			 GetByCategoryForeachData *data)
-{
-  if (desktop_entry_has_category (entry, data->category))
-    desktop_entry_set_add_entry (data->set, entry, file_id);
-}
+  i = 0;
+  while (system_config_dirs[i] != NULL)
+    {
+      if (!found_basedir)
+	{
+	  found_basedir = compare_basedir_to_config_dir (canonical_basedir,
+							 system_config_dirs[i]);
+	}
+      else
+	{
+	  menu_verbose ("Looking for parent menu file '%s' in '%s'\n",
+			menu_file, system_config_dirs[i]);
 
-static void
-get_by_category (DesktopEntrySet *entry_pool,
-		 DesktopEntrySet *set,
-		 const char      *category)
-{
-  GetByCategoryForeachData data;
+	  if (load_merge_file_with_config_dir (tree,
+					       loaded_menu_files,
+					       menu_file,
+					       system_config_dirs[i],
+					       layout))
+	    {
+	      break;
+	    }
+	}
 
-  data.set      = set;
-  data.category = category;
+      ++i;
+    }
 
-  desktop_entry_set_foreach (entry_pool,
-			     (DesktopEntrySetForeachFunc) get_by_category_foreach,
-			     &data);
+  return system_config_dirs[i] != NULL;
 }
 
-static DesktopEntrySet *
-process_include_rules (MenuLayoutNode  *layout,
-		       DesktopEntrySet *entry_pool)
+static gboolean load_parent_merge_file(Gde2MenuTree* tree, GHashTable* loaded_menu_files, MenuLayoutNode* layout)
 {
-  DesktopEntrySet *set = NULL;
+	MenuLayoutNode* root;
+	const char* basedir;
+	const char* menu_name;
+	char* canonical_basedir;
+	char* menu_file;
+	gboolean found;
 
-  switch (menu_layout_node_get_type (layout))
-    {
-    case MENU_LAYOUT_NODE_AND:
-      {
-        MenuLayoutNode *child;
+	root = menu_layout_node_get_root(layout);
 
-	menu_verbose ("Processing <And>\n");
+	basedir   = menu_layout_node_root_get_basedir(root);
+	menu_name = menu_layout_node_root_get_name(root);
 
-        child = menu_layout_node_get_children (layout);
-        while (child != NULL)
-          {
-            DesktopEntrySet *child_set;
+	canonical_basedir = menu_canonicalize_file_name(basedir, FALSE);
 
-            child_set = process_include_rules (child, entry_pool);
+	if (canonical_basedir == NULL)
+	{
+		menu_verbose("Menu basedir '%s' no longer exists, not merging parent\n", basedir);
+		return FALSE;
+	}
 
-            if (set == NULL)
-              {
-                set = child_set;
-              }
-            else
-              {
-                desktop_entry_set_intersection (set, child_set);
-                desktop_entry_set_unref (child_set);
-              }
+	found = FALSE;
+	menu_file = g_strconcat(menu_name, ".menu", NULL);
 
-            /* as soon as we get empty results, we can bail,
-             * because it's an AND
-             */
-            if (desktop_entry_set_get_count (set) == 0)
-              break;
+	if (strcmp(menu_file, "gde2-applications.menu") == 0 && g_getenv("XDG_MENU_PREFIX"))
+	{
+		char* prefixed_basename;
+		prefixed_basename = g_strdup_printf("%s%s", g_getenv("XDG_MENU_PREFIX"), menu_file);
+		found = load_parent_merge_file_from_basename(tree, loaded_menu_files, layout, prefixed_basename, canonical_basedir);
+		g_free(prefixed_basename);
+	}
 
-            child = menu_layout_node_get_next (child);
-          }
-	menu_verbose ("Processed <And>\n");
-      }
-      break;
+	if (!found)
+	{
+		found = load_parent_merge_file_from_basename(tree, loaded_menu_files, layout, menu_file, canonical_basedir);
+	}
 
-    case MENU_LAYOUT_NODE_OR:
-      {
-        MenuLayoutNode *child;
+	g_free(menu_file);
+	g_free(canonical_basedir);
 
-	menu_verbose ("Processing <Or>\n");
+	return found;
+}
 
-        child = menu_layout_node_get_children (layout);
-        while (child != NULL)
-          {
-            DesktopEntrySet *child_set;
+static void
+load_merge_dir (Gde2MenuTree      *tree,
+		GHashTable     *loaded_menu_files,
+                const char     *dirname,
+                MenuLayoutNode *where)
+{
+  GDir            *dir;
+  const char      *menu_file;
+  char            *canonical;
+  GPtrArray       *paths;
+  MenuLayoutNode **layouts;
+  guint            i;
 
-            child_set = process_include_rules (child, entry_pool);
+  menu_verbose ("Loading merge dir \"%s\"\n", dirname);
 
-            if (set == NULL)
-              {
-                set = child_set;
-              }
-            else
-              {
-                desktop_entry_set_union (set, child_set);
-                desktop_entry_set_unref (child_set);
-              }
+  gde2menu_tree_add_merged_file_monitor (tree,
+					 dirname,
+					 MENU_FILE_MONITOR_DIRECTORY);
+  gde2menu_tree_add_layout_input (tree, dirname);
 
-            child = menu_layout_node_get_next (child);
-          }
-	menu_verbose ("Processed <Or>\n");
-      }
-      break;
+  /* these usually don't exist, and canonicalizing remembers that */
+  canonical = menu_canonicalize_file_name (dirname, FALSE);
+  if (canonical == NULL)
+    return;
+  g_free (canonical);
 
-    case MENU_LAYOUT_NODE_NOT:
-      {
-        /* First get the OR of all the rules */
-        MenuLayoutNode *child;
+  if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
+    return;
 
-	menu_verbose ("Processing <Not>\n");
+  paths = g_ptr_array_new_with_free_func (g_free);
 
-        child = menu_layout_node_get_children (layout);
-        while (child != NULL)
-          {
-            DesktopEntrySet *child_set;
+  while ((menu_file = g_dir_read_name (dir)))
+    {
+      if (g_str_has_suffix (menu_file, ".menu"))
+        g_ptr_array_add (paths, g_build_filename (dirname, menu_file, NULL));
+    }
 
-            child_set = process_include_rules (child, entry_pool);
+  g_dir_close (dir);
 
-            if (set == NULL)
-              {
-                set = child_set;
-              }
-            else
-              {
-                desktop_entry_set_union (set, child_set);
-                desktop_entry_set_unref (child_set);
-              }
+  /* the files are parsed all at once, but still merged in readdir order */
+  layouts = g_new (MenuLayoutNode *, paths->len);
+  gde2menu_tree_load_menu_files (tree, paths, layouts);
 
-            child = menu_layout_node_get_next (child);
-          }
+  for (i = 0; i < paths->len; i++)
+    merge_menu_file (tree, loaded_menu_files, paths->pdata[i], layouts[i], FALSE, where);
 
-        if (set != NULL)
-          {
-	    DesktopEntrySet *inverted;
+  g_free (layouts);
+  g_ptr_array_free (paths, TRUE);
+}
 
-	    /* Now invert the result */
-	    inverted = desktop_entry_set_new ();
-	    desktop_entry_set_union (inverted, entry_pool);
-	    desktop_entry_set_subtract (inverted, set);
-	    desktop_entry_set_unref (set);
-	    set = inverted;
-          }
-	menu_verbose ("Processed <Not>\n");
-      }
-      break;
+static void
+load_merge_dir_with_config_dir (Gde2MenuTree      *tree,
+				GHashTable     *loaded_menu_files,
+                                const char     *config_dir,
+                                const char     *dirname,
+                                MenuLayoutNode *where)
+{
+  char *path;
 
-    case MENU_LAYOUT_NODE_ALL:
-      menu_verbose ("Processing <All>\n");
-      set = desktop_entry_set_new ();
-      desktop_entry_set_union (set, entry_pool);
-      menu_verbose ("Processed <All>\n");
-      break;
+  path = g_build_filename (config_dir, "menus", dirname, NULL);
 
-    case MENU_LAYOUT_NODE_FILENAME:
-      {
-        DesktopEntry *entry;
+  load_merge_dir (tree, loaded_menu_files, path, where);
 
-	menu_verbose ("Processing <Filename>%s</Filename>\n",
-		      menu_layout_node_get_content (layout));
+  g_free (path);
+}
 
-        entry = desktop_entry_set_lookup (entry_pool,
-					  menu_layout_node_get_content (layout));
-        if (entry != NULL)
-          {
-            set = desktop_entry_set_new ();
-            desktop_entry_set_add_entry (set,
-                                         entry,
-                                         menu_layout_node_get_content (layout));
-          }
-	menu_verbose ("Processed <Filename>%s</Filename>\n",
-		      menu_layout_node_get_content (layout));
-      }
-      break;
+static void
+resolve_merge_file (Gde2MenuTree      *tree,
+		    GHashTable     *loaded_menu_files,
+                    MenuLayoutNode *layout)
+{
+  char *filename;
 
-    case MENU_LAYOUT_NODE_CATEGORY:
-      menu_verbose ("Processing <Category>%s</Category>\n",
-		    menu_layout_node_get_content (layout));
-      set = desktop_entry_set_new ();
-      get_by_category (entry_pool, set, menu_layout_node_get_content (layout));
-      menu_verbose ("Processed <Category>%s</Category>\n",
-		    menu_layout_node_get_content (layout));
-      break;
-
-    default:
-      break;
+  if (menu_layout_node_merge_file_get_type (layout) == MENU_MERGE_FILE_TYPE_PARENT)
+    {
+      if (load_parent_merge_file (tree, loaded_menu_files, layout))
+        return;
     }
 
-  if (set == NULL)
-    set = desktop_entry_set_new (); /* create an empty set */
+  filename = menu_layout_node_get_content_as_path (layout);
+  if (filename == NULL)
+    {
+      menu_verbose ("didn't get node content as a path, not merging file\n");
+    }
+  else
+    {
+      load_merge_file (tree, loaded_menu_files, filename, TRUE, layout);
 
-  menu_verbose ("Matched %d entries\n", desktop_entry_set_get_count (set));
+      g_free (filename);
+    }
 
-  return set;
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
 }
 
 static void
-collect_layout_info (MenuLayoutNode  *layout,
-		     GSList         **layout_info)
+resolve_merge_dir (Gde2MenuTree      *tree,
+		   GHashTable     *loaded_menu_files,
+                   MenuLayoutNode *layout)
 {
-  MenuLayoutNode *iter;
-
-  g_slist_foreach (*layout_info,
-		   (GFunc) menu_layout_node_unref,
-		   NULL);
-  g_slist_free (*layout_info);
-  *layout_info = NULL;
+  char *path;
 
-  iter = menu_layout_node_get_children (layout);
-  while (iter != NULL)
+  path = menu_layout_node_get_content_as_path (layout);
+  if (path == NULL)
     {
-      switch (menu_layout_node_get_type (iter))
-	{
-	case MENU_LAYOUT_NODE_MENUNAME:
-	case MENU_LAYOUT_NODE_FILENAME:
-	case MENU_LAYOUT_NODE_SEPARATOR:
-	case MENU_LAYOUT_NODE_MERGE:
-	  *layout_info = g_slist_prepend (*layout_info,
-					  menu_layout_node_ref (iter));
-	  break;
-
-	default:
-	  break;
-	}
+      menu_verbose ("didn't get layout node content as a path, not merging dir\n");
+    }
+  else
+    {
+      load_merge_dir (tree, loaded_menu_files, path, layout);
 
-      iter = menu_layout_node_get_next (iter);
+      g_free (path);
     }
 
-  *layout_info = g_slist_reverse (*layout_info);
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
 }
 
-static void
-entries_listify_foreach (const char         *desktop_file_id,
-                         DesktopEntry       *desktop_entry,
-                         Gde2MenuTreeDirectory *directory)
+static MenuLayoutNode *
+add_app_dir (Gde2MenuTree      *tree,
+             MenuLayoutNode *before,
+             const char     *data_dir)
 {
-  directory->entries =
-    g_slist_prepend (directory->entries,
-		     gde2menu_tree_entry_new (directory,
-                                           desktop_entry,
-                                           desktop_file_id,
-                                           FALSE,
-                                           desktop_entry_get_no_display (desktop_entry)));
-}
+  MenuLayoutNode *tmp;
+  char           *dirname;
 
-static void
-excluded_entries_listify_foreach (const char         *desktop_file_id,
-				  DesktopEntry       *desktop_entry,
-				  Gde2MenuTreeDirectory *directory)
-{
-  directory->entries =
-    g_slist_prepend (directory->entries,
-		     gde2menu_tree_entry_new (directory,
-					   desktop_entry,
-					   desktop_file_id,
-					   TRUE,
-                                           desktop_entry_get_no_display (desktop_entry)));
+  tmp = menu_layout_node_new (MENU_LAYOUT_NODE_APP_DIR);
+  dirname = g_build_filename (data_dir, "applications", NULL);
+  menu_layout_node_set_content (tmp, dirname);
+  menu_layout_node_insert_before (before, tmp);
+  menu_layout_node_unref (before);
+
+  menu_verbose ("Adding <AppDir>%s</AppDir> in <DefaultAppDirs/>\n",
+                dirname);
+
+  g_free (dirname);
+
+  return tmp;
 }
 
 static void
-set_default_layout_values (Gde2MenuTreeDirectory *parent,
-                           Gde2MenuTreeDirectory *child)
+resolve_default_app_dirs (Gde2MenuTree      *tree,
+                          MenuLayoutNode *layout)
 {
-  GSList *tmp;
+  MenuLayoutNode     *before;
+  const char * const *system_data_dirs;
+  int                 i;
 
-  /* if the child has a defined default layout, we don't want to override its
-   * values. The parent might have a non-defined layout info (ie, no child of
-   * the DefaultLayout node) but it doesn't meant the default layout values
-   * (ie, DefaultLayout attributes) aren't different from the global defaults.
-   */
-  if (child->default_layout_info != NULL ||
-      child->default_layout_values.mask != MENU_LAYOUT_VALUES_NONE)
-    return;
+  system_data_dirs = g_get_system_data_dirs ();
 
-  child->default_layout_values = parent->default_layout_values;
+  before = add_app_dir (tree,
+			menu_layout_node_ref (layout),
+			get_user_data_dir ());
 
-  tmp = child->subdirs;
-  while (tmp != NULL)
+  i = 0;
+  while (system_data_dirs[i] != NULL)
     {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
+      before = add_app_dir (tree, before, system_data_dirs[i]);
 
-      set_default_layout_values (child, subdir);
+      ++i;
+    }
 
-      tmp = tmp->next;
-   }
+  menu_layout_node_unref (before);
+
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
 }
 
-static Gde2MenuTreeDirectory *
-process_layout (Gde2MenuTree          *tree,
-                Gde2MenuTreeDirectory *parent,
-                MenuLayoutNode     *layout,
-                DesktopEntrySet    *allocated)
+static MenuLayoutNode* add_directory_dir(Gde2MenuTree* tree, MenuLayoutNode* before, const char* data_dir)
 {
-  MenuLayoutNode     *layout_iter;
-  Gde2MenuTreeDirectory *directory;
-  DesktopEntrySet    *entry_pool;
-  DesktopEntrySet    *entries;
-  DesktopEntrySet    *allocated_set;
-  DesktopEntrySet    *excluded_set;
-  gboolean            deleted;
-  gboolean            only_unallocated;
-  GSList             *tmp;
-
-  g_assert (menu_layout_node_get_type (layout) == MENU_LAYOUT_NODE_MENU);
-  g_assert (menu_layout_node_menu_get_name (layout) != NULL);
+	MenuLayoutNode* tmp;
+	char* dirname;
 
-  directory = gde2menu_tree_directory_new (parent,
-					menu_layout_node_menu_get_name (layout),
-					parent == NULL);
+	tmp = menu_layout_node_new(MENU_LAYOUT_NODE_DIRECTORY_DIR);
+	dirname = g_build_filename(data_dir, "desktop-directories", NULL);
+	menu_layout_node_set_content(tmp, dirname);
+	menu_layout_node_insert_before(before, tmp);
+	menu_layout_node_unref(before);
 
-  menu_verbose ("=== Menu name = %s ===\n", directory->name);
+	menu_verbose("Adding <DirectoryDir>%s</DirectoryDir> in <DefaultDirectoryDirs/>\n", dirname);
 
+	g_free(dirname);
 
-  deleted = FALSE;
-  only_unallocated = FALSE;
+	return tmp;
+}
 
-  entries = desktop_entry_set_new ();
-  allocated_set = desktop_entry_set_new ();
+static void
+resolve_default_directory_dirs (Gde2MenuTree      *tree,
+                                MenuLayoutNode *layout)
+{
+  MenuLayoutNode     *before;
+  const char * const *system_data_dirs;
+  int                 i;
 
-  if (tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_EXCLUDED)
-    excluded_set = desktop_entry_set_new ();
-  else
-    excluded_set = NULL;
+  system_data_dirs = g_get_system_data_dirs ();
 
-  entry_pool = _entry_directory_list_get_all_desktops (menu_layout_node_menu_get_app_dirs (layout));
+  before = add_directory_dir (tree,
+			      menu_layout_node_ref (layout),
+			      get_user_data_dir ());
 
-  layout_iter = menu_layout_node_get_children (layout);
-  while (layout_iter != NULL)
+  i = 0;
+  while (system_data_dirs[i] != NULL)
     {
-      switch (menu_layout_node_get_type (layout_iter))
-        {
-        case MENU_LAYOUT_NODE_MENU:
-          /* recurse */
-          {
-            Gde2MenuTreeDirectory *child_dir;
+		/* Parche para tomar las carpetas /gde2/ */
+		char* path = g_build_filename(system_data_dirs[i], "gde2", NULL);
+		before = add_directory_dir(tree, before, path);
+		g_free(path);
+		/* /fin parche */
+      before = add_directory_dir (tree, before, system_data_dirs[i]);
 
-	    menu_verbose ("Processing <Menu>\n");
+      ++i;
+    }
 
-            child_dir = process_layout (tree,
-                                        directory,
-                                        layout_iter,
-                                        allocated);
-            if (child_dir)
-              directory->subdirs = g_slist_prepend (directory->subdirs,
-                                                    child_dir);
+  menu_layout_node_unref (before);
 
-	    menu_verbose ("Processed <Menu>\n");
-          }
-          break;
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
+}
 
-        case MENU_LAYOUT_NODE_INCLUDE:
-          {
-            /* The match rule children of the <Include> are
-             * independent (logical OR) so we can process each one by
-             * itself
-             */
-            MenuLayoutNode *rule;
+static void
+resolve_default_merge_dirs (Gde2MenuTree      *tree,
+			    GHashTable     *loaded_menu_files,
+                            MenuLayoutNode *layout)
+{
+  MenuLayoutNode     *root;
+  const char         *menu_name;
+  char               *merge_name;
+  const char * const *system_config_dirs;
+  int                 i;
 
-	    menu_verbose ("Processing <Include> (%d entries)\n",
-			  desktop_entry_set_get_count (entries));
+  root = menu_layout_node_get_root (layout);
+  menu_name = menu_layout_node_root_get_name (root);
 
-            rule = menu_layout_node_get_children (layout_iter);
-            while (rule != NULL)
-              {
-                DesktopEntrySet *rule_set;
+  merge_name = g_strconcat (menu_name, "-merged", NULL);
 
-                rule_set = process_include_rules (rule, entry_pool);
-                if (rule_set != NULL)
-                  {
-                    desktop_entry_set_union (entries, rule_set);
-                    desktop_entry_set_union (allocated_set, rule_set);
-		    if (excluded_set != NULL)
-		      desktop_entry_set_subtract (excluded_set, rule_set);
-                    desktop_entry_set_unref (rule_set);
-                  }
+  system_config_dirs = g_get_system_config_dirs ();
 
-                rule = menu_layout_node_get_next (rule);
-              }
+  /* Merge in reverse order */
+  i = 0;
+  while (system_config_dirs[i] != NULL) i++;
+  while (i > 0)
+    {
+      i--;
+      load_merge_dir_with_config_dir (tree,
+				      loaded_menu_files,
+                                      system_config_dirs[i],
+                                      merge_name,
+                                      layout);
+    }
 
-	    menu_verbose ("Processed <Include> (%d entries)\n",
-			  desktop_entry_set_get_count (entries));
-          }
-          break;
+  load_merge_dir_with_config_dir (tree,
+				  loaded_menu_files,
+                                  get_user_config_dir (),
+                                  merge_name,
+                                  layout);
 
-        case MENU_LAYOUT_NODE_EXCLUDE:
-          {
-            /* The match rule children of the <Exclude> are
-             * independent (logical OR) so we can process each one by
-             * itself
-             */
-            MenuLayoutNode *rule;
+  g_free (merge_name);
 
-	    menu_verbose ("Processing <Exclude> (%d entries)\n",
-			  desktop_entry_set_get_count (entries));
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
+}
 
-            rule = menu_layout_node_get_children (layout_iter);
-            while (rule != NULL)
-              {
-                DesktopEntrySet *rule_set;
+static void
+add_filename_include (const char     *desktop_file_id,
+                      DesktopEntry   *entry,
+                      MenuLayoutNode *include)
+{
+  if (!desktop_entry_has_categories (entry))
+    {
+      MenuLayoutNode *node;
 
-                rule_set = process_include_rules (rule, entry_pool);
-                if (rule_set != NULL)
-                  {
-		    if (excluded_set != NULL)
-		      desktop_entry_set_union (excluded_set, rule_set);
-		    desktop_entry_set_subtract (entries, rule_set);
-		    desktop_entry_set_unref (rule_set);
-                  }
+      node = menu_layout_node_new (MENU_LAYOUT_NODE_FILENAME);
+      menu_layout_node_set_content (node, desktop_file_id);
 
-                rule = menu_layout_node_get_next (rule);
-              }
+      menu_layout_node_append_child (include, node);
+      menu_layout_node_unref (node);
+    }
+}
 
-	    menu_verbose ("Processed <Exclude> (%d entries)\n",
-			  desktop_entry_set_get_count (entries));
-          }
-          break;
+static void
+is_dot_directory (const char   *basename,
+		  DesktopEntry *entry,
+		  gboolean     *has_dot_directory)
+{
+  if (!strcmp (basename, ".directory"))
+    *has_dot_directory = TRUE;
+}
 
-        case MENU_LAYOUT_NODE_DIRECTORY:
-          {
-            DesktopEntry *entry;
+static gboolean
+add_menu_for_legacy_dir (Gde2MenuTree   *tree,
+                         MenuLayoutNode *parent,
+                         const char     *legacy_dir,
+                	 const char     *relative_path,
+                         const char     *legacy_prefix,
+                         const char     *menu_name)
+{
+  EntryDirectory  *ed;
+  DesktopEntrySet *desktop_entries;
+  DesktopEntrySet *directory_entries;
+  GSList          *subdirs;
+  gboolean         menu_added;
+  gboolean         has_dot_directory;
 
-	    menu_verbose ("Processing <Directory>%s</Directory>\n",
-			  menu_layout_node_get_content (layout_iter));
+  gde2menu_tree_add_layout_input (tree, legacy_dir);
 
-	    /*
-             * The last <Directory> to exist wins, so we always try overwriting
-             */
-            entry = entry_directory_list_get_directory (menu_layout_node_menu_get_directory_dirs (layout),
-                                                        menu_layout_node_get_content (layout_iter));
+  ed = entry_directory_new_legacy (DESKTOP_ENTRY_INVALID, legacy_dir, legacy_prefix);
+  if (!ed)
+    return FALSE;
 
-            if (entry != NULL)
-              {
-                if (!desktop_entry_get_hidden (entry))
-                  {
-                    if (directory->directory_entry)
-                      desktop_entry_unref (directory->directory_entry);
-                    directory->directory_entry = entry; /* pass ref ownership */
-                  }
-                else
-                  {
-                    desktop_entry_unref (entry);
-                  }
-              }
+  subdirs = NULL;
+  desktop_entries   = desktop_entry_set_new ();
+  directory_entries = desktop_entry_set_new ();
 
-            menu_verbose ("Processed <Directory> new directory entry = %p (%s)\n",
-                          directory->directory_entry,
-			  directory->directory_entry? desktop_entry_get_path (directory->directory_entry) : "null");
-          }
-          break;
+  entry_directory_get_flat_contents (ed,
+                                     desktop_entries,
+                                     directory_entries,
+                                     &subdirs);
+  entry_directory_unref (ed);
 
-        case MENU_LAYOUT_NODE_DELETED:
-	  menu_verbose ("Processed <Deleted/>\n");
-          deleted = TRUE;
-          break;
+  has_dot_directory = FALSE;
+  desktop_entry_set_foreach (directory_entries,
+			     (DesktopEntrySetForeachFunc) is_dot_directory,
+			     &has_dot_directory);
+  desktop_entry_set_unref (directory_entries);
 
-        case MENU_LAYOUT_NODE_NOT_DELETED:
-	  menu_verbose ("Processed <NotDeleted/>\n");
-          deleted = FALSE;
-          break;
+  menu_added = FALSE;
+  if (desktop_entry_set_get_count (desktop_entries) > 0 || subdirs)
+    {
+      MenuLayoutNode *menu;
+      MenuLayoutNode *node;
+      GString        *subdir_path;
+      GString        *subdir_relative;
+      GSList         *tmp;
+      int             legacy_dir_len;
+      int             relative_path_len;
 
-        case MENU_LAYOUT_NODE_ONLY_UNALLOCATED:
-	  menu_verbose ("Processed <OnlyUnallocated/>\n");
-          only_unallocated = TRUE;
-          break;
+      menu = menu_layout_node_new (MENU_LAYOUT_NODE_MENU);
+      menu_layout_node_append_child (parent, menu);
 
-        case MENU_LAYOUT_NODE_NOT_ONLY_UNALLOCATED:
-	  menu_verbose ("Processed <NotOnlyUnallocated/>\n");
-          only_unallocated = FALSE;
-          break;
+      menu_added = TRUE;
 
-	case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
-	  menu_layout_node_default_layout_get_values (layout_iter,
-						      &directory->default_layout_values);
-	  collect_layout_info (layout_iter, &directory->default_layout_info);
-	  menu_verbose ("Processed <DefaultLayout/>\n");
-	  break;
+      g_assert (menu_name != NULL);
 
-	case MENU_LAYOUT_NODE_LAYOUT:
-	  collect_layout_info (layout_iter, &directory->layout_info);
-	  menu_verbose ("Processed <Layout/>\n");
-	  break;
+      node = menu_layout_node_new (MENU_LAYOUT_NODE_NAME);
+      menu_layout_node_set_content (node, menu_name);
+      menu_layout_node_append_child (menu, node);
+      menu_layout_node_unref (node);
 
-        default:
-          break;
-        }
+      if (has_dot_directory)
+	{
+	  node = menu_layout_node_new (MENU_LAYOUT_NODE_DIRECTORY);
+	  if (relative_path != NULL)
+	    {
+	      char *directory_entry_path;
 
-      layout_iter = menu_layout_node_get_next (layout_iter);
-    }
+	      directory_entry_path = g_strdup_printf ("%s/.directory", relative_path);
+	      menu_layout_node_set_content (node, directory_entry_path);
+	      g_free (directory_entry_path);
+	    }
+	  else
+	    {
+	      menu_layout_node_set_content (node, ".directory");
+	    }
+	  menu_layout_node_append_child (menu, node);
+	  menu_layout_node_unref (node);
+	}
 
-  desktop_entry_set_unref (entry_pool);
+      if (desktop_entry_set_get_count (desktop_entries) > 0)
+	{
+	  MenuLayoutNode *include;
 
-  directory->only_unallocated = only_unallocated;
+	  include = menu_layout_node_new (MENU_LAYOUT_NODE_INCLUDE);
+	  menu_layout_node_append_child (menu, include);
 
-  if (!directory->only_unallocated)
-    desktop_entry_set_union (allocated, allocated_set);
+	  desktop_entry_set_foreach (desktop_entries,
+				     (DesktopEntrySetForeachFunc) add_filename_include,
+				     include);
 
-  desktop_entry_set_unref (allocated_set);
+	  menu_layout_node_unref (include);
+	}
 
-  if (directory->directory_entry)
-    {
-      if (desktop_entry_get_no_display (directory->directory_entry))
-        {
-          directory->is_nodisplay = TRUE;
+      subdir_path = g_string_new (legacy_dir);
+      legacy_dir_len = strlen (legacy_dir);
 
-          if (!(tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_NODISPLAY))
-            {
-              menu_verbose ("Not showing menu %s because NoDisplay=true\n",
-                        desktop_entry_get_name (directory->directory_entry));
-              deleted = TRUE;
-            }
-        }
+      subdir_relative = g_string_new (relative_path);
+      relative_path_len = relative_path ? strlen (relative_path) : 0;
 
-      if (!desktop_entry_get_show_in_gde2 (directory->directory_entry))
+      tmp = subdirs;
+      while (tmp != NULL)
         {
-          menu_verbose ("Not showing menu %s because OnlyShowIn!=GDE2 or NotShowIn=GDE2\n",
-                        desktop_entry_get_name (directory->directory_entry));
-          deleted = TRUE;
-        }
-    }
+          const char *subdir = tmp->data;
 
-  if (deleted)
-    {
-      if (excluded_set != NULL)
-	desktop_entry_set_unref (excluded_set);
-      desktop_entry_set_unref (entries);
-      gde2menu_tree_item_unref (directory);
-      return NULL;
-    }
+          g_string_append_c (subdir_path, G_DIR_SEPARATOR);
+          g_string_append (subdir_path, subdir);
 
-  desktop_entry_set_foreach (entries,
-                             (DesktopEntrySetForeachFunc) entries_listify_foreach,
-                             directory);
-  desktop_entry_set_unref (entries);
+	  if (relative_path_len)
+	    {
+	      g_string_append_c (subdir_relative, G_DIR_SEPARATOR);
+	    }
+          g_string_append (subdir_relative, subdir);
 
-  if (excluded_set != NULL)
-    {
-      desktop_entry_set_foreach (excluded_set,
-				 (DesktopEntrySetForeachFunc) excluded_entries_listify_foreach,
-				 directory);
-      desktop_entry_set_unref (excluded_set);
-    }
+          add_menu_for_legacy_dir (tree,
+                                   menu,
+                                   subdir_path->str,
+				   subdir_relative->str,
+                                   legacy_prefix,
+                                   subdir);
 
-  tmp = directory->subdirs;
-  while (tmp != NULL)
-    {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
+          g_string_truncate (subdir_relative, relative_path_len);
+          g_string_truncate (subdir_path, legacy_dir_len);
 
-      set_default_layout_values (directory, subdir);
+          tmp = tmp->next;
+        }
 
-      tmp = tmp->next;
-   }
+      g_string_free (subdir_path, TRUE);
+      g_string_free (subdir_relative, TRUE);
 
-  tmp = directory->entries;
-  while (tmp != NULL)
-    {
-      Gde2MenuTreeEntry *entry = tmp->data;
-      GSList         *next  = tmp->next;
-      gboolean        delete = FALSE;
+      menu_layout_node_unref (menu);
+    }
 
-      if (desktop_entry_get_hidden (entry->desktop_entry))
-        {
-          menu_verbose ("Deleting %s because Hidden=true\n",
-                        desktop_entry_get_name (entry->desktop_entry));
-          delete = TRUE;
-        }
+  desktop_entry_set_unref (desktop_entries);
 
-      if (!(tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_NODISPLAY) &&
-          desktop_entry_get_no_display (entry->desktop_entry))
-        {
-          menu_verbose ("Deleting %s because NoDisplay=true\n",
-                        desktop_entry_get_name (entry->desktop_entry));
-          delete = TRUE;
-        }
+  g_slist_foreach (subdirs, (GFunc) g_free, NULL);
+  g_slist_free (subdirs);
 
-      if (!desktop_entry_get_show_in_gde2 (entry->desktop_entry))
+  return menu_added;
+}
+
+static void
+resolve_legacy_dir (Gde2MenuTree      *tree,
+		    GHashTable     *loaded_menu_files,
+                    MenuLayoutNode *legacy)
+{
+  MenuLayoutNode *to_merge;
+  MenuLayoutNode *menu;
+
+  to_merge = menu_layout_node_new (MENU_LAYOUT_NODE_ROOT);
+
+  menu = menu_layout_node_get_parent (legacy);
+  g_assert (menu_layout_node_get_type (menu) == MENU_LAYOUT_NODE_MENU);
+
+  if (add_menu_for_legacy_dir (tree,
+                               to_merge,
+                               menu_layout_node_get_content (legacy),
+			       NULL,
+                               menu_layout_node_legacy_dir_get_prefix (legacy),
+                               menu_layout_node_menu_get_name (menu)))
+    {
+      merge_resolved_children (tree, loaded_menu_files, legacy, to_merge);
+    }
+
+  menu_layout_node_unref (to_merge);
+}
+
+static MenuLayoutNode *
+add_legacy_dir (Gde2MenuTree      *tree,
+		GHashTable     *loaded_menu_files,
+                MenuLayoutNode *before,
+                const char     *data_dir)
+{
+  MenuLayoutNode *legacy;
+  char           *dirname;
+
+  dirname = g_build_filename (data_dir, "applnk", NULL);
+
+  legacy = menu_layout_node_new (MENU_LAYOUT_NODE_LEGACY_DIR);
+  menu_layout_node_set_content (legacy, dirname);
+  menu_layout_node_legacy_dir_set_prefix (legacy, "kde");
+  menu_layout_node_insert_before (before, legacy);
+  menu_layout_node_unref (before);
+
+  menu_verbose ("Adding <LegacyDir>%s</LegacyDir> in <KDELegacyDirs/>\n",
+                dirname);
+
+  resolve_legacy_dir (tree, loaded_menu_files, legacy);
+
+  g_free (dirname);
+
+  return legacy;
+}
+
+static void
+resolve_kde_legacy_dirs (Gde2MenuTree      *tree,
+			 GHashTable     *loaded_menu_files,
+                         MenuLayoutNode *layout)
+{
+  MenuLayoutNode     *before;
+  const char * const *system_data_dirs;
+  int                 i;
+
+  system_data_dirs = g_get_system_data_dirs ();
+
+  before = add_legacy_dir (tree,
+			   loaded_menu_files,
+			   menu_layout_node_ref (layout),
+			   get_user_data_dir ());
+
+  i = 0;
+  while (system_data_dirs[i] != NULL)
+    {
+      before = add_legacy_dir (tree, loaded_menu_files, before, system_data_dirs[i]);
+
+      ++i;
+    }
+
+  menu_layout_node_unref (before);
+
+  /* remove the now-replaced node */
+  menu_layout_node_unlink (layout);
+}
+
+static void
+gde2menu_tree_resolve_files (Gde2MenuTree      *tree,
+			  GHashTable     *loaded_menu_files,
+			  MenuLayoutNode *layout)
+{
+  MenuLayoutNode *child;
+
+  menu_verbose ("Resolving files in: ");
+  menu_debug_print_layout (layout, TRUE);
+
+  switch (menu_layout_node_get_type (layout))
+    {
+    case MENU_LAYOUT_NODE_MERGE_FILE:
+      resolve_merge_file (tree, loaded_menu_files, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE_DIR:
+      resolve_merge_dir (tree, loaded_menu_files, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_APP_DIRS:
+      resolve_default_app_dirs (tree, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_DIRECTORY_DIRS:
+      resolve_default_directory_dirs (tree, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_MERGE_DIRS:
+      resolve_default_merge_dirs (tree, loaded_menu_files, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      resolve_legacy_dir (tree, loaded_menu_files, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_KDE_LEGACY_DIRS:
+      resolve_kde_legacy_dirs (tree, loaded_menu_files, layout);
+      break;
+
+    case MENU_LAYOUT_NODE_PASSTHROUGH:
+      /* Just get rid of these, we don't need the memory usage */
+      menu_layout_node_unlink (layout);
+      break;
+
+    default:
+      /* Recurse */
+      child = menu_layout_node_get_children (layout);
+      while (child != NULL)
         {
-          menu_verbose ("Deleting %s because OnlyShowIn!=GDE2 or NotShowIn=GDE2\n",
-                        desktop_entry_get_name (entry->desktop_entry));
-          delete = TRUE;
+          MenuLayoutNode *next = menu_layout_node_get_next (child);
+
+          gde2menu_tree_resolve_files (tree, loaded_menu_files, child);
+
+          child = next;
         }
+      break;
+    }
+}
 
-      if (desktop_entry_get_tryexec_failed (entry->desktop_entry))
+/* The entry directories that don't exist are not looked for again until
+ * they are created (see canonicalize.c), so watch them for that */
+static void
+gde2menu_tree_monitor_missing_dirs (Gde2MenuTree   *tree,
+				    GHashTable     *seen,
+				    MenuLayoutNode *layout)
+{
+  MenuLayoutNode *child;
+  char           *path;
+  char           *canonical;
+
+  switch (menu_layout_node_get_type (layout))
+    {
+    case MENU_LAYOUT_NODE_APP_DIR:
+    case MENU_LAYOUT_NODE_DIRECTORY_DIR:
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      path = menu_layout_node_get_content_as_path (layout);
+      if (path == NULL || g_hash_table_contains (seen, path))
+	{
+	  g_free (path);
+	  break;
+	}
+
+      canonical = menu_canonicalize_file_name (path, FALSE);
+      if (canonical == NULL)
+	{
+	  menu_verbose ("Entry directory \"%s\" doesn't exist\n", path);
+
+	  gde2menu_tree_add_layout_input (tree, path);
+	  gde2menu_tree_add_merged_file_monitor (tree,
+						 path,
+						 MENU_FILE_MONITOR_NONEXISTENT_FILE);
+	}
+      g_free (canonical);
+
+      g_hash_table_add (seen, path);
+      break;
+
+    default:
+      child = menu_layout_node_get_children (layout);
+      while (child != NULL)
         {
-          menu_verbose ("Deleting %s because TryExec failed\n",
-                        desktop_entry_get_name (entry->desktop_entry));
-          delete = TRUE;
+          gde2menu_tree_monitor_missing_dirs (tree, seen, child);
+
+          child = menu_layout_node_get_next (child);
         }
+      break;
+    }
+}
 
-      if (delete)
+static void
+move_children (MenuLayoutNode *from,
+               MenuLayoutNode *to)
+{
+  MenuLayoutNode *from_child;
+  MenuLayoutNode *insert_before;
+
+  insert_before = menu_layout_node_get_children (to);
+  from_child    = menu_layout_node_get_children (from);
+
+  while (from_child != NULL)
+    {
+      MenuLayoutNode *next;
+
+      next = menu_layout_node_get_next (from_child);
+
+      menu_layout_node_steal (from_child);
+
+      if (menu_layout_node_get_type (from_child) == MENU_LAYOUT_NODE_NAME)
         {
-          directory->entries = g_slist_delete_link (directory->entries,
-                                                   tmp);
-          gde2menu_tree_item_unref_and_unset_parent (entry);
+          ; /* just drop the Name in the old <Menu> */
+        }
+      else if (insert_before)
+        {
+          menu_layout_node_insert_before (insert_before, from_child);
+          g_assert (menu_layout_node_get_next (from_child) == insert_before);
+        }
+      else
+        {
+          menu_layout_node_append_child (to, from_child);
         }
 
-      tmp = next;
+      menu_layout_node_unref (from_child);
+
+      from_child = next;
+    }
+}
+
+static inline guint
+null_safe_str_hash (const char *str)
+{
+  return str != NULL ? g_str_hash (str) : 0;
+}
+
+static inline gboolean
+null_safe_str_equal (const char *a,
+                     const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+  else
+    return strcmp (a, b) == 0;
+}
+
+/* Nodes are dups if they have the same type and content */
+static guint
+node_hash_func (gconstpointer key)
+{
+  MenuLayoutNode *node = (MenuLayoutNode *) key;
+
+  return menu_layout_node_get_type (node) * 31 +
+         null_safe_str_hash (menu_layout_node_get_content (node));
+}
+
+static gboolean
+node_equal_func (gconstpointer a,
+                 gconstpointer b)
+{
+  MenuLayoutNode *node_a = (MenuLayoutNode *) a;
+  MenuLayoutNode *node_b = (MenuLayoutNode *) b;
+
+  return menu_layout_node_get_type (node_a) == menu_layout_node_get_type (node_b) &&
+         null_safe_str_equal (menu_layout_node_get_content (node_a),
+                              menu_layout_node_get_content (node_b));
+}
+
+/* <Menu> nodes are dups if they have the same name */
+static guint
+node_menu_hash_func (gconstpointer key)
+{
+  return null_safe_str_hash (menu_layout_node_menu_get_name ((MenuLayoutNode *) key));
+}
+
+static gboolean
+node_menu_equal_func (gconstpointer a,
+                      gconstpointer b)
+{
+  return null_safe_str_equal (menu_layout_node_menu_get_name ((MenuLayoutNode *) a),
+                              menu_layout_node_menu_get_name ((MenuLayoutNode *) b));
+}
+
+static void
+gde2menu_tree_strip_duplicate_children (Gde2MenuTree      *tree,
+				     MenuLayoutNode *layout)
+{
+  MenuLayoutNode *child;
+  GHashTable     *simple_nodes;
+  GHashTable     *menu_layout_nodes;
+
+  /* to strip dups, we go through the child nodes where we want to
+   * kill dups, remembering the last one seen of each kind; the ones
+   * later in the file win, so a dup of a node seen earlier replaces it
+   */
+
+  simple_nodes = g_hash_table_new (node_hash_func, node_equal_func);
+  menu_layout_nodes = g_hash_table_new (node_menu_hash_func,
+                                        node_menu_equal_func);
+
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      MenuLayoutNode *next = menu_layout_node_get_next (child);
+      MenuLayoutNode *prev;
+
+      switch (menu_layout_node_get_type (child))
+        {
+          /* These are dups if their content is the same */
+        case MENU_LAYOUT_NODE_APP_DIR:
+        case MENU_LAYOUT_NODE_DIRECTORY_DIR:
+        case MENU_LAYOUT_NODE_DIRECTORY:
+          prev = g_hash_table_lookup (simple_nodes, child);
+          g_hash_table_replace (simple_nodes, child, child);
+
+          if (prev != NULL)
+            {
+              /* nuke it! */
+              menu_layout_node_unlink (prev);
+            }
+          break;
+
+          /* These have to be merged in a more complicated way,
+           * and then recursed
+           */
+        case MENU_LAYOUT_NODE_MENU:
+          prev = g_hash_table_lookup (menu_layout_nodes, child);
+          /* before the move drops the <Name> of prev */
+          g_hash_table_replace (menu_layout_nodes, child, child);
+
+          if (prev != NULL)
+            {
+              /* Move children of the earlier menu to the start of
+               * this one and nuke the earlier menu
+               */
+              move_children (prev, child);
+              menu_layout_node_unlink (prev);
+            }
+          break;
+
+        default:
+          break;
+        }
+
+      child = next;
+    }
+
+  g_hash_table_destroy (simple_nodes);
+  g_hash_table_destroy (menu_layout_nodes);
+
+  /* Recursively clean up all children */
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
+        gde2menu_tree_strip_duplicate_children (tree, child);
+
+      child = menu_layout_node_get_next (child);
+    }
+}
+
+/* The <Menu> children of the layout nodes the moves looked at, by name: an
+ * execute_moves pass goes through this instead of walking the children for
+ * each component of the paths. Like the walk, a name gives the first child
+ * with that name.
+ */
+static GHashTable *
+get_submenus_by_name (GHashTable     *submenus,
+                      MenuLayoutNode *layout)
+{
+  GHashTable     *by_name;
+  MenuLayoutNode *child;
+
+  by_name = g_hash_table_lookup (submenus, layout);
+  if (by_name != NULL)
+    return by_name;
+
+  by_name = g_hash_table_new (g_str_hash, g_str_equal);
+
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
+        {
+          const char *name = menu_layout_node_menu_get_name (child);
+
+          if (name != NULL && !g_hash_table_contains (by_name, name))
+            g_hash_table_insert (by_name, (char *) name, child);
+        }
+
+      child = menu_layout_node_get_next (child);
+    }
+
+  g_hash_table_insert (submenus, layout, by_name);
+
+  return by_name;
+}
+
+static MenuLayoutNode *
+find_submenu (GHashTable     *submenus,
+              MenuLayoutNode *layout,
+              const char     *path,
+              gboolean        create_if_not_found)
+{
+  MenuLayoutNode *child;
+  GHashTable     *by_name;
+  const char     *slash;
+  const char     *next_path;
+  char           *name;
+
+  menu_verbose (" (splitting \"%s\")\n", path);
+
+  if (path[0] == '\0' || path[0] == G_DIR_SEPARATOR)
+    return NULL;
+
+  slash = strchr (path, G_DIR_SEPARATOR);
+  if (slash != NULL)
+    {
+      name = g_strndup (path, slash - path);
+      next_path = slash + 1;
+      if (*next_path == '\0')
+        next_path = NULL;
+    }
+  else
+    {
+      name = g_strdup (path);
+      next_path = NULL;
+    }
+
+  by_name = get_submenus_by_name (submenus, layout);
+
+  child = g_hash_table_lookup (by_name, name);
+  if (child != NULL)
+    {
+      menu_verbose ("MenuNode %p found for path component \"%s\"\n",
+                    child, name);
+
+      g_free (name);
+
+      if (!next_path)
+        {
+          menu_verbose (" Found menu node %p parent is %p\n",
+                        child, layout);
+          return child;
+        }
+
+      return find_submenu (submenus, child, next_path, create_if_not_found);
+    }
+
+  if (create_if_not_found)
+    {
+      MenuLayoutNode *name_node;
+
+      child = menu_layout_node_new (MENU_LAYOUT_NODE_MENU);
+      menu_layout_node_append_child (layout, child);
+
+      name_node = menu_layout_node_new (MENU_LAYOUT_NODE_NAME);
+      menu_layout_node_set_content (name_node, name);
+      menu_layout_node_append_child (child, name_node);
+      menu_layout_node_unref (name_node);
+
+      g_hash_table_replace (by_name,
+                            (char *) menu_layout_node_menu_get_name (child),
+                            child);
+
+      menu_verbose (" Created menu node %p parent is %p\n",
+                    child, layout);
+
+      menu_layout_node_unref (child);
+      g_free (name);
+
+      if (!next_path)
+        return child;
+
+      return find_submenu (submenus, child, next_path, create_if_not_found);
+    }
+  else
+    {
+      g_free (name);
+      return NULL;
+    }
+}
+
+/* Does move_children() and unlinks @from, keeping @submenus in sync */
+static void
+move_submenu (GHashTable     *submenus,
+              MenuLayoutNode *from,
+              MenuLayoutNode *to)
+{
+  MenuLayoutNode *child;
+  GHashTable     *by_name;
+  GSList         *moved;
+  GSList         *tmp;
+  const char     *name;
+
+  /* this has to be done while @from still has its <Name> */
+  by_name = g_hash_table_lookup (submenus, menu_layout_node_get_parent (from));
+  name = menu_layout_node_menu_get_name (from);
+
+  if (by_name != NULL && name != NULL &&
+      g_hash_table_lookup (by_name, name) == from)
+    {
+      g_hash_table_remove (by_name, name);
+
+      /* another child of that name may now come first */
+      child = menu_layout_node_get_next (from);
+      while (child != NULL)
+        {
+          if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU &&
+              g_strcmp0 (menu_layout_node_menu_get_name (child), name) == 0)
+            {
+              g_hash_table_replace (by_name,
+                                    (char *) menu_layout_node_menu_get_name (child),
+                                    child);
+              break;
+            }
+
+          child = menu_layout_node_get_next (child);
+        }
+    }
+
+  g_hash_table_remove (submenus, from);
+
+  /* the children of @from go before the ones of @to, so they are found
+   * first from now on */
+  moved = NULL;
+  child = menu_layout_node_get_children (from);
+  while (child != NULL)
+    {
+      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
+        moved = g_slist_prepend (moved, child);
+
+      child = menu_layout_node_get_next (child);
+    }
+
+  move_children (from, to);
+  menu_layout_node_unlink (from);
+
+  by_name = g_hash_table_lookup (submenus, to);
+  for (tmp = moved; by_name != NULL && tmp != NULL; tmp = tmp->next)
+    {
+      name = menu_layout_node_menu_get_name (tmp->data);
+      if (name != NULL)
+        g_hash_table_replace (by_name, (char *) name, tmp->data);
+    }
+  g_slist_free (moved);
+}
+
+/* To call this you first have to strip duplicate children once,
+ * otherwise when you move a menu Foo to Bar then you may only
+ * move one of Foo, not all the merged Foo.
+ */
+static void
+execute_moves (GHashTable     *submenus,
+               MenuLayoutNode *layout,
+               gboolean       *need_remove_dups_p)
+{
+  MenuLayoutNode *child;
+  GSList         *move_nodes;
+  GSList         *tmp;
+
+  move_nodes = NULL;
+
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      switch (menu_layout_node_get_type (child))
+        {
+        case MENU_LAYOUT_NODE_MENU:
+          /* Recurse - we recurse first and process the current node
+           * second, as the spec dictates.
+           */
+          execute_moves (submenus, child, need_remove_dups_p);
+          break;
+
+        case MENU_LAYOUT_NODE_MOVE:
+          move_nodes = g_slist_prepend (move_nodes, child);
+          break;
+
+        default:
+          break;
+        }
+
+      child = menu_layout_node_get_next (child);
+    }
+
+  /* We need to execute the move operations in the order that they appear */
+  move_nodes = g_slist_reverse (move_nodes);
+
+  tmp = move_nodes;
+  while (tmp != NULL)
+    {
+      MenuLayoutNode *move_node = tmp->data;
+      MenuLayoutNode *old_node;
+      GSList         *next = tmp->next;
+      const char     *old;
+      const char     *new;
+
+      old = menu_layout_node_move_get_old (move_node);
+      new = menu_layout_node_move_get_new (move_node);
+      g_assert (old != NULL && new != NULL);
+
+      menu_verbose ("executing <Move> old = \"%s\" new = \"%s\"\n",
+                    old, new);
+
+      old_node = find_submenu (submenus, layout, old, FALSE);
+      if (old_node != NULL)
+        {
+          MenuLayoutNode *new_node;
+
+          /* here we can create duplicates anywhere below the
+           * node
+           */
+          *need_remove_dups_p = TRUE;
+
+          /* look up new node creating it and its parents if
+           * required
+           */
+          new_node = find_submenu (submenus, layout, new, TRUE);
+          g_assert (new_node != NULL);
+
+          move_submenu (submenus, old_node, new_node);
+        }
+
+      menu_layout_node_unlink (move_node);
+
+      tmp = next;
+    }
+
+  g_slist_free (move_nodes);
+}
+
+static void
+gde2menu_tree_execute_moves (Gde2MenuTree   *tree,
+			     MenuLayoutNode *layout)
+{
+  GHashTable *submenus;
+  gboolean    need_remove_dups;
+
+  submenus = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                    NULL, (GDestroyNotify) g_hash_table_destroy);
+  need_remove_dups = FALSE;
+
+  execute_moves (submenus, layout, &need_remove_dups);
+
+  g_hash_table_destroy (submenus);
+
+  /* Only remove dups once, at the root, instead of recursing the
+   * tree over and over.
+   */
+  if (need_remove_dups)
+    gde2menu_tree_strip_duplicate_children (tree, layout);
+}
+
+static void
+gde2menu_tree_load_layout (Gde2MenuTree *tree)
+{
+  GHashTable     *loaded_menu_files;
+  GHashTable     *seen;
+  MenuLayoutNode *layout;
+  GError         *error;
+  char           *compiled_key;
+
+  if (tree->layout)
+    return;
+
+  if (!gde2menu_tree_canonicalize_path (tree))
+    return;
+
+  if ((tree->shared_layout = gde2menu_tree_shared_layout_lookup (tree)) != NULL)
+    {
+      tree->layout = tree->shared_layout->layout;
+      return;
+    }
+
+  tree->shared_layout = gde2menu_tree_shared_layout_new (tree);
+  compiled_key = get_compiled_layout_key (tree);
+
+  if (gde2menu_tree_shared_layout_load (tree->shared_layout, compiled_key))
+    {
+      menu_verbose ("Using compiled menu layout for \"%s\"\n",
+                    tree->canonical_path);
+
+      gde2menu_tree_add_merged_file_monitors (tree, tree->shared_layout);
+      layout = tree->shared_layout->layout;
+    }
+  else
+    {
+      menu_verbose ("Loading menu layout from \"%s\"\n",
+                    tree->canonical_path);
+
+      error = NULL;
+      layout = gde2menu_tree_load_menu_file (tree,
+					     tree->canonical_path,
+					     tree->type == GDE2MENU_TREE_BASENAME ?
+					          tree->basename : NULL,
+					     &error);
+      if (layout == NULL)
+        {
+          g_warning ("Error loading menu layout from \"%s\": %s",
+                     tree->canonical_path, error->message);
+          g_error_free (error);
+
+          gde2menu_tree_shared_layout_unref (tree->shared_layout);
+          tree->shared_layout = NULL;
+          g_free (compiled_key);
+          return;
+        }
+
+      loaded_menu_files = g_hash_table_new (g_str_hash, g_str_equal);
+      g_hash_table_insert (loaded_menu_files, tree->canonical_path, GUINT_TO_POINTER (TRUE));
+      gde2menu_tree_resolve_files (tree, loaded_menu_files, layout);
+      g_hash_table_destroy (loaded_menu_files);
+
+      gde2menu_tree_strip_duplicate_children (tree, layout);
+      gde2menu_tree_execute_moves (tree, layout);
+
+      seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      gde2menu_tree_monitor_missing_dirs (tree, seen, layout);
+      g_hash_table_destroy (seen);
+
+      tree->shared_layout->layout = layout;
+
+      gde2menu_tree_shared_layout_save (tree->shared_layout, compiled_key);
+    }
+
+  g_free (compiled_key);
+
+  tree->layout = layout;
+
+  /* this is added before any tree monitor, so that the matches are dropped
+   * before the trees get notified and possibly rebuilt */
+  menu_layout_node_root_add_entries_monitor (layout,
+					     (MenuLayoutNodeEntriesChangedFunc) handle_shared_layout_entries_changed,
+					     tree->shared_layout);
+}
+
+static void
+gde2menu_tree_release_layout (Gde2MenuTree *tree,
+			      gboolean      invalidate)
+{
+  gde2menu_tree_force_rebuild (tree);
+
+  if (tree->shared_layout)
+    {
+      /* make sure the other trees won't pick up the stale layout */
+      if (invalidate)
+	gde2menu_tree_shared_layout_uncache (tree->shared_layout);
+
+      gde2menu_tree_shared_layout_unref (tree->shared_layout);
+    }
+  tree->shared_layout = NULL;
+  tree->layout = NULL;
+}
+
+static void
+gde2menu_tree_force_reload (Gde2MenuTree *tree)
+{
+  gde2menu_tree_release_layout (tree, TRUE);
+}
+
+typedef struct
+{
+  DesktopEntrySet *set;
+  const char      *category;
+} GetByCategoryForeachData;
+
+static void
+get_by_category_foreach (const char               *file_id,
+			 DesktopEntry             *entry,
+			 GetByCategoryForeachData *data)
+{
+  if (desktop_entry_has_category (entry, data->category))
+    desktop_entry_set_add_entry (data->set, entry, file_id);
+}
+
+static void
+get_by_category (DesktopEntrySet *entry_pool,
+		 DesktopEntrySet *set,
+		 const char      *category)
+{
+  GetByCategoryForeachData data;
+
+  data.set      = set;
+  data.category = category;
+
+  desktop_entry_set_foreach (entry_pool,
+			     (DesktopEntrySetForeachFunc) get_by_category_foreach,
+			     &data);
+}
+
+static DesktopEntrySet *
+process_include_rules (MenuLayoutNode  *layout,
+		       DesktopEntrySet *entry_pool)
+{
+  DesktopEntrySet *set = NULL;
+
+  switch (menu_layout_node_get_type (layout))
+    {
+    case MENU_LAYOUT_NODE_AND:
+      {
+        MenuLayoutNode *child;
+
+	menu_verbose ("Processing <And>\n");
+
+        child = menu_layout_node_get_children (layout);
+        while (child != NULL)
+          {
+            DesktopEntrySet *child_set;
+
+            child_set = process_include_rules (child, entry_pool);
+
+            if (set == NULL)
+              {
+                set = child_set;
+              }
+            else
+              {
+                desktop_entry_set_intersection (set, child_set);
+                desktop_entry_set_unref (child_set);
+              }
+
+            /* as soon as we get empty results, we can bail,
+             * because it's an AND
+             */
+            if (desktop_entry_set_get_count (set) == 0)
+              break;
+
+            child = menu_layout_node_get_next (child);
+          }
+	menu_verbose ("Processed <And>\n");
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_OR:
+      {
+        MenuLayoutNode *child;
+
+	menu_verbose ("Processing <Or>\n");
+
+        child = menu_layout_node_get_children (layout);
+        while (child != NULL)
+          {
+            DesktopEntrySet *child_set;
+
+            child_set = process_include_rules (child, entry_pool);
+
+            if (set == NULL)
+              {
+                set = child_set;
+              }
+            else
+              {
+                desktop_entry_set_union (set, child_set);
+                desktop_entry_set_unref (child_set);
+              }
+
+            child = menu_layout_node_get_next (child);
+          }
+	menu_verbose ("Processed <Or>\n");
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_NOT:
+      {
+        /* First get the OR of all the rules */
+        MenuLayoutNode *child;
+
+	menu_verbose ("Processing <Not>\n");
+
+        child = menu_layout_node_get_children (layout);
+        while (child != NULL)
+          {
+            DesktopEntrySet *child_set;
+
+            child_set = process_include_rules (child, entry_pool);
+
+            if (set == NULL)
+              {
+                set = child_set;
+              }
+            else
+              {
+                desktop_entry_set_union (set, child_set);
+                desktop_entry_set_unref (child_set);
+              }
+
+            child = menu_layout_node_get_next (child);
+          }
+
+        if (set != NULL)
+          {
+	    DesktopEntrySet *inverted;
+
+	    /* Now invert the result */
+	    inverted = desktop_entry_set_new ();
+	    desktop_entry_set_union (inverted, entry_pool);
+	    desktop_entry_set_subtract (inverted, set);
+	    desktop_entry_set_unref (set);
+	    set = inverted;
+          }
+	menu_verbose ("Processed <Not>\n");
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_ALL:
+      menu_verbose ("Processing <All>\n");
+      set = desktop_entry_set_new ();
+      desktop_entry_set_union (set, entry_pool);
+      menu_verbose ("Processed <All>\n");
+      break;
+
+    case MENU_LAYOUT_NODE_FILENAME:
+      {
+        DesktopEntry *entry;
+
+	menu_verbose ("Processing <Filename>%s</Filename>\n",
+		      menu_layout_node_get_content (layout));
+
+        entry = desktop_entry_set_lookup (entry_pool,
+					  menu_layout_node_get_content (layout));
+        if (entry != NULL)
+          {
+            set = desktop_entry_set_new ();
+            desktop_entry_set_add_entry (set,
+                                         entry,
+                                         menu_layout_node_get_content (layout));
+          }
+	menu_verbose ("Processed <Filename>%s</Filename>\n",
+		      menu_layout_node_get_content (layout));
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_CATEGORY:
+      menu_verbose ("Processing <Category>%s</Category>\n",
+		    menu_layout_node_get_content (layout));
+      set = desktop_entry_set_new ();
+      get_by_category (entry_pool, set, menu_layout_node_get_content (layout));
+      menu_verbose ("Processed <Category>%s</Category>\n",
+		    menu_layout_node_get_content (layout));
+      break;
+
+    default:
+      break;
+    }
+
+  if (set == NULL)
+    set = desktop_entry_set_new (); /* create an empty set */
+
+  menu_verbose ("Matched %d entries\n", desktop_entry_set_get_count (set));
+
+  return set;
+}
+
+static void
+collect_layout_info (MenuLayoutNode  *layout,
+		     GSList         **layout_info)
+{
+  MenuLayoutNode *iter;
+
+  g_slist_foreach (*layout_info,
+		   (GFunc) menu_layout_node_unref,
+		   NULL);
+  g_slist_free (*layout_info);
+  *layout_info = NULL;
+
+  iter = menu_layout_node_get_children (layout);
+  while (iter != NULL)
+    {
+      switch (menu_layout_node_get_type (iter))
+	{
+	case MENU_LAYOUT_NODE_MENUNAME:
+	case MENU_LAYOUT_NODE_FILENAME:
+	case MENU_LAYOUT_NODE_SEPARATOR:
+	case MENU_LAYOUT_NODE_MERGE:
+	  *layout_info = g_slist_prepend (*layout_info,
+					  menu_layout_node_ref (iter));
+	  break;
+
+	default:
+	  break;
+	}
+
+      iter = menu_layout_node_get_next (iter);
+    }
+
+  *layout_info = g_slist_reverse (*layout_info);
+}
+
+typedef struct
+{
+  Gde2MenuTreeDirectory *directory;
+  gboolean               is_excluded;
+
+  /* for an <OnlyUnallocated/> menu, the entries to leave out */
+  GHashTable            *entry_ids;
+  const guint8          *allocated;
+} EntriesListifyData;
+
+static inline gboolean
+is_entry_allocated (EntriesListifyData *data,
+		    const char         *desktop_file_id)
+{
+  guint id;
+
+  id = GPOINTER_TO_UINT (g_hash_table_lookup (data->entry_ids, desktop_file_id));
+  if (id == 0)
+    return FALSE;
+
+  id -= 1;
+
+  return (data->allocated[id / 8] & (1 << (id % 8))) != 0;
+}
+
+static void
+entries_listify_foreach (const char         *desktop_file_id,
+                         DesktopEntry       *desktop_entry,
+                         EntriesListifyData *data)
+{
+  if (data->allocated != NULL && is_entry_allocated (data, desktop_file_id))
+    return;
+
+  data->directory->entries =
+    g_slist_prepend (data->directory->entries,
+		     gde2menu_tree_entry_new (data->directory,
+                                           desktop_entry,
+                                           desktop_file_id,
+                                           data->is_excluded,
+                                           desktop_entry_get_no_display (desktop_entry)));
+}
+
+static void
+set_default_layout_values (Gde2MenuTreeDirectory *parent,
+                           Gde2MenuTreeDirectory *child)
+{
+  GSList *tmp;
+
+  /* if the child has a defined default layout, we don't want to override its
+   * values. The parent might have a non-defined layout info (ie, no child of
+   * the DefaultLayout node) but it doesn't meant the default layout values
+   * (ie, DefaultLayout attributes) aren't different from the global defaults.
+   */
+  if (child->default_layout_info != NULL ||
+      child->default_layout_values.mask != MENU_LAYOUT_VALUES_NONE)
+    return;
+
+  child->default_layout_values = parent->default_layout_values;
+
+  tmp = child->subdirs;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeDirectory *subdir = tmp->data;
+
+      set_default_layout_values (child, subdir);
+
+      tmp = tmp->next;
+   }
+}
+
+static MenuMatches *
+get_menu_matches_interpreted (MenuLayoutNode  *layout,
+			      DesktopEntrySet *entry_pool)
+{
+  MenuLayoutNode *layout_iter;
+  MenuMatches    *matches;
+
+  matches = g_new0 (MenuMatches, 1);
+
+  matches->entries   = desktop_entry_set_new ();
+  matches->allocated = desktop_entry_set_new ();
+  matches->excluded  = desktop_entry_set_new ();
+
+  layout_iter = menu_layout_node_get_children (layout);
+  while (layout_iter != NULL)
+    {
+      switch (menu_layout_node_get_type (layout_iter))
+        {
+        case MENU_LAYOUT_NODE_INCLUDE:
+          {
+            /* The match rule children of the <Include> are
+             * independent (logical OR) so we can process each one by
+             * itself
+             */
+            MenuLayoutNode *rule;
+
+	    menu_verbose ("Processing <Include> (%d entries)\n",
+			  desktop_entry_set_get_count (matches->entries));
+
+            rule = menu_layout_node_get_children (layout_iter);
+            while (rule != NULL)
+              {
+                DesktopEntrySet *rule_set;
+
+                rule_set = process_include_rules (rule, entry_pool);
+                if (rule_set != NULL)
+                  {
+                    desktop_entry_set_union (matches->entries, rule_set);
+                    desktop_entry_set_union (matches->allocated, rule_set);
+		    desktop_entry_set_subtract (matches->excluded, rule_set);
+                    desktop_entry_set_unref (rule_set);
+                  }
+
+                rule = menu_layout_node_get_next (rule);
+              }
+
+	    menu_verbose ("Processed <Include> (%d entries)\n",
+			  desktop_entry_set_get_count (matches->entries));
+          }
+          break;
+
+        case MENU_LAYOUT_NODE_EXCLUDE:
+          {
+            /* The match rule children of the <Exclude> are
+             * independent (logical OR) so we can process each one by
+             * itself
+             */
+            MenuLayoutNode *rule;
+
+	    menu_verbose ("Processing <Exclude> (%d entries)\n",
+			  desktop_entry_set_get_count (matches->entries));
+
+            rule = menu_layout_node_get_children (layout_iter);
+            while (rule != NULL)
+              {
+                DesktopEntrySet *rule_set;
+
+                rule_set = process_include_rules (rule, entry_pool);
+                if (rule_set != NULL)
+                  {
+		    desktop_entry_set_union (matches->excluded, rule_set);
+		    desktop_entry_set_subtract (matches->entries, rule_set);
+		    desktop_entry_set_unref (rule_set);
+                  }
+
+                rule = menu_layout_node_get_next (rule);
+              }
+
+	    menu_verbose ("Processed <Exclude> (%d entries)\n",
+			  desktop_entry_set_get_count (matches->entries));
+          }
+          break;
+
+        default:
+          break;
+        }
+
+      layout_iter = menu_layout_node_get_next (layout_iter);
+    }
+
+  return matches;
+}
+
+/* The rules are first turned into a tree of MenuRuleNode, which is
+ * simplified and reordered before being flattened to MenuRule. */
+typedef struct
+{
+  MenuRuleType  type;
+  GSList       *children;
+
+  union
+  {
+    const char *filename;
+    GQuark      category;
+  } u;
+
+  /* estimated fraction of the entry pool that the rule matches */
+  double        selectivity;
+} MenuRuleNode;
+
+static void
+menu_rule_node_free (MenuRuleNode *node)
+{
+  g_slist_foreach (node->children, (GFunc) menu_rule_node_free, NULL);
+  g_slist_free (node->children);
+  g_free (node);
+}
+
+static MenuRuleNode *
+menu_rule_node_new (MenuRuleType type)
+{
+  MenuRuleNode *node;
+
+  node = g_new0 (MenuRuleNode, 1);
+  node->type = type;
+
+  return node;
+}
+
+static MenuRuleNode *
+menu_rule_node_new_from_layout (MenuLayoutNode *layout)
+{
+  MenuRuleNode   *node;
+  MenuLayoutNode *child;
+
+  switch (menu_layout_node_get_type (layout))
+    {
+    case MENU_LAYOUT_NODE_INCLUDE:
+      node = menu_rule_node_new (MENU_RULE_INCLUDE);
+      break;
+
+    case MENU_LAYOUT_NODE_EXCLUDE:
+      node = menu_rule_node_new (MENU_RULE_EXCLUDE);
+      break;
+
+    case MENU_LAYOUT_NODE_AND:
+      node = menu_rule_node_new (MENU_RULE_AND);
+      break;
+
+    case MENU_LAYOUT_NODE_OR:
+      node = menu_rule_node_new (MENU_RULE_OR);
+      break;
+
+    case MENU_LAYOUT_NODE_NOT:
+      node = menu_rule_node_new (MENU_RULE_NOT);
+      break;
+
+    case MENU_LAYOUT_NODE_ALL:
+      return menu_rule_node_new (MENU_RULE_ALL);
+
+    case MENU_LAYOUT_NODE_FILENAME:
+      /* the content of <Filename> is interned, so it outlives the layout */
+      node = menu_rule_node_new (MENU_RULE_FILENAME);
+      node->u.filename = menu_layout_node_get_content (layout);
+      return node;
+
+    case MENU_LAYOUT_NODE_CATEGORY:
+      /* the entries may not be loaded yet, so the quark may not exist yet */
+      node = menu_rule_node_new (MENU_RULE_CATEGORY);
+      node->u.category = g_quark_from_string (menu_layout_node_get_content (layout));
+      return node;
+
+    default:
+      return menu_rule_node_new (MENU_RULE_NONE);
+    }
+
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      node->children = g_slist_prepend (node->children,
+					menu_rule_node_new_from_layout (child));
+
+      child = menu_layout_node_get_next (child);
+    }
+  node->children = g_slist_reverse (node->children);
+
+  return node;
+}
+
+typedef struct
+{
+  /* GQuark of a category -> number of entries of the pool in it */
+  GHashTable *category_counts;
+  int         n_entries;
+} MenuRuleStats;
+
+static void
+collect_rule_categories (MenuRuleNode  *node,
+			 MenuRuleStats *stats)
+{
+  if (node->type == MENU_RULE_CATEGORY)
+    g_hash_table_insert (stats->category_counts,
+			 GUINT_TO_POINTER (node->u.category),
+			 GINT_TO_POINTER (0));
+
+  g_slist_foreach (node->children, (GFunc) collect_rule_categories, stats);
+}
+
+static void
+count_categories_foreach (const char    *file_id,
+			  DesktopEntry  *entry,
+			  MenuRuleStats *stats)
+{
+  GHashTableIter iter;
+  gpointer       category;
+  gpointer       count;
+
+  g_hash_table_iter_init (&iter, stats->category_counts);
+  while (g_hash_table_iter_next (&iter, &category, &count))
+    {
+      if (desktop_entry_has_category_quark (entry, GPOINTER_TO_UINT (category)))
+        g_hash_table_iter_replace (&iter, GINT_TO_POINTER (GPOINTER_TO_INT (count) + 1));
+    }
+}
+
+static gboolean
+menu_rule_node_equal (MenuRuleNode *a,
+		      MenuRuleNode *b)
+{
+  if (a->type != b->type)
+    return FALSE;
+
+  switch (a->type)
+    {
+    case MENU_RULE_FILENAME:
+      /* interned */
+      return a->u.filename == b->u.filename;
+
+    case MENU_RULE_CATEGORY:
+      return a->u.category == b->u.category;
+
+    case MENU_RULE_ALL:
+    case MENU_RULE_NONE:
+      return TRUE;
+
+    default:
+      return FALSE;
+    }
+}
+
+static gboolean
+has_equal_menu_rule (GSList       *nodes,
+		     MenuRuleNode *node)
+{
+  for (; nodes != NULL; nodes = nodes->next)
+    {
+      if (menu_rule_node_equal (nodes->data, node))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static int
+compare_rule_selectivity (MenuRuleNode *a,
+			  MenuRuleNode *b)
+{
+  if (a->selectivity < b->selectivity)
+    return -1;
+  if (a->selectivity > b->selectivity)
+    return 1;
+
+  /* so that the same rules written in another order end up the same, and
+   * share their results */
+  if (a->type != b->type)
+    return a->type < b->type ? -1 : 1;
+
+  if (a->type == MENU_RULE_CATEGORY && a->u.category != b->u.category)
+    return a->u.category < b->u.category ? -1 : 1;
+
+  if (a->type == MENU_RULE_FILENAME)
+    return strcmp (a->u.filename, b->u.filename);
+
+  return 0;
+}
+
+static int
+compare_rule_selectivity_reversed (MenuRuleNode *a,
+				   MenuRuleNode *b)
+{
+  return compare_rule_selectivity (b, a);
+}
+
+static MenuRuleNode *optimize_menu_rule (MenuRuleNode  *node,
+					 MenuRuleStats *stats);
+
+/* Optimizes the children of an <And>, <Or>, <Include> or <Exclude>: nested
+ * operators of the same kind are flattened, constants and duplicates are
+ * dropped, and the children most likely to decide the result come first.
+ * Returns FALSE if a child decides the result on its own. */
+static gboolean
+optimize_menu_rule_children (MenuRuleNode  *node,
+			     MenuRuleType   flatten,
+			     MenuRuleType   identity,
+			     MenuRuleStats *stats)
+{
+  GSList *optimized;
+  GSList *children;
+  GSList *tmp;
+
+  /* the children of nested operators of the same kind are already
+   * optimized, and are taken as they are */
+  optimized = NULL;
+  for (tmp = node->children; tmp != NULL; tmp = tmp->next)
+    {
+      MenuRuleNode *child = optimize_menu_rule (tmp->data, stats);
+
+      if (child->type == flatten)
+        {
+          GSList *grandchildren;
+
+          for (grandchildren = child->children; grandchildren != NULL; grandchildren = grandchildren->next)
+            optimized = g_slist_prepend (optimized, grandchildren->data);
+
+          g_slist_free (child->children);
+          child->children = NULL;
+          menu_rule_node_free (child);
+        }
+      else
+        {
+          optimized = g_slist_prepend (optimized, child);
+        }
+    }
+  g_slist_free (node->children);
+  node->children = NULL;
+
+  optimized = g_slist_reverse (optimized);
+
+  children = NULL;
+
+  tmp = optimized;
+  while (tmp != NULL)
+    {
+      MenuRuleNode *child = tmp->data;
+
+      tmp = g_slist_delete_link (tmp, tmp);
+
+      if (child->type == identity ||
+          has_equal_menu_rule (children, child))
+        {
+          menu_rule_node_free (child);
+          continue;
+        }
+
+      if (child->type == MENU_RULE_ALL || child->type == MENU_RULE_NONE)
+        {
+          g_slist_foreach (children, (GFunc) menu_rule_node_free, NULL);
+          g_slist_free (children);
+          g_slist_foreach (tmp, (GFunc) menu_rule_node_free, NULL);
+          g_slist_free (tmp);
+
+          node->children = g_slist_prepend (NULL, child);
+          return FALSE;
+        }
+
+      children = g_slist_prepend (children, child);
+    }
+
+  children = g_slist_reverse (children);
+
+  if (flatten == MENU_RULE_AND)
+    children = g_slist_sort (children, (GCompareFunc) compare_rule_selectivity);
+  else
+    children = g_slist_sort (children, (GCompareFunc) compare_rule_selectivity_reversed);
+
+  node->children = children;
+
+  return TRUE;
+}
+
+static MenuRuleNode *
+replace_menu_rule (MenuRuleNode *node,
+		   MenuRuleType  type)
+{
+  menu_rule_node_free (node);
+
+  node = menu_rule_node_new (type);
+  node->selectivity = type == MENU_RULE_ALL ? 1.0 : 0.0;
+
+  return node;
+}
+
+static MenuRuleNode *
+take_only_child (MenuRuleNode *node)
+{
+  MenuRuleNode *child = node->children->data;
+
+  g_slist_free (node->children);
+  node->children = NULL;
+  menu_rule_node_free (node);
+
+  return child;
+}
+
+static MenuRuleNode *
+optimize_menu_rule (MenuRuleNode  *node,
+		    MenuRuleStats *stats)
+{
+  GSList *tmp;
+  double  selectivity;
+
+  switch (node->type)
+    {
+    case MENU_RULE_AND:
+      /* an empty <And> matches nothing, but <All/> doesn't change one */
+      if (node->children == NULL)
+        return replace_menu_rule (node, MENU_RULE_NONE);
+
+      if (!optimize_menu_rule_children (node, MENU_RULE_AND, MENU_RULE_ALL, stats))
+        return take_only_child (node);
+
+      if (node->children == NULL)
+        return replace_menu_rule (node, MENU_RULE_ALL);
+      if (node->children->next == NULL)
+        return take_only_child (node);
+
+      selectivity = 1.0;
+      for (tmp = node->children; tmp != NULL; tmp = tmp->next)
+        selectivity *= ((MenuRuleNode *) tmp->data)->selectivity;
+      node->selectivity = selectivity;
+      break;
+
+    case MENU_RULE_OR:
+    case MENU_RULE_INCLUDE:
+    case MENU_RULE_EXCLUDE:
+      if (!optimize_menu_rule_children (node, MENU_RULE_OR, MENU_RULE_NONE, stats))
+        {
+          if (node->type == MENU_RULE_OR)
+            return take_only_child (node);
+        }
+      else if (node->type == MENU_RULE_OR)
+        {
+          if (node->children == NULL)
+            return replace_menu_rule (node, MENU_RULE_NONE);
+          if (node->children->next == NULL)
+            return take_only_child (node);
+        }
+
+      selectivity = 0.0;
+      for (tmp = node->children; tmp != NULL; tmp = tmp->next)
+        selectivity += ((MenuRuleNode *) tmp->data)->selectivity;
+      node->selectivity = MIN (selectivity, 1.0);
+      break;
+
+    case MENU_RULE_NOT:
+      {
+        MenuRuleNode *child;
+
+        /* an empty <Not> matches nothing, else it inverts the <Or> of its
+         * children */
+        if (node->children == NULL)
+          return replace_menu_rule (node, MENU_RULE_NONE);
+
+        child = menu_rule_node_new (MENU_RULE_OR);
+        child->children = node->children;
+        node->children = NULL;
+
+        child = optimize_menu_rule (child, stats);
+
+        if (child->type == MENU_RULE_ALL || child->type == MENU_RULE_NONE)
+          {
+            MenuRuleType type = child->type == MENU_RULE_ALL ? MENU_RULE_NONE : MENU_RULE_ALL;
+
+            menu_rule_node_free (child);
+            return replace_menu_rule (node, type);
+          }
+
+        if (child->type == MENU_RULE_NOT)
+          {
+            menu_rule_node_free (node);
+            return take_only_child (child);
+          }
+
+        node->children = g_slist_prepend (NULL, child);
+        node->selectivity = 1.0 - child->selectivity;
+      }
+      break;
+
+    case MENU_RULE_ALL:
+      node->selectivity = 1.0;
+      break;
+
+    case MENU_RULE_FILENAME:
+      node->selectivity = stats->n_entries > 0 ? 1.0 / stats->n_entries : 0.0;
+      break;
+
+    case MENU_RULE_CATEGORY:
+      node->selectivity = stats->n_entries > 0 ?
+                          (double) GPOINTER_TO_INT (g_hash_table_lookup (stats->category_counts,
+                                                                         GUINT_TO_POINTER (node->u.category))) / stats->n_entries :
+                          0.0;
+      break;
+
+    default:
+      node->selectivity = 0.0;
+      break;
+    }
+
+  return node;
+}
+
+static void
+flatten_menu_rule (GArray       *rules,
+		   MenuRuleNode *node)
+{
+  MenuRule rule = { MENU_RULE_NONE, 0, { NULL } };
+  GSList  *tmp;
+  guint    index;
+
+  /* the rules are compared as bytes by get_menu_rule_results(): the
+   * unused bytes of the union must be zero */
+  rule.type = node->type;
+
+  if (node->type == MENU_RULE_FILENAME)
+    rule.u.filename = node->u.filename;
+  else
+    rule.u.category = node->u.category;
+
+  index = rules->len;
+  g_array_append_val (rules, rule);
+
+  for (tmp = node->children; tmp != NULL; tmp = tmp->next)
+    flatten_menu_rule (rules, tmp->data);
+
+  g_array_index (rules, MenuRule, index).end = rules->len;
+}
+
+#ifdef G_ENABLE_DEBUG
+static void
+append_menu_rule (GString      *str,
+		  MenuRuleNode *node,
+		  int           depth,
+		  int           n_entries)
+{
+  static const char *names[] = {
+    "Include", "Exclude", "And", "Or", "Not", "All", "Filename", "Category", "None"
+  };
+  GSList *tmp;
+
+  g_string_append_printf (str, "%*s<%s>", depth * 2, "", names[node->type]);
+
+  if (node->type == MENU_RULE_FILENAME)
+    g_string_append_printf (str, "%s</Filename>", node->u.filename);
+  else if (node->type == MENU_RULE_CATEGORY)
+    g_string_append_printf (str, "%s</Category>", g_quark_to_string (node->u.category));
+
+  g_string_append_printf (str, " (~%d entries)\n",
+			  (int) (node->selectivity * n_entries + 0.5));
+
+  for (tmp = node->children; tmp != NULL; tmp = tmp->next)
+    append_menu_rule (str, tmp->data, depth + 1, n_entries);
+}
+#endif /* G_ENABLE_DEBUG */
+
+static GArray *
+get_menu_rules (Gde2MenuTree    *tree,
+		MenuLayoutNode  *layout,
+		DesktopEntrySet *entry_pool)
+{
+  MenuLayoutNode *layout_iter;
+  GSList         *statements;
+  GSList         *tmp;
+  MenuRuleStats   stats;
+  GArray         *rules;
+
+  rules = g_hash_table_lookup (tree->shared_layout->rules, layout);
+  if (rules != NULL)
+    return rules;
+
+  statements = NULL;
+
+  layout_iter = menu_layout_node_get_children (layout);
+  while (layout_iter != NULL)
+    {
+      switch (menu_layout_node_get_type (layout_iter))
+        {
+        case MENU_LAYOUT_NODE_INCLUDE:
+        case MENU_LAYOUT_NODE_EXCLUDE:
+          statements = g_slist_prepend (statements,
+					menu_rule_node_new_from_layout (layout_iter));
+          break;
+
+        default:
+          break;
+        }
+
+      layout_iter = menu_layout_node_get_next (layout_iter);
+    }
+  statements = g_slist_reverse (statements);
+
+  /* the order of the <And> and <Or> children is picked from how many
+   * entries of this pool their categories match; the rules are kept when
+   * the pool changes, and the order is then only less good */
+  stats.category_counts = g_hash_table_new (NULL, NULL);
+  stats.n_entries       = desktop_entry_set_get_count (entry_pool);
+
+  g_slist_foreach (statements, (GFunc) collect_rule_categories, &stats);
+  if (g_hash_table_size (stats.category_counts) > 0)
+    desktop_entry_set_foreach (entry_pool,
+			       (DesktopEntrySetForeachFunc) count_categories_foreach,
+			       &stats);
+
+  rules = g_array_new (FALSE, FALSE, sizeof (MenuRule));
+
+  for (tmp = statements; tmp != NULL; tmp = tmp->next)
+    {
+      MenuRuleNode *statement;
+
+      /* <Include> and <Exclude> are never replaced, and the order between
+       * them matters */
+      statement = optimize_menu_rule (tmp->data, &stats);
+
+      if (statement->children != NULL &&
+          ((MenuRuleNode *) statement->children->data)->type != MENU_RULE_NONE)
+        flatten_menu_rule (rules, statement);
+    }
+
+#ifdef G_ENABLE_DEBUG
+  {
+    GString *str = g_string_new (NULL);
+
+    for (tmp = statements; tmp != NULL; tmp = tmp->next)
+      append_menu_rule (str, tmp->data, 1, stats.n_entries);
+
+    menu_verbose ("Optimized the rules of <Menu> %s to %u instructions:\n%s",
+		  menu_layout_node_menu_get_name (layout), rules->len, str->str);
+
+    g_string_free (str, TRUE);
+  }
+#endif
+
+  g_hash_table_destroy (stats.category_counts);
+
+  g_slist_foreach (statements, (GFunc) menu_rule_node_free, NULL);
+  g_slist_free (statements);
+
+  g_hash_table_insert (tree->shared_layout->rules, layout, rules);
+
+  return rules;
+}
+
+static gboolean
+menu_rule_matches (const MenuRule *rules,
+		   guint           index,
+		   const char     *file_id,
+		   DesktopEntry   *entry)
+{
+  const MenuRule *rule = &rules[index];
+  guint           child;
+
+  switch (rule->type)
+    {
+    case MENU_RULE_AND:
+      /* like the other operators, an empty <And> matches nothing */
+      if (index + 1 == rule->end)
+        return FALSE;
+
+      for (child = index + 1; child < rule->end; child = rules[child].end)
+        {
+          if (!menu_rule_matches (rules, child, file_id, entry))
+            return FALSE;
+        }
+      return TRUE;
+
+    case MENU_RULE_INCLUDE:
+    case MENU_RULE_EXCLUDE:
+    case MENU_RULE_OR:
+      for (child = index + 1; child < rule->end; child = rules[child].end)
+        {
+          if (menu_rule_matches (rules, child, file_id, entry))
+            return TRUE;
+        }
+      return FALSE;
+
+    case MENU_RULE_NOT:
+      if (index + 1 == rule->end)
+        return FALSE;
+
+      for (child = index + 1; child < rule->end; child = rules[child].end)
+        {
+          if (menu_rule_matches (rules, child, file_id, entry))
+            return FALSE;
+        }
+      return TRUE;
+
+    case MENU_RULE_ALL:
+      return TRUE;
+
+    case MENU_RULE_FILENAME:
+      return strcmp (file_id, rule->u.filename) == 0;
+
+    case MENU_RULE_CATEGORY:
+      return desktop_entry_has_category_quark (entry, rule->u.category);
+
+    default:
+      return FALSE;
+    }
+}
+
+static void
+menu_rule_pool_free (MenuRulePool *pool)
+{
+  g_hash_table_destroy (pool->results);
+  g_ptr_array_free (pool->file_ids, TRUE);
+  g_ptr_array_free (pool->entries, TRUE);
+  desktop_entry_set_unref (pool->entry_pool);
+
+  g_free (pool);
+}
+
+static Gde2MenuTreeRuleMemo *
+gde2menu_tree_rule_memo_new (void)
+{
+  Gde2MenuTreeRuleMemo *memo;
+
+  memo = g_new0 (Gde2MenuTreeRuleMemo, 1);
+
+  memo->pools = g_hash_table_new_full (NULL, NULL, NULL,
+				       (GDestroyNotify) menu_rule_pool_free);
+  memo->menus = g_hash_table_new (NULL, NULL);
+
+  return memo;
+}
+
+static void
+gde2menu_tree_rule_memo_free (Gde2MenuTreeRuleMemo *memo)
+{
+  g_hash_table_destroy (memo->menus);
+  g_hash_table_destroy (memo->pools);
+  g_free (memo);
+}
+
+static void
+add_to_rule_pool_foreach (const char   *file_id,
+			  DesktopEntry *entry,
+			  MenuRulePool *pool)
+{
+  g_ptr_array_add (pool->file_ids, (char *) file_id);
+  g_ptr_array_add (pool->entries, entry);
+}
+
+static MenuRulePool *
+get_menu_rule_pool (Gde2MenuTreeRuleMemo *memo,
+		    MenuLayoutNode       *layout)
+{
+  DesktopEntrySet *entry_pool;
+  MenuRulePool    *pool;
+  int              n_entries;
+
+  pool = g_hash_table_lookup (memo->menus, layout);
+  if (pool != NULL)
+    return pool;
+
+  entry_pool = _entry_directory_list_get_all_desktops (menu_layout_node_menu_get_app_dirs (layout));
+
+  /* the menus with the same app dirs one after the other get the same
+   * entry pool, which the memo keeps alive so that its address isn't
+   * reused by another pool */
+  pool = g_hash_table_lookup (memo->pools, entry_pool);
+  if (pool == NULL)
+    {
+      n_entries = desktop_entry_set_get_count (entry_pool);
+
+      pool = g_new0 (MenuRulePool, 1);
+
+      pool->entry_pool = desktop_entry_set_ref (entry_pool);
+      pool->file_ids   = g_ptr_array_sized_new (n_entries);
+      pool->entries    = g_ptr_array_sized_new (n_entries);
+      pool->results    = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+						(GDestroyNotify) g_bytes_unref,
+						g_free);
+
+      desktop_entry_set_foreach (entry_pool,
+				 (DesktopEntrySetForeachFunc) add_to_rule_pool_foreach,
+				 pool);
+
+      g_hash_table_insert (memo->pools, entry_pool, pool);
+    }
+
+  desktop_entry_set_unref (entry_pool);
+
+  g_hash_table_insert (memo->menus, layout, pool);
+
+  return pool;
+}
+
+static void
+evaluate_menu_rule (MenuRuleEvaluation *evaluation,
+		    gpointer            data)
+{
+  MenuRulePool *pool = evaluation->pool;
+  guint         i;
+
+  for (i = 0; i < pool->entries->len; i++)
+    evaluation->results[i] = menu_rule_matches ((const MenuRule *) evaluation->rules->data,
+						evaluation->index,
+						g_ptr_array_index (pool->file_ids, i),
+						g_ptr_array_index (pool->entries, i));
+}
+
+/* Returns, for each entry of the pool, whether the rule at index matches
+ * it. The same rule, down to the order of its children, is only evaluated
+ * once per pool while the tree is being built, whatever <Menu> it is in.
+ *
+ * If evaluations isn't NULL, a rule that wasn't evaluated yet is added to
+ * it instead, and its results are only valid once it has been evaluated. */
+static const guint8 *
+get_menu_rule_results (MenuRulePool *pool,
+		       GArray       *rules,
+		       guint         index,
+		       GPtrArray    *evaluations)
+{
+  const MenuRule     *rule = &g_array_index (rules, MenuRule, index);
+  MenuRuleEvaluation *evaluation;
+  MenuRule           *key_rules;
+  GBytes             *key;
+  guint8             *results;
+  guint               n_rules;
+  guint               i;
+
+  n_rules   = rule->end - index;
+  key_rules = g_new (MenuRule, n_rules);
+  memcpy (key_rules, rule, n_rules * sizeof (MenuRule));
+  for (i = 0; i < n_rules; i++)
+    key_rules[i].end -= index;
+
+  key = g_bytes_new_take (key_rules, n_rules * sizeof (MenuRule));
+
+  results = g_hash_table_lookup (pool->results, key);
+  if (results != NULL)
+    {
+      g_bytes_unref (key);
+      return results;
+    }
+
+  results = g_new (guint8, pool->entries->len);
+
+  g_hash_table_insert (pool->results, key, results);
+
+  evaluation = g_new (MenuRuleEvaluation, 1);
+
+  evaluation->pool    = pool;
+  evaluation->rules   = rules;
+  evaluation->index   = index;
+  evaluation->results = results;
+
+  if (evaluations != NULL)
+    {
+      g_ptr_array_add (evaluations, evaluation);
+    }
+  else
+    {
+      evaluate_menu_rule (evaluation, NULL);
+      g_free (evaluation);
+    }
+
+  return results;
+}
+
+static MenuMatches *
+get_menu_matches_compiled (GArray       *rules,
+			   MenuRulePool *pool)
+{
+  MenuMatches *matches;
+  guint8      *states;
+  guint        index;
+  guint        i;
+
+  matches = g_new0 (MenuMatches, 1);
+
+  matches->entries   = desktop_entry_set_new ();
+  matches->allocated = desktop_entry_set_new ();
+  matches->excluded  = desktop_entry_set_new ();
+
+  /* an entry ends up where the last <Include> or <Exclude> that matches it
+   * puts it, and is allocated if any <Include> matches it */
+  states = g_new0 (guint8, pool->entries->len);
+
+  for (index = 0; index < rules->len; index = g_array_index (rules, MenuRule, index).end)
+    {
+      const MenuRule *statement = &g_array_index (rules, MenuRule, index);
+      guint8          state;
+      guint           child;
+
+      if (statement->type == MENU_RULE_INCLUDE)
+        state = MENU_RULE_STATE_INCLUDED | MENU_RULE_STATE_ALLOCATED;
+      else
+        state = MENU_RULE_STATE_EXCLUDED;
+
+      for (child = index + 1; child < statement->end; child = g_array_index (rules, MenuRule, child).end)
+        {
+          const guint8 *results = get_menu_rule_results (pool, rules, child, NULL);
+
+          for (i = 0; i < pool->entries->len; i++)
+            {
+              if (results[i])
+                states[i] = (states[i] & MENU_RULE_STATE_ALLOCATED) | state;
+            }
+        }
+    }
+
+  for (i = 0; i < pool->entries->len; i++)
+    {
+      const char   *file_id = g_ptr_array_index (pool->file_ids, i);
+      DesktopEntry *entry   = g_ptr_array_index (pool->entries, i);
+
+      if (states[i] & MENU_RULE_STATE_INCLUDED)
+        desktop_entry_set_add_entry (matches->entries, entry, file_id);
+      else if (states[i] & MENU_RULE_STATE_EXCLUDED)
+        desktop_entry_set_add_entry (matches->excluded, entry, file_id);
+
+      if (states[i] & MENU_RULE_STATE_ALLOCATED)
+        desktop_entry_set_add_entry (matches->allocated, entry, file_id);
+    }
+
+  g_free (states);
+
+  return matches;
+}
+
+static void
+entry_set_contains_foreach (const char   *file_id,
+			    DesktopEntry *entry,
+			    gpointer      data)
+{
+  DesktopEntrySet **other = data;
+
+  if (*other != NULL && desktop_entry_set_lookup (*other, file_id) != entry)
+    *other = NULL;
+}
+
+static gboolean
+entry_sets_equal (DesktopEntrySet *a,
+		  DesktopEntrySet *b)
+{
+  DesktopEntrySet *other = b;
+
+  if (desktop_entry_set_get_count (a) != desktop_entry_set_get_count (b))
+    return FALSE;
+
+  desktop_entry_set_foreach (a, entry_set_contains_foreach, &other);
+
+  return other != NULL;
+}
+
+/* Set MENU_RULES to "interpret" to evaluate the rules one set at a time
+ * like before they were compiled, or to "check" to evaluate them both ways
+ * and warn when the results differ. */
+typedef enum
+{
+  MENU_RULES_COMPILED,
+  MENU_RULES_INTERPRETED,
+  MENU_RULES_CHECKED
+} MenuRulesMode;
+
+static MenuRulesMode
+get_menu_rules_mode (void)
+{
+  static gsize mode = 0;
+
+  if (g_once_init_enter (&mode))
+    {
+      const char    *env = g_getenv ("MENU_RULES");
+      MenuRulesMode  value = MENU_RULES_COMPILED;
+
+      if (g_strcmp0 (env, "interpret") == 0)
+        value = MENU_RULES_INTERPRETED;
+      else if (g_strcmp0 (env, "check") == 0)
+        value = MENU_RULES_CHECKED;
+
+      g_once_init_leave (&mode, value + 1);
+    }
+
+  return mode - 1;
+}
+
+typedef struct
+{
+  GHashTable *entry_ids;
+  GArray     *ids;
+} AllocatedIdsData;
+
+static void
+add_allocated_id_foreach (const char       *file_id,
+			  DesktopEntry     *entry,
+			  AllocatedIdsData *data)
+{
+  guint id;
+
+  id = GPOINTER_TO_UINT (g_hash_table_lookup (data->entry_ids, file_id));
+  if (id == 0)
+    {
+      id = g_hash_table_size (data->entry_ids) + 1;
+      g_hash_table_insert (data->entry_ids, g_strdup (file_id), GUINT_TO_POINTER (id));
+    }
+
+  id -= 1;
+  g_array_append_val (data->ids, id);
+}
+
+static MenuMatches *
+get_menu_matches (Gde2MenuTree   *tree,
+		  MenuLayoutNode *layout)
+{
+  MenuMatches     *matches;
+  MenuRulePool    *pool;
+  MenuRulesMode    mode;
+
+  matches = g_hash_table_lookup (tree->shared_layout->matches, layout);
+  if (matches != NULL)
+    {
+      menu_verbose ("Using cached matches (%d entries)\n",
+		    desktop_entry_set_get_count (matches->entries));
+      return matches;
+    }
+
+  pool = get_menu_rule_pool (tree->rule_memo, layout);
+
+  mode = get_menu_rules_mode ();
+
+  if (mode == MENU_RULES_INTERPRETED)
+    matches = get_menu_matches_interpreted (layout, pool->entry_pool);
+  else
+    matches = get_menu_matches_compiled (get_menu_rules (tree, layout, pool->entry_pool),
+					 pool);
+
+  if (mode == MENU_RULES_CHECKED)
+    {
+      MenuMatches *interpreted;
+
+      interpreted = get_menu_matches_interpreted (layout, pool->entry_pool);
+
+      if (!entry_sets_equal (matches->entries, interpreted->entries) ||
+          !entry_sets_equal (matches->allocated, interpreted->allocated) ||
+          !entry_sets_equal (matches->excluded, interpreted->excluded))
+        g_warning ("The compiled rules of <Menu> %s don't match the same entries as the interpreted ones",
+                   menu_layout_node_menu_get_name (layout));
+
+      menu_matches_free (interpreted);
+    }
+
+  {
+    AllocatedIdsData data;
+
+    /* the allocation of a build is a bit per id */
+    data.entry_ids = tree->shared_layout->entry_ids;
+    data.ids       = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+					desktop_entry_set_get_count (matches->allocated));
+
+    desktop_entry_set_foreach (matches->allocated,
+			       (DesktopEntrySetForeachFunc) add_allocated_id_foreach,
+			       &data);
+
+    matches->allocated_ids = data.ids;
+  }
+
+  g_hash_table_insert (tree->shared_layout->matches, layout, matches);
+
+  return matches;
+}
+
+static void
+collect_menu_rule_evaluations (Gde2MenuTree   *tree,
+			       MenuLayoutNode *layout,
+			       GPtrArray      *evaluations)
+{
+  MenuLayoutNode *child;
+
+  /* in the same order as process_layout(), which the cache of
+   * _entry_directory_list_get_all_desktops() is tuned for */
+  if (g_hash_table_lookup (tree->shared_layout->matches, layout) == NULL)
+    {
+      MenuRulePool *pool;
+      GArray       *rules;
+      guint         index;
+
+      pool  = get_menu_rule_pool (tree->rule_memo, layout);
+      rules = get_menu_rules (tree, layout, pool->entry_pool);
+
+      for (index = 0; index < rules->len; index = g_array_index (rules, MenuRule, index).end)
+        {
+          guint end = g_array_index (rules, MenuRule, index).end;
+          guint rule;
+
+          for (rule = index + 1; rule < end; rule = g_array_index (rules, MenuRule, rule).end)
+            get_menu_rule_results (pool, rules, rule, evaluations);
+        }
+    }
+
+  child = menu_layout_node_get_children (layout);
+  while (child != NULL)
+    {
+      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
+        collect_menu_rule_evaluations (tree, child, evaluations);
+
+      child = menu_layout_node_get_next (child);
+    }
+}
+
+/* The rules of all the menus are evaluated before building the tree, in
+ * parallel when there are several of them to evaluate: they only read the
+ * pools and the compiled rules, while the rest of the build goes through
+ * caches that aren't thread-safe. */
+static void
+gde2menu_tree_evaluate_rules (Gde2MenuTree   *tree,
+			      MenuLayoutNode *layout)
+{
+  GPtrArray   *evaluations;
+  GThreadPool *pool;
+  guint        i;
+
+  if (get_menu_rules_mode () == MENU_RULES_INTERPRETED)
+    return;
+
+  evaluations = g_ptr_array_new ();
+
+  collect_menu_rule_evaluations (tree, layout, evaluations);
+
+  pool = NULL;
+  if (evaluations->len > 1 && g_get_num_processors () > 1)
+    pool = g_thread_pool_new ((GFunc) evaluate_menu_rule, NULL,
+			      MIN (evaluations->len, g_get_num_processors ()),
+			      FALSE, NULL);
+
+  for (i = 0; i < evaluations->len; i++)
+    {
+      if (pool == NULL || !g_thread_pool_push (pool, evaluations->pdata[i], NULL))
+        evaluate_menu_rule (evaluations->pdata[i], NULL);
+    }
+
+  /* waits for all the evaluations to be done */
+  if (pool != NULL)
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_ptr_array_foreach (evaluations, (GFunc) g_free, NULL);
+  g_ptr_array_free (evaluations, TRUE);
+}
+
+typedef struct
+{
+  /* MenuMatches of the menus whose entries are allocated */
+  GPtrArray *allocating_menus;
+
+  /* Gde2MenuTreeDirectory and MenuMatches of each <OnlyUnallocated/>
+   * menu */
+  GPtrArray *unallocated_menus;
+} MenuAllocation;
+
+static void
+add_menu_entries (Gde2MenuTree          *tree,
+		  Gde2MenuTreeDirectory *directory,
+		  MenuMatches           *matches,
+		  const guint8          *allocated)
+{
+  EntriesListifyData  data;
+  GSList             *tmp;
+
+  data.directory   = directory;
+  data.is_excluded = FALSE;
+  data.entry_ids   = tree->shared_layout->entry_ids;
+  data.allocated   = allocated;
+
+  desktop_entry_set_foreach (matches->entries,
+                             (DesktopEntrySetForeachFunc) entries_listify_foreach,
+                             &data);
+
+  if (tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_EXCLUDED)
+    {
+      data.is_excluded = TRUE;
+      desktop_entry_set_foreach (matches->excluded,
+				 (DesktopEntrySetForeachFunc) entries_listify_foreach,
+				 &data);
+    }
+
+  tmp = directory->entries;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeEntry *entry = tmp->data;
+      GSList         *next  = tmp->next;
+      gboolean        delete = FALSE;
+
+      if (desktop_entry_get_hidden (entry->desktop_entry))
+        {
+          menu_verbose ("Deleting %s because Hidden=true\n",
+                        desktop_entry_get_name (entry->desktop_entry));
+          delete = TRUE;
+        }
+
+      if (!(tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_NODISPLAY) &&
+          desktop_entry_get_no_display (entry->desktop_entry))
+        {
+          menu_verbose ("Deleting %s because NoDisplay=true\n",
+                        desktop_entry_get_name (entry->desktop_entry));
+          delete = TRUE;
+        }
+
+      if (!desktop_entry_get_show_in_gde2 (entry->desktop_entry))
+        {
+          menu_verbose ("Deleting %s because OnlyShowIn!=GDE2 or NotShowIn=GDE2\n",
+                        desktop_entry_get_name (entry->desktop_entry));
+          delete = TRUE;
+        }
+
+      if (desktop_entry_get_tryexec_failed (entry->desktop_entry))
+        {
+          menu_verbose ("Deleting %s because TryExec failed\n",
+                        desktop_entry_get_name (entry->desktop_entry));
+          delete = TRUE;
+        }
+
+      if (delete)
+        {
+          directory->entries = g_slist_delete_link (directory->entries,
+                                                   tmp);
+          gde2menu_tree_item_unref_and_unset_parent (entry);
+        }
+
+      tmp = next;
+    }
+}
+
+static Gde2MenuTreeDirectory *
+process_layout (Gde2MenuTree          *tree,
+                Gde2MenuTreeDirectory *parent,
+                MenuLayoutNode     *layout,
+                MenuAllocation     *allocation)
+{
+  MenuLayoutNode     *layout_iter;
+  Gde2MenuTreeDirectory *directory;
+  MenuMatches        *matches;
+  gboolean            deleted;
+  gboolean            only_unallocated;
+  GSList             *tmp;
+
+  g_assert (menu_layout_node_get_type (layout) == MENU_LAYOUT_NODE_MENU);
+  g_assert (menu_layout_node_menu_get_name (layout) != NULL);
+
+  directory = gde2menu_tree_directory_new (tree->arena,
+					parent,
+					menu_layout_node_menu_get_name (layout),
+					parent == NULL);
+
+  menu_verbose ("=== Menu name = %s ===\n", directory->name);
+
+
+  deleted = FALSE;
+  only_unallocated = FALSE;
+
+  matches = get_menu_matches (tree, layout);
+
+  layout_iter = menu_layout_node_get_children (layout);
+  while (layout_iter != NULL)
+    {
+      switch (menu_layout_node_get_type (layout_iter))
+        {
+        case MENU_LAYOUT_NODE_MENU:
+          /* recurse */
+          {
+            Gde2MenuTreeDirectory *child_dir;
+
+	    menu_verbose ("Processing <Menu>\n");
+
+            child_dir = process_layout (tree,
+                                        directory,
+                                        layout_iter,
+                                        allocation);
+            if (child_dir)
+              directory->subdirs = g_slist_prepend (directory->subdirs,
+                                                    child_dir);
+
+	    menu_verbose ("Processed <Menu>\n");
+          }
+          break;
+
+        case MENU_LAYOUT_NODE_DIRECTORY:
+          {
+            DesktopEntry *entry;
+
+	    menu_verbose ("Processing <Directory>%s</Directory>\n",
+			  menu_layout_node_get_content (layout_iter));
+
+	    /*
+             * The last <Directory> to exist wins, so we always try overwriting
+             */
+            entry = entry_directory_list_get_directory (menu_layout_node_menu_get_directory_dirs (layout),
+                                                        menu_layout_node_get_content (layout_iter));
+
+            if (entry != NULL)
+              {
+                if (!desktop_entry_get_hidden (entry))
+                  {
+                    if (directory->directory_entry)
+                      desktop_entry_unref (directory->directory_entry);
+                    directory->directory_entry = entry; /* pass ref ownership */
+                  }
+                else
+                  {
+                    desktop_entry_unref (entry);
+                  }
+              }
+
+            menu_verbose ("Processed <Directory> new directory entry = %p (%s)\n",
+                          directory->directory_entry,
+			  directory->directory_entry? desktop_entry_get_path (directory->directory_entry) : "null");
+          }
+          break;
+
+        case MENU_LAYOUT_NODE_DELETED:
+	  menu_verbose ("Processed <Deleted/>\n");
+          deleted = TRUE;
+          break;
+
+        case MENU_LAYOUT_NODE_NOT_DELETED:
+	  menu_verbose ("Processed <NotDeleted/>\n");
+          deleted = FALSE;
+          break;
+
+        case MENU_LAYOUT_NODE_ONLY_UNALLOCATED:
+	  menu_verbose ("Processed <OnlyUnallocated/>\n");
+          only_unallocated = TRUE;
+          break;
+
+        case MENU_LAYOUT_NODE_NOT_ONLY_UNALLOCATED:
+	  menu_verbose ("Processed <NotOnlyUnallocated/>\n");
+          only_unallocated = FALSE;
+          break;
+
+	case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
+	  menu_layout_node_default_layout_get_values (layout_iter,
+						      &directory->default_layout_values);
+	  collect_layout_info (layout_iter, &directory->default_layout_info);
+	  menu_verbose ("Processed <DefaultLayout/>\n");
+	  break;
+
+	case MENU_LAYOUT_NODE_LAYOUT:
+	  collect_layout_info (layout_iter, &directory->layout_info);
+	  menu_verbose ("Processed <Layout/>\n");
+	  break;
+
+        default:
+          break;
+        }
+
+      layout_iter = menu_layout_node_get_next (layout_iter);
+    }
+
+  directory->only_unallocated = only_unallocated;
+
+  if (!directory->only_unallocated)
+    g_ptr_array_add (allocation->allocating_menus, matches);
+
+  if (directory->directory_entry)
+    {
+      if (desktop_entry_get_no_display (directory->directory_entry))
+        {
+          directory->is_nodisplay = TRUE;
+
+          if (!(tree->flags & GDE2MENU_TREE_FLAGS_INCLUDE_NODISPLAY))
+            {
+              menu_verbose ("Not showing menu %s because NoDisplay=true\n",
+                        desktop_entry_get_name (directory->directory_entry));
+              deleted = TRUE;
+            }
+        }
+
+      if (!desktop_entry_get_show_in_gde2 (directory->directory_entry))
+        {
+          menu_verbose ("Not showing menu %s because OnlyShowIn!=GDE2 or NotShowIn=GDE2\n",
+                        desktop_entry_get_name (directory->directory_entry));
+          deleted = TRUE;
+        }
+    }
+
+  if (deleted)
+    {
+      gde2menu_tree_item_unref (directory);
+      return NULL;
+    }
+
+  if (directory->only_unallocated)
+    {
+      /* its entries are added once all the allocated ones are known */
+      g_ptr_array_add (allocation->unallocated_menus,
+                       gde2menu_tree_item_ref (directory));
+      g_ptr_array_add (allocation->unallocated_menus, matches);
+    }
+  else
+    {
+      add_menu_entries (tree, directory, matches, NULL);
+    }
+
+  tmp = directory->subdirs;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeDirectory *subdir = tmp->data;
+
+      set_default_layout_values (directory, subdir);
+
+      tmp = tmp->next;
+   }
+
+  g_assert (directory->name != NULL);
+
+  return directory;
+}
+
+/* The entries of the <OnlyUnallocated/> menus are the ones that no other
+ * menu allocated, which is only known once all the menus are processed */
+static void
+add_unallocated_menu_entries (Gde2MenuTree   *tree,
+			      MenuAllocation *allocation)
+{
+  guint8 *allocated;
+  guint   i;
+
+  if (allocation->unallocated_menus->len == 0)
+    return;
+
+  allocated = g_new0 (guint8, (g_hash_table_size (tree->shared_layout->entry_ids) + 7) / 8);
+
+  for (i = 0; i < allocation->allocating_menus->len; i++)
+    {
+      MenuMatches *matches = allocation->allocating_menus->pdata[i];
+      guint        j;
+
+      for (j = 0; j < matches->allocated_ids->len; j++)
+        {
+          guint id = g_array_index (matches->allocated_ids, guint, j);
+
+          allocated[id / 8] |= 1 << (id % 8);
+        }
+    }
+
+  for (i = 0; i < allocation->unallocated_menus->len; i += 2)
+    {
+      Gde2MenuTreeDirectory *directory = allocation->unallocated_menus->pdata[i];
+      MenuMatches           *matches   = allocation->unallocated_menus->pdata[i + 1];
+
+      /* the directory may have been deleted with one of its parents */
+      add_menu_entries (tree, directory, matches, allocated);
+      gde2menu_tree_item_unref (directory);
+    }
+
+  g_free (allocated);
+}
+
+static void preprocess_layout_info (Gde2MenuTree          *tree,
+                                    Gde2MenuTreeDirectory *directory);
+
+static GSList *
+get_layout_info (Gde2MenuTreeDirectory *directory,
+                 gboolean           *is_default_layout)
+{
+  Gde2MenuTreeDirectory *iter;
+
+  if (directory->layout_info != NULL)
+    {
+      if (is_default_layout)
+        {
+          *is_default_layout = FALSE;
+        }
+      return directory->layout_info;
+    }
+
+  /* Even if there's no layout information at all, the result will be an
+   * implicit default layout */
+  if (is_default_layout)
+    {
+      *is_default_layout = TRUE;
+    }
+
+  iter = directory;
+  while (iter != NULL)
+    {
+      /* FIXME: this is broken: we might skip real parent in the
+       * XML structure, that are hidden because of inlining. */
+      if (iter->default_layout_info != NULL)
+	{
+	  return iter->default_layout_info;
+	}
+
+      iter = GDE2MENU_TREE_ITEM (iter)->parent;
+    }
+
+  return NULL;
+}
+
+static void
+get_values_with_defaults (MenuLayoutNode   *node,
+			  MenuLayoutValues *layout_values,
+			  MenuLayoutValues *default_layout_values)
+{
+  menu_layout_node_menuname_get_values (node, layout_values);
+
+  if (!(layout_values->mask & MENU_LAYOUT_VALUES_SHOW_EMPTY))
+    layout_values->show_empty = default_layout_values->show_empty;
+
+  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_MENUS))
+    layout_values->inline_menus = default_layout_values->inline_menus;
+
+  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_LIMIT))
+    layout_values->inline_limit = default_layout_values->inline_limit;
+
+  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_HEADER))
+    layout_values->inline_header = default_layout_values->inline_header;
+
+  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_ALIAS))
+    layout_values->inline_alias = default_layout_values->inline_alias;
+}
+
+/* The subdirs have to be preprocessed, and their inline header decided */
+static guint
+count_layout_items (Gde2MenuTreeDirectory *directory)
+{
+  guint   len;
+  GSList *tmp;
+
+  len = g_slist_length (directory->entries);
+
+  tmp = directory->subdirs;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeDirectory *subdir = tmp->data;
+
+      tmp = tmp->next;
+
+      if (GDE2MENU_TREE_ITEM (subdir)->type == GDE2MENU_TREE_ITEM_DIRECTORY &&
+          subdir->will_inline_header != G_MAXUINT16)
+        len += subdir->n_layout_items + 1;
+      else
+        len += 1;
+    }
+
+  return len;
+}
+
+static void
+preprocess_layout_info_subdir_helper (Gde2MenuTree          *tree,
+                                      Gde2MenuTreeDirectory *directory,
+                                      Gde2MenuTreeDirectory *subdir,
+                                      MenuLayoutValues   *layout_values,
+                                      gboolean           *contents_added,
+                                      gboolean           *should_remove)
+{
+  preprocess_layout_info (tree, subdir);
+
+  *should_remove = FALSE;
+  *contents_added = FALSE;
+
+  if (subdir->subdirs == NULL && subdir->entries == NULL)
+    {
+      if (!(tree->flags & GDE2MENU_TREE_FLAGS_SHOW_EMPTY) &&
+          !layout_values->show_empty)
+	{
+	  menu_verbose ("Not showing empty menu '%s'\n", subdir->name);
+	  *should_remove = TRUE;
+	}
+    }
+
+  else if (layout_values->inline_menus)
+    {
+      if (layout_values->inline_alias &&
+          subdir->n_layout_items == 1)
+        {
+          Gde2MenuTreeAlias *alias;
+          Gde2MenuTreeItem  *item;
+          GSList         *list;
+
+          if (subdir->subdirs != NULL)
+            list = subdir->subdirs;
+          else
+            list = subdir->entries;
+
+          item = GDE2MENU_TREE_ITEM (list->data);
+
+          menu_verbose ("Inline aliasing '%s' to '%s'\n",
+                        item->type == GDE2MENU_TREE_ITEM_ENTRY ?
+                          gde2menu_tree_entry_get_name (GDE2MENU_TREE_ENTRY (item)) :
+                          (item->type == GDE2MENU_TREE_ITEM_DIRECTORY ?
+                             gde2menu_tree_directory_get_name (GDE2MENU_TREE_DIRECTORY (item)) :
+                             gde2menu_tree_directory_get_name (GDE2MENU_TREE_ALIAS (item)->directory)),
+                        subdir->name);
+
+          alias = gde2menu_tree_alias_new (directory, subdir, item);
+
+          g_slist_foreach (list,
+                           (GFunc) gde2menu_tree_item_unref_and_unset_parent,
+                           NULL);
+          g_slist_free (list);
+          subdir->subdirs = NULL;
+          subdir->entries = NULL;
+
+          if (item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
+            directory->subdirs = g_slist_append (directory->subdirs, alias);
+          else
+            directory->entries = g_slist_append (directory->entries, alias);
+
+          *contents_added = TRUE;
+          *should_remove = TRUE;
+        }
+
+      else if (layout_values->inline_limit == 0 ||
+               layout_values->inline_limit >= subdir->n_layout_items)
+        {
+          if (layout_values->inline_header)
+            {
+              menu_verbose ("Creating inline header with name '%s'\n", subdir->name);
+              /* we're limited to 16-bits to spare some memory; if the limit is
+               * higher than that (would be crazy), we just consider it's
+               * unlimited */
+              if (layout_values->inline_limit < G_MAXUINT16)
+                subdir->will_inline_header = layout_values->inline_limit;
+              else
+                subdir->will_inline_header = 0;
+            }
+          else
+            {
+              g_slist_foreach (subdir->subdirs,
+                               (GFunc) gde2menu_tree_item_set_parent,
+                               directory);
+              directory->subdirs = g_slist_concat (directory->subdirs,
+                                                   subdir->subdirs);
+              subdir->subdirs = NULL;
+
+              g_slist_foreach (subdir->entries,
+                               (GFunc) gde2menu_tree_item_set_parent,
+                               directory);
+              directory->entries = g_slist_concat (directory->entries,
+                                                   subdir->entries);
+              subdir->entries = NULL;
+
+              *contents_added = TRUE;
+              *should_remove = TRUE;
+            }
+
+          menu_verbose ("Inlining directory contents of '%s' to '%s'\n",
+                        subdir->name, directory->name);
+        }
+    }
+}
+
+static void
+preprocess_layout_info (Gde2MenuTree          *tree,
+                        Gde2MenuTreeDirectory *directory)
+{
+  GSList   *tmp;
+  GSList   *layout_info;
+  gboolean  using_default_layout;
+  GSList   *last_subdir;
+  gboolean  strip_duplicates;
+  gboolean  contents_added;
+  gboolean  should_remove;
+  GSList   *subdirs_sentinel;
+
+  /* Note: we need to preprocess all menus, even if the layout mask for a menu
+   * is MENU_LAYOUT_VALUES_NONE: in this case, we need to remove empty menus;
+   * and the layout mask can be different for a submenu anyway */
+
+  menu_verbose ("Processing menu layout inline hints for %s\n", directory->name);
+  g_assert (!directory->preprocessed);
+
+  strip_duplicates = FALSE;
+  /* we use last_subdir to track the last non-inlined subdirectory */
+  last_subdir = g_slist_last (directory->subdirs);
+
+  /*
+   * First process subdirectories with explicit layout
+   */
+  layout_info = get_layout_info (directory, &using_default_layout);
+  tmp = layout_info;
+  /* see comment below about Menuname to understand why we leave the loop if
+   * last_subdir is NULL */
+  while (tmp != NULL && last_subdir != NULL)
+    {
+      MenuLayoutNode     *node = tmp->data;
+      MenuLayoutValues    layout_values;
+      const char         *name;
+      Gde2MenuTreeDirectory *subdir;
+      GSList             *subdir_l;
+
+      tmp = tmp->next;
+
+      /* only Menuname nodes are relevant here */
+      if (menu_layout_node_get_type (node) != MENU_LAYOUT_NODE_MENUNAME)
+        continue;
+
+      get_values_with_defaults (node,
+                                &layout_values,
+                                &directory->default_layout_values);
+
+      /* find the subdirectory that is affected by those attributes */
+      name = menu_layout_node_get_content (node);
+      subdir = NULL;
+      subdir_l = directory->subdirs;
+      while (subdir_l != NULL)
+        {
+          subdir = subdir_l->data;
+
+          if (!strcmp (subdir->name, name))
+            break;
+
+          subdir = NULL;
+          subdir_l = subdir_l->next;
+
+          /* We do not want to use Menuname on a menu that appeared via
+           * inlining: without inlining, the Menuname wouldn't have matched
+           * anything, and we want to keep the same behavior.
+           * Unless the layout is a default layout, in which case the Menuname
+           * does match the subdirectory. */
+          if (!using_default_layout && subdir_l == last_subdir)
+            {
+              subdir_l = NULL;
+              break;
+            }
+        }
+
+      if (subdir == NULL)
+        continue;
+
+      preprocess_layout_info_subdir_helper (tree, directory,
+                                            subdir, &layout_values,
+                                            &contents_added, &should_remove);
+      strip_duplicates = strip_duplicates || contents_added;
+      if (should_remove)
+        {
+          if (last_subdir == subdir_l)
+            {
+              /* we need to recompute last_subdir since we'll remove it from
+               * the list */
+              GSList *buf;
+
+              if (subdir_l == directory->subdirs)
+                last_subdir = NULL;
+              else
+                {
+                  buf = directory->subdirs;
+                  while (buf != NULL && buf->next != subdir_l)
+                    buf = buf->next;
+                  last_subdir = buf;
+                }
+            }
+
+          directory->subdirs = g_slist_remove (directory->subdirs, subdir);
+          gde2menu_tree_item_unref_and_unset_parent (GDE2MENU_TREE_ITEM (subdir));
+        }
+    }
+
+  /*
+   * Now process the subdirectories with no explicit layout
+   */
+  /* this is bogus data, but we just need the pointer anyway */
+  subdirs_sentinel = g_slist_prepend (directory->subdirs, PACKAGE);
+  directory->subdirs = subdirs_sentinel;
+
+  tmp = directory->subdirs;
+  while (tmp->next != NULL)
+    {
+      Gde2MenuTreeDirectory *subdir = tmp->next->data;
+
+      if (subdir->preprocessed)
+        {
+          tmp = tmp->next;
+          continue;
+        }
+
+      preprocess_layout_info_subdir_helper (tree, directory,
+                                            subdir, &directory->default_layout_values,
+                                            &contents_added, &should_remove);
+      strip_duplicates = strip_duplicates || contents_added;
+      if (should_remove)
+        {
+          tmp = g_slist_delete_link (tmp, tmp->next);
+          gde2menu_tree_item_unref_and_unset_parent (GDE2MENU_TREE_ITEM (subdir));
+        }
+      else
+        tmp = tmp->next;
+    }
+
+  /* remove the sentinel */
+  directory->subdirs = g_slist_delete_link (directory->subdirs,
+                                            directory->subdirs);
+
+  /*
+   * Finally, remove duplicates if needed
+   */
+  if (strip_duplicates)
+    {
+      /* strip duplicate entries; there should be no duplicate directories */
+      directory->entries = g_slist_sort (directory->entries,
+                                         (GCompareFunc) gde2menu_tree_entry_compare_by_id);
+      tmp = directory->entries;
+      while (tmp != NULL && tmp->next != NULL)
+        {
+          Gde2MenuTreeItem *a = tmp->data;
+          Gde2MenuTreeItem *b = tmp->next->data;
+
+          if (a->type == GDE2MENU_TREE_ITEM_ALIAS)
+            a = GDE2MENU_TREE_ALIAS (a)->aliased_item;
+
+          if (b->type == GDE2MENU_TREE_ITEM_ALIAS)
+            b = GDE2MENU_TREE_ALIAS (b)->aliased_item;
+
+          if (strcmp (GDE2MENU_TREE_ENTRY (a)->desktop_file_id,
+                      GDE2MENU_TREE_ENTRY (b)->desktop_file_id) == 0)
+            {
+              /* b might be the aliased item, not the item in the list */
+              gde2menu_tree_item_unref (tmp->next->data);
+              tmp = g_slist_delete_link (tmp, tmp->next);
+            }
+          else
+            tmp = tmp->next;
+        }
+    }
+
+  directory->n_layout_items = count_layout_items (directory);
+  directory->preprocessed = TRUE;
+}
+
+static void process_layout_info (Gde2MenuTree          *tree,
+				 Gde2MenuTreeDirectory *directory);
+
+static void
+check_pending_separator (Gde2MenuTreeDirectory *directory)
+{
+  if (directory->layout_pending_separator)
+    {
+      menu_verbose ("Adding pending separator in '%s'\n", directory->name);
+
+      g_ptr_array_add (directory->pending_contents,
+		       gde2menu_tree_separator_new (directory));
+      directory->layout_pending_separator = FALSE;
+    }
+}
+
+static void
+merge_alias (Gde2MenuTree          *tree,
+	     Gde2MenuTreeDirectory *directory,
+	     Gde2MenuTreeAlias     *alias)
+{
+  menu_verbose ("Merging alias '%s' in directory '%s'\n",
+		alias->directory->name, directory->name);
+
+  if (alias->aliased_item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
+    {
+      process_layout_info (tree, GDE2MENU_TREE_DIRECTORY (alias->aliased_item));
+    }
+
+  check_pending_separator (directory);
+
+  g_ptr_array_add (directory->pending_contents,
+		   gde2menu_tree_item_ref (alias));
+}
+
+static void
+merge_subdir (Gde2MenuTree          *tree,
+	      Gde2MenuTreeDirectory *directory,
+	      Gde2MenuTreeDirectory *subdir)
+{
+  menu_verbose ("Merging subdir '%s' in directory '%s'\n",
+		subdir->name, directory->name);
+
+  process_layout_info (tree, subdir);
+
+  check_pending_separator (directory);
+
+  if (subdir->will_inline_header == 0 ||
+      (subdir->will_inline_header != G_MAXUINT16 &&
+       subdir->n_contents <= subdir->will_inline_header))
+    {
+      Gde2MenuTreeHeader *header;
+      guint            i;
+
+      header = gde2menu_tree_header_new (directory, subdir);
+      header->n_inlined = subdir->n_contents;
+      g_ptr_array_add (directory->pending_contents, header);
+
+      for (i = 0; i < subdir->n_contents; i++)
+        {
+          gde2menu_tree_item_set_parent (subdir->contents[i], directory);
+          g_ptr_array_add (directory->pending_contents, subdir->contents[i]);
+        }
+      g_free (subdir->contents);
+      subdir->contents = NULL;
+      subdir->n_contents = 0;
+      subdir->will_inline_header = G_MAXUINT16;
+
+      gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (subdir), NULL);
+    }
+  else
+    {
+      g_ptr_array_add (directory->pending_contents,
+		       gde2menu_tree_item_ref (subdir));
+    }
+}
+
+/* While the <Layout> of a directory is processed, its subdirs and entries
+ * are looked up by name or desktop file id in these. A value is the links
+ * of directory->subdirs or directory->entries with the items of that name,
+ * in order; the data of a link is set to NULL when its item is merged, and
+ * the lists are only cleaned up before merging everything else. */
+typedef struct
+{
+  GHashTable *subdirs;
+  GHashTable *entries;
+} LayoutMergeIndex;
+
+static GHashTable *
+index_layout_items (GSList   *items,
+		    gboolean  subdirs)
+{
+  GHashTable *index;
+  GSList     *links;
+  GSList     *tmp;
+
+  index = g_hash_table_new_full (g_str_hash, g_str_equal,
+				 NULL, (GDestroyNotify) g_slist_free);
+
+  for (tmp = items; tmp != NULL; tmp = tmp->next)
+    {
+      Gde2MenuTreeItem *item = tmp->data;
+      const char       *name;
+
+      /* if it's an alias, then it cannot be affected by
+       * the Merge nodes in the layout */
+      if (item->type == GDE2MENU_TREE_ITEM_ALIAS)
+        continue;
+
+      if (subdirs)
+        name = GDE2MENU_TREE_DIRECTORY (item)->name;
+      else
+        name = GDE2MENU_TREE_ENTRY (item)->desktop_file_id;
+
+      /* there is rarely more than one item of a name, appending is fine */
+      links = g_hash_table_lookup (index, name);
+      if (links != NULL)
+        links = g_slist_append (links, tmp);
+      else
+        g_hash_table_insert (index, (char *) name, g_slist_prepend (NULL, tmp));
+    }
+
+  return index;
+}
+
+static void
+layout_merge_index_flush (LayoutMergeIndex      *index,
+			  Gde2MenuTreeDirectory *directory)
+{
+  if (index->subdirs != NULL)
+    {
+      g_hash_table_destroy (index->subdirs);
+      index->subdirs = NULL;
+      directory->subdirs = g_slist_remove_all (directory->subdirs, NULL);
+    }
+
+  if (index->entries != NULL)
+    {
+      g_hash_table_destroy (index->entries);
+      index->entries = NULL;
+      directory->entries = g_slist_remove_all (directory->entries, NULL);
+    }
+}
+
+static void
+merge_subdir_by_name (Gde2MenuTree          *tree,
+		      Gde2MenuTreeDirectory *directory,
+		      LayoutMergeIndex      *index,
+		      const char         *subdir_name)
+{
+  GSList *links;
+  GSList *tmp;
+
+  menu_verbose ("Attempting to merge subdir '%s' in directory '%s'\n",
+		subdir_name, directory->name);
+
+  if (index->subdirs == NULL)
+    index->subdirs = index_layout_items (directory->subdirs, TRUE);
+
+  /* the key is owned by an item that may go away once merged */
+  links = g_hash_table_lookup (index->subdirs, subdir_name);
+  g_hash_table_steal (index->subdirs, subdir_name);
+
+  for (tmp = links; tmp != NULL; tmp = tmp->next)
+    {
+      GSList             *link = tmp->data;
+      Gde2MenuTreeDirectory *subdir = link->data;
+
+      link->data = NULL;
+      merge_subdir (tree, directory, subdir);
+      gde2menu_tree_item_unref (subdir);
+    }
+
+  g_slist_free (links);
+}
+
+static void
+merge_entry (Gde2MenuTree          *tree,
+	     Gde2MenuTreeDirectory *directory,
+	     Gde2MenuTreeEntry     *entry)
+{
+  menu_verbose ("Merging entry '%s' in directory '%s'\n",
+		entry->desktop_file_id, directory->name);
+
+  check_pending_separator (directory);
+  g_ptr_array_add (directory->pending_contents,
+		   gde2menu_tree_item_ref (entry));
+}
+
+static void
+merge_entry_by_id (Gde2MenuTree          *tree,
+		   Gde2MenuTreeDirectory *directory,
+		   LayoutMergeIndex      *index,
+		   const char         *file_id)
+{
+  GSList *links;
+  GSList *tmp;
+
+  menu_verbose ("Attempting to merge entry '%s' in directory '%s'\n",
+		file_id, directory->name);
+
+  if (index->entries == NULL)
+    index->entries = index_layout_items (directory->entries, FALSE);
+
+  /* the key is owned by an item that may go away once merged */
+  links = g_hash_table_lookup (index->entries, file_id);
+  g_hash_table_steal (index->entries, file_id);
+
+  for (tmp = links; tmp != NULL; tmp = tmp->next)
+    {
+      GSList         *link = tmp->data;
+      Gde2MenuTreeEntry *entry = link->data;
+
+      link->data = NULL;
+      merge_entry (tree, directory, entry);
+      gde2menu_tree_item_unref (entry);
+    }
+
+  g_slist_free (links);
+}
+
+static inline gboolean
+find_name_in_set (const char *name,
+		  GHashTable *set)
+{
+  return set != NULL && g_hash_table_contains (set, name);
+}
+
+static inline void
+name_set_free (GHashTable *set)
+{
+  if (set != NULL)
+    g_hash_table_destroy (set);
+}
+
+static void
+add_sort_run (Gde2MenuTreeDirectory *directory,
+	      guint               start,
+	      gboolean            separator_was_pending)
+{
+  Gde2MenuTreeSortRun *run;
+  guint             end;
+
+  /* a pending separator is added in front of the first merged item, and is
+   * not part of the sorted items */
+  if (separator_was_pending && !directory->layout_pending_separator)
+    start++;
+
+  end = directory->pending_contents->len;
+  if (end <= start + 1)
+    return;
+
+  run = g_new0 (Gde2MenuTreeSortRun, 1);
+  run->start  = start;
+  run->length = end - start;
+
+  directory->sort_runs = g_slist_append (directory->sort_runs, run);
+}
+
+static void
+merge_subdirs (Gde2MenuTree          *tree,
+	       Gde2MenuTreeDirectory *directory,
+	       GHashTable         *except)
+{
+  GSList *subdirs;
+  GSList *tmp;
+
+  menu_verbose ("Merging subdirs in directory '%s'\n", directory->name);
+
+  subdirs = directory->subdirs;
+  directory->subdirs = NULL;
+
+  subdirs = g_slist_sort_with_data (subdirs,
+				    (GCompareDataFunc) gde2menu_tree_item_compare,
+				     GINT_TO_POINTER (GDE2MENU_TREE_SORT_NAME));
+
+  tmp = subdirs;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeDirectory *subdir = tmp->data;
+
+      if (GDE2MENU_TREE_ITEM (subdir)->type == GDE2MENU_TREE_ITEM_ALIAS)
+        {
+	  merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (subdir));
+	  gde2menu_tree_item_unref (subdir);
+        }
+      else if (!find_name_in_set (subdir->name, except))
+	{
+	  merge_subdir (tree, directory, subdir);
+	  gde2menu_tree_item_unref (subdir);
+	}
+      else
+	{
+	  menu_verbose ("Not merging directory '%s' yet\n", subdir->name);
+	  directory->subdirs = g_slist_prepend (directory->subdirs, subdir);
+	}
+
+      tmp = tmp->next;
+    }
+
+  directory->subdirs = g_slist_reverse (directory->subdirs);
+
+  g_slist_free (subdirs);
+  name_set_free (except);
+}
+
+static void
+merge_entries (Gde2MenuTree          *tree,
+	       Gde2MenuTreeDirectory *directory,
+	       GHashTable         *except)
+{
+  GSList   *entries;
+  GSList   *tmp;
+  guint     start;
+  gboolean  separator_was_pending;
+
+  menu_verbose ("Merging entries in directory '%s'\n", directory->name);
+
+  entries = directory->entries;
+  directory->entries = NULL;
+
+  start = directory->pending_contents->len;
+  separator_was_pending = directory->layout_pending_separator;
+
+  entries = g_slist_sort_with_data (entries,
+				    (GCompareDataFunc) gde2menu_tree_item_compare,
+				    GINT_TO_POINTER (tree->sort_key));
+
+  tmp = entries;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeEntry *entry = tmp->data;
+
+      if (GDE2MENU_TREE_ITEM (entry)->type == GDE2MENU_TREE_ITEM_ALIAS)
+        {
+	  merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (entry));
+	  gde2menu_tree_item_unref (entry);
+        }
+      else if (!find_name_in_set (entry->desktop_file_id, except))
+	{
+	  merge_entry (tree, directory, entry);
+	  gde2menu_tree_item_unref (entry);
+	}
+      else
+	{
+	  menu_verbose ("Not merging entry '%s' yet\n", entry->desktop_file_id);
+	  directory->entries = g_slist_prepend (directory->entries, entry);
+	}
+
+      tmp = tmp->next;
+    }
+
+  directory->entries = g_slist_reverse (directory->entries);
+
+  add_sort_run (directory, start, separator_was_pending);
+
+  g_slist_free (entries);
+  name_set_free (except);
+}
+
+static void
+merge_subdirs_and_entries (Gde2MenuTree          *tree,
+			   Gde2MenuTreeDirectory *directory,
+			   GHashTable         *except_subdirs,
+			   GHashTable         *except_entries)
+{
+  GSList   *items;
+  GSList   *tmp;
+  guint     start;
+  gboolean  separator_was_pending;
+
+  menu_verbose ("Merging subdirs and entries together in directory %s\n",
+		directory->name);
+
+  items = g_slist_concat (directory->subdirs, directory->entries);
+
+  directory->subdirs = NULL;
+  directory->entries = NULL;
+
+  start = directory->pending_contents->len;
+  separator_was_pending = directory->layout_pending_separator;
+
+  items = g_slist_sort_with_data (items,
+				  (GCompareDataFunc) gde2menu_tree_item_compare,
+				  GINT_TO_POINTER (tree->sort_key));
+
+  tmp = items;
+  while (tmp != NULL)
+    {
+      Gde2MenuTreeItem     *item = tmp->data;
+      Gde2MenuTreeItemType  type;
+
+      type = gde2menu_tree_item_get_type (item);
+
+      if (type == GDE2MENU_TREE_ITEM_ALIAS)
+        {
+          merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (item));
+          gde2menu_tree_item_unref (item);
+        }
+      else if (type == GDE2MENU_TREE_ITEM_DIRECTORY)
+	{
+	  if (!find_name_in_set (GDE2MENU_TREE_DIRECTORY (item)->name, except_subdirs))
+	    {
+	      merge_subdir (tree,
+			    directory,
+			    GDE2MENU_TREE_DIRECTORY (item));
+	      gde2menu_tree_item_unref (item);
+	    }
+	  else
+	    {
+	      menu_verbose ("Not merging directory '%s' yet\n",
+			    GDE2MENU_TREE_DIRECTORY (item)->name);
+	      directory->subdirs = g_slist_prepend (directory->subdirs, item);
+	    }
+	}
+      else if (type == GDE2MENU_TREE_ITEM_ENTRY)
+	{
+	  if (!find_name_in_set (GDE2MENU_TREE_ENTRY (item)->desktop_file_id, except_entries))
+	    {
+	      merge_entry (tree, directory, GDE2MENU_TREE_ENTRY (item));
+	      gde2menu_tree_item_unref (item);
+	    }
+	  else
+	    {
+	      menu_verbose ("Not merging entry '%s' yet\n",
+			    GDE2MENU_TREE_ENTRY (item)->desktop_file_id);
+	      directory->entries = g_slist_prepend (directory->entries, item);
+	    }
+	}
+      else
+        {
+          g_assert_not_reached ();
+        }
+
+      tmp = tmp->next;
+    }
+
+  directory->subdirs = g_slist_reverse (directory->subdirs);
+  directory->entries = g_slist_reverse (directory->entries);
+
+  add_sort_run (directory, start, separator_was_pending);
+
+  g_slist_free (items);
+  name_set_free (except_subdirs);
+  name_set_free (except_entries);
+}
+
+static GHashTable *
+get_subdirs_from_layout_info (GSList *layout_info)
+{
+  GHashTable *subdirs;
+  GSList     *tmp;
+
+  subdirs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  tmp = layout_info;
+  while (tmp != NULL)
+    {
+      MenuLayoutNode *node = tmp->data;
+
+      if (menu_layout_node_get_type (node) == MENU_LAYOUT_NODE_MENUNAME)
+	{
+	  g_hash_table_add (subdirs,
+			    (char *) menu_layout_node_get_content (node));
+	}
+
+      tmp = tmp->next;
+    }
+
+  return subdirs;
+}
+
+static GHashTable *
+get_entries_from_layout_info (GSList *layout_info)
+{
+  GHashTable *entries;
+  GSList     *tmp;
+
+  entries = g_hash_table_new (g_str_hash, g_str_equal);
+
+  tmp = layout_info;
+  while (tmp != NULL)
+    {
+      MenuLayoutNode *node = tmp->data;
+
+      if (menu_layout_node_get_type (node) == MENU_LAYOUT_NODE_FILENAME)
+	{
+	  g_hash_table_add (entries,
+			    (char *) menu_layout_node_get_content (node));
+	}
+
+      tmp = tmp->next;
+    }
+
+  return entries;
+}
+
+static void
+process_layout_info (Gde2MenuTree          *tree,
+		     Gde2MenuTreeDirectory *directory)
+{
+  GSList           *layout_info;
+  LayoutMergeIndex  index = { NULL, NULL };
+
+  menu_verbose ("Processing menu layout hints for %s\n", directory->name);
+
+  gde2menu_tree_directory_free_contents (directory);
+  directory->pending_contents = g_ptr_array_new ();
+  directory->layout_pending_separator = FALSE;
+
+  g_slist_foreach (directory->sort_runs, (GFunc) g_free, NULL);
+  g_slist_free (directory->sort_runs);
+  directory->sort_runs = NULL;
+
+  layout_info = get_layout_info (directory, NULL);
+
+  if (layout_info == NULL)
+    {
+      merge_subdirs (tree, directory, NULL);
+      merge_entries (tree, directory, NULL);
+    }
+  else
+    {
+      GSList *tmp;
+
+      tmp = layout_info;
+      while (tmp != NULL)
+	{
+	  MenuLayoutNode *node = tmp->data;
+
+	  switch (menu_layout_node_get_type (node))
+	    {
+	    case MENU_LAYOUT_NODE_MENUNAME:
+              merge_subdir_by_name (tree,
+                                    directory,
+                                    &index,
+                                    menu_layout_node_get_content (node));
+	      break;
+
+	    case MENU_LAYOUT_NODE_FILENAME:
+	      merge_entry_by_id (tree,
+				 directory,
+				 &index,
+				 menu_layout_node_get_content (node));
+	      break;
+
+	    case MENU_LAYOUT_NODE_SEPARATOR:
+	      /* Unless explicitly told to show all separators, do not show a
+	       * separator at the beginning of a menu. Note that we don't add
+	       * the separators now, and instead make it pending. This way, we
+	       * won't show two consecutive separators nor will we show a
+	       * separator at the end of a menu. */
+              if (tree->flags & GDE2MENU_TREE_FLAGS_SHOW_ALL_SEPARATORS)
+		{
+		  directory->layout_pending_separator = TRUE;
+		  check_pending_separator (directory);
+		}
+	      else if (directory->pending_contents->len > 0)
+		{
+		  menu_verbose ("Adding a potential separator in '%s'\n",
+				directory->name);
+
+		  directory->layout_pending_separator = TRUE;
+		}
+	      else
+		{
+		  menu_verbose ("Skipping separator at the beginning of '%s'\n",
+				directory->name);
+		}
+	      break;
+
+	    case MENU_LAYOUT_NODE_MERGE:
+	      layout_merge_index_flush (&index, directory);
+
+	      switch (menu_layout_node_merge_get_type (node))
+		{
+		case MENU_LAYOUT_MERGE_NONE:
+		  break;
+
+		case MENU_LAYOUT_MERGE_MENUS:
+		  merge_subdirs (tree,
+				 directory,
+				 get_subdirs_from_layout_info (tmp->next));
+		  break;
+
+		case MENU_LAYOUT_MERGE_FILES:
+		  merge_entries (tree,
+				 directory,
+				 get_entries_from_layout_info (tmp->next));
+		  break;
+
+		case MENU_LAYOUT_MERGE_ALL:
+		  merge_subdirs_and_entries (tree,
+					     directory,
+					     get_subdirs_from_layout_info (tmp->next),
+					     get_entries_from_layout_info (tmp->next));
+		  break;
+
+		default:
+		  g_assert_not_reached ();
+		  break;
+		}
+	      break;
+
+	    default:
+	      g_assert_not_reached ();
+	      break;
+	    }
+
+	  tmp = tmp->next;
+	}
+
+      layout_merge_index_flush (&index, directory);
+    }
+
+  g_slist_foreach (directory->subdirs,
+		   (GFunc) gde2menu_tree_item_unref,
+		   NULL);
+  g_slist_free (directory->subdirs);
+  directory->subdirs = NULL;
+
+  g_slist_foreach (directory->entries,
+		   (GFunc) gde2menu_tree_item_unref,
+		   NULL);
+  g_slist_free (directory->entries);
+  directory->entries = NULL;
+
+  g_slist_foreach (directory->default_layout_info,
+		   (GFunc) menu_layout_node_unref,
+		   NULL);
+  g_slist_free (directory->default_layout_info);
+  directory->default_layout_info = NULL;
+
+  g_slist_foreach (directory->layout_info,
+		   (GFunc) menu_layout_node_unref,
+		   NULL);
+  g_slist_free (directory->layout_info);
+  directory->layout_info = NULL;
+
+  directory->n_contents = directory->pending_contents->len;
+  directory->contents = g_new (Gde2MenuTreeItem *, directory->n_contents);
+  if (directory->n_contents > 0)
+    memcpy (directory->contents,
+	    directory->pending_contents->pdata,
+	    directory->n_contents * sizeof (Gde2MenuTreeItem *));
+  g_ptr_array_free (directory->pending_contents, TRUE);
+  directory->pending_contents = NULL;
+}
+
+static void
+handle_entries_changed (MenuLayoutNode *layout,
+                        Gde2MenuTree       *tree)
+{
+  if (tree->layout == layout)
+    {
+      gde2menu_tree_force_rebuild (tree);
+      gde2menu_tree_invoke_monitors (tree);
+    }
+}
+
+static void
+gde2menu_tree_build_from_layout (Gde2MenuTree *tree)
+{
+  MenuAllocation allocation;
+
+  if (tree->root)
+    return;
+
+  gde2menu_tree_load_layout (tree);
+  if (!tree->layout)
+    return;
+
+  menu_verbose ("Building menu tree from layout\n");
+
+  allocation.allocating_menus  = g_ptr_array_new ();
+  allocation.unallocated_menus = g_ptr_array_new ();
+
+  tree->arena = gde2menu_tree_arena_new ();
+  tree->rule_memo = gde2menu_tree_rule_memo_new ();
+
+  gde2menu_tree_evaluate_rules (tree, find_menu_child (tree->layout));
+
+  /* create the menu structure */
+  tree->root = process_layout (tree,
+                               NULL,
+                               find_menu_child (tree->layout),
+                               &allocation);
+
+  add_unallocated_menu_entries (tree, &allocation);
+
+  if (tree->root)
+    {
+      gde2menu_tree_directory_set_tree (tree->root, tree);
+
+      /* process the layout info part that can move/remove items:
+       * inline, show_empty, etc. */
+      preprocess_layout_info (tree, tree->root);
+      /* populate the menu structure that we got with the items, and order it
+       * according to the layout info */
+      process_layout_info (tree, tree->root);
+
+      menu_layout_node_root_add_entries_monitor (tree->layout,
+                                                 (MenuLayoutNodeEntriesChangedFunc) handle_entries_changed,
+                                                 tree);
     }
 
-  g_assert (directory->name != NULL);
+  /* from now on, the arena only lives as long as the items */
+  gde2menu_tree_arena_unref (tree->arena);
+  tree->arena = NULL;
 
-  return directory;
+  gde2menu_tree_rule_memo_free (tree->rule_memo);
+  tree->rule_memo = NULL;
+
+  g_ptr_array_free (allocation.allocating_menus, TRUE);
+  g_ptr_array_free (allocation.unallocated_menus, TRUE);
+}
+
+static Gde2MenuTreeItem *
+get_sort_unit_item (Gde2MenuTreeItem *item)
+{
+  /* an inline header is sorted with the items it precedes, as its
+   * directory */
+  if (item->type == GDE2MENU_TREE_ITEM_HEADER)
+    return GDE2MENU_TREE_ITEM (GDE2MENU_TREE_HEADER (item)->directory);
+
+  return item;
+}
+
+static int
+compare_sort_units (Gde2MenuTreeItem ***a,
+		    Gde2MenuTreeItem ***b,
+		    gpointer            sort_key_p)
+{
+  return gde2menu_tree_item_compare (get_sort_unit_item (**a),
+				     get_sort_unit_item (**b),
+				     sort_key_p);
 }
 
+static void resort_directory (Gde2MenuTree          *tree,
+			      Gde2MenuTreeDirectory *directory);
+
 static void
-process_only_unallocated (Gde2MenuTree          *tree,
-			  Gde2MenuTreeDirectory *directory,
-			  DesktopEntrySet    *allocated)
+resort_items (Gde2MenuTree      *tree,
+	      Gde2MenuTreeItem **items,
+	      guint              n_items,
+	      GSList            *sort_runs)
 {
   GSList *tmp;
+  guint   i;
 
-  /* For any directory marked only_unallocated, we have to remove any
-   * entries that were in fact allocated.
-   */
-
-  if (directory->only_unallocated)
+  /* first re-sort what's below the items, including what has been inlined
+   * after a header */
+  for (i = 0; i < n_items; i++)
     {
-      tmp = directory->entries;
-      while (tmp != NULL)
-        {
-          Gde2MenuTreeEntry *entry = tmp->data;
-          GSList         *next  = tmp->next;
+      Gde2MenuTreeItem *item = items[i];
 
-          if (desktop_entry_set_lookup (allocated, entry->desktop_file_id))
-            {
-              directory->entries = g_slist_delete_link (directory->entries,
-                                                        tmp);
-              gde2menu_tree_item_unref_and_unset_parent (entry);
-            }
+      switch (item->type)
+	{
+	case GDE2MENU_TREE_ITEM_DIRECTORY:
+	  resort_directory (tree, GDE2MENU_TREE_DIRECTORY (item));
+	  break;
 
-          tmp = next;
-        }
+	case GDE2MENU_TREE_ITEM_ALIAS:
+	  if (GDE2MENU_TREE_ALIAS (item)->aliased_item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
+	    resort_directory (tree, GDE2MENU_TREE_DIRECTORY (GDE2MENU_TREE_ALIAS (item)->aliased_item));
+	  break;
+
+	case GDE2MENU_TREE_ITEM_HEADER:
+	  {
+	    Gde2MenuTreeHeader *header = GDE2MENU_TREE_HEADER (item);
+
+	    resort_items (tree, items + i + 1, header->n_inlined,
+			  header->directory->sort_runs);
+	    i += header->n_inlined;
+	  }
+	  break;
+
+	default:
+	  break;
+	}
     }
 
-  tmp = directory->subdirs;
+  /* then re-sort the spans that come from a <Merge>; an inline header and
+   * the items after it move together */
+  tmp = sort_runs;
   while (tmp != NULL)
     {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
-
-      process_only_unallocated (tree, subdir, allocated);
+      Gde2MenuTreeSortRun  *run = tmp->data;
+      Gde2MenuTreeItem    **run_items;
+      Gde2MenuTreeItem   ***units;
+      guint                 n_units;
+      guint                 j;
 
       tmp = tmp->next;
-   }
-}
 
-static void preprocess_layout_info (Gde2MenuTree          *tree,
-                                    Gde2MenuTreeDirectory *directory);
+      g_assert (run->start + run->length <= n_items);
 
-static GSList *
-get_layout_info (Gde2MenuTreeDirectory *directory,
-                 gboolean           *is_default_layout)
-{
-  Gde2MenuTreeDirectory *iter;
+      run_items = g_new (Gde2MenuTreeItem *, run->length);
+      memcpy (run_items, items + run->start,
+	      run->length * sizeof (Gde2MenuTreeItem *));
 
-  if (directory->layout_info != NULL)
-    {
-      if (is_default_layout)
-        {
-          *is_default_layout = FALSE;
-        }
-      return directory->layout_info;
-    }
+      units = g_new (Gde2MenuTreeItem **, run->length);
+      n_units = 0;
+      for (i = 0; i < run->length; i++)
+	{
+	  units[n_units++] = run_items + i;
 
-  /* Even if there's no layout information at all, the result will be an
-   * implicit default layout */
-  if (is_default_layout)
-    {
-      *is_default_layout = TRUE;
-    }
+	  if (run_items[i]->type == GDE2MENU_TREE_ITEM_HEADER)
+	    i += GDE2MENU_TREE_HEADER (run_items[i])->n_inlined;
+	}
 
-  iter = directory;
-  while (iter != NULL)
-    {
-      /* FIXME: this is broken: we might skip real parent in the
-       * XML structure, that are hidden because of inlining. */
-      if (iter->default_layout_info != NULL)
+      g_qsort_with_data (units, n_units, sizeof (Gde2MenuTreeItem **),
+			 (GCompareDataFunc) compare_sort_units,
+			 GINT_TO_POINTER (tree->sort_key));
+
+      i = run->start;
+      for (j = 0; j < n_units; j++)
 	{
-	  return iter->default_layout_info;
+	  guint n;
+
+	  n = 1;
+	  if ((*units[j])->type == GDE2MENU_TREE_ITEM_HEADER)
+	    n += GDE2MENU_TREE_HEADER (*units[j])->n_inlined;
+
+	  memcpy (items + i, units[j], n * sizeof (Gde2MenuTreeItem *));
+	  i += n;
 	}
 
-      iter = GDE2MENU_TREE_ITEM (iter)->parent;
+      g_free (units);
+      g_free (run_items);
     }
+}
 
-  return NULL;
+static void
+resort_directory (Gde2MenuTree          *tree,
+		  Gde2MenuTreeDirectory *directory)
+{
+  menu_verbose ("Re-sorting contents of '%s'\n", directory->name);
+
+  resort_items (tree,
+		directory->contents,
+		directory->n_contents,
+		directory->sort_runs);
 }
 
 static void
-get_values_with_defaults (MenuLayoutNode   *node,
-			  MenuLayoutValues *layout_values,
-			  MenuLayoutValues *default_layout_values)
+gde2menu_tree_resort (Gde2MenuTree *tree)
 {
-  menu_layout_node_menuname_get_values (node, layout_values);
+  if (tree->root == NULL)
+    return;
 
-  if (!(layout_values->mask & MENU_LAYOUT_VALUES_SHOW_EMPTY))
-    layout_values->show_empty = default_layout_values->show_empty;
+  resort_directory (tree, tree->root);
+}
 
-  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_MENUS))
-    layout_values->inline_menus = default_layout_values->inline_menus;
+static void
+gde2menu_tree_force_rebuild (Gde2MenuTree *tree)
+{
+  if (tree->root)
+    {
+      gde2menu_tree_directory_set_tree (tree->root, NULL);
+      gde2menu_tree_item_unref (tree->root);
+      tree->root = NULL;
 
-  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_LIMIT))
-    layout_values->inline_limit = default_layout_values->inline_limit;
+      /* a tree loaded from a snapshot has no layout */
+      if (tree->layout != NULL)
+        menu_layout_node_root_remove_entries_monitor (tree->layout,
+                                                      (MenuLayoutNodeEntriesChangedFunc) handle_entries_changed,
+                                                      tree);
+    }
+}
 
-  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_HEADER))
-    layout_values->inline_header = default_layout_values->inline_header;
+/*
+ * Snapshots
+ *
+ * A snapshot is the finished tree written to a file, so that short-lived
+ * processes can get the items without loading any .menu or .desktop file.
+ * The desktop entries are written once in a table that the items refer to,
+ * and an item found a second time (the directory of an inline header, say)
+ * is written as a reference to the first one. Like the compiled layouts,
+ * a snapshot has the stat of the files and directories the tree was built
+ * from, taken when they were read, and is only used if none of them changed.
+ * That is every file of the entry directories, not only the entries that
+ * ended up in the tree.
+ *
+ * A loaded snapshot stays mapped: the strings of the items and entries point
+ * into it, so the processes loading the same one share them in the page
+ * cache, only the items themselves are allocated.
+ */
 
-  if (!(layout_values->mask & MENU_LAYOUT_VALUES_INLINE_ALIAS))
-    layout_values->inline_alias = default_layout_values->inline_alias;
+#define SNAPSHOT_MAGIC     "gde2-menus snapshot 3"
+#define SNAPSHOT_NONE      G_MAXUINT32
+#define SNAPSHOT_ITEM_REF  GDE2MENU_TREE_ITEM_INVALID
+#define SNAPSHOT_MAX_DEPTH 256
+
+typedef struct
+{
+  GString    *out;
+  GHashTable *items;   /* item -> index + 1 */
+  GHashTable *entries; /* DesktopEntry -> index + 1 */
+  GPtrArray  *entries_array;
+} SnapshotWriter;
+
+typedef struct
+{
+  const char        *data;
+  const char        *end;
+  guint              depth;
+  Gde2MenuTreeArena *arena;
+  GPtrArray         *items;
+  GPtrArray         *entries;
+  GSList            *user_paths;
+} SnapshotReader;
+
+/* What the trees depend on besides the menu file and the user directories:
+ * a daemon only serves the processes with the same. */
+static char *
+get_environment_key (void)
+{
+  char *system_config_dirs;
+  char *system_data_dirs;
+  char *languages;
+  char *retval;
+
+  system_config_dirs = g_strjoinv (":", (char **) g_get_system_config_dirs ());
+  system_data_dirs   = g_strjoinv (":", (char **) g_get_system_data_dirs ());
+  languages          = g_strjoinv (":", (char **) g_get_language_names ());
+
+  /* the strings of the entries depend on the locale, and TryExec on $PATH */
+  retval = g_strdup_printf ("%s\n%s\n%s\n%s\n%s",
+			    system_config_dirs,
+			    system_data_dirs,
+			    g_getenv ("XDG_MENU_PREFIX") ? g_getenv ("XDG_MENU_PREFIX") : "",
+			    languages,
+			    g_getenv ("PATH") ? g_getenv ("PATH") : "");
+
+  g_free (languages);
+  g_free (system_data_dirs);
+  g_free (system_config_dirs);
+
+  return retval;
 }
 
-static guint
-get_real_subdirs_len (Gde2MenuTreeDirectory *directory)
+/* from_daemon is for the snapshots of the daemon, built with its placeholder
+ * user directories */
+static char *
+get_snapshot_key (Gde2MenuTree *tree,
+		  gboolean      from_daemon)
 {
-  guint   len;
-  GSList *tmp;
+  char *layout_key;
+  char *environment_key;
+  char *retval;
 
-  len = 0;
+  layout_key      = get_layout_cache_key (tree);
+  environment_key = get_environment_key ();
 
-  tmp = directory->subdirs;
-  while (tmp != NULL)
-    {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
+  retval = g_strdup_printf ("%s\n%s\n%s\n%u\n%s",
+			    layout_key,
+			    from_daemon ? DAEMON_USER_CONFIG_DIR : get_user_config_dir (),
+			    from_daemon ? DAEMON_USER_DATA_DIR : get_user_data_dir (),
+			    tree->flags,
+			    environment_key);
 
-      tmp = tmp->next;
+  g_free (environment_key);
+  g_free (layout_key);
 
-      if (subdir->will_inline_header != G_MAXUINT16)
-        {
-          len += get_real_subdirs_len (subdir) + g_slist_length (subdir->entries) + 1;
-        }
-      else
-        len += 1;
+  return retval;
+}
+
+static char *
+get_snapshot_path (const char *key,
+		   gboolean    shared)
+{
+  char *checksum;
+  char *basename;
+  char *retval;
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+  basename = g_strconcat (checksum, ".snapshot", NULL);
+
+  if (shared)
+    retval = g_build_filename (get_daemon_dir (), basename, NULL);
+  else
+    retval = g_build_filename (g_get_user_cache_dir (), "gde2-menus", basename, NULL);
+
+  g_free (basename);
+  g_free (checksum);
+
+  return retval;
+}
+
+static guint32
+snapshot_write_entry (SnapshotWriter *writer,
+		      DesktopEntry   *entry)
+{
+  guint index;
+
+  if (entry == NULL)
+    return SNAPSHOT_NONE;
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (writer->entries, entry));
+  if (index == 0)
+    {
+      g_ptr_array_add (writer->entries_array, entry);
+      index = writer->entries_array->len;
+      g_hash_table_insert (writer->entries, entry, GUINT_TO_POINTER (index));
     }
 
-  return len;
+  return index - 1;
 }
 
 static void
-preprocess_layout_info_subdir_helper (Gde2MenuTree          *tree,
-                                      Gde2MenuTreeDirectory *directory,
-                                      Gde2MenuTreeDirectory *subdir,
-                                      MenuLayoutValues   *layout_values,
-                                      gboolean           *contents_added,
-                                      gboolean           *should_remove)
+snapshot_write_item (SnapshotWriter   *writer,
+		     Gde2MenuTreeItem *item)
 {
-  preprocess_layout_info (tree, subdir);
+  guint index;
 
-  *should_remove = FALSE;
-  *contents_added = FALSE;
-
-  if (subdir->subdirs == NULL && subdir->entries == NULL)
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (writer->items, item));
+  if (index != 0)
     {
-      if (!(tree->flags & GDE2MENU_TREE_FLAGS_SHOW_EMPTY) &&
-          !layout_values->show_empty)
-	{
-	  menu_verbose ("Not showing empty menu '%s'\n", subdir->name);
-	  *should_remove = TRUE;
-	}
+      menu_write_uint32 (writer->out, SNAPSHOT_ITEM_REF);
+      menu_write_uint32 (writer->out, index - 1);
+      return;
     }
 
-  else if (layout_values->inline_menus)
+  g_hash_table_insert (writer->items, item,
+		       GUINT_TO_POINTER (g_hash_table_size (writer->items) + 1));
+
+  menu_write_uint32 (writer->out, item->type);
+
+  switch (item->type)
     {
-      guint real_subdirs_len;
+    case GDE2MENU_TREE_ITEM_DIRECTORY:
+      {
+	Gde2MenuTreeDirectory *directory = GDE2MENU_TREE_DIRECTORY (item);
+	GSList                *tmp;
+	guint                  i;
+
+	menu_write_mapped_string (writer->out, directory->name);
+	menu_write_uint32 (writer->out,
+			   snapshot_write_entry (writer, directory->directory_entry));
+	menu_write_uint32 (writer->out, directory->is_nodisplay);
+
+	menu_write_uint32 (writer->out, directory->n_contents);
+	for (i = 0; i < directory->n_contents; i++)
+	  snapshot_write_item (writer, directory->contents[i]);
+
+	menu_write_uint32 (writer->out, g_slist_length (directory->sort_runs));
+	for (tmp = directory->sort_runs; tmp != NULL; tmp = tmp->next)
+	  {
+	    Gde2MenuTreeSortRun *run = tmp->data;
+
+	    menu_write_uint32 (writer->out, run->start);
+	    menu_write_uint32 (writer->out, run->length);
+	  }
+      }
+      break;
 
-      real_subdirs_len = get_real_subdirs_len (subdir);
+    case GDE2MENU_TREE_ITEM_ENTRY:
+      {
+	Gde2MenuTreeEntry *entry = GDE2MENU_TREE_ENTRY (item);
 
-      if (layout_values->inline_alias &&
-          real_subdirs_len + g_slist_length (subdir->entries) == 1)
-        {
-          Gde2MenuTreeAlias *alias;
-          Gde2MenuTreeItem  *item;
-          GSList         *list;
+	menu_write_uint32 (writer->out,
+			   snapshot_write_entry (writer, entry->desktop_entry));
+	menu_write_mapped_string (writer->out, entry->desktop_file_id);
+	menu_write_uint32 (writer->out, entry->is_excluded);
+	menu_write_uint32 (writer->out, entry->is_nodisplay);
+      }
+      break;
 
-          if (subdir->subdirs != NULL)
-            list = subdir->subdirs;
-          else
-            list = subdir->entries;
+    case GDE2MENU_TREE_ITEM_SEPARATOR:
+      break;
 
-          item = GDE2MENU_TREE_ITEM (list->data);
+    case GDE2MENU_TREE_ITEM_HEADER:
+      snapshot_write_item (writer,
+			   GDE2MENU_TREE_ITEM (GDE2MENU_TREE_HEADER (item)->directory));
+      menu_write_uint32 (writer->out, GDE2MENU_TREE_HEADER (item)->n_inlined);
+      break;
 
-          menu_verbose ("Inline aliasing '%s' to '%s'\n",
-                        item->type == GDE2MENU_TREE_ITEM_ENTRY ?
-                          gde2menu_tree_entry_get_name (GDE2MENU_TREE_ENTRY (item)) :
-                          (item->type == GDE2MENU_TREE_ITEM_DIRECTORY ?
-                             gde2menu_tree_directory_get_name (GDE2MENU_TREE_DIRECTORY (item)) :
-                             gde2menu_tree_directory_get_name (GDE2MENU_TREE_ALIAS (item)->directory)),
-                        subdir->name);
+    case GDE2MENU_TREE_ITEM_ALIAS:
+      snapshot_write_item (writer,
+			   GDE2MENU_TREE_ITEM (GDE2MENU_TREE_ALIAS (item)->directory));
+      snapshot_write_item (writer, GDE2MENU_TREE_ALIAS (item)->aliased_item);
+      break;
 
-          alias = gde2menu_tree_alias_new (directory, subdir, item);
+    default:
+      g_assert_not_reached ();
+      break;
+    }
+}
 
-          g_slist_foreach (list,
-                           (GFunc) gde2menu_tree_item_unref_and_unset_parent,
-                           NULL);
-          g_slist_free (list);
-          subdir->subdirs = NULL;
-          subdir->entries = NULL;
+static void
+add_snapshot_input (const char *path,
+		    gint64      mtime,
+		    gint64      size,
+		    gint64      inode,
+		    GHashTable *inputs)
+{
+  LayoutInput *input;
 
-          if (item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
-            directory->subdirs = g_slist_append (directory->subdirs, alias);
-          else
-            directory->entries = g_slist_append (directory->entries, alias);
+  if (g_hash_table_lookup (inputs, path))
+    return;
 
-          *contents_added = TRUE;
-          *should_remove = TRUE;
-        }
+  input = g_new (LayoutInput, 1);
+  input->path  = g_strdup (path);
+  input->mtime = mtime;
+  input->size  = size;
+  input->inode = inode;
 
-      else if (layout_values->inline_limit == 0 ||
-               layout_values->inline_limit >= real_subdirs_len + g_slist_length (subdir->entries))
-        {
-          if (layout_values->inline_header)
-            {
-              menu_verbose ("Creating inline header with name '%s'\n", subdir->name);
-              /* we're limited to 16-bits to spare some memory; if the limit is
-               * higher than that (would be crazy), we just consider it's
-               * unlimited */
-              if (layout_values->inline_limit < G_MAXUINT16)
-                subdir->will_inline_header = layout_values->inline_limit;
-              else
-                subdir->will_inline_header = 0;
-            }
-          else
-            {
-              g_slist_foreach (subdir->subdirs,
-                               (GFunc) gde2menu_tree_item_set_parent,
-                               directory);
-              directory->subdirs = g_slist_concat (directory->subdirs,
-                                                   subdir->subdirs);
-              subdir->subdirs = NULL;
+  g_hash_table_insert (inputs, input->path, input);
+}
 
-              g_slist_foreach (subdir->entries,
-                               (GFunc) gde2menu_tree_item_set_parent,
-                               directory);
-              directory->entries = g_slist_concat (directory->entries,
-                                                   subdir->entries);
-              subdir->entries = NULL;
+static void
+collect_snapshot_dirs (MenuLayoutNode *menu,
+		       GHashTable     *inputs)
+{
+  MenuLayoutNode *child;
+
+  entry_directory_list_foreach_input (menu_layout_node_menu_get_app_dirs (menu),
+				      (EntryDirectoryInputFunc) add_snapshot_input,
+				      inputs);
+  entry_directory_list_foreach_input (menu_layout_node_menu_get_directory_dirs (menu),
+				      (EntryDirectoryInputFunc) add_snapshot_input,
+				      inputs);
 
-              *contents_added = TRUE;
-              *should_remove = TRUE;
-            }
+  child = menu_layout_node_get_children (menu);
+  while (child != NULL)
+    {
+      if (menu_layout_node_get_type (child) == MENU_LAYOUT_NODE_MENU)
+	collect_snapshot_dirs (child, inputs);
 
-          menu_verbose ("Inlining directory contents of '%s' to '%s'\n",
-                        subdir->name, directory->name);
-        }
+      child = menu_layout_node_get_next (child);
     }
 }
 
 static void
-preprocess_layout_info (Gde2MenuTree          *tree,
-                        Gde2MenuTreeDirectory *directory)
-{
-  GSList   *tmp;
-  GSList   *layout_info;
-  gboolean  using_default_layout;
-  GSList   *last_subdir;
-  gboolean  strip_duplicates;
-  gboolean  contents_added;
-  gboolean  should_remove;
-  GSList   *subdirs_sentinel;
+write_snapshot_input (const char  *path,
+		      LayoutInput *input,
+		      GString     *out)
+{
+  menu_write_mapped_string (out, input->path);
+  menu_write_int64 (out, input->mtime);
+  menu_write_int64 (out, input->size);
+  menu_write_int64 (out, input->inode);
+}
+
+static GString *
+gde2menu_tree_write_snapshot (Gde2MenuTree  *tree,
+			      const char    *key,
+			      GError       **error)
+{
+  SnapshotWriter  writer;
+  GHashTableIter  iter;
+  GHashTable     *inputs;
+  LayoutInput    *input;
+  GString        *out;
+  GSList         *tmp;
+  gint64          now;
+  guint           i;
 
-  /* Note: we need to preprocess all menus, even if the layout mask for a menu
-   * is MENU_LAYOUT_VALUES_NONE: in this case, we need to remove empty menus;
-   * and the layout mask can be different for a submenu anyway */
+  /* everything that was read to build the tree */
+  inputs = g_hash_table_new_full (g_str_hash, g_str_equal,
+				  NULL, (GDestroyNotify) layout_input_free);
 
-  menu_verbose ("Processing menu layout inline hints for %s\n", directory->name);
-  g_assert (!directory->preprocessed);
+  for (tmp = tree->shared_layout->inputs; tmp != NULL; tmp = tmp->next)
+    {
+      input = tmp->data;
+      add_snapshot_input (input->path, input->mtime, input->size, input->inode,
+			  inputs);
+    }
 
-  strip_duplicates = FALSE;
-  /* we use last_subdir to track the last non-inlined subdirectory */
-  last_subdir = g_slist_last (directory->subdirs);
+  collect_snapshot_dirs (find_menu_child (tree->layout), inputs);
 
-  /*
-   * First process subdirectories with explicit layout
-   */
-  layout_info = get_layout_info (directory, &using_default_layout);
-  tmp = layout_info;
-  /* see comment below about Menuname to understand why we leave the loop if
-   * last_subdir is NULL */
-  while (tmp != NULL && last_subdir != NULL)
+  /* same as for the compiled layouts: a file changed in the second it was
+   * read could have changed again since without its stat showing it */
+  now = g_get_real_time () / G_USEC_PER_SEC;
+
+  g_hash_table_iter_init (&iter, inputs);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &input))
     {
-      MenuLayoutNode     *node = tmp->data;
-      MenuLayoutValues    layout_values;
-      const char         *name;
-      Gde2MenuTreeDirectory *subdir;
-      GSList             *subdir_l;
+      if (layout_input_is_recent (input, now))
+	{
+	  g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+		       "\"%s\" was just modified", input->path);
+	  g_hash_table_destroy (inputs);
+	  return NULL;
+	}
+    }
 
-      tmp = tmp->next;
+  writer.out           = g_string_new (NULL);
+  writer.items         = g_hash_table_new (g_direct_hash, g_direct_equal);
+  writer.entries       = g_hash_table_new (g_direct_hash, g_direct_equal);
+  writer.entries_array = g_ptr_array_new ();
 
-      /* only Menuname nodes are relevant here */
-      if (menu_layout_node_get_type (node) != MENU_LAYOUT_NODE_MENUNAME)
-        continue;
+  snapshot_write_item (&writer, GDE2MENU_TREE_ITEM (tree->root));
 
-      get_values_with_defaults (node,
-                                &layout_values,
-                                &directory->default_layout_values);
+  out = g_string_new (NULL);
 
-      /* find the subdirectory that is affected by those attributes */
-      name = menu_layout_node_get_content (node);
-      subdir = NULL;
-      subdir_l = directory->subdirs;
-      while (subdir_l != NULL)
-        {
-          subdir = subdir_l->data;
+  menu_write_mapped_string (out, SNAPSHOT_MAGIC);
+  menu_write_mapped_string (out, key);
+  menu_write_uint32 (out, tree->sort_key);
 
-          if (!strcmp (subdir->name, name))
-            break;
+  menu_write_uint32 (out, g_hash_table_size (inputs));
+  g_hash_table_foreach (inputs, (GHFunc) write_snapshot_input, out);
 
-          subdir = NULL;
-          subdir_l = subdir_l->next;
+  menu_write_uint32 (out, writer.entries_array->len);
+  for (i = 0; i < writer.entries_array->len; i++)
+    desktop_entry_write (writer.entries_array->pdata[i], out);
 
-          /* We do not want to use Menuname on a menu that appeared via
-           * inlining: without inlining, the Menuname wouldn't have matched
-           * anything, and we want to keep the same behavior.
-           * Unless the layout is a default layout, in which case the Menuname
-           * does match the subdirectory. */
-          if (!using_default_layout && subdir_l == last_subdir)
-            {
-              subdir_l = NULL;
-              break;
-            }
-        }
+  g_string_append_len (out, writer.out->str, writer.out->len);
 
-      if (subdir == NULL)
-        continue;
+  g_hash_table_destroy (inputs);
+  g_ptr_array_free (writer.entries_array, TRUE);
+  g_hash_table_destroy (writer.entries);
+  g_hash_table_destroy (writer.items);
+  g_string_free (writer.out, TRUE);
 
-      preprocess_layout_info_subdir_helper (tree, directory,
-                                            subdir, &layout_values,
-                                            &contents_added, &should_remove);
-      strip_duplicates = strip_duplicates || contents_added;
-      if (should_remove)
-        {
-          if (last_subdir == subdir_l)
-            {
-              /* we need to recompute last_subdir since we'll remove it from
-               * the list */
-              GSList *buf;
+  return out;
+}
 
-              if (subdir_l == directory->subdirs)
-                last_subdir = NULL;
-              else
-                {
-                  buf = directory->subdirs;
-                  while (buf != NULL && buf->next != subdir_l)
-                    buf = buf->next;
-                  last_subdir = buf;
-                }
-            }
+static DesktopEntry *
+snapshot_read_entry (SnapshotReader *reader,
+		     gboolean        allow_none,
+		     gboolean       *error)
+{
+  guint32 index;
 
-          directory->subdirs = g_slist_remove (directory->subdirs, subdir);
-          gde2menu_tree_item_unref_and_unset_parent (GDE2MENU_TREE_ITEM (subdir));
-        }
+  if (!menu_read_uint32 (&reader->data, reader->end, &index))
+    {
+      *error = TRUE;
+      return NULL;
     }
 
-  /*
-   * Now process the subdirectories with no explicit layout
-   */
-  /* this is bogus data, but we just need the pointer anyway */
-  subdirs_sentinel = g_slist_prepend (directory->subdirs, PACKAGE);
-  directory->subdirs = subdirs_sentinel;
+  if (index == SNAPSHOT_NONE && allow_none)
+    return NULL;
 
-  tmp = directory->subdirs;
-  while (tmp->next != NULL)
+  if (index >= reader->entries->len)
     {
-      Gde2MenuTreeDirectory *subdir = tmp->next->data;
+      *error = TRUE;
+      return NULL;
+    }
 
-      if (subdir->preprocessed)
-        {
-          tmp = tmp->next;
-          continue;
-        }
+  return reader->entries->pdata[index];
+}
 
-      preprocess_layout_info_subdir_helper (tree, directory,
-                                            subdir, &directory->default_layout_values,
-                                            &contents_added, &should_remove);
-      strip_duplicates = strip_duplicates || contents_added;
-      if (should_remove)
-        {
-          tmp = g_slist_delete_link (tmp, tmp->next);
-          gde2menu_tree_item_unref_and_unset_parent (GDE2MENU_TREE_ITEM (subdir));
-        }
-      else
-        tmp = tmp->next;
+static Gde2MenuTreeItem *snapshot_read_item (SnapshotReader        *reader,
+					      Gde2MenuTreeDirectory *parent);
+
+static Gde2MenuTreeItem *
+snapshot_read_item_real (SnapshotReader        *reader,
+			 Gde2MenuTreeDirectory *parent)
+{
+  Gde2MenuTreeItem *retval;
+  guint32           type;
+  guint32           index;
+  gboolean          error;
+
+  if (!menu_read_uint32 (&reader->data, reader->end, &type))
+    return NULL;
+
+  if (type == SNAPSHOT_ITEM_REF)
+    {
+      if (!menu_read_uint32 (&reader->data, reader->end, &index) ||
+	  index >= reader->items->len ||
+	  reader->items->pdata[index] == NULL)
+	return NULL;
+
+      return gde2menu_tree_item_ref (reader->items->pdata[index]);
     }
 
-  /* remove the sentinel */
-  directory->subdirs = g_slist_delete_link (directory->subdirs,
-                                            directory->subdirs);
+  /* only the root has no parent */
+  if ((parent == NULL) != (type == GDE2MENU_TREE_ITEM_DIRECTORY &&
+			   reader->items->len == 0))
+    return NULL;
 
-  /*
-   * Finally, remove duplicates if needed
-   */
-  if (strip_duplicates)
+  /* the index is taken before reading what is below the item, but it can
+   * only be referred to once the item is complete */
+  index = reader->items->len;
+  g_ptr_array_add (reader->items, NULL);
+
+  retval = NULL;
+  error  = FALSE;
+
+  switch (type)
     {
-      /* strip duplicate entries; there should be no duplicate directories */
-      directory->entries = g_slist_sort (directory->entries,
-                                         (GCompareFunc) gde2menu_tree_entry_compare_by_id);
-      tmp = directory->entries;
-      while (tmp != NULL && tmp->next != NULL)
-        {
-          Gde2MenuTreeItem *a = tmp->data;
-          Gde2MenuTreeItem *b = tmp->next->data;
+    case GDE2MENU_TREE_ITEM_DIRECTORY:
+      {
+	Gde2MenuTreeDirectory *directory;
+	DesktopEntry          *directory_entry;
+	const char            *name;
+	guint32                is_nodisplay;
+	guint32                n;
 
-          if (a->type == GDE2MENU_TREE_ITEM_ALIAS)
-            a = GDE2MENU_TREE_ALIAS (a)->aliased_item;
+	if (!menu_read_mapped_string (&reader->data, reader->end, &name) || name == NULL)
+	  return NULL;
 
-          if (b->type == GDE2MENU_TREE_ITEM_ALIAS)
-            b = GDE2MENU_TREE_ALIAS (b)->aliased_item;
+	directory = gde2menu_tree_directory_new (reader->arena, parent, name,
+						 parent == NULL);
 
-          if (strcmp (GDE2MENU_TREE_ENTRY (a)->desktop_file_id,
-                      GDE2MENU_TREE_ENTRY (b)->desktop_file_id) == 0)
-            {
-              tmp = g_slist_delete_link (tmp, tmp->next);
-              gde2menu_tree_item_unref (b);
-            }
-          else
-            tmp = tmp->next;
-        }
+	retval = GDE2MENU_TREE_ITEM (directory);
+
+	directory_entry = snapshot_read_entry (reader, TRUE, &error);
+	if (error || !menu_read_uint32 (&reader->data, reader->end, &is_nodisplay))
+	  goto error;
+
+	if (directory_entry != NULL)
+	  directory->directory_entry = desktop_entry_ref (directory_entry);
+	directory->is_nodisplay = is_nodisplay != 0;
+
+	if (!menu_read_uint32 (&reader->data, reader->end, &n) ||
+	    n > (guint32) (reader->end - reader->data) / sizeof (guint32))
+	  goto error;
+
+	directory->contents = g_new (Gde2MenuTreeItem *, n);
+	while (directory->n_contents < n)
+	  {
+	    Gde2MenuTreeItem *item;
+
+	    if ((item = snapshot_read_item (reader, directory)) == NULL)
+	      goto error;
+
+	    directory->contents[directory->n_contents++] = item;
+	  }
+
+	if (!menu_read_uint32 (&reader->data, reader->end, &n))
+	  goto error;
+
+	while (n-- > 0)
+	  {
+	    Gde2MenuTreeSortRun *run;
+	    guint32              start;
+	    guint32              length;
+
+	    /* checked by check_snapshot_items() once the whole tree is read:
+	     * the runs of an inlined directory are in the parent */
+	    if (!menu_read_uint32 (&reader->data, reader->end, &start) ||
+		!menu_read_uint32 (&reader->data, reader->end, &length))
+	      goto error;
+
+	    run = g_new (Gde2MenuTreeSortRun, 1);
+	    run->start  = start;
+	    run->length = length;
+
+	    directory->sort_runs = g_slist_append (directory->sort_runs, run);
+	  }
+
+	reader->items->pdata[index] = retval;
+      }
+      break;
+
+    case GDE2MENU_TREE_ITEM_ENTRY:
+      {
+	DesktopEntry *desktop_entry;
+	const char   *desktop_file_id;
+	guint32       is_excluded;
+	guint32       is_nodisplay;
+
+	desktop_entry = snapshot_read_entry (reader, FALSE, &error);
+	if (error)
+	  return NULL;
+
+	if (!menu_read_mapped_string (&reader->data, reader->end, &desktop_file_id) ||
+	    desktop_file_id == NULL ||
+	    !menu_read_uint32 (&reader->data, reader->end, &is_excluded) ||
+	    !menu_read_uint32 (&reader->data, reader->end, &is_nodisplay))
+	  return NULL;
+
+	retval = GDE2MENU_TREE_ITEM (gde2menu_tree_entry_new (parent,
+							      desktop_entry,
+							      desktop_file_id,
+							      is_excluded,
+							      is_nodisplay));
+	reader->items->pdata[index] = retval;
+      }
+      break;
+
+    case GDE2MENU_TREE_ITEM_SEPARATOR:
+      retval = GDE2MENU_TREE_ITEM (gde2menu_tree_separator_new (parent));
+      reader->items->pdata[index] = retval;
+      break;
+
+    case GDE2MENU_TREE_ITEM_HEADER:
+      {
+	Gde2MenuTreeItem   *directory;
+	Gde2MenuTreeHeader *header;
+	guint32             n_inlined;
+
+	if ((directory = snapshot_read_item (reader, parent)) == NULL)
+	  return NULL;
+
+	if (directory->type != GDE2MENU_TREE_ITEM_DIRECTORY ||
+	    !menu_read_uint32 (&reader->data, reader->end, &n_inlined))
+	  {
+	    gde2menu_tree_item_unref_and_unset_parent (directory);
+	    return NULL;
+	  }
+
+	header = gde2menu_tree_header_new (parent, GDE2MENU_TREE_DIRECTORY (directory));
+	header->n_inlined = n_inlined;
+	gde2menu_tree_item_unref (directory);
+
+	retval = GDE2MENU_TREE_ITEM (header);
+	reader->items->pdata[index] = retval;
+      }
+      break;
+
+    case GDE2MENU_TREE_ITEM_ALIAS:
+      {
+	Gde2MenuTreeItem *directory;
+	Gde2MenuTreeItem *aliased_item;
+
+	if ((directory = snapshot_read_item (reader, parent)) == NULL)
+	  return NULL;
+
+	if (directory->type != GDE2MENU_TREE_ITEM_DIRECTORY ||
+	    (aliased_item = snapshot_read_item (reader, parent)) == NULL)
+	  {
+	    gde2menu_tree_item_unref_and_unset_parent (directory);
+	    return NULL;
+	  }
+
+	retval = GDE2MENU_TREE_ITEM (gde2menu_tree_alias_new (parent,
+							      GDE2MENU_TREE_DIRECTORY (directory),
+							      aliased_item));
+	reader->items->pdata[index] = retval;
+
+	gde2menu_tree_item_unref (aliased_item);
+	gde2menu_tree_item_unref (directory);
+      }
+      break;
+
+    default:
+      return NULL;
     }
 
-  directory->preprocessed = TRUE;
+  return retval;
+
+ error:
+  gde2menu_tree_item_unref (retval);
+  return NULL;
 }
 
-static void process_layout_info (Gde2MenuTree          *tree,
-				 Gde2MenuTreeDirectory *directory);
+/* the item returned is referenced; parent is only NULL for the root */
+static Gde2MenuTreeItem *
+snapshot_read_item (SnapshotReader        *reader,
+		    Gde2MenuTreeDirectory *parent)
+{
+  Gde2MenuTreeItem *retval;
 
-static void
-check_pending_separator (Gde2MenuTreeDirectory *directory)
+  if (reader->depth >= SNAPSHOT_MAX_DEPTH)
+    return NULL;
+
+  reader->depth++;
+  retval = snapshot_read_item_real (reader, parent);
+  reader->depth--;
+
+  return retval;
+}
+
+/* what resort_items() relies on */
+static gboolean
+check_snapshot_items (Gde2MenuTreeItem **items,
+		      guint              n_items,
+		      GSList            *sort_runs)
 {
-  if (directory->layout_pending_separator)
+  GSList *tmp;
+  guint   i;
+
+  for (i = 0; i < n_items; i++)
     {
-      menu_verbose ("Adding pending separator in '%s'\n", directory->name);
+      Gde2MenuTreeItem      *item = items[i];
+      Gde2MenuTreeDirectory *directory;
 
-      directory->contents = g_slist_append (directory->contents,
-					    gde2menu_tree_separator_new (directory));
-      directory->layout_pending_separator = FALSE;
+      switch (item->type)
+	{
+	case GDE2MENU_TREE_ITEM_DIRECTORY:
+	  directory = GDE2MENU_TREE_DIRECTORY (item);
+	  if (!check_snapshot_items (directory->contents,
+				     directory->n_contents,
+				     directory->sort_runs))
+	    return FALSE;
+	  break;
+
+	case GDE2MENU_TREE_ITEM_ALIAS:
+	  if (GDE2MENU_TREE_ALIAS (item)->aliased_item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
+	    {
+	      directory = GDE2MENU_TREE_DIRECTORY (GDE2MENU_TREE_ALIAS (item)->aliased_item);
+	      if (!check_snapshot_items (directory->contents,
+					 directory->n_contents,
+					 directory->sort_runs))
+		return FALSE;
+	    }
+	  break;
+
+	case GDE2MENU_TREE_ITEM_HEADER:
+	  {
+	    Gde2MenuTreeHeader *header = GDE2MENU_TREE_HEADER (item);
+
+	    if (header->n_inlined > n_items - i - 1 ||
+		!check_snapshot_items (items + i + 1, header->n_inlined,
+				       header->directory->sort_runs))
+	      return FALSE;
+	    i += header->n_inlined;
+	  }
+	  break;
+
+	default:
+	  break;
+	}
+    }
+
+  for (tmp = sort_runs; tmp != NULL; tmp = tmp->next)
+    {
+      Gde2MenuTreeSortRun *run = tmp->data;
+
+      if (run->start > n_items || run->length > n_items - run->start)
+	return FALSE;
+
+      /* a header is moved along with what it inlines */
+      for (i = run->start; i < run->start + run->length; i++)
+	if (items[i]->type == GDE2MENU_TREE_ITEM_HEADER)
+	  i += GDE2MENU_TREE_HEADER (items[i])->n_inlined;
+      if (i != run->start + run->length)
+	return FALSE;
     }
+
+  return TRUE;
 }
 
-static void
-merge_alias (Gde2MenuTree          *tree,
-	     Gde2MenuTreeDirectory *directory,
-	     Gde2MenuTreeAlias     *alias)
+/* Where the user's own version of a path the daemon recorded under its
+ * placeholder user directories is, or NULL for any other path. */
+static char *
+get_daemon_user_path (const char *path)
 {
-  menu_verbose ("Merging alias '%s' in directory '%s'\n",
-		alias->directory->name, directory->name);
+  static const struct
+  {
+    const char *placeholder;
+    const char *(*get_dir) (void);
+  } dirs[] = {
+    { DAEMON_USER_CONFIG_DIR, g_get_user_config_dir },
+    { DAEMON_USER_DATA_DIR,   g_get_user_data_dir   }
+  };
+  gsize len;
+  guint i;
 
-  if (alias->aliased_item->type == GDE2MENU_TREE_ITEM_DIRECTORY)
+  for (i = 0; i < G_N_ELEMENTS (dirs); i++)
     {
-      process_layout_info (tree, GDE2MENU_TREE_DIRECTORY (alias->aliased_item));
-    }
+      len = strlen (dirs[i].placeholder);
 
-  check_pending_separator (directory);
+      if (strncmp (path, dirs[i].placeholder, len) == 0 &&
+	  (path[len] == '\0' || path[len] == G_DIR_SEPARATOR))
+	return g_strconcat (dirs[i].get_dir (), path + len, NULL);
+    }
 
-  directory->contents = g_slist_append (directory->contents,
-					gde2menu_tree_item_ref (alias));
+  return NULL;
 }
 
-static void
-merge_subdir (Gde2MenuTree          *tree,
-	      Gde2MenuTreeDirectory *directory,
-	      Gde2MenuTreeDirectory *subdir)
+/* Whether a user path doesn't change a tree built without it: it doesn't
+ * exist, or is a directory with nothing the menus read in it. */
+static gboolean
+user_path_is_unused (const char *path)
 {
-  menu_verbose ("Merging subdir '%s' in directory '%s'\n",
-		subdir->name, directory->name);
+  GDir       *dir;
+  const char *name;
+  char       *child_path;
+  gboolean    retval;
 
-  process_layout_info (tree, subdir);
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    return TRUE;
 
-  check_pending_separator (directory);
+  if ((dir = g_dir_open (path, 0, NULL)) == NULL)
+    return FALSE;
 
-  if (subdir->will_inline_header == 0 ||
-      (subdir->will_inline_header != G_MAXUINT16 &&
-       g_slist_length (subdir->contents) <= subdir->will_inline_header))
+  retval = TRUE;
+  while (retval && (name = g_dir_read_name (dir)) != NULL)
     {
-      Gde2MenuTreeHeader *header;
-
-      header = gde2menu_tree_header_new (directory, subdir);
-      directory->contents = g_slist_append (directory->contents, header);
+      child_path = g_build_filename (path, name, NULL);
+      retval = !is_menu_input_name (name) &&
+	       !g_file_test (child_path, G_FILE_TEST_IS_DIR);
+      g_free (child_path);
+    }
 
-      g_slist_foreach (subdir->contents,
-                       (GFunc) gde2menu_tree_item_set_parent,
-                       directory);
-      directory->contents = g_slist_concat (directory->contents,
-                                            subdir->contents);
-      subdir->contents = NULL;
-      subdir->will_inline_header = G_MAXUINT16;
+  g_dir_close (dir);
 
-      gde2menu_tree_item_set_parent (GDE2MENU_TREE_ITEM (subdir), NULL);
-    }
-  else
-    {
-      directory->contents = g_slist_append (directory->contents,
-					    gde2menu_tree_item_ref (subdir));
-    }
+  return retval;
 }
 
-static void
-merge_subdir_by_name (Gde2MenuTree          *tree,
-		      Gde2MenuTreeDirectory *directory,
-		      const char         *subdir_name)
+static gboolean
+check_snapshot_inputs (SnapshotReader *reader)
 {
-  GSList *tmp;
+  guint32 n;
 
-  menu_verbose ("Attempting to merge subdir '%s' in directory '%s'\n",
-		subdir_name, directory->name);
+  if (!menu_read_uint32 (&reader->data, reader->end, &n))
+    return FALSE;
 
-  tmp = directory->subdirs;
-  while (tmp != NULL)
+  while (n-- > 0)
     {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
-      GSList             *next = tmp->next;
+      const char *path;
+      char       *user_path;
+      gint64      mtime, size, inode;
+      gint64      cur_mtime, cur_size, cur_inode;
+
+      if (!menu_read_mapped_string (&reader->data, reader->end, &path) ||
+	  path == NULL ||
+	  !menu_read_int64 (&reader->data, reader->end, &mtime) ||
+	  !menu_read_int64 (&reader->data, reader->end, &size) ||
+	  !menu_read_int64 (&reader->data, reader->end, &inode))
+	return FALSE;
+
+      /* the daemon has no user files, the user may have some */
+      if ((user_path = get_daemon_user_path (path)) != NULL)
+	{
+	  if (mtime != -1 || !user_path_is_unused (user_path))
+	    {
+	      menu_verbose ("\"%s\" is used, not using the snapshot\n", user_path);
+	      g_free (user_path);
+	      return FALSE;
+	    }
 
-      /* if it's an alias, then it cannot be affected by
-       * the Merge nodes in the layout */
-      if (GDE2MENU_TREE_ITEM (subdir)->type == GDE2MENU_TREE_ITEM_ALIAS)
-        continue;
+	  reader->user_paths = g_slist_prepend (reader->user_paths, user_path);
+	  continue;
+	}
 
-      if (!strcmp (subdir->name, subdir_name))
+      menu_stat_file (path, &cur_mtime, &cur_size, &cur_inode);
+      if (cur_mtime != mtime || cur_size != size || cur_inode != inode)
 	{
-	  directory->subdirs = g_slist_delete_link (directory->subdirs, tmp);
-	  merge_subdir (tree, directory, subdir);
-	  gde2menu_tree_item_unref (subdir);
+	  menu_verbose ("\"%s\" changed, not using the snapshot\n", path);
+	  return FALSE;
 	}
-
-      tmp = next;
     }
+
+  return TRUE;
 }
 
-static void
-merge_entry (Gde2MenuTree          *tree,
-	     Gde2MenuTreeDirectory *directory,
-	     Gde2MenuTreeEntry     *entry)
-{
-  menu_verbose ("Merging entry '%s' in directory '%s'\n",
-		entry->desktop_file_id, directory->name);
+/* The paths of the user that the daemon recorded under its placeholder
+ * directories are returned in user_paths, to be monitored. */
+static Gde2MenuTreeDirectory *
+gde2menu_tree_read_snapshot (Gde2MenuTree  *tree,
+			     GMappedFile   *mapped,
+			     const char    *key,
+			     GSList       **user_paths)
+{
+  SnapshotReader    reader;
+  Gde2MenuTreeItem *root;
+  const char       *str;
+  guint32           sort_key;
+  guint32           n;
+
+  reader.data       = g_mapped_file_get_contents (mapped);
+  reader.end        = reader.data + g_mapped_file_get_length (mapped);
+  reader.depth      = 0;
+  reader.arena      = NULL;
+  reader.items      = NULL;
+  reader.entries    = NULL;
+  reader.user_paths = NULL;
+
+  root = NULL;
+
+  if (!menu_read_mapped_string (&reader.data, reader.end, &str) ||
+      g_strcmp0 (str, SNAPSHOT_MAGIC) != 0)
+    return NULL;
 
-  check_pending_separator (directory);
-  directory->contents = g_slist_append (directory->contents,
-					gde2menu_tree_item_ref (entry));
-}
+  if (!menu_read_mapped_string (&reader.data, reader.end, &str))
+    return NULL;
+  if (g_strcmp0 (str, key) != 0)
+    {
+      menu_verbose ("Snapshot is for another menu or environment\n");
+      return NULL;
+    }
 
-static void
-merge_entry_by_id (Gde2MenuTree          *tree,
-		   Gde2MenuTreeDirectory *directory,
-		   const char         *file_id)
-{
-  GSList *tmp;
+  if (!menu_read_uint32 (&reader.data, reader.end, &sort_key) ||
+      sort_key > GDE2MENU_TREE_SORT_LAST)
+    return NULL;
 
-  menu_verbose ("Attempting to merge entry '%s' in directory '%s'\n",
-		file_id, directory->name);
+  if (!check_snapshot_inputs (&reader) ||
+      !menu_read_uint32 (&reader.data, reader.end, &n))
+    goto out;
 
-  tmp = directory->entries;
-  while (tmp != NULL)
+  reader.entries = g_ptr_array_new_with_free_func ((GDestroyNotify) desktop_entry_unref);
+  while (n-- > 0)
     {
-      Gde2MenuTreeEntry *entry = tmp->data;
-      GSList         *next = tmp->next;
-
-      /* if it's an alias, then it cannot be affected by
-       * the Merge nodes in the layout */
-      if (GDE2MENU_TREE_ITEM (entry)->type == GDE2MENU_TREE_ITEM_ALIAS)
-        continue;
+      DesktopEntry *entry;
 
-      if (!strcmp (entry->desktop_file_id, file_id))
-	{
-	  directory->entries = g_slist_delete_link (directory->entries, tmp);
-	  merge_entry (tree, directory, entry);
-	  gde2menu_tree_item_unref (entry);
-	}
+      if ((entry = desktop_entry_read (mapped, &reader.data, reader.end)) == NULL)
+	goto out;
 
-      tmp = next;
+      g_ptr_array_add (reader.entries, entry);
     }
-}
 
-static inline gboolean
-find_name_in_list (const char *name,
-		   GSList     *list)
-{
-  while (list != NULL)
+  reader.arena = gde2menu_tree_arena_new ();
+  reader.arena->mapped = g_mapped_file_ref (mapped);
+  reader.items = g_ptr_array_new ();
+
+  root = snapshot_read_item (&reader, NULL);
+
+  if (root != NULL &&
+      (reader.data != reader.end ||
+       !check_snapshot_items (GDE2MENU_TREE_DIRECTORY (root)->contents,
+			      GDE2MENU_TREE_DIRECTORY (root)->n_contents,
+			      GDE2MENU_TREE_DIRECTORY (root)->sort_runs)))
     {
-      if (!strcmp (name, list->data))
-	return TRUE;
+      gde2menu_tree_item_unref (root);
+      root = NULL;
+    }
 
-      list = list->next;
+  if (root != NULL && sort_key != tree->sort_key)
+    resort_directory (tree, GDE2MENU_TREE_DIRECTORY (root));
+
+ out:
+  if (reader.items != NULL)
+    g_ptr_array_free (reader.items, TRUE);
+  if (reader.arena != NULL)
+    gde2menu_tree_arena_unref (reader.arena);
+  if (reader.entries != NULL)
+    g_ptr_array_free (reader.entries, TRUE);
+
+  if (root != NULL)
+    {
+      *user_paths = reader.user_paths;
+    }
+  else
+    {
+      g_slist_foreach (reader.user_paths, (GFunc) g_free, NULL);
+      g_slist_free (reader.user_paths);
     }
 
-  return FALSE;
+  return GDE2MENU_TREE_DIRECTORY (root);
 }
 
-static void
-merge_subdirs (Gde2MenuTree          *tree,
-	       Gde2MenuTreeDirectory *directory,
-	       GSList             *except)
+gboolean
+gde2menu_tree_save_snapshot (Gde2MenuTree  *tree,
+			     const char    *filename,
+			     GError       **error)
 {
-  GSList *subdirs;
-  GSList *tmp;
+  GString  *out;
+  char     *key;
+  char     *path;
+  char     *dirname;
+  gboolean  shared;
+  gboolean  retval;
 
-  menu_verbose ("Merging subdirs in directory '%s'\n", directory->name);
+  g_return_val_if_fail (tree != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  subdirs = directory->subdirs;
-  directory->subdirs = NULL;
+  menu_lock ();
 
-  subdirs = g_slist_sort_with_data (subdirs,
-				    (GCompareDataFunc) gde2menu_tree_item_compare,
-				     GINT_TO_POINTER (GDE2MENU_TREE_SORT_NAME));
+  /* a tree that was itself loaded from a snapshot doesn't know what it was
+   * built from */
+  if (tree->root != NULL && tree->layout == NULL)
+    gde2menu_tree_force_rebuild (tree);
 
-  tmp = subdirs;
-  while (tmp != NULL)
-    {
-      Gde2MenuTreeDirectory *subdir = tmp->data;
+  if (!tree->root)
+    gde2menu_tree_build_from_layout (tree);
 
-      if (GDE2MENU_TREE_ITEM (subdir)->type == GDE2MENU_TREE_ITEM_ALIAS)
-        {
-	  merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (subdir));
-	  gde2menu_tree_item_unref (subdir);
-        }
-      else if (!find_name_in_list (subdir->name, except))
-	{
-	  merge_subdir (tree, directory, subdir);
-	  gde2menu_tree_item_unref (subdir);
-	}
-      else
-	{
-	  menu_verbose ("Not merging directory '%s' yet\n", subdir->name);
-	  directory->subdirs = g_slist_append (directory->subdirs, subdir);
-	}
+  if (!tree->root)
+    {
+      menu_unlock ();
 
-      tmp = tmp->next;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		   "Failed to load menu \"%s\"",
+		   tree->canonical_path ? tree->canonical_path :
+		     (tree->basename ? tree->basename : tree->absolute_path));
+      return FALSE;
     }
 
-  g_slist_free (subdirs);
-  g_slist_free (except);
-}
+  key = get_snapshot_key (tree, FALSE);
+  out = gde2menu_tree_write_snapshot (tree, key, error);
 
-static void
-merge_entries (Gde2MenuTree          *tree,
-	       Gde2MenuTreeDirectory *directory,
-	       GSList             *except)
-{
-  GSList *entries;
-  GSList *tmp;
+  menu_unlock ();
 
-  menu_verbose ("Merging entries in directory '%s'\n", directory->name);
+  if (out == NULL)
+    {
+      g_free (key);
+      return FALSE;
+    }
 
-  entries = directory->entries;
-  directory->entries = NULL;
+  /* the daemon writes them for all the users */
+  shared = filename == NULL && daemon_lock_fd >= 0;
+  path   = filename ? g_strdup (filename) : get_snapshot_path (key, shared);
 
-  entries = g_slist_sort_with_data (entries,
-				    (GCompareDataFunc) gde2menu_tree_item_compare,
-				    GINT_TO_POINTER (tree->sort_key));
+  retval = TRUE;
 
-  tmp = entries;
-  while (tmp != NULL)
+  dirname = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dirname, shared ? 0755 : 0700) != 0)
     {
-      Gde2MenuTreeEntry *entry = tmp->data;
+      int errsv = errno;
 
-      if (GDE2MENU_TREE_ITEM (entry)->type == GDE2MENU_TREE_ITEM_ALIAS)
-        {
-	  merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (entry));
-	  gde2menu_tree_item_unref (entry);
-        }
-      else if (!find_name_in_list (entry->desktop_file_id, except))
-	{
-	  merge_entry (tree, directory, entry);
-	  gde2menu_tree_item_unref (entry);
-	}
-      else
-	{
-	  menu_verbose ("Not merging entry '%s' yet\n", entry->desktop_file_id);
-	  directory->entries = g_slist_append (directory->entries, entry);
-	}
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		   "Failed to create directory \"%s\": %s",
+		   dirname, g_strerror (errsv));
+      retval = FALSE;
+    }
+  else if (g_file_set_contents (path, out->str, out->len, error))
+    {
+      if (shared)
+	g_chmod (path, 0644);
 
-      tmp = tmp->next;
+      menu_verbose ("Saved snapshot of \"%s\" to \"%s\"\n",
+		    tree->canonical_path, path);
+    }
+  else
+    {
+      retval = FALSE;
     }
 
-  g_slist_free (entries);
-  g_slist_free (except);
+  g_free (dirname);
+  g_free (path);
+  g_free (key);
+  g_string_free (out, TRUE);
+
+  return retval;
 }
 
-static void
-merge_subdirs_and_entries (Gde2MenuTree          *tree,
-			   Gde2MenuTreeDirectory *directory,
-			   GSList             *except_subdirs,
-			   GSList             *except_entries)
+/* Anyone who can write to the daemon directory can hand trees to the other
+ * users: its snapshots are only used if the directory and the file can only
+ * be written by their owner, the same for both. */
+static gboolean
+daemon_snapshot_is_trusted (const char *path)
 {
-  GSList *items;
-  GSList *tmp;
+  GStatBuf dir_buf;
+  GStatBuf buf;
 
-  menu_verbose ("Merging subdirs and entries together in directory %s\n",
-		directory->name);
+  if (g_stat (get_daemon_dir (), &dir_buf) != 0 ||
+      g_stat (path, &buf) != 0)
+    return FALSE;
 
-  items = g_slist_concat (directory->subdirs, directory->entries);
+  return (dir_buf.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+	 (buf.st_mode & (S_IWGRP | S_IWOTH)) == 0 &&
+	 buf.st_uid == dir_buf.st_uid;
+}
 
-  directory->subdirs = NULL;
-  directory->entries = NULL;
+/* from_daemon is for the snapshots the daemon keeps up to date */
+static gboolean
+gde2menu_tree_load_snapshot_real (Gde2MenuTree  *tree,
+				  const char    *filename,
+				  gboolean       from_daemon,
+				  GError       **error)
+{
+  Gde2MenuTreeDirectory *root;
+  GMappedFile           *mapped;
+  GSList                *user_paths;
+  GSList                *tmp;
+  char                  *key;
+  char                  *path;
 
-  items = g_slist_sort_with_data (items,
-				  (GCompareDataFunc) gde2menu_tree_item_compare,
-				  GINT_TO_POINTER (tree->sort_key));
+  menu_lock ();
 
-  tmp = items;
-  while (tmp != NULL)
+  if (tree->root != NULL)
     {
-      Gde2MenuTreeItem     *item = tmp->data;
-      Gde2MenuTreeItemType  type;
-
-      type = gde2menu_tree_item_get_type (item);
-
-      if (type == GDE2MENU_TREE_ITEM_ALIAS)
-        {
-          merge_alias (tree, directory, GDE2MENU_TREE_ALIAS (item));
-          gde2menu_tree_item_unref (item);
-        }
-      else if (type == GDE2MENU_TREE_ITEM_DIRECTORY)
-	{
-	  if (!find_name_in_list (GDE2MENU_TREE_DIRECTORY (item)->name, except_subdirs))
-	    {
-	      merge_subdir (tree,
-			    directory,
-			    GDE2MENU_TREE_DIRECTORY (item));
-	      gde2menu_tree_item_unref (item);
-	    }
-	  else
-	    {
-	      menu_verbose ("Not merging directory '%s' yet\n",
-			    GDE2MENU_TREE_DIRECTORY (item)->name);
-	      directory->subdirs = g_slist_append (directory->subdirs, item);
-	    }
-	}
-      else if (type == GDE2MENU_TREE_ITEM_ENTRY)
-	{
-	  if (!find_name_in_list (GDE2MENU_TREE_ENTRY (item)->desktop_file_id, except_entries))
-	    {
-	      merge_entry (tree, directory, GDE2MENU_TREE_ENTRY (item));
-	      gde2menu_tree_item_unref (item);
-	    }
-	  else
-	    {
-	      menu_verbose ("Not merging entry '%s' yet\n",
-			    GDE2MENU_TREE_ENTRY (item)->desktop_file_id);
-	      directory->entries = g_slist_append (directory->entries, item);
-	    }
-	}
-      else
-        {
-          g_assert_not_reached ();
-        }
+      menu_unlock ();
+      return TRUE;
+    }
 
-      tmp = tmp->next;
+  if (!gde2menu_tree_canonicalize_path (tree))
+    {
+      menu_unlock ();
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+		   "Menu file \"%s\" not found",
+		   tree->basename ? tree->basename : tree->absolute_path);
+      return FALSE;
     }
 
-  g_slist_free (items);
-  g_slist_free (except_subdirs);
-  g_slist_free (except_entries);
-}
+  key  = get_snapshot_key (tree, from_daemon);
+  path = filename ? g_strdup (filename) :
+		    get_snapshot_path (key, from_daemon || daemon_lock_fd >= 0);
 
-static GSList *
-get_subdirs_from_layout_info (GSList *layout_info)
-{
-  GSList *subdirs;
-  GSList *tmp;
+  mapped = NULL;
+  if (from_daemon && !daemon_snapshot_is_trusted (path))
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED,
+		 "Snapshot \"%s\" may have been written by anyone", path);
+  else
+    mapped = g_mapped_file_new (path, FALSE, error);
 
-  subdirs = NULL;
+  if (mapped == NULL)
+    {
+      menu_unlock ();
 
-  tmp = layout_info;
-  while (tmp != NULL)
+      g_free (path);
+      g_free (key);
+      return FALSE;
+    }
+
+  user_paths = NULL;
+  root = gde2menu_tree_read_snapshot (tree, mapped, key, &user_paths);
+  g_mapped_file_unref (mapped);
+
+  if (root == NULL)
     {
-      MenuLayoutNode *node = tmp->data;
+      menu_unlock ();
 
-      if (menu_layout_node_get_type (node) == MENU_LAYOUT_NODE_MENUNAME)
-	{
-	  subdirs = g_slist_append (subdirs,
-				    (char *) menu_layout_node_get_content (node));
-	}
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		   "Snapshot \"%s\" is invalid or out of date", path);
+      g_free (path);
+      g_free (key);
+      return FALSE;
+    }
 
-      tmp = tmp->next;
+  menu_verbose ("Loaded snapshot of \"%s\" from \"%s\"\n",
+		tree->canonical_path, path);
+
+  gde2menu_tree_directory_set_tree (root, tree);
+  tree->root = root;
+
+  /* whoever writes a new snapshot is watching the files it is built from */
+  gde2menu_tree_add_menu_file_monitor (tree, path, MENU_FILE_MONITOR_FILE);
+
+  /* but not those of the user */
+  for (tmp = user_paths; tmp != NULL; tmp = tmp->next)
+    {
+      gde2menu_tree_add_menu_file_monitor (tree, tmp->data,
+					   g_file_test (tmp->data, G_FILE_TEST_IS_DIR) ?
+					     MENU_FILE_MONITOR_USER_DIRECTORY :
+					     MENU_FILE_MONITOR_NONEXISTENT_FILE);
+      g_free (tmp->data);
     }
+  g_slist_free (user_paths);
 
-  return subdirs;
+  menu_unlock ();
+
+  g_free (path);
+  g_free (key);
+
+  return TRUE;
 }
 
-static GSList *
-get_entries_from_layout_info (GSList *layout_info)
+gboolean
+gde2menu_tree_load_snapshot (Gde2MenuTree  *tree,
+			     const char    *filename,
+			     GError       **error)
 {
-  GSList *entries;
-  GSList *tmp;
+  g_return_val_if_fail (tree != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
-  entries = NULL;
+  return gde2menu_tree_load_snapshot_real (tree, filename, FALSE, error);
+}
 
-  tmp = layout_info;
-  while (tmp != NULL)
-    {
-      MenuLayoutNode *node = tmp->data;
+/*
+ * Daemon
+ *
+ * gde2-menu-cache-gen --daemon keeps some trees built, with all their
+ * monitors, and saves a new snapshot of a tree whenever it changes. It holds
+ * a lock on a file of the daemon directory while it runs, and listens on a
+ * socket next to it: then the trees of the other processes are loaded from
+ * the snapshots when they are fresh, and only monitor the snapshot file and
+ * a connection to that socket, which is closed when the daemon exits.
+ * Without a daemon, or once it is gone, they are built here.
+ *
+ * The daemon directory is shared by all the users, and the snapshots are
+ * built without any user directory: a daemon serves the processes of every
+ * user with the same environment, whose own menu and desktop files are not
+ * used, see check_snapshot_inputs(). The lock and the socket are named
+ * after that environment, so that daemons for others can run as well.
+ */
 
-      if (menu_layout_node_get_type (node) == MENU_LAYOUT_NODE_FILENAME)
-	{
-	  entries = g_slist_append (entries,
-				    (char *) menu_layout_node_get_content (node));
-	}
+static char *
+get_daemon_path (const char *suffix)
+{
+  char *environment_key;
+  char *checksum;
+  char *basename;
+  char *retval;
 
-      tmp = tmp->next;
-    }
+  environment_key = get_environment_key ();
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, environment_key, -1);
+  basename = g_strconcat (checksum, suffix, NULL);
 
-  return entries;
+  retval = g_build_filename (get_daemon_dir (), basename, NULL);
+
+  g_free (basename);
+  g_free (checksum);
+  g_free (environment_key);
+
+  return retval;
 }
 
-static void
-process_layout_info (Gde2MenuTree          *tree,
-		     Gde2MenuTreeDirectory *directory)
+static char *
+get_daemon_lock_path (void)
+{
+  return get_daemon_path (".lock");
+}
+
+static char *
+get_daemon_socket_path (void)
 {
-  GSList *layout_info;
+  return get_daemon_path (".socket");
+}
 
-  menu_verbose ("Processing menu layout hints for %s\n", directory->name);
+static gboolean
+daemon_client_closed (int           fd,
+		      GIOCondition  condition,
+		      gpointer      user_data)
+{
+  /* the clients never write anything, they only wait for the connection to
+   * be closed */
+  close (fd);
 
-  g_slist_foreach (directory->contents,
-		   (GFunc) gde2menu_tree_item_unref_and_unset_parent,
-		   NULL);
-  g_slist_free (directory->contents);
-  directory->contents = NULL;
-  directory->layout_pending_separator = FALSE;
+  return FALSE;
+}
 
-  layout_info = get_layout_info (directory, NULL);
+static gboolean
+daemon_accept (int           fd,
+	       GIOCondition  condition,
+	       gpointer      user_data)
+{
+  GSource *source;
+  int      client;
 
-  if (layout_info == NULL)
+  if ((client = accept (fd, NULL, NULL)) < 0)
+    return TRUE;
+
+  fcntl (client, F_SETFD, FD_CLOEXEC);
+
+  source = g_unix_fd_source_new (client, G_IO_IN | G_IO_HUP | G_IO_ERR);
+  g_source_set_callback (source, (GSourceFunc) daemon_client_closed, NULL, NULL);
+  g_source_attach (source, g_source_get_context (g_main_current_source ()));
+  g_source_unref (source);
+
+  return TRUE;
+}
+
+static gboolean
+daemon_listen (const char  *path,
+	       GError     **error)
+{
+  struct sockaddr_un  addr;
+  GSource            *source;
+  int                 fd;
+  int                 errsv;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
     {
-      merge_subdirs (tree, directory, NULL);
-      merge_entries (tree, directory, NULL);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG,
+		   "Socket path \"%s\" is too long", path);
+      return FALSE;
     }
-  else
-    {
-      GSList *tmp;
 
-      tmp = layout_info;
-      while (tmp != NULL)
-	{
-	  MenuLayoutNode *node = tmp->data;
+  strcpy (addr.sun_path, path);
 
-	  switch (menu_layout_node_get_type (node))
-	    {
-	    case MENU_LAYOUT_NODE_MENUNAME:
-              merge_subdir_by_name (tree,
-                                    directory,
-                                    menu_layout_node_get_content (node));
-	      break;
+  /* left behind by a daemon that was killed: we hold the lock now */
+  unlink (path);
 
-	    case MENU_LAYOUT_NODE_FILENAME:
-	      merge_entry_by_id (tree,
-				 directory,
-				 menu_layout_node_get_content (node));
-	      break;
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
 
-	    case MENU_LAYOUT_NODE_SEPARATOR:
-	      /* Unless explicitly told to show all separators, do not show a
-	       * separator at the beginning of a menu. Note that we don't add
-	       * the separators now, and instead make it pending. This way, we
-	       * won't show two consecutive separators nor will we show a
-	       * separator at the end of a menu. */
-              if (tree->flags & GDE2MENU_TREE_FLAGS_SHOW_ALL_SEPARATORS)
-		{
-		  directory->layout_pending_separator = TRUE;
-		  check_pending_separator (directory);
-		}
-	      else if (directory->contents)
-		{
-		  menu_verbose ("Adding a potential separator in '%s'\n",
-				directory->name);
+  /* any user may connect */
+  if (fd < 0 ||
+      bind (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+      chmod (path, 0666) != 0 ||
+      listen (fd, SOMAXCONN) != 0)
+    {
+      errsv = errno;
 
-		  directory->layout_pending_separator = TRUE;
-		}
-	      else
-		{
-		  menu_verbose ("Skipping separator at the beginning of '%s'\n",
-				directory->name);
-		}
-	      break;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		   "Failed to listen on \"%s\": %s", path, g_strerror (errsv));
+      if (fd >= 0)
+	close (fd);
+      return FALSE;
+    }
 
-	    case MENU_LAYOUT_NODE_MERGE:
-	      switch (menu_layout_node_merge_get_type (node))
-		{
-		case MENU_LAYOUT_MERGE_NONE:
-		  break;
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
 
-		case MENU_LAYOUT_MERGE_MENUS:
-		  merge_subdirs (tree,
-				 directory,
-				 get_subdirs_from_layout_info (tmp->next));
-		  break;
+  source = g_unix_fd_source_new (fd, G_IO_IN);
+  g_source_set_callback (source, (GSourceFunc) daemon_accept, NULL, NULL);
+  g_source_attach (source, g_main_context_get_thread_default ());
+  g_source_unref (source);
 
-		case MENU_LAYOUT_MERGE_FILES:
-		  merge_entries (tree,
-				 directory,
-				 get_entries_from_layout_info (tmp->next));
-		  break;
+  return TRUE;
+}
 
-		case MENU_LAYOUT_MERGE_ALL:
-		  merge_subdirs_and_entries (tree,
-					     directory,
-					     get_subdirs_from_layout_info (tmp->next),
-					     get_entries_from_layout_info (tmp->next));
-		  break;
+static gboolean
+daemon_is_running (void)
+{
+  struct flock  lock;
+  char         *path;
+  int           fd;
+  gboolean      retval;
 
-		default:
-		  g_assert_not_reached ();
-		  break;
-		}
-	      break;
+  /* the daemon itself builds the trees */
+  if (daemon_lock_fd >= 0)
+    return FALSE;
 
-	    default:
-	      g_assert_not_reached ();
-	      break;
-	    }
+  path = get_daemon_lock_path ();
+  fd = open (path, O_RDONLY);
+  g_free (path);
 
-	  tmp = tmp->next;
-	}
-    }
+  if (fd < 0)
+    return FALSE;
 
-  g_slist_foreach (directory->subdirs,
-		   (GFunc) gde2menu_tree_item_unref,
-		   NULL);
-  g_slist_free (directory->subdirs);
-  directory->subdirs = NULL;
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type   = F_WRLCK;
+  lock.l_whence = SEEK_SET;
 
-  g_slist_foreach (directory->entries,
-		   (GFunc) gde2menu_tree_item_unref,
-		   NULL);
-  g_slist_free (directory->entries);
-  directory->entries = NULL;
+  retval = fcntl (fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK;
 
-  g_slist_foreach (directory->default_layout_info,
-		   (GFunc) menu_layout_node_unref,
-		   NULL);
-  g_slist_free (directory->default_layout_info);
-  directory->default_layout_info = NULL;
+  close (fd);
 
-  g_slist_foreach (directory->layout_info,
-		   (GFunc) menu_layout_node_unref,
-		   NULL);
-  g_slist_free (directory->layout_info);
-  directory->layout_info = NULL;
+  return retval;
 }
 
-static void
-handle_entries_changed (MenuLayoutNode *layout,
-                        Gde2MenuTree       *tree)
+gboolean
+gde2menu_tree_daemon_acquire (GError **error)
 {
-  if (tree->layout == layout)
+  struct flock  lock;
+  char         *path;
+  char         *socket_path;
+  char         *dirname;
+  int           fd;
+  int           errsv;
+
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (daemon_lock_fd >= 0)
+    return TRUE;
+
+  path    = get_daemon_lock_path ();
+  dirname = g_path_get_dirname (path);
+
+  /* the other users must be able to read the lock */
+  fd = -1;
+  if (g_mkdir_with_parents (dirname, 0755) == 0 &&
+      (fd = open (path, O_RDWR | O_CREAT, 0644)) >= 0 &&
+      fchmod (fd, 0644) != 0)
     {
-      gde2menu_tree_force_rebuild (tree);
-      gde2menu_tree_invoke_monitors (tree);
+      close (fd);
+      fd = -1;
     }
-}
 
-static void
-gde2menu_tree_build_from_layout (Gde2MenuTree *tree)
-{
-  DesktopEntrySet *allocated;
+  if (fd < 0)
+    {
+      errsv = errno;
 
-  if (tree->root)
-    return;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		   "Failed to open \"%s\": %s", path, g_strerror (errsv));
+      g_free (dirname);
+      g_free (path);
+      return FALSE;
+    }
 
-  gde2menu_tree_load_layout (tree);
-  if (!tree->layout)
-    return;
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type   = F_WRLCK;
+  lock.l_whence = SEEK_SET;
 
-  menu_verbose ("Building menu tree from layout\n");
+  if (fcntl (fd, F_SETLK, &lock) != 0)
+    {
+      errsv = errno;
 
-  allocated = desktop_entry_set_new ();
+      if (errsv == EACCES || errsv == EAGAIN)
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+		     "Another daemon is already running");
+      else
+	g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+		     "Failed to lock \"%s\": %s", path, g_strerror (errsv));
 
-  /* create the menu structure */
-  tree->root = process_layout (tree,
-                               NULL,
-                               find_menu_child (tree->layout),
-                               allocated);
-  if (tree->root)
+      close (fd);
+      g_free (dirname);
+      g_free (path);
+      return FALSE;
+    }
+
+  socket_path = get_daemon_socket_path ();
+  if (!daemon_listen (socket_path, error))
     {
-      gde2menu_tree_directory_set_tree (tree->root, tree);
+      close (fd);
+      g_free (socket_path);
+      g_free (dirname);
+      g_free (path);
+      return FALSE;
+    }
+  g_free (socket_path);
 
-      process_only_unallocated (tree, tree->root, allocated);
+  /* the lock and the socket go away with the process */
+  daemon_lock_fd = fd;
 
-      /* process the layout info part that can move/remove items:
-       * inline, show_empty, etc. */
-      preprocess_layout_info (tree, tree->root);
-      /* populate the menu structure that we got with the items, and order it
-       * according to the layout info */
-      process_layout_info (tree, tree->root);
+  menu_verbose ("Acting as the menu daemon\n");
 
-      menu_layout_node_root_add_entries_monitor (tree->layout,
-                                                 (MenuLayoutNodeEntriesChangedFunc) handle_entries_changed,
-                                                 tree);
-    }
+  g_free (dirname);
+  g_free (path);
 
-  desktop_entry_set_unref (allocated);
+  return TRUE;
 }
 
 static void
-gde2menu_tree_force_rebuild (Gde2MenuTree *tree)
+gde2menu_tree_ensure_root (Gde2MenuTree *tree)
 {
+  char *path;
+
   if (tree->root)
-    {
-      gde2menu_tree_directory_set_tree (tree->root, NULL);
-      gde2menu_tree_item_unref (tree->root);
-      tree->root = NULL;
+    return;
 
-      g_assert (tree->layout != NULL);
+  if (daemon_is_running () &&
+      gde2menu_tree_load_snapshot_real (tree, NULL, TRUE, NULL))
+    {
+      /* once the daemon is gone, the tree is built here with all its
+       * monitors */
+      path = get_daemon_socket_path ();
+      gde2menu_tree_add_menu_file_monitor (tree, path, MENU_FILE_MONITOR_DAEMON);
+      g_free (path);
 
-      menu_layout_node_root_remove_entries_monitor (tree->layout,
-                                                    (MenuLayoutNodeEntriesChangedFunc) handle_entries_changed,
-                                                    tree);
+      return;
     }
+
+  gde2menu_tree_build_from_layout (tree);
 }
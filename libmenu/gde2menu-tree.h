@@ -21,6 +21,7 @@
 #define __GDE2MENU_TREE_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +37,13 @@ typedef struct Gde2MenuTreeAlias     Gde2MenuTreeAlias;
 
 typedef void (*Gde2MenuTreeChangedFunc) (Gde2MenuTree* tree, gpointer user_data);
 
+typedef struct {
+	/*< private >*/
+	gpointer dummy1;
+	gpointer dummy2;
+	guint dummy3;
+} Gde2MenuTreeIter;
+
 typedef enum {
 	GDE2MENU_TREE_ITEM_INVALID = 0,
 	GDE2MENU_TREE_ITEM_DIRECTORY,
@@ -78,8 +86,37 @@ gpointer gde2menu_tree_get_user_data(Gde2MenuTree* tree);
 
 const char* gde2menu_tree_get_menu_file(Gde2MenuTree* tree);
 Gde2MenuTreeDirectory* gde2menu_tree_get_root_directory(Gde2MenuTree* tree);
+/* Builds the tree in a thread; the callback is invoked in the thread-default
+ * main context of the caller, which is also where the files read are monitored
+ * and the change callbacks invoked. Other calls on the tree block until the
+ * build is done. */
+void gde2menu_tree_load_async(Gde2MenuTree* tree, GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+Gde2MenuTreeDirectory* gde2menu_tree_load_finish(Gde2MenuTree* tree, GAsyncResult* result, GError** error);
 Gde2MenuTreeDirectory* gde2menu_tree_get_directory_from_path(Gde2MenuTree* tree, const char* path);
 
+/* Snapshots of the finished tree, for short-lived processes: loading one
+ * answers the getters without reading any menu or desktop file. With a NULL
+ * filename, a file in the user cache directory is used, or in the shared
+ * daemon directory for the daemon. Loading fails if
+ * anything the tree was built from changed, and the tree is then built as
+ * usual. A tree loaded from a snapshot only monitors the snapshot file.
+ * Saving fails with G_IO_ERROR_BUSY while a file the tree was built from was
+ * modified in the last second or so, as it could have changed again since
+ * it was read: try again later, once the monitors of the tree had a chance
+ * to notice. */
+gboolean gde2menu_tree_save_snapshot(Gde2MenuTree* tree, const char* filename, GError** error);
+gboolean gde2menu_tree_load_snapshot(Gde2MenuTree* tree, const char* filename, GError** error);
+/* Makes this process the one that keeps the snapshots in the daemon
+ * directory ($GDE2_MENU_DAEMON_DIR, or $localstatedir/cache/gde2-menus) up
+ * to date for the current environment, see gde2-menu-cache-gen --daemon.
+ * It must be called before any tree is loaded: the trees are then built
+ * without the user directories. While it runs, the processes of all the
+ * users with the same environment load their trees from these snapshots,
+ * unless they have menu or desktop files of their own; when it exits, they
+ * build them as usual. The connections of these processes are accepted
+ * from the thread-default main context. */
+gboolean gde2menu_tree_daemon_acquire(GError** error);
+
 Gde2MenuTreeSortKey gde2menu_tree_get_sort_key(Gde2MenuTree* tree);
 void gde2menu_tree_set_sort_key(Gde2MenuTree* tree, Gde2MenuTreeSortKey sort_key);
 
@@ -96,6 +133,10 @@ Gde2MenuTreeDirectory* gde2menu_tree_item_get_parent(Gde2MenuTreeItem* item);
 
 
 GSList* gde2menu_tree_directory_get_contents(Gde2MenuTreeDirectory* directory);
+/* Walks the contents without copying them: the returned items are not
+ * referenced, and stay valid as long as a reference on the directory is held. */
+void gde2menu_tree_directory_iter_init(Gde2MenuTreeIter* iter, Gde2MenuTreeDirectory* directory);
+Gde2MenuTreeItem* gde2menu_tree_directory_iter_next(Gde2MenuTreeIter* iter);
 const char* gde2menu_tree_directory_get_name(Gde2MenuTreeDirectory* directory);
 const char* gde2menu_tree_directory_get_comment(Gde2MenuTreeDirectory* directory);
 const char* gde2menu_tree_directory_get_icon(Gde2MenuTreeDirectory* directory);
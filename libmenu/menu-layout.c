@@ -133,6 +133,17 @@ node_next (MenuLayoutNode *node)
   return node->next;
 }
 
+/* The desktop file ids, categories and .directory names of the rules come
+ * back in every .menu file and every snapshot: they are interned, so that
+ * the nodes share one copy of each. */
+static inline gboolean
+content_is_interned (MenuLayoutNodeType type)
+{
+  return type == MENU_LAYOUT_NODE_FILENAME ||
+         type == MENU_LAYOUT_NODE_CATEGORY ||
+         type == MENU_LAYOUT_NODE_DIRECTORY;
+}
+
 static void
 handle_entry_directory_changed (EntryDirectory *dir,
                                 MenuLayoutNode *node)
@@ -228,7 +239,8 @@ menu_layout_node_unref (MenuLayoutNode *node)
           g_free (nr->name);
         }
 
-      g_free (node->content);
+      if (!content_is_interned (node->type))
+        g_free (node->content);
       g_free (node);
     }
 }
@@ -284,6 +296,63 @@ menu_layout_node_new (MenuLayoutNodeType type)
   return node;
 }
 
+MenuLayoutNode *
+menu_layout_node_copy (MenuLayoutNode *node)
+{
+  MenuLayoutNode *copy;
+  MenuLayoutNode *iter;
+
+  copy = menu_layout_node_new (node->type);
+  if (content_is_interned (node->type))
+    copy->content = node->content;
+  else
+    copy->content = g_strdup (node->content);
+
+  /* the entry directory lists and the <Name> of menus are looked up again
+   * on demand, and the entries monitors stay with the original */
+  switch (node->type)
+    {
+    case MENU_LAYOUT_NODE_ROOT:
+      ((MenuLayoutNodeRoot *) copy)->basedir = g_strdup (((MenuLayoutNodeRoot *) node)->basedir);
+      ((MenuLayoutNodeRoot *) copy)->name    = g_strdup (((MenuLayoutNodeRoot *) node)->name);
+      break;
+
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      ((MenuLayoutNodeLegacyDir *) copy)->prefix = g_strdup (((MenuLayoutNodeLegacyDir *) node)->prefix);
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE_FILE:
+      ((MenuLayoutNodeMergeFile *) copy)->type = ((MenuLayoutNodeMergeFile *) node)->type;
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
+      ((MenuLayoutNodeDefaultLayout *) copy)->layout_values = ((MenuLayoutNodeDefaultLayout *) node)->layout_values;
+      break;
+
+    case MENU_LAYOUT_NODE_MENUNAME:
+      ((MenuLayoutNodeMenuname *) copy)->layout_values = ((MenuLayoutNodeMenuname *) node)->layout_values;
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE:
+      ((MenuLayoutNodeMerge *) copy)->merge_type = ((MenuLayoutNodeMerge *) node)->merge_type;
+      break;
+
+    default:
+      break;
+    }
+
+  for (iter = node->children; iter != NULL; iter = node_next (iter))
+    {
+      MenuLayoutNode *child;
+
+      child = menu_layout_node_copy (iter);
+      menu_layout_node_append_child (copy, child);
+      menu_layout_node_unref (child);
+    }
+
+  return copy;
+}
+
 MenuLayoutNode *
 menu_layout_node_get_next (MenuLayoutNode *node)
 {
@@ -562,6 +631,12 @@ menu_layout_node_set_content (MenuLayoutNode *node,
   if (node->content == content)
     return;
 
+  if (content_is_interned (node->type))
+    {
+      node->content = (char *) g_intern_string (content);
+      return;
+    }
+
   g_free (node->content);
   node->content = g_strdup (content);
 }
@@ -622,137 +697,99 @@ menu_layout_node_menu_get_name (MenuLayoutNode *node)
   return menu_layout_node_get_content (nm->name_node);
 }
 
-static void
-ensure_dir_lists (MenuLayoutNodeMenu *nm)
+/* The dirs of a menu are its own ones, latest first, followed by the ones
+ * of its parent. The lists are interned: a menu without dirs of its own
+ * shares the list of its parent, and the menus with the same dirs share
+ * one list. */
+static EntryDirectoryList *
+get_dir_list (MenuLayoutNodeMenu *nm,
+              gboolean            apps)
 {
   MenuLayoutNode     *node;
   MenuLayoutNode     *iter;
-  EntryDirectoryList *app_dirs;
-  EntryDirectoryList *dir_dirs;
+  EntryDirectoryList *parent_dirs;
+  EntryDirectoryList *dirs;
+  DesktopEntryType    entry_type;
 
   node = (MenuLayoutNode *) nm;
 
-  if (nm->app_dirs && nm->dir_dirs)
-    return;
+  entry_type = apps ? DESKTOP_ENTRY_DESKTOP : DESKTOP_ENTRY_DIRECTORY;
 
-  app_dirs = NULL;
-  dir_dirs = NULL;
-
-  if (nm->app_dirs == NULL)
+  parent_dirs = NULL;
+  if (node->parent && node->parent->type == MENU_LAYOUT_NODE_MENU)
     {
-      app_dirs = entry_directory_list_new ();
-
-      if (node->parent && node->parent->type == MENU_LAYOUT_NODE_MENU)
-        {
-          EntryDirectoryList *dirs;
-
-          if ((dirs = menu_layout_node_menu_get_app_dirs (node->parent)))
-            entry_directory_list_append_list (app_dirs, dirs);
-        }
+      if (apps)
+        parent_dirs = menu_layout_node_menu_get_app_dirs (node->parent);
+      else
+        parent_dirs = menu_layout_node_menu_get_directory_dirs (node->parent);
     }
 
-  if (nm->dir_dirs == NULL)
-    {
-      dir_dirs = entry_directory_list_new ();
-
-      if (node->parent && node->parent->type == MENU_LAYOUT_NODE_MENU)
-        {
-          EntryDirectoryList *dirs;
-
-          if ((dirs = menu_layout_node_menu_get_directory_dirs (node->parent)))
-            entry_directory_list_append_list (dir_dirs, dirs);
-        }
-    }
+  dirs = NULL;
 
   iter = node->children;
   while (iter != NULL)
     {
       EntryDirectory *ed;
+      char           *path;
 
-      if (app_dirs != NULL && iter->type == MENU_LAYOUT_NODE_APP_DIR)
-        {
-          char *path;
-
-          path = menu_layout_node_get_content_as_path (iter);
-
-          ed = entry_directory_new (DESKTOP_ENTRY_DESKTOP, path);
-          if (ed != NULL)
-            {
-              entry_directory_list_prepend (app_dirs, ed);
-              entry_directory_unref (ed);
-            }
-
-          g_free (path);
-        }
+      ed = NULL;
 
-      if (dir_dirs != NULL && iter->type == MENU_LAYOUT_NODE_DIRECTORY_DIR)
+      if ((apps && iter->type == MENU_LAYOUT_NODE_APP_DIR) ||
+          (!apps && iter->type == MENU_LAYOUT_NODE_DIRECTORY_DIR))
         {
-          char *path;
-
           path = menu_layout_node_get_content_as_path (iter);
-
-          ed = entry_directory_new (DESKTOP_ENTRY_DIRECTORY, path);
-          if (ed != NULL)
-            {
-              entry_directory_list_prepend (dir_dirs, ed);
-              entry_directory_unref (ed);
-            }
-
+          ed = entry_directory_new (entry_type, path);
           g_free (path);
         }
 
       if (iter->type == MENU_LAYOUT_NODE_LEGACY_DIR)
         {
           MenuLayoutNodeLegacyDir *legacy = (MenuLayoutNodeLegacyDir *) iter;
-          char                    *path;
 
           path = menu_layout_node_get_content_as_path (iter);
+          ed = entry_directory_new_legacy (entry_type, path, legacy->prefix);
+          g_free (path);
+        }
 
-          if (app_dirs != NULL) /* we're loading app dirs */
-            {
-              ed = entry_directory_new_legacy (DESKTOP_ENTRY_DESKTOP,
-                                               path,
-                                               legacy->prefix);
-              if (ed != NULL)
-                {
-                  entry_directory_list_prepend (app_dirs, ed);
-                  entry_directory_unref (ed);
-                }
-            }
-
-          if (dir_dirs != NULL) /* we're loading dir dirs */
+      if (ed != NULL)
+        {
+          if (dirs == NULL)
             {
-              ed = entry_directory_new_legacy (DESKTOP_ENTRY_DIRECTORY,
-                                               path,
-                                               legacy->prefix);
-              if (ed != NULL)
-                {
-                  entry_directory_list_prepend (dir_dirs, ed);
-                  entry_directory_unref (ed);
-                }
+              dirs = entry_directory_list_new ();
+              if (parent_dirs)
+                entry_directory_list_append_list (dirs, parent_dirs);
             }
 
-          g_free (path);
+          entry_directory_list_prepend (dirs, ed);
+          entry_directory_unref (ed);
         }
 
       iter = node_next (iter);
     }
 
-  if (app_dirs)
-    {
-      g_assert (nm->app_dirs == NULL);
+  if (dirs == NULL && parent_dirs != NULL)
+    return entry_directory_list_ref (parent_dirs);
+
+  if (dirs == NULL)
+    dirs = entry_directory_list_new ();
+
+  return entry_directory_list_intern (dirs);
+}
 
-      nm->app_dirs = app_dirs;
+static void
+ensure_dir_lists (MenuLayoutNodeMenu *nm)
+{
+  if (nm->app_dirs == NULL)
+    {
+      nm->app_dirs = get_dir_list (nm, TRUE);
       entry_directory_list_add_monitors (nm->app_dirs,
                                          (EntryDirectoryChangedFunc) handle_entry_directory_changed,
                                          nm);
     }
 
-  if (dir_dirs)
+  if (nm->dir_dirs == NULL)
     {
-      g_assert (nm->dir_dirs == NULL);
-
-      nm->dir_dirs = dir_dirs;
+      nm->dir_dirs = get_dir_list (nm, FALSE);
       entry_directory_list_add_monitors (nm->dir_dirs,
                                          (EntryDirectoryChangedFunc) handle_entry_directory_changed,
                                          nm);
@@ -1193,7 +1230,102 @@ add_context_to_error (GError             **err,
   (*err)->message = str;
 }
 
-#define ELEMENT_IS(name) (strcmp (element_name, (name)) == 0)
+/* Element names are looked up in a perfect hash table: no two of them have
+ * the same ELEMENT_HASH(), so a single strcmp() tells whether an element is
+ * known. Check that this still holds when adding an element. */
+#define ELEMENT_HASH(name, len) \
+  (((len) * 20 + (guchar) (name)[0] * 8 + (guchar) (name)[(len) - 1] * 7) & 63)
+
+static const struct
+{
+  const char         *name;
+  MenuLayoutNodeType  type;
+} element_types[64] = {
+  { "And", MENU_LAYOUT_NODE_AND },
+  { "KDELegacyDirs", MENU_LAYOUT_NODE_KDE_LEGACY_DIRS },
+  { NULL, 0 },
+  { "Name", MENU_LAYOUT_NODE_NAME },
+  { "Layout", MENU_LAYOUT_NODE_LAYOUT },
+  { "DefaultMergeDirs", MENU_LAYOUT_NODE_DEFAULT_MERGE_DIRS },
+  { NULL, 0 },
+  { "Category", MENU_LAYOUT_NODE_CATEGORY },
+  { NULL, 0 },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Menuname", MENU_LAYOUT_NODE_MENUNAME },
+  { NULL, 0 },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Merge", MENU_LAYOUT_NODE_MERGE },
+  { "DefaultLayout", MENU_LAYOUT_NODE_DEFAULT_LAYOUT },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Filename", MENU_LAYOUT_NODE_FILENAME },
+  { "NotOnlyUnallocated", MENU_LAYOUT_NODE_NOT_ONLY_UNALLOCATED },
+  { "DefaultDirectoryDirs", MENU_LAYOUT_NODE_DEFAULT_DIRECTORY_DIRS },
+  { NULL, 0 },
+  { "Include", MENU_LAYOUT_NODE_INCLUDE },
+  { "Not", MENU_LAYOUT_NODE_NOT },
+  { NULL, 0 },
+  { NULL, 0 },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "DefaultAppDirs", MENU_LAYOUT_NODE_DEFAULT_APP_DIRS },
+  { "AppDir", MENU_LAYOUT_NODE_APP_DIR },
+  { "MergeFile", MENU_LAYOUT_NODE_MERGE_FILE },
+  { "OnlyUnallocated", MENU_LAYOUT_NODE_ONLY_UNALLOCATED },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Directory", MENU_LAYOUT_NODE_DIRECTORY },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "MergeDir", MENU_LAYOUT_NODE_MERGE_DIR },
+  { NULL, 0 },
+  { "Deleted", MENU_LAYOUT_NODE_DELETED },
+  { NULL, 0 },
+  { "Separator", MENU_LAYOUT_NODE_SEPARATOR },
+  { "Menu", MENU_LAYOUT_NODE_MENU },
+  { NULL, 0 },
+  { "New", MENU_LAYOUT_NODE_NEW },
+  { "DirectoryDir", MENU_LAYOUT_NODE_DIRECTORY_DIR },
+  { NULL, 0 },
+  { "Old", MENU_LAYOUT_NODE_OLD },
+  { NULL, 0 },
+  { "LegacyDir", MENU_LAYOUT_NODE_LEGACY_DIR },
+  { NULL, 0 },
+  { "NotDeleted", MENU_LAYOUT_NODE_NOT_DELETED },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Exclude", MENU_LAYOUT_NODE_EXCLUDE },
+  { "All", MENU_LAYOUT_NODE_ALL },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Move", MENU_LAYOUT_NODE_MOVE },
+  { NULL, 0 },
+  { NULL, 0 },
+  { "Or", MENU_LAYOUT_NODE_OR },
+  { NULL, 0 },
+};
+
+/* MENU_LAYOUT_NODE_ROOT, which is not an element, if the name is unknown */
+static MenuLayoutNodeType
+element_name_to_type (const char *element_name)
+{
+  gsize len;
+  guint hash;
+
+  len = strlen (element_name);
+  if (len == 0)
+    return MENU_LAYOUT_NODE_ROOT;
+
+  hash = ELEMENT_HASH (element_name, len);
+
+  if (element_types[hash].name == NULL ||
+      strcmp (element_types[hash].name, element_name) != 0)
+    return MENU_LAYOUT_NODE_ROOT;
+
+  return element_types[hash].type;
+}
 
 typedef struct
 {
@@ -1379,169 +1511,136 @@ start_menu_element (MenuParser           *parser,
 static void
 start_menu_child_element (MenuParser           *parser,
                           GMarkupParseContext  *context,
+                          MenuLayoutNodeType    type,
                           const char           *element_name,
                           const char          **attribute_names,
                           const char          **attribute_values,
                           GError              **error)
 {
-  if (ELEMENT_IS ("LegacyDir"))
+  switch (type)
     {
-      const char *prefix;
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      {
+        const char *prefix;
 
-      push_node (parser, MENU_LAYOUT_NODE_LEGACY_DIR);
+        push_node (parser, MENU_LAYOUT_NODE_LEGACY_DIR);
 
-      if (!locate_attributes (context, element_name,
-                              attribute_names, attribute_values,
-                              error,
-                              "prefix", &prefix,
-                              NULL))
-        return;
+        if (!locate_attributes (context, element_name,
+                                attribute_names, attribute_values,
+                                error,
+                                "prefix", &prefix,
+                                NULL))
+          return;
 
-      menu_layout_node_legacy_dir_set_prefix (parser->stack_top, prefix);
-    }
-  else if (ELEMENT_IS ("MergeFile"))
-    {
-      const char *type;
+        menu_layout_node_legacy_dir_set_prefix (parser->stack_top, prefix);
+      }
+      return;
 
-      push_node (parser, MENU_LAYOUT_NODE_MERGE_FILE);
+    case MENU_LAYOUT_NODE_MERGE_FILE:
+      {
+        const char *merge_type;
 
-      if (!locate_attributes (context, element_name,
-                              attribute_names, attribute_values,
-                              error,
-                              "type", &type,
-                              NULL))
-        return;
+        push_node (parser, MENU_LAYOUT_NODE_MERGE_FILE);
 
-      if (type != NULL && strcmp (type, "parent") == 0)
-	{
-	  menu_layout_node_merge_file_set_type (parser->stack_top,
-						MENU_MERGE_FILE_TYPE_PARENT);
-	}
-    }
-  else if (ELEMENT_IS ("DefaultLayout"))
-    {
-      const char *show_empty;
-      const char *inline_menus;
-      const char *inline_limit;
-      const char *inline_header;
-      const char *inline_alias;
-
-      push_node (parser, MENU_LAYOUT_NODE_DEFAULT_LAYOUT);
-
-      locate_attributes (context, element_name,
-                         attribute_names, attribute_values,
-                         error,
-                         "show_empty",    &show_empty,
-                         "inline",        &inline_menus,
-                         "inline_limit",  &inline_limit,
-                         "inline_header", &inline_header,
-                         "inline_alias",  &inline_alias,
-                         NULL);
-
-      menu_layout_node_default_layout_set_values (parser->stack_top,
-						  show_empty,
-						  inline_menus,
-						  inline_limit,
-						  inline_header,
-						  inline_alias);
-    }
-  else
-    {
-      if (!check_no_attributes (context, element_name,
+        if (!locate_attributes (context, element_name,
                                 attribute_names, attribute_values,
-                                error))
-        return;
+                                error,
+                                "type", &merge_type,
+                                NULL))
+          return;
 
-      if (ELEMENT_IS ("AppDir"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_APP_DIR);
-        }
-      else if (ELEMENT_IS ("DefaultAppDirs"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DEFAULT_APP_DIRS);
-        }
-      else if (ELEMENT_IS ("DirectoryDir"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DIRECTORY_DIR);
-        }
-      else if (ELEMENT_IS ("DefaultDirectoryDirs"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DEFAULT_DIRECTORY_DIRS);
-        }
-      else if (ELEMENT_IS ("DefaultMergeDirs"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DEFAULT_MERGE_DIRS);
-        }
-      else if (ELEMENT_IS ("Name"))
-        {
-          if (has_child_of_type (parser->stack_top, MENU_LAYOUT_NODE_NAME))
-            {
-              set_error (error, context,
-                         G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
-                         "Multiple <Name> elements in a <Menu> element is not allowed\n");
-              return;
-            }
+        if (merge_type != NULL && strcmp (merge_type, "parent") == 0)
+	  {
+	    menu_layout_node_merge_file_set_type (parser->stack_top,
+						  MENU_MERGE_FILE_TYPE_PARENT);
+	  }
+      }
+      return;
 
-          push_node (parser, MENU_LAYOUT_NODE_NAME);
-        }
-      else if (ELEMENT_IS ("Directory"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DIRECTORY);
-        }
-      else if (ELEMENT_IS ("OnlyUnallocated"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_ONLY_UNALLOCATED);
-        }
-      else if (ELEMENT_IS ("NotOnlyUnallocated"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_NOT_ONLY_UNALLOCATED);
-        }
-      else if (ELEMENT_IS ("Include"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_INCLUDE);
-        }
-      else if (ELEMENT_IS ("Exclude"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_EXCLUDE);
-        }
-      else if (ELEMENT_IS ("MergeDir"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_MERGE_DIR);
-        }
-      else if (ELEMENT_IS ("KDELegacyDirs"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_KDE_LEGACY_DIRS);
-        }
-      else if (ELEMENT_IS ("Move"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_MOVE);
-        }
-      else if (ELEMENT_IS ("Deleted"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_DELETED);
+    case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
+      {
+        const char *show_empty;
+        const char *inline_menus;
+        const char *inline_limit;
+        const char *inline_header;
+        const char *inline_alias;
 
-        }
-      else if (ELEMENT_IS ("NotDeleted"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_NOT_DELETED);
-        }
-      else if (ELEMENT_IS ("Layout"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_LAYOUT);
-        }
-      else
+        push_node (parser, MENU_LAYOUT_NODE_DEFAULT_LAYOUT);
+
+        locate_attributes (context, element_name,
+                           attribute_names, attribute_values,
+                           error,
+                           "show_empty",    &show_empty,
+                           "inline",        &inline_menus,
+                           "inline_limit",  &inline_limit,
+                           "inline_header", &inline_header,
+                           "inline_alias",  &inline_alias,
+                           NULL);
+
+        menu_layout_node_default_layout_set_values (parser->stack_top,
+						    show_empty,
+						    inline_menus,
+						    inline_limit,
+						    inline_header,
+						    inline_alias);
+      }
+      return;
+
+    default:
+      break;
+    }
+
+  if (!check_no_attributes (context, element_name,
+                            attribute_names, attribute_values,
+                            error))
+    return;
+
+  switch (type)
+    {
+    case MENU_LAYOUT_NODE_NAME:
+      if (has_child_of_type (parser->stack_top, MENU_LAYOUT_NODE_NAME))
         {
           set_error (error, context,
-                     G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
-                     "Element <%s> may not appear below <%s>\n",
-                     element_name, "Menu");
+                     G_MARKUP_ERROR, G_MARKUP_ERROR_PARSE,
+                     "Multiple <Name> elements in a <Menu> element is not allowed\n");
+          return;
         }
+
+      push_node (parser, MENU_LAYOUT_NODE_NAME);
+      break;
+
+    case MENU_LAYOUT_NODE_APP_DIR:
+    case MENU_LAYOUT_NODE_DEFAULT_APP_DIRS:
+    case MENU_LAYOUT_NODE_DIRECTORY_DIR:
+    case MENU_LAYOUT_NODE_DEFAULT_DIRECTORY_DIRS:
+    case MENU_LAYOUT_NODE_DEFAULT_MERGE_DIRS:
+    case MENU_LAYOUT_NODE_DIRECTORY:
+    case MENU_LAYOUT_NODE_ONLY_UNALLOCATED:
+    case MENU_LAYOUT_NODE_NOT_ONLY_UNALLOCATED:
+    case MENU_LAYOUT_NODE_INCLUDE:
+    case MENU_LAYOUT_NODE_EXCLUDE:
+    case MENU_LAYOUT_NODE_MERGE_DIR:
+    case MENU_LAYOUT_NODE_KDE_LEGACY_DIRS:
+    case MENU_LAYOUT_NODE_MOVE:
+    case MENU_LAYOUT_NODE_DELETED:
+    case MENU_LAYOUT_NODE_NOT_DELETED:
+    case MENU_LAYOUT_NODE_LAYOUT:
+      push_node (parser, type);
+      break;
+
+    default:
+      set_error (error, context,
+                 G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
+                 "Element <%s> may not appear below <%s>\n",
+                 element_name, "Menu");
+      break;
     }
 }
 
 static void
 start_matching_rule_element (MenuParser           *parser,
                              GMarkupParseContext  *context,
+                             MenuLayoutNodeType    type,
                              const char           *element_name,
                              const char          **attribute_names,
                              const char          **attribute_values,
@@ -1552,43 +1651,30 @@ start_matching_rule_element (MenuParser           *parser,
                             error))
     return;
 
-
-  if (ELEMENT_IS ("Filename"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_FILENAME);
-    }
-  else if (ELEMENT_IS ("Category"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_CATEGORY);
-    }
-  else if (ELEMENT_IS ("All"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_ALL);
-    }
-  else if (ELEMENT_IS ("And"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_AND);
-    }
-  else if (ELEMENT_IS ("Or"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_OR);
-    }
-  else if (ELEMENT_IS ("Not"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_NOT);
-    }
-  else
+  switch (type)
     {
+    case MENU_LAYOUT_NODE_FILENAME:
+    case MENU_LAYOUT_NODE_CATEGORY:
+    case MENU_LAYOUT_NODE_ALL:
+    case MENU_LAYOUT_NODE_AND:
+    case MENU_LAYOUT_NODE_OR:
+    case MENU_LAYOUT_NODE_NOT:
+      push_node (parser, type);
+      break;
+
+    default:
       set_error (error, context,
                  G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
                  "Element <%s> may not appear in this context\n",
                  element_name);
+      break;
     }
 }
 
 static void
 start_move_child_element (MenuParser           *parser,
                           GMarkupParseContext  *context,
+                          MenuLayoutNodeType    type,
                           const char           *element_name,
                           const char          **attribute_names,
                           const char          **attribute_values,
@@ -1599,94 +1685,100 @@ start_move_child_element (MenuParser           *parser,
                             error))
     return;
 
-  if (ELEMENT_IS ("Old"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_OLD);
-    }
-  else if (ELEMENT_IS ("New"))
-    {
-      push_node (parser, MENU_LAYOUT_NODE_NEW);
-    }
-  else
+  switch (type)
     {
+    case MENU_LAYOUT_NODE_OLD:
+    case MENU_LAYOUT_NODE_NEW:
+      push_node (parser, type);
+      break;
+
+    default:
       set_error (error, context,
                  G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
                  "Element <%s> may not appear below <%s>\n",
                  element_name, "Move");
+      break;
     }
 }
 
 static void
 start_layout_child_element (MenuParser           *parser,
                             GMarkupParseContext  *context,
+                            MenuLayoutNodeType    type,
                             const char           *element_name,
                             const char          **attribute_names,
                             const char          **attribute_values,
                             GError              **error)
 {
-  if (ELEMENT_IS ("Menuname"))
+  switch (type)
     {
-      const char *show_empty;
-      const char *inline_menus;
-      const char *inline_limit;
-      const char *inline_header;
-      const char *inline_alias;
+    case MENU_LAYOUT_NODE_MENUNAME:
+      {
+        const char *show_empty;
+        const char *inline_menus;
+        const char *inline_limit;
+        const char *inline_header;
+        const char *inline_alias;
 
-      push_node (parser, MENU_LAYOUT_NODE_MENUNAME);
+        push_node (parser, MENU_LAYOUT_NODE_MENUNAME);
 
-      locate_attributes (context, element_name,
-                         attribute_names, attribute_values,
-                         error,
-                         "show_empty",    &show_empty,
-                         "inline",        &inline_menus,
-                         "inline_limit",  &inline_limit,
-                         "inline_header", &inline_header,
-                         "inline_alias",  &inline_alias,
-                         NULL);
+        locate_attributes (context, element_name,
+                           attribute_names, attribute_values,
+                           error,
+                           "show_empty",    &show_empty,
+                           "inline",        &inline_menus,
+                           "inline_limit",  &inline_limit,
+                           "inline_header", &inline_header,
+                           "inline_alias",  &inline_alias,
+                           NULL);
 
-       menu_layout_node_menuname_set_values (parser->stack_top,
-					     show_empty,
-					     inline_menus,
-					     inline_limit,
-					     inline_header,
-					     inline_alias);
-    }
-  else if (ELEMENT_IS ("Merge"))
-    {
-        const char *type;
+        menu_layout_node_menuname_set_values (parser->stack_top,
+					      show_empty,
+					      inline_menus,
+					      inline_limit,
+					      inline_header,
+					      inline_alias);
+      }
+      return;
+
+    case MENU_LAYOUT_NODE_MERGE:
+      {
+        const char *merge_type;
 
         push_node (parser, MENU_LAYOUT_NODE_MERGE);
 
         locate_attributes (context, element_name,
                            attribute_names, attribute_values,
                            error,
-                           "type", &type,
+                           "type", &merge_type,
                            NULL);
 
-	menu_layout_node_merge_set_type (parser->stack_top, type);
+	menu_layout_node_merge_set_type (parser->stack_top, merge_type);
+      }
+      return;
+
+    default:
+      break;
     }
-  else
+
+  if (!check_no_attributes (context, element_name,
+                            attribute_names, attribute_values,
+                            error))
+    return;
+
+  switch (type)
     {
-      if (!check_no_attributes (context, element_name,
-                                attribute_names, attribute_values,
-                                error))
-        return;
+    case MENU_LAYOUT_NODE_FILENAME:
+    case MENU_LAYOUT_NODE_SEPARATOR:
+      push_node (parser, type);
+      break;
 
-      if (ELEMENT_IS ("Filename"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_FILENAME);
-        }
-      else if (ELEMENT_IS ("Separator"))
-        {
-          push_node (parser, MENU_LAYOUT_NODE_SEPARATOR);
-        }
-      else
-        {
-          set_error (error, context,
-                     G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
-                     "Element <%s> may not appear below <%s>\n",
-                     element_name, "Move");
-        }
+    default:
+      set_error (error, context,
+                 G_MARKUP_ERROR, G_MARKUP_ERROR_UNKNOWN_ELEMENT,
+                 "Element <%s> may not appear below <%s>\n",
+                 element_name, "Move");
+      break;
     }
 }
 
@@ -1698,9 +1790,12 @@ start_element_handler (GMarkupParseContext   *context,
                        gpointer               user_data,
                        GError               **error)
 {
-  MenuParser *parser = user_data;
+  MenuParser         *parser = user_data;
+  MenuLayoutNodeType  type;
 
-  if (ELEMENT_IS ("Menu"))
+  type = element_name_to_type (element_name);
+
+  if (type == MENU_LAYOUT_NODE_MENU)
     {
       if (parser->stack_top == parser->root &&
           has_child_of_type (parser->root, MENU_LAYOUT_NODE_MENU))
@@ -1724,7 +1819,7 @@ start_element_handler (GMarkupParseContext   *context,
     }
   else if (parser->stack_top->type == MENU_LAYOUT_NODE_MENU)
     {
-      start_menu_child_element (parser, context, element_name,
+      start_menu_child_element (parser, context, type, element_name,
                                 attribute_names, attribute_values,
                                 error);
     }
@@ -1734,20 +1829,20 @@ start_element_handler (GMarkupParseContext   *context,
            parser->stack_top->type == MENU_LAYOUT_NODE_OR      ||
            parser->stack_top->type == MENU_LAYOUT_NODE_NOT)
     {
-      start_matching_rule_element (parser, context, element_name,
+      start_matching_rule_element (parser, context, type, element_name,
                                    attribute_names, attribute_values,
                                    error);
     }
   else if (parser->stack_top->type == MENU_LAYOUT_NODE_MOVE)
     {
-      start_move_child_element (parser, context, element_name,
+      start_move_child_element (parser, context, type, element_name,
                                 attribute_names, attribute_values,
                                 error);
     }
   else if (parser->stack_top->type == MENU_LAYOUT_NODE_LAYOUT ||
            parser->stack_top->type == MENU_LAYOUT_NODE_DEFAULT_LAYOUT)
     {
-      start_layout_child_element (parser, context, element_name,
+      start_layout_child_element (parser, context, type, element_name,
                                   attribute_names, attribute_values,
                                   error);
     }
@@ -2357,3 +2452,236 @@ menu_layout_load (const char  *filename,
 
   return retval;
 }
+
+/*
+ * Compiled layouts
+ *
+ * Nodes are written depth-first: type, content, the data specific to the
+ * type, then the number of children followed by the children themselves.
+ */
+
+#define MENU_LAYOUT_READ_MAX_DEPTH 256
+
+static void
+menu_layout_values_write (MenuLayoutValues *values,
+			  GString          *out)
+{
+  menu_write_uint32 (out, values->mask);
+  menu_write_uint32 (out,
+		     (values->show_empty    ? 1 << 0 : 0) |
+		     (values->inline_menus  ? 1 << 1 : 0) |
+		     (values->inline_header ? 1 << 2 : 0) |
+		     (values->inline_alias  ? 1 << 3 : 0));
+  menu_write_uint32 (out, values->inline_limit);
+}
+
+static gboolean
+menu_layout_values_read (MenuLayoutValues  *values,
+			 const char       **data,
+			 const char        *end)
+{
+  guint32 mask;
+  guint32 bits;
+  guint32 inline_limit;
+
+  if (!menu_read_uint32 (data, end, &mask) ||
+      !menu_read_uint32 (data, end, &bits) ||
+      !menu_read_uint32 (data, end, &inline_limit))
+    return FALSE;
+
+  values->mask          = mask;
+  values->show_empty    = (bits & (1 << 0)) != 0;
+  values->inline_menus  = (bits & (1 << 1)) != 0;
+  values->inline_header = (bits & (1 << 2)) != 0;
+  values->inline_alias  = (bits & (1 << 3)) != 0;
+  values->inline_limit  = inline_limit;
+
+  return TRUE;
+}
+
+static void
+menu_layout_node_write (MenuLayoutNode *node,
+			GString        *out)
+{
+  MenuLayoutNode *iter;
+  guint32         n_children;
+
+  menu_write_uint32 (out, node->type);
+  menu_write_string (out, node->content);
+
+  switch (node->type)
+    {
+    case MENU_LAYOUT_NODE_ROOT:
+      {
+        MenuLayoutNodeRoot *nr = (MenuLayoutNodeRoot *) node;
+
+        menu_write_string (out, nr->basedir);
+        menu_write_string (out, nr->name);
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      menu_write_string (out, ((MenuLayoutNodeLegacyDir *) node)->prefix);
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE_FILE:
+      menu_write_uint32 (out, ((MenuLayoutNodeMergeFile *) node)->type);
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
+      menu_layout_values_write (&((MenuLayoutNodeDefaultLayout *) node)->layout_values,
+				out);
+      break;
+
+    case MENU_LAYOUT_NODE_MENUNAME:
+      menu_layout_values_write (&((MenuLayoutNodeMenuname *) node)->layout_values,
+				out);
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE:
+      menu_write_uint32 (out, ((MenuLayoutNodeMerge *) node)->merge_type);
+      break;
+
+    default:
+      break;
+    }
+
+  n_children = 0;
+  for (iter = node->children; iter != NULL; iter = node_next (iter))
+    n_children++;
+
+  menu_write_uint32 (out, n_children);
+
+  for (iter = node->children; iter != NULL; iter = node_next (iter))
+    menu_layout_node_write (iter, out);
+}
+
+void
+menu_layout_write (MenuLayoutNode *root,
+		   GString        *out)
+{
+  g_return_if_fail (root->type == MENU_LAYOUT_NODE_ROOT);
+
+  menu_layout_node_write (root, out);
+}
+
+static MenuLayoutNode *
+menu_layout_node_read (const char **data,
+		       const char  *end,
+		       guint        depth)
+{
+  MenuLayoutNode *node;
+  guint32         type;
+  guint32         value;
+  guint32         n_children;
+
+  if (depth > MENU_LAYOUT_READ_MAX_DEPTH)
+    return NULL;
+
+  if (!menu_read_uint32 (data, end, &type) ||
+      type > MENU_LAYOUT_NODE_MERGE)
+    return NULL;
+
+  node = menu_layout_node_new (type);
+
+  if (!menu_read_string (data, end, &node->content))
+    goto error;
+
+  if (content_is_interned (node->type))
+    {
+      char *content = node->content;
+
+      node->content = (char *) g_intern_string (content);
+      g_free (content);
+    }
+
+  switch (node->type)
+    {
+    case MENU_LAYOUT_NODE_ROOT:
+      {
+        MenuLayoutNodeRoot *nr = (MenuLayoutNodeRoot *) node;
+
+        if (!menu_read_string (data, end, &nr->basedir) ||
+            !menu_read_string (data, end, &nr->name))
+          goto error;
+      }
+      break;
+
+    case MENU_LAYOUT_NODE_LEGACY_DIR:
+      if (!menu_read_string (data, end, &((MenuLayoutNodeLegacyDir *) node)->prefix))
+        goto error;
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE_FILE:
+      if (!menu_read_uint32 (data, end, &value))
+        goto error;
+      ((MenuLayoutNodeMergeFile *) node)->type = value;
+      break;
+
+    case MENU_LAYOUT_NODE_DEFAULT_LAYOUT:
+      if (!menu_layout_values_read (&((MenuLayoutNodeDefaultLayout *) node)->layout_values,
+                                    data, end))
+        goto error;
+      break;
+
+    case MENU_LAYOUT_NODE_MENUNAME:
+      if (!menu_layout_values_read (&((MenuLayoutNodeMenuname *) node)->layout_values,
+                                    data, end))
+        goto error;
+      break;
+
+    case MENU_LAYOUT_NODE_MERGE:
+      if (!menu_read_uint32 (data, end, &value))
+        goto error;
+      ((MenuLayoutNodeMerge *) node)->merge_type = value;
+      break;
+
+    default:
+      break;
+    }
+
+  if (!menu_read_uint32 (data, end, &n_children))
+    goto error;
+
+  while (n_children-- > 0)
+    {
+      MenuLayoutNode *child;
+
+      child = menu_layout_node_read (data, end, depth + 1);
+      if (child == NULL || child->type == MENU_LAYOUT_NODE_ROOT)
+        {
+          if (child != NULL)
+            menu_layout_node_unref (child);
+          goto error;
+        }
+
+      menu_layout_node_append_child (node, child);
+      menu_layout_node_unref (child);
+    }
+
+  return node;
+
+ error:
+  menu_layout_node_unref (node);
+  return NULL;
+}
+
+MenuLayoutNode *
+menu_layout_read (const char **data,
+		  const char  *end)
+{
+  MenuLayoutNode *root;
+
+  root = menu_layout_node_read (data, end, 0);
+  if (root == NULL)
+    return NULL;
+
+  if (root->type != MENU_LAYOUT_NODE_ROOT ||
+      !has_child_of_type (root, MENU_LAYOUT_NODE_MENU))
+    {
+      menu_layout_node_unref (root);
+      return NULL;
+    }
+
+  return root;
+}
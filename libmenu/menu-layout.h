@@ -104,9 +104,14 @@ typedef struct {
 
 MenuLayoutNode *menu_layout_load (const char* filename, const char  *non_prefixed_basename, GError** error);
 
+/* Compiled form of a whole layout, used by the persistent layout cache */
+void            menu_layout_write (MenuLayoutNode* root, GString* out);
+MenuLayoutNode *menu_layout_read  (const char** data, const char* end);
+
 MenuLayoutNode *menu_layout_node_new   (MenuLayoutNodeType  type);
 MenuLayoutNode *menu_layout_node_ref   (MenuLayoutNode     *node);
 void            menu_layout_node_unref (MenuLayoutNode     *node);
+MenuLayoutNode *menu_layout_node_copy  (MenuLayoutNode     *node);
 
 MenuLayoutNodeType menu_layout_node_get_type (MenuLayoutNode *node);
 
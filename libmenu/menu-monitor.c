@@ -25,8 +25,30 @@
 #include "menu-monitor.h"
 
 #include <gio/gio.h>
+#include <glib-unix.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "menu-util.h"
+#include "canonicalize.h"
+
+/* How long to wait before trying again when the lock is held by a thread
+ * loading a tree, in ms */
+#define MENU_LOCK_RETRY_INTERVAL 100
+
+typedef struct MenuMonitorState MenuMonitorState;
+
+struct MenuMonitorState {
+	gint64 mtime;
+	gint64 size;
+	gint64 inode;
+
+	/* basename -> MenuMonitorState, for directories */
+	GHashTable* children;
+};
 
 struct MenuMonitor {
 	char* path;
@@ -35,16 +57,38 @@ struct MenuMonitor {
 	GSList* notifies;
 
 	GFileMonitor* monitor;
+	/* where the file monitor lives and the events are emitted */
+	GMainContext* context;
+
+	/* what the path looked like when the monitor was registered, until
+	 * its deferred creation: see menu_monitor_begin_deferred() */
+	MenuMonitorState* state;
+
+	/* the connection watched by a socket monitor, and its source in the
+	 * context */
+	int socket_fd;
+	GSource* socket_source;
 
 	guint is_directory: 1;
+	guint is_socket: 1;
 };
 
+typedef struct {
+	GMainContext* context;
+	GSList* monitors;
+} MenuMonitorDeferred;
+
 typedef struct {
 	MenuMonitor* monitor;
 	MenuMonitorEvent event;
 	char* path;
 } MenuMonitorEventInfo;
 
+typedef struct {
+	GMainContext* context;
+	GSList* events;
+} MenuMonitorEventQueue;
+
 typedef struct {
 	MenuMonitorNotifyFunc notify_func;
 	gpointer user_data;
@@ -55,8 +99,32 @@ static MenuMonitorNotify* gde2_menu_monitor_notify_ref(MenuMonitorNotify* notify
 static void gde2_menu_monitor_notify_unref(MenuMonitorNotify* notify);
 
 static GHashTable* monitors_registry = NULL;
-static guint events_idle_handler = 0;
-static GSList* pending_events = NULL;
+
+/* the events are queued by the file monitors without taking the library
+ * lock, which may be held for a while by a thread loading a tree: there is
+ * a queue for each GMainContext with monitors, emitted by an idle source of
+ * that context */
+static GMutex pending_events_lock;
+static GHashTable* pending_events = NULL;
+
+static GPrivate deferred_monitors = G_PRIVATE_INIT (NULL);
+
+static guint menu_monitor_add_source(GMainContext* context, guint interval, GSourceFunc func, gpointer data)
+{
+  GSource *source;
+  guint    id;
+
+  if (interval > 0)
+    source = g_timeout_source_new (interval);
+  else
+    source = g_idle_source_new ();
+
+  g_source_set_callback (source, func, data, NULL);
+  id = g_source_attach (source, context);
+  g_source_unref (source);
+
+  return id;
+}
 
 static void invoke_notifies(MenuMonitor* monitor, MenuMonitorEvent  event, const char* path)
 {
@@ -87,15 +155,31 @@ static void invoke_notifies(MenuMonitor* monitor, MenuMonitorEvent  event, const
   g_slist_free (copy);
 }
 
-static gboolean emit_events_in_idle(void)
+static gboolean emit_events_in_idle(MenuMonitorEventQueue* queue)
 {
   GSList *events_to_emit;
   GSList *tmp;
 
-  events_to_emit = pending_events;
+  if (!menu_trylock ())
+    {
+      /* don't block the main loop until the tree is loaded */
+      menu_monitor_add_source (queue->context,
+                               MENU_LOCK_RETRY_INTERVAL,
+                               (GSourceFunc) emit_events_in_idle,
+                               queue);
+      return FALSE;
+    }
+
+  g_mutex_lock (&pending_events_lock);
+
+  /* the events queued from now on get a new queue and idle source */
+  g_hash_table_remove (pending_events, queue->context);
+  events_to_emit = queue->events;
+
+  g_mutex_unlock (&pending_events_lock);
 
-  pending_events = NULL;
-  events_idle_handler = 0;
+  g_main_context_unref (queue->context);
+  g_free (queue);
 
   tmp = events_to_emit;
   while (tmp != NULL)
@@ -131,29 +215,179 @@ static gboolean emit_events_in_idle(void)
 
   g_slist_free (events_to_emit);
 
+  menu_unlock ();
+
   return FALSE;
 }
 
+/* Called with the pending events lock held. */
+static void menu_monitor_queue_event_unlocked(MenuMonitorEventInfo* event_info)
+{
+  MenuMonitorEventQueue *queue;
+  GMainContext          *context;
+
+  context = event_info->monitor->context;
+
+  if (pending_events == NULL)
+    pending_events = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  queue = g_hash_table_lookup (pending_events, context);
+
+  if (queue == NULL)
+    {
+      queue = g_new0 (MenuMonitorEventQueue, 1);
+      queue->context = g_main_context_ref (context);
+
+      g_hash_table_insert (pending_events, context, queue);
+
+      menu_monitor_add_source (context,
+                               0,
+                               (GSourceFunc) emit_events_in_idle,
+                               queue);
+    }
+
+  queue->events = g_slist_append (queue->events, event_info);
+}
+
 static void menu_monitor_queue_event(MenuMonitorEventInfo* event_info)
 {
-  pending_events = g_slist_append (pending_events, event_info);
+  g_mutex_lock (&pending_events_lock);
+  menu_monitor_queue_event_unlocked (event_info);
+  g_mutex_unlock (&pending_events_lock);
+}
+
+static void menu_monitor_report_event(MenuMonitor* monitor, MenuMonitorEvent event, char* path)
+{
+  MenuMonitorEventInfo *event_info;
+
+  event_info = g_new0 (MenuMonitorEventInfo, 1);
+
+  event_info->path    = path;
+  event_info->event   = event;
+  event_info->monitor = monitor;
+
+  menu_canonicalize_file_changed (event_info->path,
+                                  event == MENU_MONITOR_EVENT_CREATED);
+  menu_monitor_queue_event (event_info);
+}
+
+static void menu_monitor_state_free(MenuMonitorState* state)
+{
+  if (state->children != NULL)
+    g_hash_table_destroy (state->children);
+
+  g_free (state);
+}
+
+static MenuMonitorState* menu_monitor_state_new(const char* path, gboolean is_directory)
+{
+  MenuMonitorState *state;
+  GDir             *dir;
+  const char       *name;
+
+  state = g_new0 (MenuMonitorState, 1);
+
+  menu_stat_file (path, &state->mtime, &state->size, &state->inode);
 
-  if (events_idle_handler == 0)
+  if (!is_directory)
+    return state;
+
+  state->children = g_hash_table_new_full (g_str_hash,
+                                           g_str_equal,
+                                           g_free,
+                                           (GDestroyNotify) menu_monitor_state_free);
+
+  if ((dir = g_dir_open (path, 0, NULL)) == NULL)
+    return state;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      char *child_path;
+
+      child_path = g_build_filename (path, name, NULL);
+      g_hash_table_insert (state->children,
+                           g_strdup (name),
+                           menu_monitor_state_new (child_path, FALSE));
+      g_free (child_path);
+    }
+
+  g_dir_close (dir);
+
+  return state;
+}
+
+static inline gboolean menu_monitor_state_equal(MenuMonitorState* a, MenuMonitorState* b)
+{
+  return a->mtime == b->mtime && a->size == b->size && a->inode == b->inode;
+}
+
+/* Reports what changed between the registration of a deferred monitor and
+ * its creation, as the file monitor would have. */
+static void menu_monitor_replay_changes(MenuMonitor* monitor)
+{
+  MenuMonitorState *old_state;
+  MenuMonitorState *new_state;
+  GHashTableIter    iter;
+  const char       *name;
+  MenuMonitorState *child;
+
+  old_state = monitor->state;
+  monitor->state = NULL;
+
+  new_state = menu_monitor_state_new (monitor->path, monitor->is_directory);
+
+  if (!monitor->is_directory)
+    {
+      if (!menu_monitor_state_equal (old_state, new_state))
+        menu_monitor_report_event (monitor,
+                                   old_state->mtime == -1 ? MENU_MONITOR_EVENT_CREATED :
+                                   new_state->mtime == -1 ? MENU_MONITOR_EVENT_DELETED :
+                                                            MENU_MONITOR_EVENT_CHANGED,
+                                   g_strdup (monitor->path));
+    }
+  else
     {
-      events_idle_handler = g_idle_add ((GSourceFunc) emit_events_in_idle, NULL);
+      g_hash_table_iter_init (&iter, old_state->children);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &name, (gpointer *) &child))
+        {
+          MenuMonitorState *new_child;
+
+          new_child = g_hash_table_lookup (new_state->children, name);
+
+          if (new_child == NULL)
+            menu_monitor_report_event (monitor, MENU_MONITOR_EVENT_DELETED,
+                                       g_build_filename (monitor->path, name, NULL));
+          else if (!menu_monitor_state_equal (child, new_child))
+            menu_monitor_report_event (monitor, MENU_MONITOR_EVENT_CHANGED,
+                                       g_build_filename (monitor->path, name, NULL));
+        }
+
+      g_hash_table_iter_init (&iter, new_state->children);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &name, NULL))
+        {
+          if (g_hash_table_lookup (old_state->children, name) == NULL)
+            menu_monitor_report_event (monitor, MENU_MONITOR_EVENT_CREATED,
+                                       g_build_filename (monitor->path, name, NULL));
+        }
+
+      if (old_state->mtime != -1 && new_state->mtime == -1)
+        menu_monitor_report_event (monitor, MENU_MONITOR_EVENT_DELETED,
+                                   g_strdup (monitor->path));
     }
+
+  menu_monitor_state_free (old_state);
+  menu_monitor_state_free (new_state);
 }
 
-static inline char* get_registry_key(const char* path, gboolean is_directory)
+static inline char* get_registry_key(const char* path, gboolean is_directory, gboolean is_socket)
 {
   return g_strdup_printf ("%s:%s",
 			  path,
-			  is_directory ? "<dir>" : "<file>");
+			  is_socket ? "<socket>" : is_directory ? "<dir>" : "<file>");
 }
 
 static gboolean monitor_callback (GFileMonitor* monitor, GFile* child, GFile* other_file, GFileMonitorEvent eflags, gpointer user_data)
 {
-  MenuMonitorEventInfo *event_info;
   MenuMonitorEvent      event;
   MenuMonitor          *menu_monitor = (MenuMonitor *) user_data;
 
@@ -173,67 +407,250 @@ static gboolean monitor_callback (GFileMonitor* monitor, GFile* child, GFile* ot
       return TRUE;
     }
 
-  event_info = g_new0 (MenuMonitorEventInfo, 1);
+  menu_monitor_report_event (menu_monitor, event, g_file_get_path (child));
 
-  event_info->path    = g_file_get_path (child);
-  event_info->event   = event;
-  event_info->monitor = menu_monitor;
+  return TRUE;
+}
 
-  menu_monitor_queue_event (event_info);
+/* The file monitor is attached to the thread-default context. */
+static void create_file_monitor(MenuMonitor* monitor)
+{
+  GFile *file;
 
-  return TRUE;
+  file = g_file_new_for_path (monitor->path);
+
+  if (file == NULL)
+    {
+      menu_verbose ("Not adding monitor on '%s', failed to create GFile\n",
+                    monitor->path);
+      return;
+    }
+
+  if (monitor->is_directory)
+      monitor->monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
+                                                   NULL, NULL);
+  else
+      monitor->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE,
+                                              NULL, NULL);
+
+  g_object_unref (G_OBJECT (file));
+
+  if (monitor->monitor == NULL)
+    {
+      menu_verbose ("Not adding monitor on '%s', failed to create monitor\n",
+                    monitor->path);
+      return;
+    }
+
+  g_signal_connect (monitor->monitor, "changed",
+                    G_CALLBACK (monitor_callback), monitor);
 }
 
-static MenuMonitor* register_monitor(const char* path, gboolean is_directory)
+static gboolean socket_closed(int fd, GIOCondition condition, MenuMonitor* monitor)
 {
-  MenuMonitor     *retval;
-  GFile           *file;
+  MenuMonitorEventInfo *event_info;
+
+  g_mutex_lock (&pending_events_lock);
+
+  /* the monitor is gone if it was unreffed while we were dispatched */
+  if (!g_source_is_destroyed (g_main_current_source ()))
+    {
+      menu_verbose ("The connection to \"%s\" was closed\n", monitor->path);
+
+      event_info = g_new0 (MenuMonitorEventInfo, 1);
+
+      event_info->path    = g_strdup (monitor->path);
+      event_info->event   = MENU_MONITOR_EVENT_CHANGED;
+      event_info->monitor = monitor;
+
+      menu_monitor_queue_event_unlocked (event_info);
+    }
+
+  g_mutex_unlock (&pending_events_lock);
+
+  return FALSE;
+}
+
+/* The connection is watched from the context of the monitor, until it is
+ * closed or the monitor is unreffed. */
+static void watch_socket(MenuMonitor* monitor)
+{
+  struct sockaddr_un  addr;
+  int                 fd;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+
+  fd = -1;
+  if (strlen (monitor->path) < sizeof (addr.sun_path))
+    {
+      strcpy (addr.sun_path, monitor->path);
+      fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    }
+
+  if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof (addr)) != 0)
+    {
+      close (fd);
+      fd = -1;
+    }
+
+  if (fd < 0)
+    {
+      menu_verbose ("Failed to connect to \"%s\"\n", monitor->path);
+
+      menu_monitor_report_event (monitor,
+                                 MENU_MONITOR_EVENT_CHANGED,
+                                 g_strdup (monitor->path));
+      return;
+    }
+
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+  monitor->socket_fd     = fd;
+  monitor->socket_source = g_unix_fd_source_new (fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+
+  g_source_set_callback (monitor->socket_source,
+                         (GSourceFunc) socket_closed,
+                         monitor,
+                         NULL);
+  g_source_attach (monitor->socket_source, monitor->context);
+}
+
+static MenuMonitor* register_monitor(const char* path, gboolean is_directory, gboolean is_socket)
+{
+  MenuMonitor         *retval;
+  MenuMonitorDeferred *deferred;
 
   retval = g_new0 (MenuMonitor, 1);
 
   retval->path         = g_strdup (path);
   retval->refcount     = 1;
+  retval->socket_fd    = -1;
   retval->is_directory = is_directory != FALSE;
+  retval->is_socket    = is_socket != FALSE;
 
-  file = g_file_new_for_path (retval->path);
+  deferred = g_private_get (&deferred_monitors);
 
-  if (file == NULL)
+  if (retval->is_socket)
     {
-      menu_verbose ("Not adding monitor on '%s', failed to create GFile\n",
-                    retval->path);
+      retval->context = deferred != NULL ? g_main_context_ref (deferred->context) :
+                                           g_main_context_ref_thread_default ();
+
+      watch_socket (retval);
+
       return retval;
     }
 
-  if (retval->is_directory)
-      retval->monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
-                                                  NULL, NULL);
-  else
-      retval->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE,
-                                             NULL, NULL);
+  if (deferred != NULL)
+    {
+      retval->context = g_main_context_ref (deferred->context);
+      retval->state   = menu_monitor_state_new (retval->path,
+                                                retval->is_directory);
 
-  g_object_unref (G_OBJECT (file));
+      deferred->monitors = g_slist_prepend (deferred->monitors,
+                                            gde2_menu_monitor_ref (retval));
 
-  if (retval->monitor == NULL)
-    {
-      menu_verbose ("Not adding monitor on '%s', failed to create monitor\n",
-                    retval->path);
       return retval;
     }
 
-  g_signal_connect (retval->monitor, "changed",
-                    G_CALLBACK (monitor_callback), retval);
+  retval->context = g_main_context_ref_thread_default ();
+
+  create_file_monitor (retval);
 
   return retval;
 }
 
-static MenuMonitor* lookup_monitor(const char* path, gboolean is_directory)
+static gboolean create_deferred_monitors(MenuMonitorDeferred* deferred)
+{
+  GSList *tmp;
+
+  if (!menu_trylock ())
+    {
+      menu_monitor_add_source (deferred->context,
+                               MENU_LOCK_RETRY_INTERVAL,
+                               (GSourceFunc) create_deferred_monitors,
+                               deferred);
+      return FALSE;
+    }
+
+  /* we're dispatched in the context, so it can be acquired */
+  g_main_context_push_thread_default (deferred->context);
+
+  deferred->monitors = g_slist_reverse (deferred->monitors);
+
+  tmp = deferred->monitors;
+  while (tmp != NULL)
+    {
+      MenuMonitor *monitor = tmp->data;
+
+      /* unless it's been unreffed in the meantime */
+      if (monitor->refcount > 1)
+        {
+          create_file_monitor (monitor);
+          menu_monitor_replay_changes (monitor);
+        }
+
+      menu_monitor_unref (monitor);
+
+      tmp = tmp->next;
+    }
+
+  g_main_context_pop_thread_default (deferred->context);
+
+  menu_unlock ();
+
+  g_slist_free (deferred->monitors);
+  g_main_context_unref (deferred->context);
+  g_free (deferred);
+
+  return FALSE;
+}
+
+void menu_monitor_begin_deferred(GMainContext* context)
+{
+  MenuMonitorDeferred *deferred;
+
+  g_return_if_fail (g_private_get (&deferred_monitors) == NULL);
+
+  deferred = g_new0 (MenuMonitorDeferred, 1);
+
+  deferred->context = context != NULL ? g_main_context_ref (context) :
+                                        g_main_context_ref_thread_default ();
+
+  g_private_set (&deferred_monitors, deferred);
+}
+
+void menu_monitor_end_deferred(void)
+{
+  MenuMonitorDeferred *deferred;
+
+  deferred = g_private_get (&deferred_monitors);
+
+  g_return_if_fail (deferred != NULL);
+
+  g_private_set (&deferred_monitors, NULL);
+
+  if (deferred->monitors == NULL)
+    {
+      g_main_context_unref (deferred->context);
+      g_free (deferred);
+      return;
+    }
+
+  menu_monitor_add_source (deferred->context,
+                           0,
+                           (GSourceFunc) create_deferred_monitors,
+                           deferred);
+}
+
+static MenuMonitor* lookup_monitor(const char* path, gboolean is_directory, gboolean is_socket)
 {
   MenuMonitor *retval;
   char        *registry_key;
 
   retval = NULL;
 
-  registry_key = get_registry_key (path, is_directory);
+  registry_key = get_registry_key (path, is_directory, is_socket);
 
   if (monitors_registry == NULL)
     {
@@ -249,31 +666,38 @@ static MenuMonitor* lookup_monitor(const char* path, gboolean is_directory)
 
   if (retval == NULL)
     {
-      retval = register_monitor (path, is_directory);
+      retval = register_monitor (path, is_directory, is_socket);
       g_hash_table_insert (monitors_registry, registry_key, retval);
-
-      return retval;
     }
   else
     {
       g_free (registry_key);
 
-      return gde2_menu_monitor_ref(retval);
+      gde2_menu_monitor_ref (retval);
     }
+
+  return retval;
 }
 
 MenuMonitor* gde2_menu_monitor_file_get(const char* path)
 {
 	g_return_val_if_fail(path != NULL, NULL);
 
-	return lookup_monitor(path, FALSE);
+	return lookup_monitor(path, FALSE, FALSE);
 }
 
 MenuMonitor* menu_get_directory_monitor(const char* path)
 {
   g_return_val_if_fail (path != NULL, NULL);
 
-  return lookup_monitor (path, TRUE);
+  return lookup_monitor (path, TRUE, FALSE);
+}
+
+MenuMonitor* menu_get_socket_monitor(const char* path)
+{
+  g_return_val_if_fail (path != NULL, NULL);
+
+  return lookup_monitor (path, FALSE, TRUE);
 }
 
 MenuMonitor* gde2_menu_monitor_ref(MenuMonitor* monitor)
@@ -288,9 +712,16 @@ MenuMonitor* gde2_menu_monitor_ref(MenuMonitor* monitor)
 
 static void menu_monitor_clear_pending_events(MenuMonitor* monitor)
 {
-  GSList *tmp;
+  MenuMonitorEventQueue *queue;
+  GSList                *tmp;
+
+  g_mutex_lock (&pending_events_lock);
 
-  tmp = pending_events;
+  queue = NULL;
+  if (pending_events != NULL)
+    queue = g_hash_table_lookup (pending_events, monitor->context);
+
+  tmp = queue != NULL ? queue->events : NULL;
   while (tmp != NULL)
     {
       MenuMonitorEventInfo *event_info = tmp->data;
@@ -298,7 +729,7 @@ static void menu_monitor_clear_pending_events(MenuMonitor* monitor)
 
       if (event_info->monitor == monitor)
 	{
-	  pending_events = g_slist_delete_link (pending_events, tmp);
+	  queue->events = g_slist_delete_link (queue->events, tmp);
 
 	  g_free (event_info->path);
 	  event_info->path = NULL;
@@ -311,6 +742,8 @@ static void menu_monitor_clear_pending_events(MenuMonitor* monitor)
 
       tmp = next;
     }
+
+  g_mutex_unlock (&pending_events_lock);
 }
 
 void menu_monitor_unref(MenuMonitor* monitor)
@@ -323,7 +756,7 @@ void menu_monitor_unref(MenuMonitor* monitor)
   if (--monitor->refcount > 0)
     return;
 
-  registry_key = get_registry_key (monitor->path, monitor->is_directory);
+  registry_key = get_registry_key (monitor->path, monitor->is_directory, monitor->is_socket);
   g_hash_table_remove (monitors_registry, registry_key);
   g_free (registry_key);
 
@@ -340,12 +773,34 @@ void menu_monitor_unref(MenuMonitor* monitor)
       monitor->monitor = NULL;
     }
 
+  if (monitor->socket_source)
+    {
+      /* see socket_closed() */
+      g_mutex_lock (&pending_events_lock);
+      g_source_destroy (monitor->socket_source);
+      g_mutex_unlock (&pending_events_lock);
+
+      g_source_unref (monitor->socket_source);
+      monitor->socket_source = NULL;
+    }
+
+  if (monitor->socket_fd >= 0)
+    close (monitor->socket_fd);
+  monitor->socket_fd = -1;
+
   g_slist_foreach (monitor->notifies, (GFunc) gde2_menu_monitor_notify_unref, NULL);
   g_slist_free (monitor->notifies);
   monitor->notifies = NULL;
 
   menu_monitor_clear_pending_events (monitor);
 
+  if (monitor->state)
+    menu_monitor_state_free (monitor->state);
+  monitor->state = NULL;
+
+  g_main_context_unref (monitor->context);
+  monitor->context = NULL;
+
   g_free (monitor->path);
   monitor->path = NULL;
 
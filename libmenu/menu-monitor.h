@@ -41,6 +41,11 @@ typedef void (*MenuMonitorNotifyFunc) (MenuMonitor* monitor, MenuMonitorEvent ev
 
 MenuMonitor* menu_get_file_monitor(const char* path);
 MenuMonitor* menu_get_directory_monitor(const char* path);
+/* Connects to the Unix socket at @path, and reports a change once the
+ * connection is closed by the other end, for instance because it exited, or
+ * right away if it can't be made. Looking the monitor up again after the
+ * last unref makes a new connection. */
+MenuMonitor* menu_get_socket_monitor(const char* path);
 
 MenuMonitor* menu_monitor_ref(MenuMonitor* monitor);
 void menu_monitor_unref(MenuMonitor* monitor);
@@ -48,12 +53,21 @@ void menu_monitor_unref(MenuMonitor* monitor);
 void menu_monitor_add_notify(MenuMonitor* monitor, MenuMonitorNotifyFunc notify_func, gpointer user_data);
 void menu_monitor_remove_notify(MenuMonitor* monitor, MenuMonitorNotifyFunc notify_func, gpointer user_data);
 
+/* The monitors registered by the calling thread until menu_monitor_end_deferred()
+ * are only created on @context (the thread-default one if NULL) once that has
+ * been called, and their events are emitted there: for threads building trees
+ * for a caller running a main loop. The changes that happened in the meantime
+ * are reported then. */
+void menu_monitor_begin_deferred(GMainContext* context);
+void menu_monitor_end_deferred(void);
+
 
 /* Izquierda a derecha
  */
 
 #define gde2_menu_monitor_file_get       menu_get_file_monitor
 #define gde2_menu_monitor_directory_get  menu_get_directory_monitor
+#define gde2_menu_monitor_socket_get     menu_get_socket_monitor
 
 #define gde2_menu_monitor_ref    menu_monitor_ref
 #define gde2_menu_monitor_unref  menu_monitor_unref
@@ -25,7 +25,149 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <glib/gstdio.h>
 
+static GRecMutex menu_rec_lock;
+
+void menu_lock(void)
+{
+	g_rec_mutex_lock(&menu_rec_lock);
+}
+
+void menu_unlock(void)
+{
+	g_rec_mutex_unlock(&menu_rec_lock);
+}
+
+gboolean menu_trylock(void)
+{
+	return g_rec_mutex_trylock(&menu_rec_lock);
+}
+
+#define NULL_STRING_LENGTH G_MAXUINT32
+
+void menu_write_uint32(GString* out, guint32 value)
+{
+	g_string_append_len(out, (const char*) &value, sizeof(value));
+}
+
+void menu_write_int64(GString* out, gint64 value)
+{
+	g_string_append_len(out, (const char*) &value, sizeof(value));
+}
+
+void menu_write_string(GString* out, const char* str)
+{
+	if (str == NULL)
+	{
+		menu_write_uint32(out, NULL_STRING_LENGTH);
+		return;
+	}
+
+	menu_write_uint32(out, strlen(str));
+	g_string_append(out, str);
+}
+
+void menu_write_mapped_string(GString* out, const char* str)
+{
+	if (str == NULL)
+	{
+		menu_write_uint32(out, NULL_STRING_LENGTH);
+		return;
+	}
+
+	menu_write_uint32(out, strlen(str));
+	g_string_append_len(out, str, strlen(str) + 1);
+}
+
+gboolean menu_read_uint32(const char** data, const char* end, guint32* value)
+{
+	if (end - *data < (gssize) sizeof(*value))
+		return FALSE;
+
+	memcpy(value, *data, sizeof(*value));
+	*data += sizeof(*value);
+
+	return TRUE;
+}
+
+gboolean menu_read_int64(const char** data, const char* end, gint64* value)
+{
+	if (end - *data < (gssize) sizeof(*value))
+		return FALSE;
+
+	memcpy(value, *data, sizeof(*value));
+	*data += sizeof(*value);
+
+	return TRUE;
+}
+
+gboolean menu_read_string(const char** data, const char* end, char** str)
+{
+	guint32 len;
+
+	if (!menu_read_uint32(data, end, &len))
+		return FALSE;
+
+	if (len == NULL_STRING_LENGTH)
+	{
+		*str = NULL;
+		return TRUE;
+	}
+
+	if (end - *data < (gssize) len)
+		return FALSE;
+
+	*str = g_strndup(*data, len);
+	*data += len;
+
+	return TRUE;
+}
+
+gboolean menu_read_mapped_string(const char** data, const char* end, const char** str)
+{
+	guint32 len;
+
+	if (!menu_read_uint32(data, end, &len))
+		return FALSE;
+
+	if (len == NULL_STRING_LENGTH)
+	{
+		*str = NULL;
+		return TRUE;
+	}
+
+	if (end - *data <= (gssize) len || (*data)[len] != '\0')
+		return FALSE;
+
+	*str = *data;
+	*data += len + 1;
+
+	return TRUE;
+}
+
+void menu_stat_file(const char* path, gint64* mtime, gint64* size, gint64* inode)
+{
+	GStatBuf buf;
+
+	if (g_stat(path, &buf) != 0)
+	{
+		*mtime = -1;
+		*size = 0;
+		*inode = 0;
+		return;
+	}
+
+	#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+		*mtime = (gint64) buf.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + buf.st_mtim.tv_nsec;
+	#else
+		*mtime = buf.st_mtime;
+	#endif
+
+	*size = buf.st_size;
+	*inode = buf.st_ino;
+}
 
 #ifdef G_ENABLE_DEBUG
 
@@ -30,7 +30,38 @@
 extern "C" {
 #endif
 
-
+/* The caches of the library (trees, directories, monitors) are shared, so
+ * anything touching them from a thread other than the main one must hold
+ * this recursive lock. */
+void menu_lock(void);
+void menu_unlock(void);
+
+/* Like menu_lock(), but returns FALSE instead of waiting if the lock is held
+ * by another thread, e.g. while a tree is being loaded there: handlers run
+ * from the main loop use it not to block it. */
+gboolean menu_trylock(void);
+
+/* Helpers for the compiled layout cache: values are stored in host byte
+ * order, strings are prefixed by their length and may be NULL. The read
+ * functions advance *data and return FALSE if there isn't enough data. */
+void menu_write_uint32(GString* out, guint32 value);
+void menu_write_int64(GString* out, gint64 value);
+void menu_write_string(GString* out, const char* str);
+
+gboolean menu_read_uint32(const char** data, const char* end, guint32* value);
+gboolean menu_read_int64(const char** data, const char* end, gint64* value);
+gboolean menu_read_string(const char** data, const char* end, char** str);
+
+/* For data that is used from a mapping of the file it was read from: the
+ * strings are written with their trailing nul, and *str points into the
+ * data instead of being a copy. */
+void menu_write_mapped_string(GString* out, const char* str);
+gboolean menu_read_mapped_string(const char** data, const char* end, const char** str);
+
+/* What the caches record of the files they were built from, to tell whether
+ * they changed since: the mtime is in ns where available, and -1 if the file
+ * doesn't exist. */
+void menu_stat_file(const char* path, gint64* mtime, gint64* size, gint64* inode);
 
 #ifdef G_ENABLE_DEBUG
 
@@ -207,8 +207,8 @@ static PyObject* pygde2menu_tree_directory_get_contents(PyObject* self, PyObject
 {
 	PyGde2MenuTreeDirectory* directory;
 	PyObject* retval;
-	GSList* contents;
-	GSList* tmp;
+	Gde2MenuTreeIter iter;
+	Gde2MenuTreeItem* item;
 
 	if (args != NULL)
 	{
@@ -222,13 +222,10 @@ static PyObject* pygde2menu_tree_directory_get_contents(PyObject* self, PyObject
 
 	retval = PyList_New(0);
 
-	contents = gde2menu_tree_directory_get_contents(GDE2MENU_TREE_DIRECTORY(directory->item));
+	gde2menu_tree_directory_iter_init(&iter, GDE2MENU_TREE_DIRECTORY(directory->item));
 
-	tmp = contents;
-
-	while (tmp != NULL)
+	while ((item = gde2menu_tree_directory_iter_next(&iter)) != NULL)
 	{
-		Gde2MenuTreeItem* item = tmp->data;
 		PyObject* pyitem;
 
 		switch (gde2menu_tree_item_get_type(item))
@@ -260,14 +257,8 @@ static PyObject* pygde2menu_tree_directory_get_contents(PyObject* self, PyObject
 
 		PyList_Append(retval, pyitem);
 		Py_DECREF(pyitem);
-
-		gde2menu_tree_item_unref(item);
-
-		tmp = tmp->next;
 	}
 
-	g_slist_free(contents);
-
 	return retval;
 }
 
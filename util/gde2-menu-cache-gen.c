@@ -0,0 +1,258 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Writes a snapshot of a menu tree, that gde2menu_tree_load_snapshot() can
+ * then use instead of building the tree. Without --output, the snapshot goes
+ * to the user cache directory, where it is found for a process with the same
+ * environment.
+ *
+ * With --daemon, keeps the trees built and writes a new snapshot whenever one
+ * of them changes, in a directory shared by all the users; the processes of
+ * the users with the same environment then load their trees from these
+ * snapshots instead of building them. The directory is
+ * $localstatedir/cache/gde2-menus unless $GDE2_MENU_DAEMON_DIR is set, and
+ * only the daemon may be able to write to it. */
+
+#include <config.h>
+
+#include "gde2menu-tree.h"
+
+/* Same as in test-menu-spec.c: no translations for now */
+#define _(x) x
+#define N_(x) x
+
+/* how long to wait for more changes before saving a changed tree */
+#define SAVE_DELAY 500
+
+/* how many times to wait for a tree built from files that were just
+ * modified before giving up, without --daemon */
+#define SAVE_RETRIES 5
+
+static char** menu_files = NULL;
+static char* output = NULL;
+static gboolean daemon_mode = FALSE;
+static gboolean include_excluded = FALSE;
+static gboolean include_nodisplay = FALSE;
+static gboolean show_empty = FALSE;
+static gboolean show_all_separators = FALSE;
+
+static GOptionEntry options[] = {
+	{"file",                'f', 0, G_OPTION_ARG_STRING_ARRAY, &menu_files,          N_("Menu file, may be given several times"), N_("MENU_FILE")},
+	{"output",              'o', 0, G_OPTION_ARG_FILENAME,     &output,              N_("Where to write the snapshot"),         N_("FILE")},
+	{"daemon",              'd', 0, G_OPTION_ARG_NONE,         &daemon_mode,         N_("Keep the snapshots up to date"),       NULL},
+	{"include-excluded",    'i', 0, G_OPTION_ARG_NONE,         &include_excluded,    N_("Include <Exclude>d entries"),          NULL},
+	{"include-nodisplay",   'n', 0, G_OPTION_ARG_NONE,         &include_nodisplay,   N_("Include NoDisplay=true entries"),      NULL},
+	{"show-empty",          'e', 0, G_OPTION_ARG_NONE,         &show_empty,          N_("Include empty directories"),           NULL},
+	{"show-all-separators", 's', 0, G_OPTION_ARG_NONE,         &show_all_separators, N_("Keep all the separators of the layout"), NULL},
+	{NULL}
+};
+
+static GHashTable* pending_trees = NULL;
+static guint save_timeout = 0;
+
+/* If busy isn't NULL, a tree built from files that were just modified isn't
+ * reported: *busy is set instead, and the tree must be saved again later,
+ * once the monitors had a chance to notice any further change. */
+static gboolean save_snapshot(Gde2MenuTree* tree, const char* filename, gboolean* busy)
+{
+	GError* error = NULL;
+
+	if (busy != NULL)
+		*busy = FALSE;
+
+	if (!gde2menu_tree_save_snapshot(tree, filename, &error))
+	{
+		if (busy != NULL && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_BUSY))
+			*busy = TRUE;
+		else
+			g_printerr(_("Failed to write the snapshot: %s\n"), error->message);
+
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean save_pending_trees(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer tree;
+	gboolean busy;
+
+	g_hash_table_iter_init(&iter, pending_trees);
+
+	while (g_hash_table_iter_next(&iter, &tree, NULL))
+	{
+		save_snapshot(tree, NULL, &busy);
+
+		if (!busy)
+			g_hash_table_iter_remove(&iter);
+	}
+
+	if (g_hash_table_size(pending_trees) > 0)
+		return TRUE;
+
+	save_timeout = 0;
+
+	return FALSE;
+}
+
+static gboolean quit_loop(gpointer loop)
+{
+	g_main_loop_quit(loop);
+
+	return FALSE;
+}
+
+static void handle_tree_changed(Gde2MenuTree* tree, gpointer data)
+{
+	g_hash_table_add(pending_trees, tree);
+
+	if (save_timeout == 0)
+		save_timeout = g_timeout_add(SAVE_DELAY, save_pending_trees, NULL);
+}
+
+static int run_daemon(Gde2MenuTreeFlags flags)
+{
+	static const char* default_files[] = {"gde2-applications.menu", NULL};
+	const char* const* files;
+	GSList* trees = NULL;
+	GMainLoop* loop;
+	GError* error = NULL;
+	gboolean busy;
+	int i;
+
+	if (!gde2menu_tree_daemon_acquire(&error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	pending_trees = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	files = menu_files ? (const char* const*) menu_files : default_files;
+
+	for (i = 0; files[i] != NULL; i++)
+	{
+		Gde2MenuTree* tree;
+
+		tree = gde2menu_tree_lookup(files[i], flags);
+
+		g_assert(tree != NULL);
+
+		if (!save_snapshot(tree, NULL, &busy) && busy)
+			handle_tree_changed(tree, NULL);
+
+		gde2menu_tree_add_monitor(tree, handle_tree_changed, NULL);
+
+		trees = g_slist_prepend(trees, tree);
+	}
+
+	loop = g_main_loop_new(NULL, FALSE);
+	g_main_loop_run(loop);
+	g_main_loop_unref(loop);
+
+	g_slist_foreach(trees, (GFunc) gde2menu_tree_unref, NULL);
+	g_slist_free(trees);
+	g_hash_table_destroy(pending_trees);
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	GOptionContext* options_context;
+	Gde2MenuTreeFlags flags;
+	Gde2MenuTree* tree;
+	GMainLoop* loop;
+	GError* error = NULL;
+	gboolean busy;
+	int retval = 0;
+	int i;
+
+	options_context = g_option_context_new(_("- write a snapshot of a menu for faster loading"));
+	g_option_context_add_main_entries(options_context, options, GETTEXT_PACKAGE);
+
+	if (!g_option_context_parse(options_context, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(options_context);
+		return 1;
+	}
+
+	g_option_context_free(options_context);
+
+	flags = GDE2MENU_TREE_FLAGS_NONE;
+
+	if (include_excluded)
+		flags |= GDE2MENU_TREE_FLAGS_INCLUDE_EXCLUDED;
+
+	if (include_nodisplay)
+		flags |= GDE2MENU_TREE_FLAGS_INCLUDE_NODISPLAY;
+
+	if (show_empty)
+		flags |= GDE2MENU_TREE_FLAGS_SHOW_EMPTY;
+
+	if (show_all_separators)
+		flags |= GDE2MENU_TREE_FLAGS_SHOW_ALL_SEPARATORS;
+
+	if (daemon_mode)
+	{
+		if (output != NULL)
+		{
+			g_printerr(_("--output cannot be used with --daemon\n"));
+			return 1;
+		}
+
+		return run_daemon(flags);
+	}
+
+	if (menu_files != NULL && menu_files[0] != NULL && menu_files[1] != NULL)
+	{
+		g_printerr(_("Only one menu file can be given without --daemon\n"));
+		return 1;
+	}
+
+	tree = gde2menu_tree_lookup(menu_files ? menu_files[0] : "gde2-applications.menu", flags);
+
+	g_assert(tree != NULL);
+
+	/* while we wait, the monitors of the tree rebuild it if a file that was
+	 * just modified changes again */
+	loop = g_main_loop_new(NULL, FALSE);
+
+	for (i = 0; !save_snapshot(tree, output, i < SAVE_RETRIES ? &busy : NULL); i++)
+	{
+		if (i == SAVE_RETRIES || !busy)
+		{
+			retval = 1;
+			break;
+		}
+
+		g_timeout_add(SAVE_DELAY, quit_loop, loop);
+		g_main_loop_run(loop);
+	}
+
+	g_main_loop_unref(loop);
+
+	gde2menu_tree_unref(tree);
+
+	return retval;
+}
@@ -102,13 +102,13 @@ static void print_directory(Gde2MenuTreeDirectory* directory)
 		path = freeme + 1;
 	}
 
-	GSList* items = gde2menu_tree_directory_get_contents(directory);
-	GSList* tmp = items;
+	Gde2MenuTreeIter iter;
+	Gde2MenuTreeItem* item;
 
-	while (tmp != NULL)
-	{
-		Gde2MenuTreeItem* item = tmp->data;
+	gde2menu_tree_directory_iter_init(&iter, directory);
 
+	while ((item = gde2menu_tree_directory_iter_next(&iter)) != NULL)
+	{
 		switch (gde2menu_tree_item_get_type(item))
 		{
 			case GDE2MENU_TREE_ITEM_ENTRY:
@@ -138,14 +138,8 @@ static void print_directory(Gde2MenuTreeDirectory* directory)
 				g_assert_not_reached();
 				break;
 		}
-
-		gde2menu_tree_item_unref(tmp->data);
-
-		tmp = tmp->next;
 	}
 
-	g_slist_free(items);
-
 	g_free(freeme);
 }
 